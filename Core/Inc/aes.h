@@ -0,0 +1,44 @@
+/**
+ *******************************************************************************
+ * @file   aes.h
+ * @brief  AES-128 in counter mode (FIPS 197, SP 800-38A), decrypting the
+ *         update stream in place. The encryption T-tables are generated into
+ *         SRAM2 on first use instead of being stored in flash.
+ *******************************************************************************
+ */
+
+#ifndef __AES_H
+#define __AES_H
+
+#include <stdint.h>
+
+/** Size of an AES-128 key in bytes */
+#define AES_KEY_SIZE   (16)
+/** Size of an AES block, and of the initial counter block, in bytes */
+#define AES_BLOCK_SIZE (16)
+
+/** AES-128-CTR context */
+typedef struct
+{
+    uint32_t key[44];                 /*!< Expanded key */
+    uint8_t  iv[AES_BLOCK_SIZE];      /*!< Initial counter block */
+    uint8_t  counter[AES_BLOCK_SIZE]; /*!< Next counter block */
+    uint8_t  stream[AES_BLOCK_SIZE];  /*!< Current key stream block */
+    uint32_t used;                    /*!< Bytes of stream consumed */
+} AesCtrContext;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Aes_CtrInit(AesCtrContext* ctx, const uint8_t* key, const uint8_t* iv);
+void Aes_CtrSeek(AesCtrContext* ctx, uint32_t offset);
+void Aes_CtrCrypt(AesCtrContext* ctx, void* data, uint32_t length);
+void Aes_CtrWipe(AesCtrContext* ctx);
+bool Aes_SelfTest(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __AES_H */
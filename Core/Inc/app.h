@@ -3,7 +3,13 @@
 #include "main.h"
 #include "bootloader.h"
 
-#define CONF_FILENAME "Scale.bin"
+#define CONF_FILENAME  "Scale.bin"
+#define PATCH_FILENAME "Scale.dif"
+#define HEX_FILENAME   "Scale.hex"
+#define SREC_FILENAME  "Scale.mot"
+
+/** Level of the card detect switch when a card is inserted */
+#define SD_DETECT_INSERTED GPIO_PIN_RESET
 
 #define BLINK_FAST   100
 #define BLINK_SLOW   500
@@ -44,6 +50,15 @@ enum eApplicationErrorCodes
     ERR_FILE_CLOSE,
     ERR_FILE_DELETE,
     ERR_OBP,
+    ERR_PATCH,
+    ERR_PATCH_BASE,
+    ERR_HEX,
+    ERR_HASH,
+    ERR_SIGNATURE,
+    ERR_KEY,
+    ERR_IMAGE,
+    ERR_UART,
+    ERR_UART_NONE,
 };
 
 
@@ -53,4 +68,10 @@ void    println(const char* tag, const char* txt);
 bool    mount(void);
 bool    unmount(void);
 uint8_t Enter_Bootloader(void);
+uint8_t Enter_DeltaUpdate(void);
+uint8_t Enter_HexUpdate(const char* filename);
+uint8_t Enter_UartUpdate(void);
 void    SD_Eject(void);
+#if (USE_HANDOFF)
+void Handoff_Prepare(uint32_t updateMs);
+#endif
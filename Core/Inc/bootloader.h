@@ -30,23 +30,192 @@
 /** Check application checksum on startup */
 #define USE_CHECKSUM 0
 
-/** Enable write protection after performing in-app-programming */
+/** Enable write protection of the application pages before jumping to it. The
+ * option bytes are only reprogrammed (one reset) when the protected pages
+ * change, and the protection is removed when an update opens the journal. */
 #define USE_WRITE_PROTECTION 0
 
 /** Clear reset flags
  *  - If enabled: bootloader clears reset flags. (This occurs only when OBL RST
- * flag is active.)
+ * flag is active, or on every boot with USE_MAILBOX.)
  *  - If disabled: bootloader does not clear reset flags, not even when OBL RST
  * is active.
  */
 #define CLEAR_RESET_FLAGS 1
 
+/** Only probe the SD card after a cold boot (power-on, reset pin, option
+ * bytes), when the application posted a request in the mailbox (see
+ * mailbox.h), or when there is no valid application; other resets jump
+ * straight to the application. The reset flags are copied to the mailbox
+ * and cleared on every boot: without CLEAR_RESET_FLAGS, every boot after a
+ * power-on is taken for a cold boot */
+#define USE_MAILBOX 0
+
+/** Accept delta patches applied against the application currently in flash */
+#define USE_DELTA_UPDATE 1
+
+/** Accept Intel HEX and S-record files, programming only the pages they touch */
+#define USE_HEX_UPDATE 1
+
+/** Check the SHA-256 digest appended to the image file (image trailer)
+ * before committing the update */
+#define USE_SHA256 0
+
+/** Print the SHA-256 throughput at startup */
+#define SHA256_BENCHMARK 0
+
+/** Only accept images whose trailer carries an Ed25519 signature of the
+ * SHA-256 digest. The signature, then the digest of the whole image, are
+ * checked before flash is erased (requires USE_SHA256, and USE_HEX_UPDATE,
+ * USE_DELTA_UPDATE and USE_UART_UPDATE disabled: these carry no signature) */
+#define USE_SIGNATURE 0
+
+/** Decrypt the image with AES-128-CTR while it is programmed. The initial
+ * counter block is stored in the image trailer, the key at AES_KEY_ADDRESS */
+#define USE_ENCRYPTION 0
+
+/** Address of the AES-128 key: OTP area, written once at production */
+#define AES_KEY_ADDRESS (uint32_t)0x1FFF7000
+
+/** Ed25519 public key of the image signer (RFC 8032 test key: replace it) */
+#define SIGNATURE_PUBLIC_KEY                                                                                           \
+    {0xd7, 0x5a, 0x98, 0x01, 0x82, 0xb1, 0x0a, 0xb7, 0xd5, 0x4b, 0xfe, 0xd3, 0xc9, 0x64, 0x07, 0x3a,                   \
+     0x0e, 0xe1, 0x72, 0xf3, 0xda, 0xa6, 0x23, 0x25, 0xaf, 0x02, 0x1a, 0x68, 0xf7, 0x07, 0x51, 0x1a}
+
+/** Program the image from the flash interrupt while the next chunk is read
+ * from the SD card, instead of busy-waiting on each doubleword */
+#define USE_ASYNC_FLASH 1
+
+/** Number of rows (or erase jobs) queued for the asynchronous flash writer */
+#define FLASH_QUEUE_DEPTH 4
+
+/** Let the asynchronous writer program blank rows in fast programming mode
+ * (FSTPG). Not validated on target: RM0394 describes fast programming after
+ * a mass erase, and this bootloader only erases pages. A fast row also
+ * writes the erased-value doublewords with their ECC, they cannot be
+ * programmed again before the next erase */
+#define USE_FAST_PROGRAM 0
+
+/** Minimum number of doublewords to program in a blank row for the
+ * asynchronous writer to use fast programming (~1.9 ms per row, against
+ * ~82 us per doubleword), with USE_FAST_PROGRAM */
+#define FLASH_FAST_MIN_DOUBLEWORDS 24
+
+/** Measure the CPU work done while the application area is erased: a buffer
+ * is hashed until the queued erase is done, printed as [ERAZ] (requires
+ * USE_ASYNC_FLASH, not with USE_STAGING). The update hot path runs from SRAM
+ * (see STM32L452RETX_FLASH.ld), flash fetches would stall otherwise */
+#define ERASE_BENCHMARK 0
+
+/** The update file is a container (see image.h, made by Tools/packer.cpp):
+ * its header carries the identity, digest, initial counter block and
+ * signature of the image, and is checked before anything is erased. Image
+ * trailers are not used */
+#define USE_CONTAINER 0
+
+/** Read the image into SRAM one chunk at a time and check the chunk against
+ * its SHA-256 digest from the container header before its pages are erased
+ * (requires USE_ASYNC_FLASH and USE_CONTAINER) */
+#define USE_STAGING 0
+
+/** Size of a staged chunk in bytes, multiple of FLASH_PAGE_SIZE */
+#define STAGING_CHUNK_SIZE (64 * 1024)
+
+/** Hand the image to the programming and verification pipelines straight
+ * from the sector buffer of the file object with f_forward (sets _USE_FORWARD),
+ * instead of reading it into a local buffer. Ignored with USE_STAGING, which
+ * needs whole chunks in SRAM. Off until its gain is measured on target: it
+ * saves a copy but reads one sector at a time instead of multiple sectors
+ * straight into the buffer, so compare the program and verify phases of a
+ * USE_ITM trace with both settings before enabling it */
+#define USE_FORWARD 0
+
+/** Mount exFAT cards (SDXC, 64 GB and more) besides FAT12/16/32, and stream
+ * an image stored in contiguous clusters by LBA range. Sets _FS_EXFAT and
+ * _USE_LFN in ffconf.h: exFAT requires long file names, which bring their
+ * working buffer and the code page tables, several KB of flash */
+#define USE_EXFAT 0
+
+/** Run the programming pass as cooperative tasks (see scheduler.h): the SD
+ * card reader fills a queue of chunks, the programmer runs the pipeline on
+ * them and feeds the flash writer only when its queue has room, the console
+ * is drained one character at a time and the LED blinks on a timer, none of
+ * them waiting on another (requires USE_ASYNC_FLASH, not with USE_STAGING;
+ * replaces USE_FORWARD for the programming pass) */
+#define USE_SCHEDULER 0
+
+/** Number of chunks of two flash rows queued between the SD card reader and
+ * the programmer */
+#define SCHEDULER_CHUNKS 4
+
+/** Number of characters of console output queued while the tasks run */
+#define CONSOLE_QUEUE_SIZE 256
+
+/** Offer a YMODEM-1K transfer over USART1 before probing the SD card (see
+ * ymodem.h and Tools/ymodem.cpp): the bootloader polls for a sender at
+ * UART_UPDATE_BAUDRATE for UART_UPDATE_WAIT ms, receives into a circular
+ * DMA buffer, and programs each block while the next one is received. A
+ * received image replaces the SD card update (requires USE_ASYNC_FLASH) */
+#define USE_UART_UPDATE 0
+
+/** Baud rate of the transfer, up to 2000000; the console rate is restored
+ * afterwards */
+#define UART_UPDATE_BAUDRATE 921600
+
+/** Time given to a sender to show up after a reset, in ms */
+#define UART_UPDATE_WAIT 1000
+
+/** Size of the DMA reception buffer in bytes, power of two holding two
+ * 1K blocks */
+#define UART_RX_BUFFER_SIZE 4096
+
+/** Erase policies, see EARLY_ERASE */
+#define EARLY_ERASE_NONE 0 /*!< Erase once the update file is found and checked */
+#define EARLY_ERASE_FILE 1 /*!< Start erasing once the update file is identified, while its CRC is computed */
+
+/** Start erasing the first application pages in the background once the
+ * update file is found and checked (size, trailer, signature), while the file
+ * is read for its CRC (requires USE_ASYNC_FLASH, not with USE_CONTAINER, whose
+ * header holds the CRC). Only the CRC pass overlaps the erase: the card is
+ * mounted and the file checked before. The journal is opened with the size
+ * alone when the erase starts, and completed with the CRC once it is known: an
+ * update file which then cannot be read leaves no valid application. A file
+ * of the size of the installed application may be that application, and
+ * nothing is erased before the CRC tells them apart */
+#define EARLY_ERASE EARLY_ERASE_NONE
+
+/** Number of pages erased while the update file is read for its CRC */
+#define EARLY_ERASE_PAGES 16
+
+/** Jump to the application with the 80 MHz clock tree, USART1 and the SD
+ * card still running, described by a handoff block (see handoff.h) in the
+ * last bytes of SRAM2; only the interrupts are stopped. The application must
+ * not reconfigure the PLL it is running from */
+#define USE_HANDOFF 0
+
+/** Send the console output and timestamped phase events over SWO (PB3)
+ * instead of USART1 (see trace.h and Tools/itmdecode.cpp): a stimulus port
+ * write takes a few cycles, no output is lost or waited for while no
+ * debugger captures the trace */
+#define USE_ITM 0
+
+/** SWO bit rate (NRZ), must divide the 80 MHz core clock */
+#define ITM_SWO_SPEED 2000000
+
 /** Start address of the bootloader in flash */
 #define BOOTLOADER_ADDRESS (uint32_t)0x08000000
 
+/** Start address of the bootloader record in flash (last page of the
+ * bootloader area, excluded from the bootloader code by the linker script) */
+#define RECORD_ADDRESS (uint32_t)0x08007800
+
 /** Start address of application space in flash */
 #define APP_ADDRESS (uint32_t)0x08008000
 
+/** Offset of the application version in its vector table: first reserved
+ * vector slot, recorded with the image (0xFFFFFFFF or 0: unknown) */
+#define APP_VERSION_OFFSET (uint32_t)0x1C
+
 /** End address of application space (address of last byte) */
 #define END_ADDRESS (uint32_t)0x0807FFB
 
@@ -70,6 +239,9 @@
 /** Size of application in DWORD (32bits or 4bytes) */
 #define APP_SIZE (uint32_t)(((END_ADDRESS - APP_ADDRESS) + 3) / 4)
 
+/** Size of a flash row (32 doublewords): granularity of the blank scan */
+#define FLASH_ROW_SIZE (256)
+
 /** Number of pages per bank in flash */
 #define FLASH_PAGE_NBPERBANK (256)
 
@@ -77,6 +249,43 @@
 #define RAM_BASE SRAM1_BASE                  /*!< Start address of RAM */
 #define RAM_SIZE SRAM1_SIZE_MAX + SRAM2_SIZE /*!< RAM size in bytes */
 
+/** Magic number of a valid bootloader record: "BLRC" */
+#define RECORD_MAGIC  (uint32_t)0x43524C42
+/** Magic number of an open update journal: "BLJR" */
+#define JOURNAL_MAGIC (uint32_t)0x524A4C42
+
+/** CRC-32 of a journal opened before the CRC of the image is known, see
+ * ::Bootloader_JournalOpen */
+#define JOURNAL_CRC_UNKNOWN (uint32_t)0xFFFFFFFF
+
+/** Layout of the record page: bootloader record, then the journal header
+ * (a ::BootloaderRecord tagged ::JOURNAL_MAGIC), then one doubleword per
+ * committed application page */
+#define JOURNAL_ADDRESS         (RECORD_ADDRESS + 16)
+#define JOURNAL_ENTRIES_ADDRESS (RECORD_ADDRESS + 32)
+#define JOURNAL_ENTRIES_MAX     ((FLASH_PAGE_SIZE - 32) / 8)
+
+/* Typedefs ------------------------------------------------------------------*/
+/** Bootloader record: identity of the installed application. It is written
+ * once the application has been programmed and verified, and cleared before
+ * the application area is modified. The same structure identifies the image
+ * being installed in the journal header. */
+typedef struct
+{
+    uint32_t magic;   /*!< ::RECORD_MAGIC */
+    uint32_t size;    /*!< Size of the installed image in bytes */
+    uint32_t crc;     /*!< CRC-32 of the installed image */
+    uint32_t version; /*!< Version of the installed image (::APP_VERSION_OFFSET), 0 if unknown */
+} BootloaderRecord;
+
+/** Flash programming statistics, reset by ::Bootloader_Init */
+typedef struct
+{
+    uint32_t programmed; /*!< Number of bytes programmed */
+    uint32_t skipped;    /*!< Number of erased-value (0xFF) bytes skipped */
+    uint32_t cycles;     /*!< CPU cycles spent programming */
+} BootloaderFlashStats;
+
 /* Enumerations --------------------------------------------------------------*/
 /** Bootloader error codes */
 enum eBootloaderErrorCodes
@@ -87,7 +296,8 @@ enum eBootloaderErrorCodes
     BL_CHKS_ERROR,  /*!< Application checksum error */
     BL_ERASE_ERROR, /*!< Flash erase error */
     BL_WRITE_ERROR, /*!< Flash write error */
-    BL_OBP_ERROR    /*!< Flash option bytes programming error */
+    BL_OBP_ERROR,   /*!< Flash option bytes programming error */
+    BL_BUSY         /*!< Asynchronous flash operations are pending */
 };
 
 /** Flash Protection Types */
@@ -106,16 +316,40 @@ extern "C" {
 
 uint8_t Bootloader_Init(void);
 uint8_t Bootloader_Erase(void);
+uint8_t Bootloader_ErasePages(uint32_t address, uint32_t count);
 
 uint8_t Bootloader_FlashBegin(void);
+uint8_t Bootloader_FlashSeek(uint32_t address);
 uint8_t Bootloader_FlashNext(uint64_t data);
+uint8_t Bootloader_FlashBuffer(const void* data, uint32_t length);
 uint8_t Bootloader_FlashEnd(void);
+void    Bootloader_GetFlashStats(BootloaderFlashStats* stats);
+
+uint8_t Bootloader_AsyncBegin(void);
+uint8_t Bootloader_AsyncErase(uint32_t address, uint32_t count);
+uint8_t Bootloader_AsyncWrite(uint32_t address, const void* data, uint32_t length);
+uint8_t Bootloader_AsyncCommit(uint32_t page);
+uint8_t Bootloader_AsyncPoll(void);
+uint32_t Bootloader_AsyncSpace(void);
+uint8_t Bootloader_AsyncEnd(void);
+void    Bootloader_FlashIRQHandler(void);
+
+uint8_t Bootloader_GetRecord(BootloaderRecord* record);
+uint8_t Bootloader_SetRecord(uint32_t size, uint32_t crc);
+uint8_t Bootloader_ClearRecord(void);
+
+uint8_t Bootloader_JournalOpen(uint32_t size, uint32_t crc);
+uint8_t Bootloader_JournalCommit(uint32_t page);
+uint8_t Bootloader_JournalResume(uint32_t size, uint32_t crc, uint32_t* pages);
+uint8_t Bootloader_JournalPages(uint32_t* pages);
+uint8_t Bootloader_CheckJournal(void);
 
 uint8_t Bootloader_GetProtectionStatus(void);
-uint8_t Bootloader_ConfigProtection(uint32_t protection);
+uint8_t Bootloader_ConfigProtection(uint32_t protection, uint32_t size);
 
 uint8_t Bootloader_CheckSize(uint32_t appsize);
-uint8_t Bootloader_VerifyChecksum(void);
+uint8_t  Bootloader_VerifyChecksum(void);
+uint32_t Bootloader_CRC32(uint32_t crc, const void* data, uint32_t length);
 uint8_t Bootloader_CheckForApplication(void);
 void    Bootloader_JumpToApplication(void);
 void    Bootloader_JumpToSysMem(void);
@@ -0,0 +1,83 @@
+/**
+ *******************************************************************************
+ * @file   delta.h
+ * @brief  Delta update: applies a patch file against the application that is
+ *         currently installed in flash.
+ *
+ * Patch file layout (little endian):
+ *  - ::DeltaHeader
+ *  - Stream of commands, each one being an opcode byte followed by a LEB128
+ *    encoded argument:
+ *    - ::DELTA_OP_COPY  n: copy n bytes from the source image
+ *    - ::DELTA_OP_ADD   n: add the next n patch bytes to n source bytes
+ *    - ::DELTA_OP_INSERT n: copy the next n patch bytes
+ *    - ::DELTA_OP_SEEK  n: move the source pointer by n (zigzag encoded)
+ *    - ::DELTA_OP_END   0: end of patch
+ *
+ * The patch is applied in place, page by page. Source bytes can therefore only
+ * be read from the page that is being rebuilt or above: the patch generator
+ * (Tools/delta) must respect this constraint, the bootloader rejects patches
+ * that do not. A page whose rebuilt content matches flash is not erased. A
+ * page reading source bytes of its own range is first written to a scratch
+ * page, the first page above both images. Each page is then erased,
+ * programmed and committed to the update journal: an interrupted update
+ * resumes at the first page not committed.
+ *******************************************************************************
+ */
+
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <stdint.h>
+#include "ff.h"
+
+/** Magic number of a patch file: "BLDF" */
+#define DELTA_MAGIC   (uint32_t)0x46444C42
+/** Supported patch format version */
+#define DELTA_VERSION (uint32_t)1
+
+/** Patch file header */
+typedef struct
+{
+    uint32_t magic;        /*!< ::DELTA_MAGIC */
+    uint32_t version;      /*!< ::DELTA_VERSION */
+    uint32_t sourceSize;   /*!< Size of the image the patch applies to */
+    uint32_t sourceCrc;    /*!< CRC-32 of the image the patch applies to */
+    uint32_t targetSize;   /*!< Size of the patched image */
+    uint32_t targetCrc;    /*!< CRC-32 of the patched image */
+    uint32_t reserved[2];  /*!< Must be 0 */
+} DeltaHeader;
+
+/** Patch commands */
+enum eDeltaOpcodes
+{
+    DELTA_OP_END    = 0x00,
+    DELTA_OP_COPY   = 0x01,
+    DELTA_OP_ADD    = 0x02,
+    DELTA_OP_INSERT = 0x03,
+    DELTA_OP_SEEK   = 0x04,
+};
+
+/** Delta update error codes */
+enum eDeltaErrorCodes
+{
+    DELTA_OK = 0,        /*!< No error */
+    DELTA_APPLIED,       /*!< Target image is already installed */
+    DELTA_READ_ERROR,    /*!< Patch file cannot be read */
+    DELTA_FORMAT_ERROR,  /*!< Malformed patch or out of bounds access */
+    DELTA_BASE_MISMATCH, /*!< Installed image is not the patch source */
+    DELTA_FLASH_ERROR,   /*!< Flash erase or write error */
+    DELTA_VERIFY_ERROR,  /*!< Patched image does not match its CRC */
+};
+
+/** Where an update resumes, see ::Delta_Check */
+typedef struct
+{
+    uint32_t page;    /*!< First page not committed to the update journal */
+    uint8_t  scratch; /*!< Page ::page is restored from the scratch page */
+} DeltaResume;
+
+uint8_t Delta_Check(FIL* fp, DeltaHeader* header, DeltaResume* resume);
+uint8_t Delta_Apply(FIL* fp, const DeltaHeader* header, const DeltaResume* resume);
+
+#endif /* __DELTA_H */
@@ -0,0 +1,32 @@
+/**
+ *******************************************************************************
+ * @file   ed25519.h
+ * @brief  Ed25519 (RFC 8032) signature verification. Verification only: no
+ *         secret is handled, so the double scalar multiplication does not need
+ *         to run in constant time. It works on fixed size buffers on the stack
+ *         (about 3 KB) and its running time does not depend on the message,
+ *         which is hashed once with SHA-512.
+ *******************************************************************************
+ */
+
+#ifndef __ED25519_H
+#define __ED25519_H
+
+#include <stdint.h>
+
+/** Size of an Ed25519 public key in bytes */
+#define ED25519_KEY_SIZE       (32)
+/** Size of an Ed25519 signature in bytes */
+#define ED25519_SIGNATURE_SIZE (64)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool Ed25519_Verify(const uint8_t* signature, const uint8_t* message, uint32_t length, const uint8_t* key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ED25519_H */
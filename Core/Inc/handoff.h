@@ -0,0 +1,86 @@
+/**
+ *******************************************************************************
+ * @file   handoff.h
+ * @brief  Handoff block passed to the application with ::USE_HANDOFF: the
+ *         bootloader leaves the clock tree, USART1 and the SD card running,
+ *         and describes them here so that the application can skip their
+ *         initialization.
+ *
+ * The block lives at the start of the last 256 bytes of SRAM2, excluded from
+ * the RAM of the bootloader and of the application by their linker scripts,
+ * and followed by the update request mailbox (see mailbox.h).
+ * The application checks it before its own initialization:
+ *  - ::HANDOFF_MAGIC, a known ::HANDOFF_VERSION, a size within
+ *    ::HANDOFF_SIZE, and the CRC-32 (IEEE 802.3, same as zlib) of the first
+ *    size - 4 bytes, stored in the last 4 bytes of the block
+ *  - each ::eHandoffFlags bit it relies on
+ * then clears the magic, so that a later reset does not reuse the block.
+ * Later versions only add fields in front of the CRC: the fields known by
+ * an older application keep their offset.
+ *
+ * This header does not depend on the HAL and can be copied to the
+ * application.
+ *******************************************************************************
+ */
+
+#ifndef __HANDOFF_H
+#define __HANDOFF_H
+
+#include <stdint.h>
+
+/** Address of the handoff block: last 256 bytes of SRAM2, seen after SRAM1 */
+#define HANDOFF_ADDRESS (uint32_t)0x20027F00
+/** Space reserved for the handoff block */
+#define HANDOFF_SIZE    (240)
+/** Magic number of a handoff block: "BLHO" */
+#define HANDOFF_MAGIC   (uint32_t)0x4F484C42
+/** Layout version */
+#define HANDOFF_VERSION (uint16_t)1
+
+/** State left running by the bootloader */
+enum eHandoffFlags
+{
+    HANDOFF_CLOCKS = 0x0001, /*!< Clock tree configured, PLL running, see the clock fields */
+    HANDOFF_UART   = 0x0002, /*!< USART1 enabled for TX and RX, see the console fields */
+    HANDOFF_SD     = 0x0004, /*!< SD card initialized in SPI mode on SPI3, deselected, see the card fields */
+};
+
+/** Handoff block */
+typedef struct
+{
+    uint32_t magic;      /*!< ::HANDOFF_MAGIC */
+    uint16_t version;    /*!< ::HANDOFF_VERSION */
+    uint16_t size;       /*!< Size of the block in bytes */
+    uint32_t flags;      /*!< ::eHandoffFlags */
+
+    /* Clocks */
+    uint32_t sysclk;     /*!< SYSCLK frequency in Hz */
+    uint32_t hclk;       /*!< AHB frequency in Hz */
+    uint32_t pclk1;      /*!< APB1 frequency in Hz */
+    uint32_t pclk2;      /*!< APB2 frequency in Hz */
+    uint32_t rccCr;      /*!< RCC_CR: oscillators enabled */
+    uint32_t rccCfgr;    /*!< RCC_CFGR: clock source and prescalers */
+    uint32_t rccPllcfgr; /*!< RCC_PLLCFGR: PLL configuration */
+    uint32_t rccCcipr;   /*!< RCC_CCIPR: peripheral clock sources */
+    uint32_t flashAcr;   /*!< FLASH_ACR: wait states and caches */
+    uint32_t pwrCr1;     /*!< PWR_CR1: voltage range */
+
+    /* Console */
+    uint32_t uartBase;   /*!< Base address of the console UART */
+    uint32_t baudRate;   /*!< Baud rate, 8N1 */
+
+    /* SD card */
+    uint8_t  sdType;     /*!< FatFs card type (MMC_GET_TYPE): 0x02 SDv1, 0x04 SDv2, 0x08 block addressing */
+    uint8_t  reserved[3];
+    uint32_t sdClock;    /*!< SPI clock in Hz */
+    uint32_t sdSectors;  /*!< Capacity in 512 bytes sectors */
+    uint8_t  sdCsd[16];  /*!< CSD register, most significant byte first */
+
+    /* Boot timing */
+    uint32_t bootMs;     /*!< Time from reset to the jump, in ms */
+    uint32_t updateMs;   /*!< Part of it spent on the SD card and the update */
+
+    uint32_t crc;        /*!< CRC-32 of the block up to this field, always last */
+} HandoffBlock;
+
+#endif /* __HANDOFF_H */
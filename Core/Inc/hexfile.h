@@ -0,0 +1,53 @@
+/**
+ *******************************************************************************
+ * @file   hexfile.h
+ * @brief  Streaming Intel HEX / Motorola S-record loader. Records are decoded
+ *         on the fly (no line buffer), coalesced into flash rows and only the
+ *         flash pages touched by the file are erased and programmed. Memory
+ *         usage does not depend on the file size.
+ *
+ * Supported records:
+ *  - Intel HEX: 00 (data), 01 (end of file), 02 and 04 (extended address),
+ *    03 and 05 (start address, ignored)
+ *  - S-record: S1/S2/S3 (data), S7/S8/S9 (end of file), S0 and S5/S6
+ *    (header and count, ignored)
+ *
+ * Records must not overlap, and the records writing a flash row must be
+ * consecutive: a row is programmed once the records leave it, and flash cannot
+ * be programmed twice without being erased.
+ *******************************************************************************
+ */
+
+#ifndef __HEXFILE_H
+#define __HEXFILE_H
+
+#include <stdint.h>
+#include "ff.h"
+
+/** Summary of a hex file, filled by ::Hex_Check */
+typedef struct
+{
+    uint32_t start; /*!< Lowest address written by the file */
+    uint32_t end;   /*!< Address following the highest byte written */
+    uint32_t bytes; /*!< Number of data bytes */
+    uint32_t pages; /*!< Number of flash pages touched */
+} HexInfo;
+
+/** Hex loader error codes */
+enum eHexErrorCodes
+{
+    HEX_OK = 0,         /*!< No error */
+    HEX_READ_ERROR,     /*!< File cannot be read */
+    HEX_FORMAT_ERROR,   /*!< Malformed record or missing end of file record */
+    HEX_CHECKSUM_ERROR, /*!< Record checksum mismatch */
+    HEX_RANGE_ERROR,    /*!< Data outside of the application area */
+    HEX_FLASH_ERROR,    /*!< Flash erase or write error */
+    HEX_VERIFY_ERROR,   /*!< Flash content does not match the file */
+    HEX_OVERLAP_ERROR,  /*!< Records overlap or come back to a row they left */
+};
+
+uint8_t Hex_Check(FIL* fp, HexInfo* info);
+uint8_t Hex_Program(FIL* fp);
+uint8_t Hex_Verify(FIL* fp);
+
+#endif /* __HEXFILE_H */
@@ -0,0 +1,94 @@
+/**
+ *******************************************************************************
+ * @file   image.h
+ * @brief  Update container (::USE_CONTAINER): a fixed header followed by the
+ *         image. The header is checked before anything is erased.
+ *
+ * Container file layout (little endian):
+ *  - ::ImageHeader, ::IMAGE_HEADER_SIZE bytes: one SD card sector, so that
+ *    each flash page of the image maps onto whole sectors
+ *  - Image, AES-128-CTR encrypted with the header IV if
+ *    ::IMAGE_FLAG_ENCRYPTED is set
+ *
+ * The CRC-32, the SHA-256 digest and the chunk digests cover the plain image.
+ * The Ed25519 signature covers the header up to the signature field.
+ *
+ * This module does not depend on the HAL: the host packer (Tools/packer.cpp)
+ * uses it to check the containers it produces.
+ *******************************************************************************
+ */
+
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Magic number of a container: "BLIM" */
+#define IMAGE_MAGIC       (uint32_t)0x4D494C42
+/** Supported container format version */
+#define IMAGE_VERSION     (uint16_t)1
+/** Size of the container header, image offset in the file */
+#define IMAGE_HEADER_SIZE (512)
+/** Maximum number of chunk digests */
+#define IMAGE_CHUNKS_MAX  (8)
+
+/** Container flags */
+enum eImageFlags
+{
+    IMAGE_FLAG_ENCRYPTED = 0x0001, /*!< Image is AES-128-CTR encrypted */
+    IMAGE_FLAG_SIGNED    = 0x0002, /*!< Header carries an Ed25519 signature */
+};
+
+/** Compression of the image */
+enum eImageCompression
+{
+    IMAGE_COMPRESSION_NONE = 0, /*!< Only value supported */
+};
+
+/** Container header */
+typedef struct
+{
+    uint32_t magic;                              /*!< ::IMAGE_MAGIC */
+    uint16_t version;                            /*!< ::IMAGE_VERSION */
+    uint16_t flags;                              /*!< ::eImageFlags */
+    uint32_t address;                            /*!< Load address of the image */
+    uint32_t size;                               /*!< Size of the image */
+    uint32_t crc;                                /*!< CRC-32 of the plain image */
+    uint8_t  compression;                        /*!< ::eImageCompression */
+    uint8_t  reserved[3];                        /*!< Must be 0 */
+    uint32_t chunkSize;                          /*!< Size of a chunk, 0 if no chunk digests */
+    uint32_t chunks;                             /*!< Number of chunk digests */
+    uint8_t  iv[16];                             /*!< AES-128-CTR initial counter block */
+    uint8_t  digest[32];                         /*!< SHA-256 of the plain image */
+    uint8_t  chunkDigests[IMAGE_CHUNKS_MAX][32]; /*!< SHA-256 of each chunk of the plain image */
+    uint8_t  signature[64];                      /*!< Ed25519 signature of the header up to this field */
+    uint8_t  padding[112];                       /*!< Must be 0 */
+} ImageHeader;
+
+/** Number of header bytes covered by the signature */
+#define IMAGE_SIGNED_SIZE offsetof(ImageHeader, signature)
+
+/** Container error codes */
+enum eImageErrorCodes
+{
+    IMAGE_OK = 0,        /*!< Header is valid */
+    IMAGE_BAD_MAGIC,     /*!< Not a container */
+    IMAGE_BAD_VERSION,   /*!< Unsupported format version */
+    IMAGE_BAD_ADDRESS,   /*!< Built for another load address */
+    IMAGE_BAD_SIZE,      /*!< Image size does not match the file */
+    IMAGE_BAD_CHUNKS,    /*!< Chunk digests do not cover the image */
+    IMAGE_UNSUPPORTED,   /*!< Compression or flags not supported */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint8_t Image_CheckHeader(const ImageHeader* header, uint32_t fileSize, uint32_t address, uint16_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __IMAGE_H */
@@ -0,0 +1,77 @@
+/**
+ *******************************************************************************
+ * @file   mailbox.h
+ * @brief  Update request mailbox (::USE_MAILBOX): the application asks for
+ *         an update by writing a request here and resetting the MCU, the
+ *         bootloader only probes the SD card when a request is pending or
+ *         after a cold boot.
+ *
+ * The mailbox lives in the last ::MAILBOX_SIZE bytes of SRAM2, right after
+ * the handoff block (see handoff.h). It is not initialized by the startup
+ * code of either side, and SRAM2 keeps its content across a system reset.
+ * A request is only valid with ::MAILBOX_MAGIC and its complement in check:
+ * the random content of SRAM2 after a power-on is never taken for one. The
+ * bootloader consumes the request before probing the card, and copies the
+ * RCC reset flags to resetFlags on every boot, since it clears them.
+ *
+ * This header does not depend on the HAL and can be copied to the
+ * application.
+ *******************************************************************************
+ */
+
+#ifndef __MAILBOX_H
+#define __MAILBOX_H
+
+#include <stdint.h>
+
+/** Address of the mailbox: last 16 bytes of SRAM2, seen after SRAM1 */
+#define MAILBOX_ADDRESS (uint32_t)0x20027FF0
+/** Space reserved for the mailbox */
+#define MAILBOX_SIZE    (16)
+/** Magic number of a pending request: "BLMB" */
+#define MAILBOX_MAGIC   (uint32_t)0x424D4C42
+
+/** Requests, any of them makes the bootloader probe the SD card */
+enum eMailboxRequest
+{
+    MAILBOX_UPDATE       = 0x0001, /*!< Look for an update file */
+    MAILBOX_CARD_CHANGED = 0x0002, /*!< A card was inserted since the last probe */
+};
+
+/** Mailbox */
+typedef struct
+{
+    uint32_t magic;      /*!< ::MAILBOX_MAGIC while a request is pending */
+    uint32_t request;    /*!< ::eMailboxRequest */
+    uint32_t check;      /*!< ~request */
+    uint32_t resetFlags; /*!< RCC_CSR reset flags of the last reset, written by the bootloader */
+} Mailbox;
+
+/**
+ * @brief  Post a request, to be followed by a system reset.
+ * @param  request: ::eMailboxRequest
+ */
+static inline void Mailbox_Post(uint32_t request) {
+    volatile Mailbox* mailbox = (volatile Mailbox*)MAILBOX_ADDRESS;
+
+    mailbox->request = request;
+    mailbox->check   = ~request;
+    mailbox->magic   = MAILBOX_MAGIC;
+}
+
+/**
+ * @brief  Consume the pending request.
+ * @return ::eMailboxRequest, 0 if there is none
+ */
+static inline uint32_t Mailbox_Take(void) {
+    volatile Mailbox* mailbox = (volatile Mailbox*)MAILBOX_ADDRESS;
+    uint32_t          request = mailbox->request;
+
+    if ((mailbox->magic != MAILBOX_MAGIC) || (mailbox->check != ~request)) {
+        request = 0;
+    }
+    mailbox->magic = 0;
+    return request;
+}
+
+#endif /* __MAILBOX_H */
@@ -74,6 +74,11 @@ void Error_Handler(void);
 #define SD_SPI_HANDLE   hspi3
 #define SD_CS_GPIO_Port uSD_CS_GPIO_Port
 #define SD_CS_Pin       uSD_CS_Pin
+/* Sectors of the FAT/directory read cache in user_diskio.c, 0 to disable */
+#define SD_CACHE_SECTORS 8
+/* Card on the SDMMC1 4-bit bus (sdmmc_diskio.c) instead of SPI3, needs a board
+   wired for SDMMC: D0-D3 PC8-PC11, CK PC12, CMD PD2 */
+#define SD_USE_SDMMC 0
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -0,0 +1,149 @@
+/**
+ *******************************************************************************
+ * @file   pipeline.h
+ * @brief  Update pipeline composed at compile time: a source fills a buffer,
+ *         transform stages modify it in place and a sink consumes it.
+ *
+ * A stage is any class providing one of:
+ *  - source:    uint8_t read(uint8_t* data, uint32_t size, uint32_t* length)
+ *  - transform: uint8_t process(uint8_t* data, uint32_t length)
+ *  - sink:      uint8_t write(uint8_t* data, uint32_t length)
+ * returning 0 on success, an ::eApplicationErrorCodes value otherwise. A
+ * source signals the end of the stream with a zero length.
+ *
+ * Stages have no virtual functions: every call is resolved at compile time
+ * and inlined, and a stage compiled out (::NullStage) costs neither code nor
+ * cycles. The stages declared here do not depend on the HAL and can be built
+ * and timed on a host, alone or wrapped in ::Timed with a host clock.
+ *******************************************************************************
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+#include <tuple>
+#include "aes.h"
+#include "sha256.h"
+
+/**
+ * @brief  Source, transform stages and sink, run chunk by chunk.
+ */
+template <typename Source, typename Sink, typename... Stages>
+class Pipeline {
+public:
+    Pipeline(Source& source, Sink& sink, Stages&... stages) : source(source), sink(sink), stages(stages...) {}
+
+    /**
+     * @brief  Pump the source into the sink until the end of the stream.
+     * @param  buffer: chunk buffer, 8 bytes aligned
+     * @param  size: size of the buffer in bytes, multiple of 8
+     * @param  progress: called with the length of each chunk written
+     * @return 0 or the error code of the first failing stage
+     */
+    template <typename Progress>
+    uint8_t run(uint8_t* buffer, uint32_t size, Progress progress) {
+        uint32_t length;
+        uint8_t  status;
+
+        while (true) {
+            status = source.read(buffer, size, &length);
+            if ((status != 0) || (length == 0)) {
+                return status;
+            }
+            status = push(buffer, length);
+            if (status != 0) {
+                return status;
+            }
+            progress(length);
+        }
+    }
+
+    /**
+     * @brief  Run the stages and the sink on a chunk provided by the caller,
+     *         e.g. straight from the buffer of a file system.
+     * @param  data: chunk, modified in place; the sink may pad it up to the
+     *         next multiple of 8 bytes
+     * @param  length: length of the chunk in bytes
+     * @return 0 or the error code of the first failing stage
+     */
+    uint8_t push(uint8_t* data, uint32_t length) {
+        uint8_t status = 0;
+
+        std::apply([&](auto&... stage) { return (((status = stage.process(data, length)) == 0) && ...); }, stages);
+        if (status == 0) {
+            status = sink.write(data, length);
+        }
+        return status;
+    }
+
+private:
+    Source&                source;
+    Sink&                  sink;
+    std::tuple<Stages&...> stages;
+};
+
+/**
+ * @brief  Transform stage standing for a feature disabled in the
+ *         configuration.
+ */
+class NullStage {
+public:
+    uint8_t process(uint8_t*, uint32_t) { return 0; }
+};
+
+/**
+ * @brief  In place AES-128-CTR decryption.
+ */
+class CtrDecryptStage {
+public:
+    void    init(const uint8_t* key, const uint8_t* iv) { Aes_CtrInit(&ctx, key, iv); }
+    void    seek(uint32_t offset) { Aes_CtrSeek(&ctx, offset); }
+    void    wipe(void) { Aes_CtrWipe(&ctx); }
+    uint8_t process(uint8_t* data, uint32_t length) {
+        Aes_CtrCrypt(&ctx, data, length);
+        return 0;
+    }
+
+private:
+    AesCtrContext ctx;
+};
+
+/**
+ * @brief  SHA-256 of the stream, data is left untouched.
+ */
+class Sha256Stage {
+public:
+    void    init(void) { Sha256_Init(&ctx); }
+    void    update(const void* data, uint32_t length) { Sha256_Update(&ctx, data, length); }
+    void    final(uint8_t* digest) { Sha256_Final(&ctx, digest); }
+    uint8_t process(uint8_t* data, uint32_t length) {
+        Sha256_Update(&ctx, data, length);
+        return 0;
+    }
+
+private:
+    Sha256Context ctx;
+};
+
+/**
+ * @brief  Stage wrapper accumulating the time spent in the stage.
+ * @tparam Stage: transform stage
+ * @tparam Clock: class providing static uint32_t now(), e.g. a cycle counter
+ */
+template <typename Stage, typename Clock>
+class Timed : public Stage {
+public:
+    uint32_t elapsed = 0;
+
+    uint8_t process(uint8_t* data, uint32_t length) {
+        uint32_t start = Clock::now();
+        uint8_t  status;
+
+        status = Stage::process(data, length);
+        elapsed += Clock::now() - start;
+        return status;
+    }
+};
+
+#endif /* __PIPELINE_H */
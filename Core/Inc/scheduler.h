@@ -0,0 +1,154 @@
+/**
+ *******************************************************************************
+ * @file   scheduler.h
+ * @brief  Cooperative run-to-completion scheduler and bounded single
+ *         producer, single consumer queues linking its tasks, and tasks to
+ *         interrupt handlers.
+ *
+ * A task is any class providing:
+ *  - uint8_t step(void)
+ * doing a bounded amount of work without waiting, and returning an
+ * ::eTaskState value. Tasks are stepped in the order of their declaration,
+ * one round after the other: for the same inputs, the interleaving is always
+ * the same.
+ *
+ * Like pipeline.h, the scheduler has no virtual functions and does not depend
+ * on the HAL: tasks and queues can be built and run on a host, with an idle
+ * policy doing nothing.
+ *******************************************************************************
+ */
+
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdint.h>
+#include <tuple>
+
+/** Result of a task step */
+enum eTaskState
+{
+    TASK_IDLE = 0, /*!< Nothing done, waiting for input, output room or hardware */
+    TASK_BUSY,     /*!< Work done, or hardware being polled */
+    TASK_DONE,     /*!< Nothing left to do, may get work again from another task */
+    TASK_FAILED,   /*!< Error, the task keeps its error code */
+};
+
+/**
+ * @brief  Bounded lock-free queue for one producer and one consumer, each
+ *         running in thread or interrupt context. Slots are filled and read
+ *         in place: the producer writes the slot returned by back() then
+ *         publishes it with commit(), the consumer reads the slot returned
+ *         by front() then releases it with pop().
+ * @tparam T: slot type
+ * @tparam N: number of slots, power of two
+ */
+template <typename T, uint32_t N>
+class SpscQueue {
+    static_assert((N != 0) && ((N & (N - 1)) == 0), "SpscQueue size must be a power of two");
+
+public:
+    /** Empty the queue, neither side may be running */
+    void reset(void) {
+        head = 0;
+        tail = 0;
+    }
+
+    /* Producer side ---------------------------------------------------------*/
+    /** Number of free slots */
+    uint32_t space(void) const { return N - (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)); }
+    bool     full(void) const { return space() == 0; }
+
+    /** Slot to fill, nullptr if the queue is full */
+    T* back(void) { return full() ? nullptr : &slots[head % N]; }
+
+    /** Publish the slot returned by back() */
+    void commit(void) { __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE); }
+
+    bool push(const T& item) {
+        T* slot = back();
+
+        if (slot == nullptr) {
+            return false;
+        }
+        *slot = item;
+        commit();
+        return true;
+    }
+
+    /** Drop every published slot, e.g. pending work after an error. The
+     * consumer must not run meanwhile (its interrupt masked): a slot filled
+     * by the producer is only dropped once published */
+    void clear(void) { __atomic_store_n(&tail, head, __ATOMIC_RELEASE); }
+
+    /* Consumer side ---------------------------------------------------------*/
+    /** Number of published slots */
+    uint32_t count(void) const { return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail; }
+    bool     empty(void) const { return count() == 0; }
+
+    /** Oldest published slot, nullptr if the queue is empty */
+    T* front(void) { return empty() ? nullptr : &slots[tail % N]; }
+
+    /** Release the slot returned by front() */
+    void pop(void) { __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE); }
+
+private:
+    T        slots[N];
+    uint32_t head = 0; /*!< Written by the producer only */
+    uint32_t tail = 0; /*!< Written by the consumer, or by clear() while it is stopped */
+};
+
+/**
+ * @brief  Steps the tasks round after round until every task is done in the
+ *         same round, or one fails.
+ * @tparam Idle: class providing static void wait(void), called after a round
+ *         in which no task was busy, e.g. to sleep until the next interrupt
+ * @tparam Tasks: tasks, stepped in this order
+ */
+template <typename Idle, typename... Tasks>
+class Scheduler {
+public:
+    explicit Scheduler(Tasks&... tasks) : tasks(tasks...) {}
+
+    /**
+     * @brief  Run the tasks.
+     * @return ::TASK_DONE, or ::TASK_FAILED as soon as a task fails: the
+     *         tasks after it are not stepped in that round
+     */
+    uint8_t run(void) {
+        while (true) {
+            bool busy = false;
+            bool done = true;
+            bool ok   = std::apply(
+                [&](auto&... task) {
+                    return ([&](uint8_t state) {
+                        busy |= (state == TASK_BUSY);
+                        done &= (state == TASK_DONE);
+                        return state != TASK_FAILED;
+                    }(task.step()) && ...);
+                },
+                tasks);
+
+            if (!ok) {
+                return TASK_FAILED;
+            }
+            if (done) {
+                return TASK_DONE;
+            }
+            if (!busy) {
+                Idle::wait();
+            }
+        }
+    }
+
+private:
+    std::tuple<Tasks&...> tasks;
+};
+
+/**
+ * @brief  Idle policy never waiting, for hosts and busy polling.
+ */
+struct NoIdle {
+    static void wait(void) {}
+};
+
+#endif /* __SCHEDULER_H */
@@ -0,0 +1,44 @@
+/**
+ *******************************************************************************
+ * @file   sha256.h
+ * @brief  Streaming SHA-256 (FIPS 180-4) tuned for the Cortex-M4: the
+ *         compression function is unrolled over the 8 rounds period of the
+ *         working variables, whole blocks are hashed straight from the
+ *         caller's buffer and the round constants live in SRAM2.
+ *******************************************************************************
+ */
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stdint.h>
+
+/** Size of a SHA-256 digest in bytes */
+#define SHA256_DIGEST_SIZE (32)
+/** Size of a SHA-256 block in bytes */
+#define SHA256_BLOCK_SIZE  (64)
+
+/** SHA-256 context */
+typedef struct
+{
+    uint32_t state[8];                 /*!< Intermediate hash value */
+    uint8_t  block[SHA256_BLOCK_SIZE]; /*!< Pending partial block */
+    uint32_t used;                     /*!< Number of bytes in block */
+    uint64_t length;                   /*!< Number of bytes hashed */
+} Sha256Context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Sha256_Init(Sha256Context* ctx);
+void Sha256_Update(Sha256Context* ctx, const void* data, uint32_t length);
+void Sha256_Final(Sha256Context* ctx, uint8_t* digest);
+bool Sha256_SelfTest(void);
+void Sha256_Benchmark(uint32_t* fast, uint32_t* reference);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHA256_H */
@@ -0,0 +1,75 @@
+/**
+ *******************************************************************************
+ * @file   trace.h
+ * @brief  Trace output over SWO (::USE_ITM): console text on ITM stimulus
+ *         port ::ITM_PORT_TEXT, binary events on ::ITM_PORT_EVENT.
+ *
+ * A stimulus port write costs a few cycles while the ITM FIFO has room, the
+ * SWO pin shifts the packets out in the background. An event is two words:
+ *  - event << 24 | argument (24 bits)
+ *  - DWT cycle counter
+ * written from thread mode only, so that the two words stay together. The
+ * host tool Tools/itmdecode.cpp turns the captured SWO stream into the
+ * console text and a timeline of the events.
+ *
+ * Without ::USE_ITM the event functions are empty and compiled out.
+ *******************************************************************************
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "bootloader.h"
+
+/** Stimulus port of the console text */
+#define ITM_PORT_TEXT  0
+/** Stimulus port of the binary events */
+#define ITM_PORT_EVENT 1
+
+/** Events */
+enum eTraceEvent
+{
+    TRACE_BOOT = 1, /*!< Bootloader started, argument: RCC_CSR reset flags >> 24 */
+    TRACE_PHASE,    /*!< Phase started, ending the previous one, argument: ::eTracePhase */
+    TRACE_CHUNK,    /*!< Chunk programmed or verified, argument: length in bytes */
+    TRACE_ERROR,    /*!< Update failed, argument: ::eApplicationErrorCodes */
+    TRACE_JUMP,     /*!< Jump to the application, argument: update time in ms */
+};
+
+/** Phases of an update */
+enum eTracePhase
+{
+    PHASE_MOUNT = 1, /*!< SD card initialization and mount */
+    PHASE_CHECK,     /*!< Update file opened and checked */
+    PHASE_ERASE,     /*!< Erase queued or done */
+    PHASE_PROGRAM,   /*!< Programming pass */
+    PHASE_VERIFY,    /*!< Verification pass */
+    PHASE_CLEANUP,   /*!< Record written, file erased, card ejected */
+    PHASE_UART,      /*!< Waiting for a YMODEM sender */
+};
+
+void Trace_Init(void);
+void Trace_Write(const char* str, uint32_t length);
+
+/**
+ * @brief  Emit an event on ::ITM_PORT_EVENT, if a trace is being captured.
+ * @param  event: ::eTraceEvent
+ * @param  arg: argument, 24 bits
+ */
+static inline void Trace_Event(uint8_t event, uint32_t arg) {
+#if (USE_ITM)
+    if ((ITM->TCR & ITM_TCR_ITMENA_Msk) && (ITM->TER & (1UL << ITM_PORT_EVENT))) {
+        while (ITM->PORT[ITM_PORT_EVENT].u32 == 0) {
+        }
+        ITM->PORT[ITM_PORT_EVENT].u32 = ((uint32_t)event << 24) | (arg & 0xFFFFFF);
+        while (ITM->PORT[ITM_PORT_EVENT].u32 == 0) {
+        }
+        ITM->PORT[ITM_PORT_EVENT].u32 = DWT->CYCCNT;
+    }
+#else
+    (void)event;
+    (void)arg;
+#endif
+}
+
+#endif /* __TRACE_H */
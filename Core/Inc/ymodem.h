@@ -0,0 +1,356 @@
+/**
+ *******************************************************************************
+ * @file   ymodem.h
+ * @brief  YMODEM-1K receiver, as a pipeline source (see pipeline.h): each
+ *         read returns the payload of one block, trimmed to the file size
+ *         given by the header block.
+ *
+ * A block is acknowledged as soon as its CRC and sequence number are
+ * checked, before the stages and the sink run on it: the sender streams the
+ * next block while this one is programmed, and the stop-and-wait protocol
+ * throttles it to the speed of the flash writer. The link stays compatible
+ * with any YMODEM sender (sb, sz --ymodem, Tools/ymodem.cpp), 128 and 1024
+ * bytes blocks, one file per transfer.
+ *
+ * A port is any class providing:
+ *  - static int32_t get(void): next received byte, -1 if none yet
+ *  - static void put(uint8_t c): send a byte
+ *  - static uint32_t now(void): time in ms
+ *
+ * Like pipeline.h, the receiver does not depend on the HAL: the host tool
+ * runs it on a serial port or a pseudo-terminal.
+ *******************************************************************************
+ */
+
+#ifndef __YMODEM_H
+#define __YMODEM_H
+
+#include <stdint.h>
+
+/** Control characters */
+#define YMODEM_SOH 0x01 /*!< 128 bytes block */
+#define YMODEM_STX 0x02 /*!< 1024 bytes block */
+#define YMODEM_EOT 0x04 /*!< End of file */
+#define YMODEM_ACK 0x06
+#define YMODEM_NAK 0x15
+#define YMODEM_CAN 0x18 /*!< Cancel, sent twice */
+#define YMODEM_CRC 'C'  /*!< Receiver ready, blocks with CRC-16 */
+
+/** Payload of a 1K block: size of the buffer passed to read() */
+#define YMODEM_BLOCK_SIZE   1024
+/** Payload of a short block, and of the header block */
+#define YMODEM_SHORT_SIZE   128
+/** Time between two 'C' while waiting for the sender, in ms */
+#define YMODEM_POLL_MS      250
+/** Time waiting for a block, in ms */
+#define YMODEM_BLOCK_MS     1000
+/** Time waiting for the next byte within a block, in ms */
+#define YMODEM_BYTE_MS      100
+/** Consecutive errors before the transfer is cancelled */
+#define YMODEM_RETRIES      10
+
+/** Transfer status */
+enum eYmodemStatus
+{
+    YMODEM_OK = 0,    /*!< Transfer going on or complete */
+    YMODEM_NONE,      /*!< No sender, or an empty batch */
+    YMODEM_TIMEOUT,   /*!< Too many lost or damaged blocks */
+    YMODEM_CANCELLED, /*!< Cancelled by the sender */
+    YMODEM_SEQUENCE,  /*!< Block out of sequence */
+    YMODEM_TOO_LARGE, /*!< File larger than the limit */
+};
+
+/**
+ * @brief  CRC-16/XMODEM (polynomial 0x1021, initial value 0) of a block.
+ * @param  crc: CRC of the previous data, 0 to start
+ * @param  data: data
+ * @param  length: length in bytes
+ * @return Updated CRC
+ */
+static inline uint16_t Ymodem_CRC16(uint16_t crc, const uint8_t* data, uint32_t length) {
+    while (length--) {
+        uint8_t x = (uint8_t)((crc >> 8) ^ *data++);
+
+        x ^= x >> 4;
+        crc = (uint16_t)((crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x);
+    }
+    return crc;
+}
+
+/**
+ * @brief  YMODEM-1K receiver.
+ * @tparam Port: serial port, see above
+ */
+template <typename Port>
+class YmodemSource {
+public:
+    uint8_t  status   = YMODEM_OK; /*!< ::eYmodemStatus, kept after a failed read */
+    uint32_t size     = 0;         /*!< File size from the header, 0 if not given */
+    uint32_t received = 0;         /*!< Bytes returned so far */
+
+    /** @param limit: largest file accepted, in bytes */
+    explicit YmodemSource(uint32_t limit) : limit(limit) {}
+
+    /**
+     * @brief  Wait for the header block of a file, polling the sender with
+     *         'C', and acknowledge it. The first read() asks for the data:
+     *         the caller can prepare the flash in between.
+     * @param  buffer: ::YMODEM_BLOCK_SIZE bytes for the header block
+     * @param  wait: time given to a sender to show up, in ms
+     * @return ::YMODEM_OK, ::YMODEM_NONE without a sender or file, or the
+     *         error which cancelled the transfer
+     */
+    uint8_t start(uint8_t* buffer, uint32_t wait) {
+        uint32_t begin  = Port::now();
+        uint32_t errors = 0;
+        uint32_t length;
+        uint8_t  seq;
+        uint8_t  kind;
+
+        while (true) {
+            /* Also asks for a damaged header again */
+            Port::put(YMODEM_CRC);
+            kind = receive(buffer, &length, &seq, YMODEM_POLL_MS);
+            if ((kind == KIND_BLOCK) || (kind == KIND_CANCEL)) {
+                break;
+            }
+            /* Once a damaged header came in, the sender gets as many tries
+             * as for a data block; line noise is not taken for a sender */
+            if ((kind == KIND_BAD) || (errors != 0)) {
+                if (++errors >= YMODEM_RETRIES) {
+                    return status = YMODEM_NONE;
+                }
+            } else if (Port::now() - begin >= wait) {
+                return status = YMODEM_NONE;
+            }
+        }
+        if (kind == KIND_CANCEL) {
+            return status = YMODEM_CANCELLED;
+        }
+        if (seq != 0) {
+            cancel();
+            return status = YMODEM_SEQUENCE;
+        }
+        Port::put(YMODEM_ACK);
+        if (buffer[0] == 0) {
+            /* Empty batch */
+            return status = YMODEM_NONE;
+        }
+
+        /* "name\0size[ mtime mode...]" */
+        const uint8_t* p   = buffer;
+        const uint8_t* end = buffer + length;
+
+        while ((p < end) && (*p != 0)) {
+            p++;
+        }
+        for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+            size = size * 10 + (*p - '0');
+        }
+        if (size > limit) {
+            cancel();
+            return status = YMODEM_TOO_LARGE;
+        }
+        next = 1;
+        return status = YMODEM_OK;
+    }
+
+    /**
+     * @brief  Pipeline source: receive the next block.
+     * @param  data: buffer of at least ::YMODEM_BLOCK_SIZE bytes
+     * @param  size: size of the buffer
+     * @param  length: payload length, 0 once the sender ended the transfer
+     * @return ::YMODEM_OK, or the error which cancelled the transfer
+     */
+    uint8_t read(uint8_t* data, uint32_t, uint32_t* length) {
+        uint32_t chunk;
+        uint8_t  seq;
+        uint8_t  kind;
+
+        *length = 0;
+        if ((status != YMODEM_OK) || done) {
+            return status;
+        }
+        if (!requested) {
+            /* Ask for the data once the caller is ready */
+            Port::put(YMODEM_CRC);
+            requested = true;
+        }
+        for (uint32_t errors = 0; errors < YMODEM_RETRIES;) {
+            kind = receive(data, &chunk, &seq, YMODEM_BLOCK_MS);
+            if (kind == KIND_BLOCK) {
+                if (seq == (uint8_t)(next - 1)) {
+                    /* Sent again after a lost acknowledgement */
+                    Port::put(YMODEM_ACK);
+                    continue;
+                }
+                if (seq != (uint8_t)next) {
+                    cancel();
+                    return status = YMODEM_SEQUENCE;
+                }
+                /* Checked: the sender can go on while the block is programmed */
+                Port::put(YMODEM_ACK);
+                next++;
+                errors = 0;
+                if ((size != 0) && (chunk > size - received)) {
+                    /* Padding of the last block */
+                    chunk = size - received;
+                }
+                if (chunk > limit - received) {
+                    cancel();
+                    return status = YMODEM_TOO_LARGE;
+                }
+                if (chunk == 0) {
+                    continue;
+                }
+                received += chunk;
+                *length = chunk;
+                return YMODEM_OK;
+            }
+            if (kind == KIND_EOT) {
+                if (!eot) {
+                    /* The first EOT is confirmed by a second one */
+                    eot = true;
+                    Port::put(YMODEM_NAK);
+                    continue;
+                }
+                Port::put(YMODEM_ACK);
+                finish(data);
+                return YMODEM_OK;
+            }
+            if (kind == KIND_CANCEL) {
+                return status = YMODEM_CANCELLED;
+            }
+            errors++;
+            Port::put(YMODEM_NAK);
+        }
+        cancel();
+        return status = YMODEM_TIMEOUT;
+    }
+
+    /** Cancel the transfer, e.g. after an error of another stage */
+    void cancel(void) {
+        for (int i = 0; i < 3; i++) {
+            Port::put(YMODEM_CAN);
+        }
+    }
+
+private:
+    enum
+    {
+        KIND_BLOCK,
+        KIND_EOT,
+        KIND_CANCEL,
+        KIND_TIMEOUT,
+        KIND_BAD,
+    };
+
+    uint32_t limit;
+    uint32_t next      = 0;     /*!< Sequence number of the next block */
+    bool     requested = false; /*!< Data asked for with 'C' */
+    bool     eot       = false;
+    bool     done      = false;
+
+    /** Next byte, -1 after timeout ms */
+    static int32_t get(uint32_t timeout) {
+        uint32_t begin = Port::now();
+        int32_t  c;
+
+        while ((c = Port::get()) < 0) {
+            if (Port::now() - begin >= timeout) {
+                break;
+            }
+        }
+        return c;
+    }
+
+    /** Drop the rest of a damaged block, until the line is idle */
+    static void purge(void) {
+        while (get(YMODEM_BYTE_MS) >= 0) {
+        }
+    }
+
+    /**
+     * @brief  Receive a block or a control character.
+     * @param  data: payload, ::YMODEM_BLOCK_SIZE bytes
+     * @param  length: payload length of a block
+     * @param  seq: sequence number of a block
+     * @param  timeout: time waiting for the first byte, in ms
+     * @return KIND_BLOCK for a block with a valid CRC, KIND_BAD for a damaged
+     *         one, or the control character received
+     */
+    uint8_t receive(uint8_t* data, uint32_t* length, uint8_t* seq, uint32_t timeout) {
+        uint32_t begin = Port::now();
+        uint16_t crc;
+        int32_t  c;
+        int32_t  n;
+
+        /* Characters other than a block start are line noise */
+        do {
+            uint32_t elapsed = Port::now() - begin;
+
+            if ((elapsed >= timeout) || ((c = get(timeout - elapsed)) < 0)) {
+                return KIND_TIMEOUT;
+            }
+            if (c == YMODEM_EOT) {
+                return KIND_EOT;
+            }
+            if ((c == YMODEM_CAN) && (get(YMODEM_BYTE_MS) == YMODEM_CAN)) {
+                return KIND_CANCEL;
+            }
+        } while ((c != YMODEM_SOH) && (c != YMODEM_STX));
+        *length = (c == YMODEM_STX) ? YMODEM_BLOCK_SIZE : YMODEM_SHORT_SIZE;
+
+        c = get(YMODEM_BYTE_MS);
+        n = get(YMODEM_BYTE_MS);
+        if ((c < 0) || (n < 0) || ((uint8_t)c != (uint8_t)~n)) {
+            purge();
+            return KIND_BAD;
+        }
+        *seq = (uint8_t)c;
+        for (uint32_t i = 0; i < *length; i++) {
+            if ((c = get(YMODEM_BYTE_MS)) < 0) {
+                return KIND_BAD;
+            }
+            data[i] = (uint8_t)c;
+        }
+        c = get(YMODEM_BYTE_MS);
+        n = get(YMODEM_BYTE_MS);
+        if ((c < 0) || (n < 0)) {
+            return KIND_BAD;
+        }
+        crc = Ymodem_CRC16(0, data, *length);
+        if (crc != (uint16_t)((c << 8) | n)) {
+            purge();
+            return KIND_BAD;
+        }
+        return KIND_BLOCK;
+    }
+
+    /** After the last EOT: receive the empty header closing the batch */
+    void finish(uint8_t* buffer) {
+        uint32_t length;
+        uint8_t  seq;
+
+        done = true;
+        for (uint32_t errors = 0; errors < YMODEM_RETRIES; errors++) {
+            Port::put(YMODEM_CRC);
+            switch (receive(buffer, &length, &seq, YMODEM_BLOCK_MS)) {
+                case KIND_BLOCK:
+                    Port::put(YMODEM_ACK);
+                    return;
+                case KIND_EOT:
+                    /* The acknowledgement of the EOT was lost */
+                    Port::put(YMODEM_ACK);
+                    break;
+                case KIND_CANCEL:
+                    return;
+                default:
+                    break;
+            }
+        }
+        /* The file is complete: a sender not closing the batch is ignored */
+    }
+};
+
+#endif /* __YMODEM_H */
@@ -0,0 +1,248 @@
+/**
+ *******************************************************************************
+ * @file   aes.cpp
+ * @brief  AES-128-CTR for the Cortex-M4, which has no AES peripheral on the
+ *         L452. Only the forward cipher is needed by counter mode. A round is
+ *         16 lookups into four 1 KB T-tables combining SubBytes, ShiftRows
+ *         and MixColumns. The tables are computed at first use into SRAM2,
+ *         next to the SHA-256 constants, which saves 4.25 KB of flash.
+ *
+ * State words are little endian (byte 0 of a column in bits 0..7), so loads
+ * and stores are plain LDR/STR.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "aes.h"
+#include <string.h>
+
+/* Private macros ------------------------------------------------------------*/
+#define ROTL8(x, n) ((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+#define ROTL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define XTIME(x)    ((uint8_t)(((x) << 1) ^ (((x)&0x80) ? 0x1B : 0x00)))
+
+/* Private variables ---------------------------------------------------------*/
+static uint32_t Te[4][256] __attribute__((section(".sram2")));
+static uint8_t  Sbox[256] __attribute__((section(".sram2")));
+static bool     tables_ready = false;
+
+/* Private functions ---------------------------------------------------------*/
+static inline uint32_t load_le32(const uint8_t* p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+/**
+ * @brief  Generate the S-box by walking the multiplicative group of GF(2^8)
+ *         with generator 3 and its inverse, then the T-tables from it.
+ */
+static void aes_tables(void) {
+    uint8_t p = 1;
+    uint8_t q = 1;
+
+    do {
+        /* p * 3 */
+        p = p ^ XTIME(p);
+        /* q / 3 */
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80) {
+            q ^= 0x09;
+        }
+        /* Affine transformation of the inverse */
+        Sbox[p] = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4) ^ 0x63;
+    } while (p != 1);
+    Sbox[0] = 0x63;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint8_t  s = Sbox[i];
+        uint8_t  d = XTIME(s);
+        uint32_t t = d | ((uint32_t)s << 8) | ((uint32_t)s << 16) | ((uint32_t)(d ^ s) << 24);
+
+        Te[0][i] = t;
+        Te[1][i] = ROTL(t, 8);
+        Te[2][i] = ROTL(t, 16);
+        Te[3][i] = ROTL(t, 24);
+    }
+    tables_ready = true;
+}
+
+static uint32_t sub_word(uint32_t w) {
+    return Sbox[w & 0xFF] | ((uint32_t)Sbox[(w >> 8) & 0xFF] << 8) | ((uint32_t)Sbox[(w >> 16) & 0xFF] << 16) |
+           ((uint32_t)Sbox[w >> 24] << 24);
+}
+
+static void aes_expand(uint32_t* rk, const uint8_t* key) {
+    uint8_t  rcon = 1;
+    uint32_t t;
+
+    for (uint32_t i = 0; i < 4; i++) {
+        rk[i] = load_le32(&key[4 * i]);
+    }
+    for (uint32_t i = 4; i < 44; i++) {
+        t = rk[i - 1];
+        if ((i % 4) == 0) {
+            t    = sub_word(ROTL(t, 24)) ^ rcon;
+            rcon = XTIME(rcon);
+        }
+        rk[i] = rk[i - 4] ^ t;
+    }
+}
+
+static void aes_encrypt(const uint32_t* rk, const uint8_t* in, uint8_t* out) {
+    uint32_t s0 = load_le32(&in[0]) ^ rk[0];
+    uint32_t s1 = load_le32(&in[4]) ^ rk[1];
+    uint32_t s2 = load_le32(&in[8]) ^ rk[2];
+    uint32_t s3 = load_le32(&in[12]) ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for (uint32_t r = 1; r < 10; r++) {
+        rk += 4;
+        t0 = Te[0][s0 & 0xFF] ^ Te[1][(s1 >> 8) & 0xFF] ^ Te[2][(s2 >> 16) & 0xFF] ^ Te[3][s3 >> 24] ^ rk[0];
+        t1 = Te[0][s1 & 0xFF] ^ Te[1][(s2 >> 8) & 0xFF] ^ Te[2][(s3 >> 16) & 0xFF] ^ Te[3][s0 >> 24] ^ rk[1];
+        t2 = Te[0][s2 & 0xFF] ^ Te[1][(s3 >> 8) & 0xFF] ^ Te[2][(s0 >> 16) & 0xFF] ^ Te[3][s1 >> 24] ^ rk[2];
+        t3 = Te[0][s3 & 0xFF] ^ Te[1][(s0 >> 8) & 0xFF] ^ Te[2][(s1 >> 16) & 0xFF] ^ Te[3][s2 >> 24] ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    /* Last round: no MixColumns */
+    rk += 4;
+    t0 = sub_word((s0 & 0xFF) | (s1 & 0xFF00) | (s2 & 0xFF0000) | (s3 & 0xFF000000)) ^ rk[0];
+    t1 = sub_word((s1 & 0xFF) | (s2 & 0xFF00) | (s3 & 0xFF0000) | (s0 & 0xFF000000)) ^ rk[1];
+    t2 = sub_word((s2 & 0xFF) | (s3 & 0xFF00) | (s0 & 0xFF0000) | (s1 & 0xFF000000)) ^ rk[2];
+    t3 = sub_word((s3 & 0xFF) | (s0 & 0xFF00) | (s1 & 0xFF0000) | (s2 & 0xFF000000)) ^ rk[3];
+    store_le32(&out[0], t0);
+    store_le32(&out[4], t1);
+    store_le32(&out[8], t2);
+    store_le32(&out[12], t3);
+}
+
+/** Add a block count to a big endian 128bit counter */
+static void ctr_add(uint8_t* counter, uint32_t blocks) {
+    uint32_t carry = blocks;
+
+    for (int32_t i = AES_BLOCK_SIZE - 1; (i >= 0) && carry; i--) {
+        carry += counter[i];
+        counter[i] = (uint8_t)carry;
+        carry >>= 8;
+    }
+}
+
+static void ctr_next(AesCtrContext* ctx) {
+    aes_encrypt(ctx->key, ctx->counter, ctx->stream);
+    ctr_add(ctx->counter, 1);
+    ctx->used = 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+/**
+ * @brief  This function initializes a context at the start of the stream.
+ * @param  ctx: context
+ * @param  key: ::AES_KEY_SIZE bytes key
+ * @param  iv: ::AES_BLOCK_SIZE bytes initial counter block
+ */
+void Aes_CtrInit(AesCtrContext* ctx, const uint8_t* key, const uint8_t* iv) {
+    if (!tables_ready) {
+        aes_tables();
+    }
+    aes_expand(ctx->key, key);
+    memcpy(ctx->iv, iv, AES_BLOCK_SIZE);
+    Aes_CtrSeek(ctx, 0);
+}
+
+/**
+ * @brief  This function moves to a byte offset of the stream, e.g. to resume
+ *         an interrupted update.
+ * @param  ctx: context
+ * @param  offset: offset from the start of the stream in bytes
+ */
+void Aes_CtrSeek(AesCtrContext* ctx, uint32_t offset) {
+    memcpy(ctx->counter, ctx->iv, AES_BLOCK_SIZE);
+    ctr_add(ctx->counter, offset / AES_BLOCK_SIZE);
+    ctx->used = AES_BLOCK_SIZE;
+    if (offset % AES_BLOCK_SIZE) {
+        ctr_next(ctx);
+        ctx->used = offset % AES_BLOCK_SIZE;
+    }
+}
+
+/**
+ * @brief  This function encrypts or decrypts data in place. Whole blocks are
+ *         processed a word at a time.
+ * @param  ctx: context
+ * @param  data: data to process
+ * @param  length: length of the data in bytes
+ */
+void Aes_CtrCrypt(AesCtrContext* ctx, void* data, uint32_t length) {
+    uint8_t* p = (uint8_t*)data;
+
+    while (length) {
+        if (ctx->used == AES_BLOCK_SIZE) {
+            ctr_next(ctx);
+        }
+        if ((ctx->used == 0) && (length >= AES_BLOCK_SIZE)) {
+            for (uint32_t i = 0; i < AES_BLOCK_SIZE; i += 4) {
+                store_le32(&p[i], load_le32(&p[i]) ^ load_le32(&ctx->stream[i]));
+            }
+            ctx->used = AES_BLOCK_SIZE;
+            p += AES_BLOCK_SIZE;
+            length -= AES_BLOCK_SIZE;
+        } else {
+            *p++ ^= ctx->stream[ctx->used++];
+            length--;
+        }
+    }
+}
+
+/**
+ * @brief  This function clears the expanded key and the counter from memory
+ *         once the stream is done with, through volatile stores the compiler
+ *         cannot drop. The context must be initialized again before use.
+ * @param  ctx: context
+ */
+void Aes_CtrWipe(AesCtrContext* ctx) {
+    volatile uint8_t* p = (volatile uint8_t*)ctx;
+
+    for (uint32_t i = 0; i < sizeof(AesCtrContext); i++) {
+        p[i] = 0;
+    }
+}
+
+/**
+ * @brief  This function checks the implementation against the CTR-AES128
+ *         example of SP 800-38A (F.5.1), starting at an unaligned offset to
+ *         exercise the seek and partial block paths.
+ * @return true if the output matches
+ */
+bool Aes_SelfTest(void) {
+    static const uint8_t key[AES_KEY_SIZE] = {
+      0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    static const uint8_t iv[AES_BLOCK_SIZE] = {
+      0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+    static const uint8_t plain[32] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e,
+                                      0x11, 0x73, 0x93, 0x17, 0x2a, 0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03,
+                                      0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51};
+    static const uint8_t cipher[32] = {0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68,
+                                       0x64, 0x99, 0x0d, 0xb6, 0xce, 0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70,
+                                       0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff};
+    AesCtrContext        ctx;
+    uint8_t              data[32];
+
+    memcpy(data, plain, sizeof(data));
+    Aes_CtrInit(&ctx, key, iv);
+    Aes_CtrSeek(&ctx, 3);
+    Aes_CtrCrypt(&ctx, &data[3], sizeof(data) - 3);
+    Aes_CtrSeek(&ctx, 0);
+    Aes_CtrCrypt(&ctx, data, 3);
+    return memcmp(data, cipher, sizeof(data)) == 0;
+}
@@ -2,15 +2,781 @@
 #include "usart.h"
 #include "fatfs.h"
 #include "ff.h"
+#include "delta.h"
+#include "hexfile.h"
+#include "ed25519.h"
+#include "pipeline.h"
+#include "scheduler.h"
+#include "image.h"
+#include "handoff.h"
+#include "ymodem.h"
+#include "trace.h"
 #include <string.h>
 #include <stdio.h>
 
+#if (USE_CONTAINER)
+/** Header of the update container, checked before anything is erased */
+static ImageHeader image_header;
+/** Flags the container must carry */
+#define IMAGE_FLAGS_REQUIRED                                                                                           \
+    (((USE_ENCRYPTION) ? IMAGE_FLAG_ENCRYPTED : 0) | ((USE_SIGNATURE) ? IMAGE_FLAG_SIGNED : 0))
+#endif
+
+#if (USE_STAGING)
+#if !(USE_ASYNC_FLASH) || !(USE_CONTAINER)
+#error "USE_STAGING requires USE_ASYNC_FLASH and USE_CONTAINER"
+#endif
+static_assert(STAGING_CHUNK_SIZE * IMAGE_CHUNKS_MAX >= FLASH_BASE + FLASH_PAGE_NBPERBANK * FLASH_PAGE_SIZE - APP_ADDRESS,
+              "Chunk digests must cover the application area");
+/** File read buffer: one chunk of the image, checked before it is programmed */
+static uint32_t io_buffer[STAGING_CHUNK_SIZE / 4];
+#elif !(USE_FORWARD)
+/** File read buffer: two flash rows, 32bit aligned for flash programming */
+static uint32_t io_buffer[2 * FLASH_ROW_SIZE / 4];
+#endif
+
+/** Cycle counter used to time pipeline stages */
+struct DwtClock {
+    static uint32_t now(void) { return DWT->CYCCNT; }
+};
+
+#if (_FS_EXFAT)
+/**
+ * @brief  This function locates the read pointer of a file stored in
+ *         contiguous clusters (exFAT NoFatChain flag): such a file can be
+ *         streamed by LBA range, without the allocation table and without
+ *         splitting transfers at cluster boundaries.
+ * @param  fp: file, read pointer at a sector boundary
+ * @return Sector at the read pointer, 0 if the file must be read with f_read
+ */
+static DWORD File_ContiguousSector(FIL* fp) {
+    FATFS* fs = fp->obj.fs;
+
+    if ((fs->fs_type != FS_EXFAT) || ((fp->obj.stat & 3) != 2) || (fp->obj.sclust < 2) ||
+        (fp->fptr % _MIN_SS != 0) || (fp->fptr >= fp->obj.objsize)) {
+        return 0;
+    }
+    return fs->database + (fp->obj.sclust - 2) * fs->csize + (DWORD)(fp->fptr / _MIN_SS);
+}
+#endif
+
+/**
+ * @brief  Pipeline source: image file, trailers excluded. A read stops at a
+ *         multiple of the buffer size from the start of the image, so that
+ *         a chunk always covers the same range of the image. A contiguous
+ *         file is read with one multi-sector transfer per chunk.
+ */
+class FileSource {
+public:
+    FileSource(FIL* fp, uint32_t offset, uint32_t remaining) : fp(fp), offset(offset), remaining(remaining) {
+#if (_FS_EXFAT)
+        sector = File_ContiguousSector(fp);
+#endif
+    }
+
+    /** The file is streamed by LBA range, see ::File_ContiguousSector */
+    bool contiguous(void) const { return sector != 0; }
+
+    uint8_t read(uint8_t* data, uint32_t size, uint32_t* length) {
+        UINT     num;
+        uint32_t chunk = size - (offset % size);
+
+        if (remaining < chunk) {
+            chunk = remaining;
+        }
+#if (_FS_EXFAT)
+        if (sector != 0) {
+            /* Whole sectors: the size of the buffer is a multiple of them */
+            num = (chunk + _MIN_SS - 1) / _MIN_SS;
+            if ((num != 0) && (disk_read(fp->obj.fs->drv, data, sector, num) != RES_OK)) {
+                return ERR_SD_FILE;
+            }
+            if (data == fp->buf) {
+                /* The sector buffer of the file object no longer matches */
+                fp->sect = 0;
+            }
+            sector += num;
+            offset += chunk;
+            remaining -= chunk;
+            *length = chunk;
+            return ERR_OK;
+        }
+#endif
+        if (f_read(fp, data, chunk, &num) != FR_OK) {
+            return ERR_SD_FILE;
+        }
+        offset += num;
+        remaining -= num;
+        *length = num;
+        return ERR_OK;
+    }
+
+private:
+    FIL*     fp;
+    uint32_t offset;
+    uint32_t remaining;
+    DWORD    sector = 0;
+};
+
+#if (USE_FORWARD) && !(USE_STAGING)
+/**
+ * @brief  Runs a pipeline on the sector buffer of a file object: f_forward
+ *         hands each sector, or the part of it left in the stream, to the
+ *         stages and the sink, which work on it in place. The callback of
+ *         f_forward has no context argument, hence the static members.
+ * @tparam P: ::Pipeline, its source is not used
+ * @tparam Progress: called with the length of each span written
+ */
+template <typename P, typename Progress>
+class Forwarder {
+public:
+    /**
+     * @brief  Forward the next length bytes of the file.
+     * @return 0 or the error code of the first failing stage
+     */
+    static uint8_t run(P& pipeline, Progress& progress, FIL* fp, uint32_t length) {
+        UINT num;
+
+        Forwarder::pipeline = &pipeline;
+        Forwarder::progress = &progress;
+        status              = ERR_OK;
+        FRESULT result      = f_forward(fp, stream, length, &num);
+
+        /* The stages worked in place: the sector buffer of the file object
+         * no longer matches the card, and f_lseek does not reload a sector
+         * still cached when the file is read again */
+        fp->sect = 0;
+        if ((result != FR_OK) || ((status == ERR_OK) && (num != length))) {
+            return ERR_SD_FILE;
+        }
+        return status;
+    }
+
+private:
+    static inline P*        pipeline;
+    static inline Progress* progress;
+    static inline uint8_t   status;
+
+    static UINT stream(const BYTE* data, UINT length) {
+        if (length == 0) {
+            /* Sense call: stop streaming after an error */
+            return status == ERR_OK;
+        }
+        status = pipeline->push((uint8_t*)data, length);
+        if (status == ERR_OK) {
+            (*progress)(length);
+        }
+        return length;
+    }
+};
+
+/**
+ * @brief  Forward length bytes of a file through a pipeline.
+ */
+template <typename P, typename Progress>
+static uint8_t Forward_Run(P& pipeline, FIL* fp, uint32_t length, Progress progress) {
+    return Forwarder<P, Progress>::run(pipeline, progress, fp, length);
+}
+#endif
+
+/**
+ * @brief  Pipeline stage: CRC-32 of the stream, data is left untouched.
+ */
+class Crc32Stage {
+public:
+    uint32_t crc = 0;
+
+    uint8_t process(uint8_t* data, uint32_t length) {
+        crc = Bootloader_CRC32(crc, data, length);
+        return ERR_OK;
+    }
+};
+
+/**
+ * @brief  Pipeline sink: drops the stream, for a pass run for its stages.
+ */
+class NullSink {
+public:
+    uint8_t write(uint8_t*, uint32_t) { return ERR_OK; }
+};
+
+/**
+ * @brief  Pipeline sink: programs flash and commits each completed page to
+ *         the journal. The last chunk is padded to a whole doubleword. With
+ *         ::USE_ASYNC_FLASH the chunk is queued row by row and programmed
+ *         from the flash interrupt while the next chunk is read.
+ */
+class FlashSink {
+public:
+    uint32_t offset; /*!< Offset of the next byte in the application area */
+#if (USE_STAGING)
+    uint32_t erased; /*!< First page not erased yet, relative to ::APP_ADDRESS */
+
+    explicit FlashSink(uint32_t offset) : offset(offset), erased(offset / FLASH_PAGE_SIZE) {}
+#else
+    explicit FlashSink(uint32_t offset) : offset(offset) {}
+#endif
+
+    uint8_t write(uint8_t* data, uint32_t length) {
+        uint8_t status = BL_OK;
+
+        while (length % 8) {
+            data[length++] = 0xFF;
+        }
+#if (USE_STAGING)
+        /* The chunk has been checked: its pages can now be erased */
+        {
+            uint32_t end = (offset + length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+            if (erased < end) {
+                status = Bootloader_AsyncErase(APP_ADDRESS + erased * FLASH_PAGE_SIZE, end - erased);
+                erased = end;
+            }
+        }
+#endif
+#if (USE_ASYNC_FLASH)
+        for (uint32_t done = 0, chunk; (status == BL_OK) && (done < length); done += chunk) {
+            chunk = FLASH_ROW_SIZE - (offset % FLASH_ROW_SIZE);
+            if (chunk > length - done) {
+                chunk = length - done;
+            }
+            status = Bootloader_AsyncWrite(APP_ADDRESS + offset, &data[done], chunk);
+            if (status == BL_OK) {
+                offset += chunk;
+                if (offset % FLASH_PAGE_SIZE == 0) {
+                    status = Bootloader_AsyncCommit(offset / FLASH_PAGE_SIZE - 1);
+                }
+            }
+        }
+#else
+        status = Bootloader_FlashBuffer(data, length);
+        if (status == BL_OK) {
+            offset += length;
+            if (offset % FLASH_PAGE_SIZE == 0) {
+                status = Bootloader_JournalCommit(offset / FLASH_PAGE_SIZE - 1);
+            }
+        }
+#endif
+        return (status == BL_OK) ? ERR_OK : ERR_FLASH;
+    }
+
+    /**
+     * @brief  Complete programming: on success commit the last, partial page,
+     *         then wait for the queued operations.
+     * @param  status: result of the pipeline
+     * @return Final result ::eApplicationErrorCodes
+     */
+    uint8_t finish(uint8_t status) {
+        if ((status == ERR_OK) && (offset % FLASH_PAGE_SIZE)) {
+#if (USE_ASYNC_FLASH)
+            status = (Bootloader_AsyncCommit(offset / FLASH_PAGE_SIZE) == BL_OK) ? ERR_OK : ERR_FLASH;
+#else
+            status = (Bootloader_JournalCommit(offset / FLASH_PAGE_SIZE) == BL_OK) ? ERR_OK : ERR_FLASH;
+#endif
+        }
+#if (USE_STAGING)
+        /* Leave no part of the previous application above the image */
+        if ((status == ERR_OK) && (erased < (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE)) {
+            status = (Bootloader_AsyncErase(APP_ADDRESS + erased * FLASH_PAGE_SIZE,
+                                            (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE - erased) ==
+                      BL_OK)
+                       ? ERR_OK
+                       : ERR_FLASH;
+        }
+#endif
+#if (USE_ASYNC_FLASH)
+        if ((Bootloader_AsyncEnd() != BL_OK) && (status == ERR_OK)) {
+            status = ERR_FLASH;
+        }
+#else
+        Bootloader_FlashEnd();
+#endif
+        return status;
+    }
+};
+
+/**
+ * @brief  Pipeline sink: compares the stream with the application area.
+ */
+class VerifySink {
+public:
+    uint32_t offset; /*!< Offset of the next byte in the application area */
+
+    VerifySink() : offset(0) {}
+
+    uint8_t write(uint8_t* data, uint32_t length) {
+        if (memcmp((const void*)(APP_ADDRESS + offset), data, length) != 0) {
+            return ERR_VERIFY;
+        }
+        offset += length;
+        return ERR_OK;
+    }
+};
+
+#if (USE_STAGING)
+/**
+ * @brief  Transform stage comparing each chunk of the plain image with its
+ *         digest from the container header. A chunk failing the check never
+ *         reaches the flash sink, so its pages are not erased.
+ */
+class ChunkCheckStage {
+public:
+    /**
+     * @brief  Start at an offset of the image: the part of the current chunk
+     *         below the offset must then be hashed with update().
+     */
+    void init(uint32_t offset) {
+        this->offset = offset - (offset % STAGING_CHUNK_SIZE);
+        Sha256_Init(&ctx);
+    }
+
+    void update(const void* data, uint32_t length) {
+        Sha256_Update(&ctx, data, length);
+        offset += length;
+    }
+
+    uint8_t process(uint8_t* data, uint32_t length) {
+        uint8_t  digest[SHA256_DIGEST_SIZE];
+        uint32_t chunk = offset / STAGING_CHUNK_SIZE;
+
+        /* Reads stop at chunk boundaries: the buffer ends the chunk */
+        update(data, length);
+        Sha256_Final(&ctx, digest);
+        Sha256_Init(&ctx);
+        if ((chunk >= image_header.chunks) || (memcmp(digest, image_header.chunkDigests[chunk], sizeof(digest)) != 0)) {
+            return ERR_HASH;
+        }
+        return ERR_OK;
+    }
+
+private:
+    Sha256Context ctx;
+    uint32_t      offset;
+};
+
+typedef ChunkCheckStage ChunkStage;
+#else
+typedef NullStage ChunkStage;
+#endif
+
+#if (USE_SCHEDULER)
+#if !(USE_ASYNC_FLASH) || (USE_STAGING)
+#error "USE_SCHEDULER requires USE_ASYNC_FLASH, not with USE_STAGING"
+#endif
+/** Chunk of the image, from the SD card reader to the programmer */
+struct Chunk {
+    uint32_t data[2 * FLASH_ROW_SIZE / 4]; /*!< 32bit aligned for flash programming */
+    uint32_t length;                       /*!< Bytes read */
+};
+
+/** Flash writer jobs queued for a chunk: its rows and a journal commit */
+#define CHUNK_FLASH_JOBS (sizeof(Chunk::data) / FLASH_ROW_SIZE + 1)
+static_assert(FLASH_QUEUE_DEPTH >= CHUNK_FLASH_JOBS, "The flash writer queue must hold the jobs of a chunk");
+
+/** Chunks read and not programmed yet */
+static SpscQueue<Chunk, SCHEDULER_CHUNKS> chunks;
+/** Console output, queued by print() while the tasks run */
+static SpscQueue<char, CONSOLE_QUEUE_SIZE> console;
+static bool                                console_queued;
+
+/**
+ * @brief  Send the next queued character if the UART can take it.
+ * @return true while characters are queued
+ */
+static bool Console_Drain(void) {
+    const char* c = console.front();
+
+    if (c == NULL) {
+        return false;
+    }
+    if (huart1.Instance->ISR & USART_ISR_TXE) {
+        huart1.Instance->TDR = (uint8_t)*c;
+        console.pop();
+    }
+    return true;
+}
+
+/** Idle policy of the tasks: sleep until the next interrupt (flash writer,
+ * SysTick) */
+struct WfiIdle {
+    static void wait(void) { __WFI(); }
+};
+
+/**
+ * @brief  Task reading the image into the chunk queue.
+ * @tparam Source: pipeline source, see ::FileSource
+ */
+template <typename Source>
+class ReadTask {
+public:
+    uint8_t status = ERR_OK; /*!< Error code ::eApplicationErrorCodes */
+
+    explicit ReadTask(Source& source) : source(source) {}
+
+    uint8_t step(void) {
+        Chunk* chunk;
+
+        if (end) {
+            return TASK_DONE;
+        }
+        chunk = chunks.back();
+        if (chunk == NULL) {
+            return TASK_IDLE;
+        }
+        status = source.read((uint8_t*)chunk->data, sizeof(chunk->data), &chunk->length);
+        if (status != ERR_OK) {
+            return TASK_FAILED;
+        }
+        if (chunk->length == 0) {
+            end = true;
+            return TASK_DONE;
+        }
+        chunks.commit();
+        return TASK_BUSY;
+    }
+
+private:
+    Source& source;
+    bool    end = false;
+};
+
+/**
+ * @brief  Task running the stages and the sink of a pipeline on the queued
+ *         chunks, once the flash writer has room for all the jobs of a chunk.
+ * @tparam P: ::Pipeline, its source is not used
+ * @tparam Progress: called with the length of each chunk written
+ */
+template <typename P, typename Progress>
+class ProgramTask {
+public:
+    uint8_t status = ERR_OK; /*!< Error code ::eApplicationErrorCodes */
+
+    ProgramTask(P& pipeline, Progress& progress) : pipeline(pipeline), progress(progress) {}
+
+    uint8_t step(void) {
+        Chunk* chunk = chunks.front();
+
+        if (chunk == NULL) {
+            return TASK_DONE;
+        }
+        if (Bootloader_AsyncSpace() < CHUNK_FLASH_JOBS) {
+            return TASK_IDLE;
+        }
+        status = pipeline.push((uint8_t*)chunk->data, chunk->length);
+        if (status != ERR_OK) {
+            return TASK_FAILED;
+        }
+        progress(chunk->length);
+        chunks.pop();
+        return TASK_BUSY;
+    }
+
+private:
+    P&        pipeline;
+    Progress& progress;
+};
+
+/**
+ * @brief  Task draining the console queue into the UART.
+ */
+class ConsoleTask {
+public:
+    uint8_t step(void) { return Console_Drain() ? TASK_BUSY : TASK_DONE; }
+};
+
+/**
+ * @brief  Task blinking the status LED while the others run.
+ */
+class LedTask {
+public:
+    uint8_t step(void) {
+        if (HAL_GetTick() - last >= BLINK_FAST) {
+            last += BLINK_FAST;
+            LED_G2_TG();
+        }
+        return TASK_DONE;
+    }
+
+private:
+    uint32_t last = HAL_GetTick();
+};
+
+/**
+ * @brief  Program the image with the reader, programmer, console and LED
+ *         tasks. print() queues its output meanwhile.
+ * @param  pipeline: programming pipeline
+ * @param  source: source of the pipeline
+ * @param  progress: called with the length of each chunk written
+ * @return 0 or the error code of the failing task
+ */
+template <typename P, typename Source, typename Progress>
+static uint8_t Program_Run(P& pipeline, Source& source, Progress& progress) {
+    ReadTask<Source>         reader(source);
+    ProgramTask<P, Progress> programmer(pipeline, progress);
+    ConsoleTask              output;
+    LedTask                  led;
+    Scheduler<WfiIdle, ReadTask<Source>, ProgramTask<P, Progress>, ConsoleTask, LedTask> scheduler(
+        reader, programmer, output, led);
+    uint8_t state;
+
+    chunks.reset();
+    console.reset();
+    console_queued = true;
+    state          = scheduler.run();
+    console_queued = false;
+    /* Output queued before a failure */
+    while (Console_Drain()) {
+    }
+
+    if (state == TASK_DONE) {
+        return ERR_OK;
+    }
+    return (reader.status != ERR_OK) ? reader.status : programmer.status;
+}
+#endif
+
+#if (EARLY_ERASE != EARLY_ERASE_NONE)
+#if !(USE_ASYNC_FLASH) || (USE_CONTAINER)
+#error "EARLY_ERASE requires USE_ASYNC_FLASH, not with USE_CONTAINER"
+#endif
+/**
+ * @brief  Erase of the first application pages started once the update file
+ *         is identified, while it is read for its CRC. The asynchronous writer
+ *         is stopped before any other flash access, at the latest when the
+ *         object goes out of scope.
+ */
+class EarlyErase {
+public:
+    uint32_t first; /*!< First page erased, relative to ::APP_ADDRESS */
+    uint32_t count; /*!< Number of pages erased */
+
+    EarlyErase() : first(0), count(0), active(false) {}
+    ~EarlyErase() { end(); }
+
+    /**
+     * @brief  Commit to the update: open the journal, unless an interrupted
+     *         update left it open, and queue the erase of the first pages not
+     *         committed to it.
+     * @param  size: size of the image
+     * @param  crc: CRC-32 of the image, ::JOURNAL_CRC_UNKNOWN if not known
+     *         yet (::Bootloader_JournalResume completes it)
+     */
+    void start(uint32_t size, uint32_t crc) {
+        uint32_t last = (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE;
+
+        Bootloader_Init();
+        if (Bootloader_JournalPages(&first) != BL_OK) {
+            if (Bootloader_JournalOpen(size, crc) != BL_OK) {
+                return;
+            }
+            first = 0;
+        }
+        if (first >= last) {
+            return;
+        }
+        count = (last - first < EARLY_ERASE_PAGES) ? last - first : EARLY_ERASE_PAGES;
+
+        Bootloader_AsyncBegin();
+        active = (Bootloader_AsyncErase(APP_ADDRESS + first * FLASH_PAGE_SIZE, count) == BL_OK);
+        if (!active) {
+            Bootloader_AsyncEnd();
+            count = 0;
+        }
+    }
+
+    /**
+     * @brief  Wait for the erase and stop the asynchronous writer.
+     * @return Bootloader error code ::eBootloaderErrorCodes
+     */
+    uint8_t end(void) {
+        uint8_t status = BL_OK;
+
+        if (active) {
+            active = false;
+            status = Bootloader_AsyncEnd();
+            if (status != BL_OK) {
+                count = 0;
+            }
+        }
+        return status;
+    }
+
+private:
+    bool active;
+};
+#endif
+
+#if (USE_UART_UPDATE)
+#if !(USE_ASYNC_FLASH)
+#error "USE_UART_UPDATE requires USE_ASYNC_FLASH"
+#endif
+static_assert((UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)) == 0, "UART_RX_BUFFER_SIZE must be a power of two");
+static_assert(UART_RX_BUFFER_SIZE >= 2 * (YMODEM_BLOCK_SIZE + 5), "The reception buffer must hold two blocks");
+
+/** USART1 reception buffer, written by DMA1 channel 5 in circular mode */
+static uint8_t  uart_ring[UART_RX_BUFFER_SIZE];
+static uint32_t uart_tail;
+/** Baud rate register of the console, restored after the transfer */
+static uint32_t uart_brr;
+/** Received block, 32bit aligned for flash programming */
+static uint32_t uart_block[YMODEM_BLOCK_SIZE / 4];
+
+/** YMODEM port on USART1: the DMA fills the ring without interrupts, bytes
+ * keep coming in while the CPU waits for the flash writer */
+struct UartPort {
+    static int32_t get(void) {
+        uint32_t head = UART_RX_BUFFER_SIZE - DMA1_Channel5->CNDTR;
+        int32_t  c;
+
+        if (head == uart_tail) {
+            return -1;
+        }
+        c         = uart_ring[uart_tail];
+        uart_tail = (uart_tail + 1) % UART_RX_BUFFER_SIZE;
+        return c;
+    }
+    static void put(uint8_t c) {
+        while (!(USART1->ISR & USART_ISR_TXE)) {
+        }
+        USART1->TDR = c;
+    }
+    static uint32_t now(void) { return HAL_GetTick(); }
+};
+
+/**
+ * @brief  Switch USART1 to ::UART_UPDATE_BAUDRATE and start the circular
+ *         reception by DMA1 channel 5 (request 2: USART1_RX).
+ */
+static void Uart_Begin(void) {
+    while (!(USART1->ISR & USART_ISR_TC)) {
+    }
+    USART1->CR1 &= ~USART_CR1_UE;
+    uart_brr    = USART1->BRR;
+    USART1->BRR = (HAL_RCC_GetPCLK2Freq() + UART_UPDATE_BAUDRATE / 2) / UART_UPDATE_BAUDRATE;
+    /* An overrun would stop the DMA requests */
+    USART1->CR3 |= USART_CR3_OVRDIS | USART_CR3_DMAR;
+    USART1->ICR = USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_NCF | USART_ICR_PECF;
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    DMA1_Channel5->CCR = 0;
+    MODIFY_REG(DMA1_CSELR->CSELR, DMA_CSELR_C5S, 2 << DMA_CSELR_C5S_Pos);
+    DMA1_Channel5->CPAR  = (uint32_t)&USART1->RDR;
+    DMA1_Channel5->CMAR  = (uint32_t)uart_ring;
+    DMA1_Channel5->CNDTR = UART_RX_BUFFER_SIZE;
+    DMA1_Channel5->CCR   = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+    uart_tail            = 0;
+
+    USART1->CR1 |= USART_CR1_UE;
+}
+
+/**
+ * @brief  Stop the reception and restore the console.
+ */
+static void Uart_End(void) {
+    while (!(USART1->ISR & USART_ISR_TC)) {
+    }
+    USART1->CR1 &= ~USART_CR1_UE;
+    DMA1_Channel5->CCR = 0;
+    USART1->CR3 &= ~(USART_CR3_OVRDIS | USART_CR3_DMAR);
+    USART1->BRR = uart_brr;
+    USART1->CR1 |= USART_CR1_UE;
+}
+
+/**
+ * @brief  Transform stage erasing the pages of each chunk ahead of the flash
+ *         sink, for an image whose content is only known as it arrives.
+ */
+class EraseStage {
+public:
+    uint8_t process(uint8_t*, uint32_t length) {
+        uint32_t end = (offset + length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+        offset += length;
+        if (erased < end) {
+            if (Bootloader_AsyncErase(APP_ADDRESS + erased * FLASH_PAGE_SIZE, end - erased) != BL_OK) {
+                return ERR_FLASH;
+            }
+            erased = end;
+        }
+        return ERR_OK;
+    }
+
+    /**
+     * @brief  Erase the rest of the application area: no part of the
+     *         previous application is left above the image.
+     * @return Application error code ::eApplicationErrorCodes
+     */
+    uint8_t finish(void) {
+        uint32_t last = (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE;
+
+        if ((erased < last) &&
+            (Bootloader_AsyncErase(APP_ADDRESS + erased * FLASH_PAGE_SIZE, last - erased) != BL_OK)) {
+            return ERR_FLASH;
+        }
+        erased = last;
+        return ERR_OK;
+    }
+
+private:
+    uint32_t offset = 0; /*!< Offset of the next byte in the application area */
+    uint32_t erased = 0; /*!< First page not erased yet */
+};
+#endif
+
+#if (USE_ENCRYPTION)
+typedef Timed<CtrDecryptStage, DwtClock> DecryptStage;
+#else
+typedef NullStage DecryptStage;
+#endif
+#if (USE_SHA256)
+typedef Sha256Stage HashStage;
+#else
+typedef NullStage HashStage;
+#endif
+
+/** Key stream of the image being programmed and verified */
+static DecryptStage decrypt;
+/** Hash of the image being programmed, kept in SRAM2 with the round constants */
+static HashStage hash __attribute__((section(".sram2")));
+/** Chunk digests check of a staged image */
+static ChunkStage check;
+
+#if (USE_SIGNATURE)
+#if !(USE_SHA256)
+#error "USE_SIGNATURE requires USE_SHA256"
+#endif
+#if (USE_HEX_UPDATE) || (USE_DELTA_UPDATE) || (USE_UART_UPDATE)
+#error "USE_SIGNATURE: HEX, delta and YMODEM updates carry no signature, disable them"
+#endif
+/** Image trailer: SHA-256 digest followed by its Ed25519 signature */
+#define TRAILER_SIZE (SHA256_DIGEST_SIZE + ED25519_SIGNATURE_SIZE)
+#else
+/** Image trailer: SHA-256 digest */
+#define TRAILER_SIZE (SHA256_DIGEST_SIZE)
+#endif
+
 /**
  * @brief  Debug over UART2 -> ST-LINK -> USB Virtual Com Port
  * @param  str: string to be written to UART2
  * @retval None
  */
 void print(const char* str) {
+#if (USE_ITM)
+    /* A few cycles per word, whether or not a debugger captures the trace */
+    Trace_Write(str, strlen(str));
+    return;
+#endif
+#if (USE_SCHEDULER)
+    if (console_queued) {
+        /* Sent by ConsoleTask, or here while the queue is full */
+        for (; *str != 0; str++) {
+            while (!console.push(*str)) {
+                Console_Drain();
+            }
+        }
+        return;
+    }
+#endif
     HAL_UART_Transmit(&huart1, (uint8_t*)str, (uint16_t)strlen(str), 100);
 }
 
@@ -27,6 +793,180 @@ void println(const char* tag, const char* txt) {
 }
 
 
+#if !(USE_CONTAINER)
+/**
+ * @brief  This function computes the CRC-32 of the plain image held in the
+ *         update file, decrypted if need be: the CRC of the image as it is
+ *         programmed, which identifies it in the bootloader record.
+ * @param  start: offset of the image in the file
+ * @param  size: size of the image
+ * @param  crc: CRC-32 of the plain image
+ * @retval Application error code ::eApplicationErrorCodes
+ */
+static uint8_t Image_CRC32(uint32_t start, uint32_t size, uint32_t* crc) {
+    Crc32Stage check;
+    uint8_t    status = ERR_SD_FILE;
+
+#if (USE_ENCRYPTION)
+    decrypt.seek(0);
+#endif
+    if (f_lseek(&USERFile, start) == FR_OK) {
+        FileSource source(&USERFile, 0, size);
+        NullSink   sink;
+        Pipeline   pass(source, sink, decrypt, check);
+
+        auto progress = [](uint32_t) {};
+#if (USE_FORWARD)
+        status = Forward_Run(pass, &USERFile, size, progress);
+#else
+        status = pass.run((uint8_t*)io_buffer, sizeof(io_buffer), progress);
+#endif
+    }
+    *crc = check.crc;
+    return status;
+}
+#endif
+
+/**
+ * @brief  This function checks whether the image described by size and CRC is
+ *         the application recorded as installed.
+ * @param  size: size of the image
+ * @param  crc: CRC-32 of the image
+ * @retval true if the image is already installed
+ */
+static bool Is_Installed(uint32_t size, uint32_t crc) {
+    BootloaderRecord record;
+
+    return (Bootloader_GetRecord(&record) == BL_OK) && (record.size == size) && (record.crc == crc) &&
+           (Bootloader_CheckForApplication() == BL_OK);
+}
+
+#if (USE_ENCRYPTION)
+/**
+ * @brief  This function checks the AES implementation and the key, then
+ *         starts the key stream of the image.
+ * @param  iv: initial counter block of the image
+ * @retval false if the self-test fails or no key is programmed
+ */
+static bool Load_Key(const uint8_t* iv) {
+    const uint8_t* key   = (const uint8_t*)AES_KEY_ADDRESS;
+    uint8_t        blank = 0xFF;
+
+    for (uint32_t i = 0; i < AES_KEY_SIZE; i++) {
+        blank &= key[i];
+    }
+    if (!Aes_SelfTest() || (blank == 0xFF)) {
+        return false;
+    }
+    decrypt.init(key, iv);
+    return true;
+}
+
+/**
+ * @brief  Clears the key schedule and the counter of the image when the update
+ *         ends, whether it completes or fails.
+ */
+class KeyWipe {
+public:
+    ~KeyWipe() { decrypt.wipe(); }
+};
+#endif
+
+#if (USE_SIGNATURE)
+/**
+ * @brief  This function verifies an Ed25519 signature made with the key of
+ *         the image signer (::SIGNATURE_PUBLIC_KEY).
+ * @param  signature: ::ED25519_SIGNATURE_SIZE bytes signature
+ * @param  data: signed data
+ * @param  length: length of the signed data
+ * @param  ms: time spent in the verification, in milliseconds
+ * @retval true if the signature is valid
+ */
+static bool Check_Signature(const uint8_t* signature, const uint8_t* data, uint32_t length, uint32_t* ms) {
+    static const uint8_t key[ED25519_KEY_SIZE] = SIGNATURE_PUBLIC_KEY;
+    uint32_t             start;
+    bool                 valid;
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    start = DWT->CYCCNT;
+    valid = Ed25519_Verify(signature, data, length, key);
+    *ms   = (DWT->CYCCNT - start) / (SystemCoreClock / 1000);
+    return valid;
+}
+
+#if !(USE_STAGING)
+/**
+ * @brief  This function hashes the whole image and compares it with the
+ *         signed digest, before anything is erased: a tampered image then
+ *         leaves the installed application in place.
+ * @param  start: offset of the image in the file
+ * @param  size: size of the image
+ * @param  expected: signed SHA-256 digest of the plain image
+ * @retval true if the image matches the digest
+ */
+static bool Check_Payload(uint32_t start, uint32_t size, const uint8_t* expected) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t status = ERR_SD_FILE;
+
+    hash.init();
+#if (USE_ENCRYPTION)
+    decrypt.seek(0);
+#endif
+    if (f_lseek(&USERFile, start) == FR_OK) {
+        FileSource source(&USERFile, 0, size);
+        NullSink   sink;
+        Pipeline   pass(source, sink, decrypt, hash);
+
+        auto progress = [](uint32_t) {};
+#if (USE_FORWARD)
+        status = Forward_Run(pass, &USERFile, size, progress);
+#else
+        status = pass.run((uint8_t*)io_buffer, sizeof(io_buffer), progress);
+#endif
+    }
+    hash.final(digest);
+    return (status == ERR_OK) && (memcmp(digest, expected, sizeof(digest)) == 0);
+}
+#endif
+#endif
+
+#if (ERASE_BENCHMARK)
+/**
+ * @brief  This function hashes a buffer until the queued erase is done, then
+ *         hashes the same amount with the flash idle: the ratio of both times
+ *         is the share of the CPU left to the update while flash is erased.
+ * @param  ms: duration of the erase, in milliseconds
+ * @param  bytes: number of bytes hashed during the erase
+ * @return Share of the CPU available during the erase, in percent
+ */
+static uint32_t Erase_Benchmark(uint32_t* ms, uint32_t* bytes) {
+    static uint8_t data[1024];
+    Sha256Context  ctx;
+    uint32_t       start;
+    uint32_t       erasing;
+    uint32_t       idle;
+
+    Sha256_Init(&ctx);
+    *bytes = 0;
+    start  = DWT->CYCCNT;
+    while (Bootloader_AsyncPoll() == BL_BUSY) {
+        Sha256_Update(&ctx, data, sizeof(data));
+        *bytes += sizeof(data);
+    }
+    erasing = DWT->CYCCNT - start;
+
+    start = DWT->CYCCNT;
+    for (uint32_t i = 0; i < *bytes; i += sizeof(data)) {
+        Sha256_Update(&ctx, data, sizeof(data));
+    }
+    idle = DWT->CYCCNT - start;
+
+    *ms = erasing / (SystemCoreClock / 1000);
+    return (erasing == 0) ? 0 : (uint32_t)((uint64_t)idle * 100 / erasing);
+}
+#endif
+
 /**
  * @brief  This function executes the bootloader sequence.
  * @param  None
@@ -35,15 +975,43 @@ void println(const char* tag, const char* txt) {
  */
 uint8_t Enter_Bootloader(void) {
     FRESULT  fr;
-    UINT     num;
     uint8_t  status;
     size_t   size;
-    uint64_t data;
     uint32_t cntr;
-    uint32_t addr;
+    uint32_t crc;
+    uint32_t page;
     char     msg[100];
 
+    BootloaderFlashStats stats;
+#if (USE_SHA256) || (USE_ENCRYPTION) || (USE_CONTAINER)
+    UINT num;
+#endif
+#if (USE_CONTAINER)
+    /* The image follows the container header */
+    const uint32_t start = IMAGE_HEADER_SIZE;
+#else
+    const uint32_t start = 0;
+#endif
+#if (USE_SHA256)
+    uint8_t digest[SHA256_DIGEST_SIZE];
+#if (USE_CONTAINER)
+    const uint8_t* expected = image_header.digest;
+#else
+    uint8_t expected[TRAILER_SIZE];
+#endif
+#endif
+
+#if (EARLY_ERASE != EARLY_ERASE_NONE)
+    /* Started once the update file is identified */
+    EarlyErase early;
+#endif
+#if (USE_ENCRYPTION)
+    /* Expanded key loaded from the header or the trailer */
+    KeyWipe wipe;
+#endif
+
     /* Mount SD card */
+    Trace_Event(TRACE_PHASE, PHASE_MOUNT);
     printr("SD", "Mounting");
     fr = f_mount(&USERFatFS, (TCHAR const*)USERPath, 1);
     if (fr != FR_OK) {
@@ -56,14 +1024,33 @@ uint8_t Enter_Bootloader(void) {
     println("SD", "Mounted");
 
     /* Open file for programming */
+    Trace_Event(TRACE_PHASE, PHASE_CHECK);
     printr("FILE", "Loading");
     fr = f_open(&USERFile, CONF_FILENAME, FA_READ);
     if (fr != FR_OK) {
         uint8_t res;
 
         if (fr == FR_NO_FILE) {
-            println("FILE", "Nothing to flash");
+            /* Look for the alternative update files */
             res = ERR_OK;
+#if (USE_HEX_UPDATE)
+            if (f_stat(HEX_FILENAME, NULL) == FR_OK) {
+                res = Enter_HexUpdate(HEX_FILENAME);
+                fr  = FR_OK;
+            } else if (f_stat(SREC_FILENAME, NULL) == FR_OK) {
+                res = Enter_HexUpdate(SREC_FILENAME);
+                fr  = FR_OK;
+            }
+#endif
+#if (USE_DELTA_UPDATE)
+            if ((fr == FR_NO_FILE) && (f_stat(PATCH_FILENAME, NULL) == FR_OK)) {
+                res = Enter_DeltaUpdate();
+                fr  = FR_OK;
+            }
+#endif
+            if (fr == FR_NO_FILE) {
+                println("FILE", "Nothing to flash");
+            }
 
         } else {
             /* f_open failed */
@@ -91,55 +1078,402 @@ uint8_t Enter_Bootloader(void) {
     }
     println("SIZE", "App size OK");
 
-    /* Step 1: Init Bootloader and Flash */
+#if (USE_CONTAINER)
+    /* Check the container header: wrong images are rejected before anything
+     * is erased, the header gives the identity of the image */
+    printr("IMG", "Reading header");
+    if ((f_read(&USERFile, &image_header, sizeof(image_header), &num) != FR_OK) || (num != sizeof(image_header))) {
+        println("IMG", "Cannot read header");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_SD_FILE;
+    }
+    status = Image_CheckHeader(&image_header, size, APP_ADDRESS, IMAGE_FLAGS_REQUIRED);
+#if (USE_STAGING)
+    if ((status == IMAGE_OK) && (image_header.chunkSize != STAGING_CHUNK_SIZE)) {
+        status = IMAGE_BAD_CHUNKS;
+    }
+#endif
+    if (status != IMAGE_OK) {
+        snprintf(msg, 50, "Error: invalid header (%u)", status);
+        println("IMG", msg);
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_IMAGE;
+    }
+    size = image_header.size;
+    crc  = image_header.crc;
+    println("IMG", "Header OK");
+
+#if (USE_SHA256)
+    if (!Sha256_SelfTest()) {
+        println("SHA", "Error: self-test failed");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_HASH;
+    }
+#endif
+
+#if (USE_ENCRYPTION)
+    printr("AES", "Loading key");
+    if (!Load_Key(image_header.iv)) {
+        println("AES", "Error: self-test failed or no key");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_KEY;
+    }
+    println("AES", "Key loaded");
+#endif
+
+#if (USE_SIGNATURE)
+    /* Authenticate the header, hence the image digest, before anything is
+     * erased: the streamed image is then checked against this digest */
+    printr("SIGN", "Verifying signature");
+    {
+        uint32_t ms;
+
+        if (!Check_Signature(image_header.signature, (const uint8_t*)&image_header, IMAGE_SIGNED_SIZE, &ms)) {
+            println("SIGN", "Error: invalid signature");
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+            return ERR_SIGNATURE;
+        }
+        snprintf(msg, 60, "Signature OK (%lu ms)", ms);
+        println("SIGN", msg);
+    }
+
+#if !(USE_STAGING)
+    /* Staged images check each chunk against the signed header instead */
+    printr("SIGN", "Checking image");
+    if (!Is_Installed(size, crc) && !Check_Payload(start, size, expected)) {
+        println("SIGN", "Error: image does not match its signed digest");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_HASH;
+    }
+    println("SIGN", "Image OK");
+#endif
+#endif
+#else
+#if (USE_SHA256)
+    /* Read the digest from the image trailer */
+    printr("SHA", "Reading trailer");
+    if (!Sha256_SelfTest() || (size < TRAILER_SIZE)) {
+        println("SHA", "Error: self-test failed or no trailer");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_HASH;
+    }
+    size -= TRAILER_SIZE;
+    if ((f_lseek(&USERFile, size) != FR_OK) || (f_read(&USERFile, expected, sizeof(expected), &num) != FR_OK) ||
+        (num != sizeof(expected))) {
+        println("SHA", "Cannot read trailer");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_SD_FILE;
+    }
+    println("SHA", "Trailer found");
+#endif
+
+#if (USE_ENCRYPTION)
+    /* Read the initial counter block, in front of the other trailers */
+    printr("AES", "Loading key");
+    {
+        uint8_t iv[AES_BLOCK_SIZE];
+
+        if ((size < AES_BLOCK_SIZE) || (f_lseek(&USERFile, size - AES_BLOCK_SIZE) != FR_OK) ||
+            (f_read(&USERFile, iv, sizeof(iv), &num) != FR_OK) || (num != sizeof(iv))) {
+            println("AES", "Cannot read IV");
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+            return ERR_SD_FILE;
+        }
+        size -= AES_BLOCK_SIZE;
+        if (!Load_Key(iv)) {
+            println("AES", "Error: self-test failed or no key");
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+            return ERR_KEY;
+        }
+    }
+    println("AES", "Key loaded");
+#endif
+
+#if (USE_SIGNATURE)
+    /* Authenticate the digest before anything is erased: the streamed image
+     * is then checked against this digest while it is programmed */
+    printr("SIGN", "Verifying signature");
+    {
+        uint32_t ms;
+
+        if (!Check_Signature(&expected[SHA256_DIGEST_SIZE], expected, SHA256_DIGEST_SIZE, &ms)) {
+            println("SIGN", "Error: invalid signature");
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+            return ERR_SIGNATURE;
+        }
+        snprintf(msg, 60, "Signature OK (%lu ms)", ms);
+        println("SIGN", msg);
+    }
+
+    /* The digest is authentic: check the image against it */
+    printr("SIGN", "Checking image");
+    if (!Check_Payload(start, size, expected)) {
+        println("SIGN", "Error: image does not match its signed digest");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_HASH;
+    }
+    println("SIGN", "Image OK");
+#endif
+
+#if (EARLY_ERASE != EARLY_ERASE_NONE)
+    {
+        BootloaderRecord record;
+
+        /* The CRC pass overlaps the erase, unless the file may be the
+         * installed application */
+        if ((Bootloader_GetRecord(&record) != BL_OK) || (record.size != size)) {
+            early.start(size, JOURNAL_CRC_UNKNOWN);
+        }
+        if (early.count) {
+            snprintf(msg, 50, "Erasing pages %lu-%lu early", early.first, early.first + early.count - 1);
+            println("ERAZ", msg);
+        }
+    }
+#endif
+
+    /* Compare the image with the installed application */
+    printr("HASH", "Computing CRC");
+    if (Image_CRC32(start, size, &crc) != ERR_OK) {
+        println("HASH", "Cannot read file");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_SD_FILE;
+    }
+#endif
+    if (Is_Installed(size, crc)) {
+        /* Only the cleanup of a previous update is left to do */
+        println("HASH", "Already installed");
+        f_close(&USERFile);
+        if (f_unlink(CONF_FILENAME) != FR_OK) {
+            println("FILE", "Failed to erase file, ignored");
+        }
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_OK;
+    }
+    snprintf(msg, 50, "New image [CRC %08lX]", crc);
+    println("HASH", msg);
+
+    /* Step 1: Init Bootloader and Flash, resume an interrupted update */
+#if (EARLY_ERASE != EARLY_ERASE_NONE)
+    if (early.end() != BL_OK) {
+        println("ERAZ", "Error: erase failed");
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_FLASH;
+    }
+#endif
     Bootloader_Init();
+    if (Bootloader_JournalResume(size, crc, &page) == BL_OK) {
+        snprintf(msg, 50, "Resuming at page %lu", page);
+        println("JRNL", msg);
+    } else {
+        page = 0;
+        if (Bootloader_JournalOpen(size, crc) != BL_OK) {
+            println("JRNL", "Cannot open journal");
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+            return ERR_FLASH;
+        }
+    }
+    cntr = page * FLASH_PAGE_SIZE;
+#if (USE_SHA256)
+    /* Pages committed before an interruption are hashed from flash */
+    hash.init();
+    hash.update((const void*)APP_ADDRESS, (cntr < size) ? cntr : size);
+#endif
+#if (USE_STAGING)
+    /* Same for the start of the chunk holding the resume page */
+    check.init(cntr);
+    check.update((const void*)(APP_ADDRESS + cntr - (cntr % STAGING_CHUNK_SIZE)), cntr % STAGING_CHUNK_SIZE);
+#endif
 
     /* Step 2: Erase Flash */
+    Trace_Event(TRACE_PHASE, PHASE_ERASE);
+#if (USE_STAGING)
+    /* Pages are erased by the flash sink, once their chunk has been checked */
+    Bootloader_AsyncBegin();
+    println("ERAZ", "Erasing each chunk once checked");
+#else
+    uint32_t addr = APP_ADDRESS + page * FLASH_PAGE_SIZE;
+
     printr("ERAZ", "Erasing flash...");
+#if (USE_ASYNC_FLASH)
+    /* Erased in the background while the first chunks are read */
+    Bootloader_AsyncBegin();
+#if (EARLY_ERASE != EARLY_ERASE_NONE)
+    {
+        /* Pages erased before the mount are skipped */
+        uint32_t last = (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE;
+        uint32_t next = (page > early.first + early.count) ? page : early.first + early.count;
+
+        status = BL_OK;
+        if (page < early.first) {
+            status = Bootloader_AsyncErase(addr, early.first - page);
+        }
+        if ((status == BL_OK) && (next < last)) {
+            status = Bootloader_AsyncErase(APP_ADDRESS + next * FLASH_PAGE_SIZE, last - next);
+        }
+    }
+#else
+    status = Bootloader_AsyncErase(addr, (FLASH_BASE + FLASH_SIZE - addr) / FLASH_PAGE_SIZE);
+#endif
+#else
     LED_G2_ON();
-    Bootloader_Erase();
+    status = Bootloader_ErasePages(addr, (FLASH_BASE + FLASH_SIZE - addr) / FLASH_PAGE_SIZE);
     LED_G2_OFF();
+#endif
+    if (status != BL_OK) {
+        println("ERAZ", "Error: erase failed");
+#if (USE_ASYNC_FLASH)
+        Bootloader_AsyncEnd();
+#endif
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_FLASH;
+    }
+#if (USE_ASYNC_FLASH)
+    println("ERAZ", "Flash erase queued");
+#if (ERASE_BENCHMARK)
+    {
+        uint32_t ms;
+        uint32_t bytes;
+        uint32_t share = Erase_Benchmark(&ms, &bytes);
+
+        snprintf(msg, 60, "%lu ms erase, %lu KB hashed meanwhile (%lu%% CPU)", ms, bytes / 1024, share);
+        println("ERAZ", msg);
+    }
+#endif
+#else
     println("ERAZ", "Flash erased");
+#endif
+#endif
 
-    /* Step 3: Programming */
+    /* Step 3: Programming, committing each page to the journal */
+    Trace_Event(TRACE_PHASE, PHASE_PROGRAM);
     printr("PROG", "Starting");
     LED_G1_ON();
-    cntr = 0;
+    fr = f_lseek(&USERFile, start + cntr);
+#if (USE_ENCRYPTION)
+    decrypt.seek(cntr);
+    decrypt.elapsed = 0;
+#endif
+#if !(USE_ASYNC_FLASH)
     Bootloader_FlashBegin();
-    do {
-        data = 0xFFFFFFFFFFFFFFFF;
-        fr   = f_read(&USERFile, &data, 8, &num);
-        if (num) {
-            status = Bootloader_FlashNext(data);
-            if (status == BL_OK) {
-                cntr++;
-            } else {
-                snprintf(msg, 50, "Error at: %lu byte", (cntr * 8));
-                println("PROG", msg);
+    Bootloader_FlashSeek(addr);
+#endif
+    {
+        /* Decrypted in place, the plain image is checked, hashed and programmed */
+        FileSource source(&USERFile, cntr, (cntr < size) ? size - cntr : 0);
+        FlashSink  sink(cntr);
+        Pipeline   program(source, sink, decrypt, check, hash);
 
-                f_close(&USERFile);
-                SD_Eject();
-                println("SD", "Ejected");
+        auto progress = [&](uint32_t length) {
+            cntr += length;
+            Trace_Event(TRACE_CHUNK, length);
+            if (cntr % 2048 == 0) {
+#if !(USE_SCHEDULER)
+                /* Blinked by LedTask otherwise */
+                LED_G2_TG();
+#endif
+                snprintf(msg, 50, "%2lu%% [%6lu/%6u]", cntr * 100 / size, cntr, size);
+                printr("PROG", msg);
+            }
+        };
 
-                LED_ALL_OFF();
-                return ERR_FLASH;
+        status = ERR_SD_FILE;
+        if (fr == FR_OK) {
+#if (USE_SCHEDULER)
+            status = Program_Run(program, source, progress);
+#elif (USE_FORWARD) && !(USE_STAGING)
+#if (_FS_EXFAT)
+            if (source.contiguous()) {
+                /* Sector by sector into the buffer of the file object */
+                status = program.run(USERFile.buf, sizeof(USERFile.buf), progress);
+            } else
+#endif
+            {
+                status = Forward_Run(program, &USERFile, (cntr < size) ? size - cntr : 0, progress);
             }
+#else
+            status = program.run((uint8_t*)io_buffer, sizeof(io_buffer), progress);
+#endif
         }
-        if (cntr % 256 == 0) {
-            LED_G2_TG();
-            snprintf(msg, 50, "%2lu%% [%6lu/%6u]", cntr * 8 * 100 / size, cntr * 8, size);
-            printr("PROG", msg);
+        status = sink.finish(status);
+        if (status != ERR_OK) {
+            snprintf(msg, 50, "Error at: %lu byte", sink.offset);
+            println("PROG", msg);
+
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+
+            LED_ALL_OFF();
+            return status;
         }
-    } while ((fr == FR_OK) && (num > 0));
+    }
 
     /* Step 4: Finalize Programming */
-    Bootloader_FlashEnd();
     f_close(&USERFile);
     LED_ALL_OFF();
     snprintf(msg, 50, "Flashed %d bytes", size);
     println("PROG", msg);
+    Bootloader_GetFlashStats(&stats);
+    snprintf(msg,
+             60,
+             "Programmed %lu B, skipped %lu B (~%lu ms saved)",
+             stats.programmed,
+             stats.skipped,
+             (stats.programmed == 0) ? 0 : (uint32_t)((uint64_t)stats.cycles * stats.skipped / stats.programmed /
+                                                      (SystemCoreClock / 1000)));
+    println("PROG", msg);
+#if (USE_ENCRYPTION)
+    snprintf(msg, 60, "Decrypted in %lu ms", decrypt.elapsed / (SystemCoreClock / 1000));
+    println("AES", msg);
+#endif
+
+#if (USE_SHA256)
+    /* Compare the image digest with the trailer before committing */
+    hash.final(digest);
+    if (memcmp(digest, expected, sizeof(digest)) != 0) {
+        println("SHA", "Error: digest mismatch");
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_HASH;
+    }
+    println("SHA", "Digest OK");
+#endif
 
     /* Open file for verification */
+    Trace_Event(TRACE_PHASE, PHASE_VERIFY);
     printr("CHCK", "Checking data");
     fr = f_open(&USERFile, CONF_FILENAME, FA_READ);
     if (fr != FR_OK) {
@@ -154,37 +1488,79 @@ uint8_t Enter_Bootloader(void) {
     }
 
     /* Step 5: Verify Flash Content */
-    addr = APP_ADDRESS;
     cntr = 0;
-    do {
-        data = 0xFFFFFFFFFFFFFFFF;
-        fr   = f_read(&USERFile, &data, 4, &num);
-        if (num) {
-            if (*(uint32_t*)addr == (uint32_t)data) {
-                addr += 4;
-                cntr++;
-            } else {
-                snprintf(msg, 50, "Error at: %lu byte", cntr * 4);
-                println("CHCK", msg);
-
-                f_close(&USERFile);
-                SD_Eject();
-                println("SD", "Ejected");
-
-                LED_G1_OFF();
-                return ERR_VERIFY;
-            }
-        }
-        if (cntr % 256 == 0) {
-            /* Toggle green LED during verification */
-            LED_G1_TG();
-            snprintf(msg, 50, "%2lu%% [%6lu/%6u]", cntr * 4 * 100 / size, cntr * 4, size);
-            printr("CHCK", msg);
-        }
-    } while ((fr == FR_OK) && (num > 0));
+    fr   = f_lseek(&USERFile, start);
+#if (USE_ENCRYPTION)
+    decrypt.seek(0);
+#endif
+    {
+        FileSource source(&USERFile, 0, size);
+        VerifySink sink;
+        NullStage  none;
+        Pipeline   verify(source, sink, decrypt, none);
+
+        auto progress = [&](uint32_t length) {
+            cntr += length;
+            Trace_Event(TRACE_CHUNK, length);
+            if (cntr % 1024 == 0) {
+                /* Toggle green LED during verification */
+                LED_G1_TG();
+                snprintf(msg, 50, "%2lu%% [%6lu/%6u]", cntr * 100 / size, cntr, size);
+                printr("CHCK", msg);
+            }
+        };
+
+        status = ERR_SD_FILE;
+        if (fr == FR_OK) {
+#if (USE_FORWARD) && !(USE_STAGING)
+#if (_FS_EXFAT)
+            if (source.contiguous()) {
+                status = verify.run(USERFile.buf, sizeof(USERFile.buf), progress);
+            } else
+#endif
+            {
+                status = Forward_Run(verify, &USERFile, size, progress);
+            }
+#else
+            status = verify.run((uint8_t*)io_buffer, sizeof(io_buffer), progress);
+#endif
+        }
+        if (status != ERR_OK) {
+            snprintf(msg, 50, "Error at: %lu byte", sink.offset);
+            println("CHCK", msg);
+
+            f_close(&USERFile);
+            SD_Eject();
+            println("SD", "Ejected");
+
+            LED_G1_OFF();
+            return status;
+        }
+    }
     println("CHCK", "Passed");
     LED_G1_OFF();
 
+    /* The record holds the size and CRC-32 of the image as programmed: the
+     * CRC identifying the image (container header, or image pass) must be
+     * the one of flash */
+    if (Bootloader_CRC32(0, (const void*)APP_ADDRESS, size) != crc) {
+#if (USE_CONTAINER)
+        println("CHCK", "Error: image does not match header CRC");
+#else
+        println("CHCK", "Error: image CRC changed");
+#endif
+        f_close(&USERFile);
+        SD_Eject();
+        println("SD", "Ejected");
+        return ERR_VERIFY;
+    }
+
+    /* Record the installed application */
+    Trace_Event(TRACE_PHASE, PHASE_CLEANUP);
+    if (Bootloader_SetRecord(size, crc) != BL_OK) {
+        println("CHCK", "Failed to record application");
+    }
+
     /* Closing file */
     fr = f_close(&USERFile);
     if (fr != FR_OK) {
@@ -211,11 +1587,346 @@ uint8_t Enter_Bootloader(void) {
     return ERR_OK;
 }
 
+#if (USE_HEX_UPDATE)
+/**
+ * @brief  This function programs an Intel HEX or S-record file. The file is
+ *         fully validated before flash is modified, and only the pages it
+ *         touches are erased.
+ * @param  filename: name of the hex file
+ * @retval Application error code ::eApplicationErrorCodes
+ */
+uint8_t Enter_HexUpdate(const char* filename) {
+    FRESULT              fr;
+    uint8_t              status;
+    uint32_t             crc;
+    uint32_t             extent;
+    HexInfo              info;
+    BootloaderFlashStats stats;
+    char                 msg[100];
+
+    fr = f_open(&USERFile, filename, FA_READ);
+    if (fr != FR_OK) {
+        println("HEX", "Cannot be opened");
+        sprintf(msg, "FatFs error code: %u", fr);
+        println("HEX", msg);
+        return ERR_SD_FILE;
+    }
+    println("HEX", filename);
+
+    /* Validate every record before touching flash */
+    printr("HEX", "Checking records");
+    status = Hex_Check(&USERFile, &info);
+    if ((status != HEX_OK) || (info.bytes == 0)) {
+        println("HEX", (status == HEX_RANGE_ERROR)     ? "Error: data outside of app area"
+                       : (status == HEX_OVERLAP_ERROR) ? "Error: overlapping records"
+                                                       : "Error: invalid file");
+        f_close(&USERFile);
+        return (status == HEX_READ_ERROR) ? ERR_SD_FILE : ERR_HEX;
+    }
+    snprintf(msg, 60, "%lu B in %lu pages [%08lX-%08lX]", info.bytes, info.pages, info.start, info.end - 1);
+    println("HEX", msg);
+
+    /* Compare flash with the installed application, then with the file */
+    extent = info.end - APP_ADDRESS;
+    if (Is_Installed(extent, Bootloader_CRC32(0, (const void*)APP_ADDRESS, extent)) &&
+        (Hex_Verify(&USERFile) == HEX_OK)) {
+        println("HASH", "Already installed");
+    } else {
+        /* Erase and program the touched pages */
+        if (Bootloader_JournalOpen(extent, 0) != BL_OK) {
+            println("JRNL", "Cannot open journal");
+            f_close(&USERFile);
+            return ERR_FLASH;
+        }
+        printr("PROG", "Programming...");
+        LED_G1_ON();
+        status = Hex_Program(&USERFile);
+        LED_ALL_OFF();
+        if (status != HEX_OK) {
+            println("PROG", "Error: flash failed");
+            f_close(&USERFile);
+            return ERR_FLASH;
+        }
+        Bootloader_GetFlashStats(&stats);
+        snprintf(msg, 60, "Programmed %lu B, skipped %lu B", stats.programmed, stats.skipped);
+        println("PROG", msg);
+
+        printr("CHCK", "Checking data");
+        if (Hex_Verify(&USERFile) != HEX_OK) {
+            println("CHCK", "Error: verification failed");
+            f_close(&USERFile);
+            return ERR_VERIFY;
+        }
+        println("CHCK", "Passed");
+
+        crc = Bootloader_CRC32(0, (const void*)APP_ADDRESS, extent);
+        if (Bootloader_SetRecord(extent, crc) != BL_OK) {
+            println("CHCK", "Failed to record application");
+        }
+    }
+    f_close(&USERFile);
+
+    /* Erasing hex file */
+    printr("FILE", "Erasing firmware file");
+    if (f_unlink(filename) != FR_OK) {
+        println("FILE", "Failed to erase file, ignored");
+    } else {
+        println("FILE", "File erased");
+    }
+    return ERR_OK;
+}
+#endif
+
+#if (USE_DELTA_UPDATE)
+/**
+ * @brief  This function applies the patch file against the installed
+ *         application. The patch is fully validated before flash is modified.
+ * @param  None
+ * @retval Application error code ::eApplicationErrorCodes
+ */
+uint8_t Enter_DeltaUpdate(void) {
+    FRESULT     fr;
+    uint8_t     status;
+    DeltaHeader header;
+    DeltaResume resume;
+    uint32_t    page;
+    char        msg[100];
+
+    fr = f_open(&USERFile, PATCH_FILENAME, FA_READ);
+    if (fr != FR_OK) {
+        println("DIFF", "Cannot be opened");
+        sprintf(msg, "FatFs error code: %u", fr);
+        println("DIFF", msg);
+        return ERR_SD_FILE;
+    }
+    println("DIFF", "Patch found");
+
+    /* Validate patch against the installed application */
+    printr("DIFF", "Checking patch");
+    status = Delta_Check(&USERFile, &header, &resume);
+    if (status == DELTA_APPLIED) {
+        println("DIFF", "Already applied");
+        f_close(&USERFile);
+        if (f_unlink(PATCH_FILENAME) != FR_OK) {
+            println("FILE", "Failed to erase file, ignored");
+        }
+        if (!Is_Installed(header.targetSize, header.targetCrc)) {
+            Bootloader_SetRecord(header.targetSize, header.targetCrc);
+        }
+        return ERR_OK;
+    } else if (status != DELTA_OK) {
+        println("DIFF", (status == DELTA_BASE_MISMATCH) ? "Error: wrong base image" : "Error: invalid patch");
+        f_close(&USERFile);
+        return (status == DELTA_BASE_MISMATCH) ? ERR_PATCH_BASE : ERR_PATCH;
+    } else {
+        snprintf(msg, 50, "Patch OK [%6lu -> %6lu]", header.sourceSize, header.targetSize);
+        println("DIFF", msg);
+
+        if (Bootloader_JournalResume(header.targetSize, header.targetCrc, &page) == BL_OK) {
+            snprintf(msg, 50, "Resuming at page %lu", resume.page);
+            println("JRNL", msg);
+        } else if (Bootloader_JournalOpen(header.targetSize, header.targetCrc) != BL_OK) {
+            println("JRNL", "Cannot open journal");
+            f_close(&USERFile);
+            return ERR_FLASH;
+        }
+
+        /* Rebuild the application page by page */
+        printr("DIFF", "Patching...");
+        LED_G1_ON();
+        status = Delta_Apply(&USERFile, &header, &resume);
+        LED_ALL_OFF();
+        if (status != DELTA_OK) {
+            println("DIFF", (status == DELTA_VERIFY_ERROR) ? "Error: verification failed" : "Error: flash failed");
+            f_close(&USERFile);
+            return (status == DELTA_VERIFY_ERROR) ? ERR_VERIFY : ERR_FLASH;
+        }
+        println("DIFF", "Patched");
+        if (Bootloader_SetRecord(header.targetSize, header.targetCrc) != BL_OK) {
+            println("DIFF", "Failed to record application");
+        }
+    }
+
+    fr = f_close(&USERFile);
+    if (fr != FR_OK) {
+        return ERR_FILE_CLOSE;
+    }
+
+    /* Erasing patch */
+    printr("FILE", "Erasing patch file");
+    fr = f_unlink(PATCH_FILENAME);
+    if (fr != FR_OK) {
+        println("FILE", "Failed to erase file");
+        sprintf(msg, "FatFs error code: %u", fr);
+        println("FILE", msg);
+        return ERR_FILE_DELETE;
+    }
+    println("FILE", "File erased");
+    return ERR_OK;
+}
+#endif
+
+#if (USE_UART_UPDATE)
+/**
+ * @brief  This function receives an image over USART1 with YMODEM-1K and
+ *         programs it while it is received. Nothing is printed during the
+ *         transfer: the console shares the line.
+ * @param  None
+ * @retval Application error code ::eApplicationErrorCodes
+ * @retval ERR_UART_NONE: no sender showed up, flash is untouched
+ */
+uint8_t Enter_UartUpdate(void) {
+    YmodemSource<UartPort> source(FLASH_BASE + FLASH_SIZE - APP_ADDRESS);
+    uint8_t                status;
+    uint32_t               start;
+    uint32_t               ms;
+    char                   msg[60];
+
+    snprintf(msg, 60, "Waiting %u ms for a sender at %lu baud", UART_UPDATE_WAIT, (uint32_t)UART_UPDATE_BAUDRATE);
+    println("UART", msg);
+    Trace_Event(TRACE_PHASE, PHASE_UART);
+    Uart_Begin();
+    if (source.start((uint8_t*)uart_block, UART_UPDATE_WAIT) != YMODEM_OK) {
+        Uart_End();
+        if (source.status == YMODEM_NONE) {
+            println("UART", "No sender");
+            return ERR_UART_NONE;
+        }
+        snprintf(msg, 60, "Error: transfer refused (%u)", source.status);
+        println("UART", msg);
+        return ERR_UART;
+    }
+    start = HAL_GetTick();
+
+    /* The header is acknowledged, the sender waits for the journal */
+    Bootloader_Init();
+    if (Bootloader_JournalOpen(source.size, 0) != BL_OK) {
+        source.cancel();
+        Uart_End();
+        println("JRNL", "Cannot open journal");
+        return ERR_FLASH;
+    }
+    Bootloader_AsyncBegin();
+    Trace_Event(TRACE_PHASE, PHASE_PROGRAM);
+    LED_G1_ON();
+    {
+        EraseStage erase;
+        Crc32Stage crc;
+        FlashSink  sink(0);
+        Pipeline   program(source, sink, erase, crc);
+
+        status = program.run((uint8_t*)uart_block, sizeof(uart_block), [](uint32_t length) {
+            Trace_Event(TRACE_CHUNK, length);
+            LED_G2_TG();
+        });
+        if (source.status != YMODEM_OK) {
+            status = ERR_UART;
+        } else if (status != ERR_OK) {
+            source.cancel();
+        }
+        if (status == ERR_OK) {
+            status = erase.finish();
+        }
+        status = sink.finish(status);
+        ms     = HAL_GetTick() - start;
+        Uart_End();
+        LED_ALL_OFF();
+        if (status != ERR_OK) {
+            snprintf(msg, 60, "Error %u at: %lu byte (%u)", status, source.received, source.status);
+            println("UART", msg);
+            return status;
+        }
+
+        snprintf(msg, 60, "Received %lu bytes in %lu ms", source.received, ms);
+        println("UART", msg);
+        if (ms != 0) {
+            snprintf(msg, 60, "%lu bytes/s", (uint32_t)((uint64_t)source.received * 1000 / ms));
+            println("UART", msg);
+        }
+
+        /* The flash must hold what the block CRCs let through */
+        Trace_Event(TRACE_PHASE, PHASE_VERIFY);
+        printr("CHCK", "Checking data");
+        if (Bootloader_CRC32(0, (const void*)APP_ADDRESS, source.received) != crc.crc) {
+            println("CHCK", "Error: CRC mismatch");
+            return ERR_VERIFY;
+        }
+        println("CHCK", "Passed");
+        Trace_Event(TRACE_PHASE, PHASE_CLEANUP);
+        if (Bootloader_SetRecord(source.received, crc.crc) != BL_OK) {
+            println("CHCK", "Failed to record application");
+        }
+    }
+    return ERR_OK;
+}
+#endif
+
 /**
  * @brief  This function ejects the SD card.
  * @param  None
  * @retval None
  */
 void SD_Eject(void) {
+#if (SD_CACHE_SECTORS > 0) && !SD_USE_SDMMC
+    DWORD hits, misses;
+    char  msg[50];
+
+    USER_CacheStats(&hits, &misses);
+    snprintf(msg, 50, "Sector cache: %lu hits, %lu misses", hits, misses);
+    println("SD", msg);
+#endif
     f_mount(NULL, (TCHAR const*)USERPath, 0);
 }
+
+#if (USE_HANDOFF)
+/**
+ * @brief  Fill the handoff block (see handoff.h) with the state left running
+ *         for the application. Called last before the jump.
+ * @param  updateMs: time spent on the SD card and the update, in ms
+ */
+void Handoff_Prepare(uint32_t updateMs) {
+    static_assert(sizeof(HandoffBlock) <= HANDOFF_SIZE, "Handoff block larger than its reserved space");
+    HandoffBlock* block = (HandoffBlock*)HANDOFF_ADDRESS;
+
+    memset(block, 0, HANDOFF_SIZE);
+    block->version = HANDOFF_VERSION;
+    block->flags   = HANDOFF_CLOCKS | HANDOFF_UART;
+
+    block->sysclk     = HAL_RCC_GetSysClockFreq();
+    block->hclk       = HAL_RCC_GetHCLKFreq();
+    block->pclk1      = HAL_RCC_GetPCLK1Freq();
+    block->pclk2      = HAL_RCC_GetPCLK2Freq();
+    block->rccCr      = RCC->CR;
+    block->rccCfgr    = RCC->CFGR;
+    block->rccPllcfgr = RCC->PLLCFGR;
+    block->rccCcipr   = RCC->CCIPR;
+    block->flashAcr   = FLASH->ACR;
+    block->pwrCr1     = PWR->CR1;
+
+    block->uartBase = (uint32_t)huart1.Instance;
+    block->baudRate = huart1.Init.BaudRate;
+
+#if !(SD_USE_SDMMC)
+    BYTE  pdrv = USERPath[0] - '0';
+    BYTE  type;
+    DWORD sectors;
+
+    /* The card is only described if it was initialized: CMD9 must succeed */
+    if (!(disk_status(pdrv) & STA_NOINIT) && (disk_ioctl(pdrv, MMC_GET_TYPE, &type) == RES_OK) &&
+        (disk_ioctl(pdrv, MMC_GET_CSD, block->sdCsd) == RES_OK) &&
+        (disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectors) == RES_OK)) {
+        block->sdType    = type;
+        block->sdSectors = sectors;
+        /* SPI3 runs from PCLK1, divided by 2 << BR */
+        block->sdClock = HAL_RCC_GetPCLK1Freq() >> (((SPI3->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos) + 1);
+        block->flags |= HANDOFF_SD;
+    }
+#endif
+
+    block->bootMs   = HAL_GetTick();
+    block->updateMs = updateMs;
+    block->size     = sizeof(HandoffBlock);
+    block->magic    = HANDOFF_MAGIC;
+    block->crc      = Bootloader_CRC32(0, (uint8_t*)block, sizeof(HandoffBlock) - 4);
+}
+#endif
@@ -15,6 +15,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "bootloader.h"
+#include "scheduler.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -24,12 +25,40 @@
 #define BOOTLOADER_VERSION_PATCH 0 /*!< Patch version */
 #define BOOTLOADER_VERSION_RC    0 /*!< Release candidate version */
 
+/** Number of exception and interrupt vectors of the STM32L452 */
+#define VECTOR_COUNT (16 + I2C4_ER_IRQn + 1)
+
 /* Private typedef -----------------------------------------------------------*/
 typedef void (*pFunction)(void); /*!< Function pointer definition */
 
+/** Asynchronous flash writer job */
+typedef struct
+{
+    uint32_t address;                   /*!< First page or doubleword */
+    uint32_t length;                    /*!< Number of pages or bytes */
+    uint8_t  erase;                     /*!< Page erase (1) or programming (0) */
+    uint32_t data[FLASH_ROW_SIZE / 4];  /*!< Data to program */
+} FlashJob;
+
 /* Private variables ---------------------------------------------------------*/
 /** Private variable for tracking flashing progress */
 static uint32_t flash_ptr = APP_ADDRESS;
+/** Private variable for flash programming statistics */
+static BootloaderFlashStats flash_stats;
+
+/** Asynchronous flash writer: jobs are added by the main loop and consumed
+ * by the flash interrupt, the job in progress stays at the front */
+static SpscQueue<FlashJob, FLASH_QUEUE_DEPTH> flash_queue;
+static volatile uint32_t job_offset;
+static volatile uint32_t job_start;
+static volatile bool     flash_busy;
+static volatile bool     job_fast;
+static volatile uint8_t  flash_error;
+
+/** Copy of the vector table in SRAM, in use while the asynchronous writer
+ * runs: the vector fetch of an interrupt taken during an erase would stall */
+static uint32_t ram_vectors[VECTOR_COUNT] __attribute__((aligned(512)));
+static uint32_t flash_vectors;
 
 /**
  * @brief  This function initializes bootloader and flash.
@@ -45,6 +74,11 @@ uint8_t Bootloader_Init(void) {
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
     HAL_FLASH_Lock();
 
+    /* Cycle counter for programming statistics */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    memset(&flash_stats, 0, sizeof(flash_stats));
+
     return BL_OK;
 }
 
@@ -76,6 +110,41 @@ uint8_t Bootloader_Erase(void) {
     return (status == HAL_OK) ? BL_OK : BL_ERASE_ERROR;
 }
 
+/**
+ * @brief  This function erases a range of pages in the user application area.
+ * @param  address: address of the first page to be erased (page aligned)
+ * @param  count: number of pages to be erased
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_ERASE_ERROR: upon failure or when the range leaves the
+ *         application area
+ */
+uint8_t Bootloader_ErasePages(uint32_t address, uint32_t count) {
+    uint32_t               PageError = 0;
+    FLASH_EraseInitTypeDef pEraseInit;
+    HAL_StatusTypeDef      status = HAL_OK;
+
+    if ((address < APP_ADDRESS) || ((address - FLASH_BASE) % FLASH_PAGE_SIZE) ||
+        ((address + count * FLASH_PAGE_SIZE) > (FLASH_BASE + FLASH_SIZE))) {
+        return BL_ERASE_ERROR;
+    }
+    if (count == 0) {
+        return BL_OK;
+    }
+
+    HAL_FLASH_Unlock();
+
+    pEraseInit.Banks     = FLASH_BANK_1;
+    pEraseInit.NbPages   = count;
+    pEraseInit.Page      = (address - FLASH_BASE) / FLASH_PAGE_SIZE;
+    pEraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+    status               = HAL_FLASHEx_Erase(&pEraseInit, &PageError);
+
+    HAL_FLASH_Lock();
+
+    return (status == HAL_OK) ? BL_OK : BL_ERASE_ERROR;
+}
+
 /**
  * @brief  Begin flash programming: this function unlocks the flash and sets
  *         the data pointer to the start of application flash area.
@@ -93,6 +162,25 @@ uint8_t Bootloader_FlashBegin(void) {
     return BL_OK;
 }
 
+/**
+ * @brief  Move the flash programming pointer: the next call to
+ *         ::Bootloader_FlashNext writes at the given address. Flash must
+ *         already be unlocked by ::Bootloader_FlashBegin.
+ * @param  address: new destination address (doubleword aligned)
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_WRITE_ERROR: if the address is outside of the application area
+ */
+uint8_t Bootloader_FlashSeek(uint32_t address) {
+    if ((address < APP_ADDRESS) || (address > (FLASH_BASE + FLASH_SIZE - 8)) || (address & 0x7)) {
+        return BL_WRITE_ERROR;
+    }
+
+    flash_ptr = address;
+
+    return BL_OK;
+}
+
 /**
  * @brief  Program 64bit data into flash: this function writes an 8byte (64bit)
  *         data chunk into the flash and increments the data pointer.
@@ -103,12 +191,29 @@ uint8_t Bootloader_FlashBegin(void) {
  * @retval BL_WRITE_ERROR: upon failure
  */
 uint8_t Bootloader_FlashNext(uint64_t data) {
+    uint32_t start;
+
     if (!(flash_ptr <= (FLASH_BASE + FLASH_SIZE - 8)) || (flash_ptr < APP_ADDRESS)) {
         HAL_FLASH_Lock();
         return BL_WRITE_ERROR;
     }
 
+    if (data == 0xFFFFFFFFFFFFFFFF) {
+        /* Erased value: nothing to program, only check the flash is blank */
+        if (*(uint64_t*)flash_ptr != data) {
+            HAL_FLASH_Lock();
+            return BL_WRITE_ERROR;
+        }
+        flash_stats.skipped += 8;
+        flash_ptr += 8;
+        return BL_OK;
+    }
+
+    start = DWT->CYCCNT;
     if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, flash_ptr, data) == HAL_OK) {
+        flash_stats.cycles += DWT->CYCCNT - start;
+        flash_stats.programmed += 8;
+
         /* Check the written value */
         if (*(uint64_t*)flash_ptr != data) {
             /* Flash content doesn't match source content */
@@ -126,6 +231,78 @@ uint8_t Bootloader_FlashNext(uint64_t data) {
     return BL_OK;
 }
 
+/**
+ * @brief  Program a buffer into flash: the buffer is scanned one flash row at
+ *         a time with word-wide reads, rows holding only the erased value
+ *         (0xFF) are skipped without being programmed.
+ * @see    README for futher information
+ * @param  data: pointer to the data, 32bit aligned
+ * @param  length: number of bytes, multiple of 8
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_WRITE_ERROR: upon failure
+ */
+uint8_t Bootloader_FlashBuffer(const void* data, uint32_t length) {
+    const uint32_t* src = (const uint32_t*)data;
+    uint32_t        chunk;
+    uint32_t        blank;
+
+    if (length & 0x7) {
+        HAL_FLASH_Lock();
+        return BL_WRITE_ERROR;
+    }
+
+    while (length) {
+        /* Up to the next row boundary */
+        chunk = FLASH_ROW_SIZE - ((flash_ptr - FLASH_BASE) % FLASH_ROW_SIZE);
+        if (chunk > length) {
+            chunk = length;
+        }
+        if ((flash_ptr < APP_ADDRESS) || (flash_ptr + chunk > FLASH_BASE + FLASH_SIZE)) {
+            HAL_FLASH_Lock();
+            return BL_WRITE_ERROR;
+        }
+
+        blank = 0xFFFFFFFF;
+        for (uint32_t i = 0; i < chunk / 4; i++) {
+            blank &= src[i];
+        }
+
+        if (blank == 0xFFFFFFFF) {
+            for (uint32_t i = 0; i < chunk / 4; i++) {
+                blank &= ((__IO uint32_t*)flash_ptr)[i];
+            }
+        }
+
+        if (blank == 0xFFFFFFFF) {
+            /* Whole row is erased in both source and flash */
+            flash_stats.skipped += chunk;
+            flash_ptr += chunk;
+        } else {
+            for (uint32_t i = 0; i < chunk / 4; i += 2) {
+                uint8_t status = Bootloader_FlashNext(((uint64_t)src[i + 1] << 32) | src[i]);
+                if (status != BL_OK) {
+                    return status;
+                }
+            }
+        }
+
+        src += chunk / 4;
+        length -= chunk;
+    }
+
+    return BL_OK;
+}
+
+/**
+ * @brief  This function returns the flash programming statistics collected
+ *         since ::Bootloader_Init.
+ * @param  stats: filled with the statistics
+ */
+void Bootloader_GetFlashStats(BootloaderFlashStats* stats) {
+    *stats = flash_stats;
+}
+
 /**
  * @brief  Finish flash programming: this function finalizes the flash
  *         programming by locking the flash.
@@ -140,6 +317,575 @@ uint8_t Bootloader_FlashEnd(void) {
     return BL_OK;
 }
 
+#if (USE_FAST_PROGRAM)
+/**
+ * @brief  Program a whole row in fast programming mode, if it is worth it:
+ *         the row must be blank and hold more doublewords to program than
+ *         fit in the time of a fast row programming.
+ * @return true if the programming has been started
+ */
+static bool async_fast(const FlashJob* job) {
+    const uint32_t* row  = (const uint32_t*)job->address;
+    uint32_t        used = 0;
+    uint32_t        primask;
+
+    if ((job->length != FLASH_ROW_SIZE) || ((job->address - FLASH_BASE) % FLASH_ROW_SIZE)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < FLASH_ROW_SIZE / 4; i += 2) {
+        if ((row[i] & row[i + 1]) != 0xFFFFFFFF) {
+            return false;
+        }
+        if ((job->data[i] & job->data[i + 1]) != 0xFFFFFFFF) {
+            used++;
+        }
+    }
+    if (used < FLASH_FAST_MIN_DOUBLEWORDS) {
+        return false;
+    }
+
+    flash_busy = true;
+    job_fast   = true;
+    job_start  = DWT->CYCCNT;
+    SET_BIT(FLASH->CR, FLASH_CR_FSTPG);
+    /* The 64 words must reach the flash interface without a gap */
+    primask = __get_PRIMASK();
+    __disable_irq();
+    for (uint32_t i = 0; i < FLASH_ROW_SIZE / 4; i++) {
+        *(__IO uint32_t*)(job->address + 4 * i) = job->data[i];
+    }
+    __set_PRIMASK(primask);
+    return true;
+}
+#endif
+
+/**
+ * @brief  Start the next operation of the asynchronous writer, skipping the
+ *         doublewords holding the erased value. Called from the flash
+ *         interrupt, or from the main loop while the writer is idle.
+ */
+static void async_start(void) {
+    FlashJob* job;
+
+    while ((job = flash_queue.front()) != NULL) {
+        if (job->erase) {
+            if (job_offset < job->length) {
+                flash_busy = true;
+                job_start  = DWT->CYCCNT;
+                FLASH_PageErase((job->address - FLASH_BASE) / FLASH_PAGE_SIZE + job_offset, FLASH_BANK_1);
+                return;
+            }
+            /* The update hot path runs from SRAM during the erase, stale
+             * lines of the instruction cache are dropped afterwards */
+            __HAL_FLASH_INSTRUCTION_CACHE_DISABLE();
+            __HAL_FLASH_INSTRUCTION_CACHE_RESET();
+            __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+        } else {
+#if (USE_FAST_PROGRAM)
+            if ((job_offset == 0) && async_fast(job)) {
+                return;
+            }
+#endif
+            while (job_offset < job->length) {
+                uint32_t address = job->address + job_offset;
+                uint32_t lo      = job->data[job_offset / 4];
+                uint32_t hi      = job->data[job_offset / 4 + 1];
+
+                if ((lo & hi) != 0xFFFFFFFF) {
+                    flash_busy = true;
+                    job_start  = DWT->CYCCNT;
+                    SET_BIT(FLASH->CR, FLASH_CR_PG);
+                    *(__IO uint32_t*)address = lo;
+                    __ISB();
+                    *(__IO uint32_t*)(address + 4) = hi;
+                    return;
+                }
+                /* Erased value: nothing to program, only check the flash is blank */
+                if ((*(__IO uint32_t*)address & *(__IO uint32_t*)(address + 4)) != 0xFFFFFFFF) {
+                    /* The producer drops the pending jobs, see async_drop */
+                    flash_error = BL_WRITE_ERROR;
+                    flash_busy  = false;
+                    return;
+                }
+                flash_stats.skipped += 8;
+                job_offset += 8;
+            }
+        }
+        job_offset = 0;
+        flash_queue.pop();
+    }
+    flash_busy = false;
+}
+
+/**
+ * @brief  Begin asynchronous flash programming: this function unlocks the
+ *         flash, moves the vector table to SRAM and enables the flash
+ *         interrupt. Operations are queued with
+ *         ::Bootloader_AsyncErase, ::Bootloader_AsyncWrite and
+ *         ::Bootloader_AsyncCommit and run in the background, the main loop
+ *         only blocks when the queue is full.
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK is returned in every case
+ */
+uint8_t Bootloader_AsyncBegin(void) {
+    flash_queue.reset();
+    job_offset  = 0;
+    flash_busy  = false;
+    job_fast    = false;
+    flash_error = BL_OK;
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    /* Data cache would return stale flash content */
+    __HAL_FLASH_DATA_CACHE_DISABLE();
+    SET_BIT(FLASH->CR, FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+
+    if (SCB->VTOR != (uint32_t)ram_vectors) {
+        flash_vectors = SCB->VTOR;
+        memcpy(ram_vectors, (const void*)flash_vectors, sizeof(ram_vectors));
+        SCB->VTOR = (uint32_t)ram_vectors;
+        __DSB();
+    }
+    HAL_NVIC_SetPriority(FLASH_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    return BL_OK;
+}
+
+/**
+ * @brief  Drop the pending jobs after a failed one. Only the producer empties
+ *         the queue, with the flash interrupt masked: a job being filled
+ *         while the interrupt reports the error cannot be published after the
+ *         queue is emptied, and be programmed later on.
+ * @return Error code of the failed job
+ */
+static uint8_t async_drop(void) {
+    HAL_NVIC_DisableIRQ(FLASH_IRQn);
+    flash_queue.clear();
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+    return flash_error;
+}
+
+/**
+ * @brief  Add a job to the queue, waiting for a free slot, and start it if
+ *         the writer is idle.
+ */
+static uint8_t async_queue(uint32_t address, uint32_t length, uint8_t erase, const void* data) {
+    FlashJob* job;
+
+    while (flash_queue.full()) {
+        if (flash_error != BL_OK) {
+            return async_drop();
+        }
+        __WFI();
+    }
+    if (flash_error != BL_OK) {
+        return async_drop();
+    }
+
+    job          = flash_queue.back();
+    job->address = address;
+    job->length  = length;
+    job->erase   = erase;
+    if (data != NULL) {
+        memcpy(job->data, data, length);
+    }
+
+    HAL_NVIC_DisableIRQ(FLASH_IRQn);
+    flash_queue.commit();
+    if (flash_error != BL_OK) {
+        /* A job failed while this one was filled */
+        flash_queue.clear();
+    } else if (!flash_busy) {
+        async_start();
+    }
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    return flash_error;
+}
+
+/**
+ * @brief  Queue the erase of a range of pages in the user application area.
+ * @param  address: address of the first page to be erased (page aligned)
+ * @param  count: number of pages to be erased
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_ERASE_ERROR: if the range leaves the application area
+ */
+uint8_t Bootloader_AsyncErase(uint32_t address, uint32_t count) {
+    if ((address < APP_ADDRESS) || ((address - FLASH_BASE) % FLASH_PAGE_SIZE) ||
+        ((address + count * FLASH_PAGE_SIZE) > (FLASH_BASE + FLASH_SIZE))) {
+        return BL_ERASE_ERROR;
+    }
+
+    return async_queue(address, count, 1, NULL);
+}
+
+/**
+ * @brief  Queue the programming of data within one flash row. The data is
+ *         copied, the buffer can be reused as soon as the function returns.
+ *         A whole row written to blank flash uses fast programming.
+ * @param  address: destination address (doubleword aligned)
+ * @param  data: pointer to the data, 32bit aligned
+ * @param  length: number of bytes, multiple of 8, not crossing a row
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_WRITE_ERROR: on invalid parameters or if a previous job failed
+ */
+uint8_t Bootloader_AsyncWrite(uint32_t address, const void* data, uint32_t length) {
+    if ((address < APP_ADDRESS) || (address & 0x7) || (length & 0x7) ||
+        (((address - FLASH_BASE) % FLASH_ROW_SIZE) + length > FLASH_ROW_SIZE) ||
+        (address + length > FLASH_BASE + FLASH_SIZE)) {
+        return BL_WRITE_ERROR;
+    }
+
+    return async_queue(address, length, 0, data);
+}
+
+/**
+ * @brief  Queue a journal commit (see ::Bootloader_JournalCommit). Jobs run in
+ *         order: the entry is written once the page has been programmed.
+ * @param  page: index of the page, relative to ::APP_ADDRESS
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_WRITE_ERROR: if no journal is open or a previous job failed
+ */
+uint8_t Bootloader_AsyncCommit(uint32_t page) {
+    uint32_t entry[2] = {page, ~page};
+
+    /* Nothing is committed before the image is identified */
+    if ((page >= JOURNAL_ENTRIES_MAX) || (*(__IO uint32_t*)JOURNAL_ADDRESS != JOURNAL_MAGIC) ||
+        (((const BootloaderRecord*)JOURNAL_ADDRESS)->version == 0xFFFFFFFF)) {
+        return BL_WRITE_ERROR;
+    }
+
+    return async_queue(JOURNAL_ENTRIES_ADDRESS + page * 8, sizeof(entry), 0, entry);
+}
+
+/**
+ * @brief  This function returns the state of the asynchronous writer.
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: all queued jobs are done
+ * @retval BL_BUSY: jobs are pending
+ * @retval BL_ERASE_ERROR, BL_WRITE_ERROR: a job failed, the queue is flushed
+ */
+uint8_t Bootloader_AsyncPoll(void) {
+    if (flash_error != BL_OK) {
+        return async_drop();
+    }
+    return flash_queue.empty() ? BL_OK : BL_BUSY;
+}
+
+/**
+ * @brief  This function returns the number of jobs that can be queued
+ *         without waiting, e.g. for a cooperative task not to block in
+ *         ::Bootloader_AsyncWrite.
+ * @return Number of free slots in the queue of the asynchronous writer
+ */
+uint32_t Bootloader_AsyncSpace(void) {
+    if (flash_error != BL_OK) {
+        /* Room for the next job, which returns the error */
+        async_drop();
+    }
+    return flash_queue.space();
+}
+
+/**
+ * @brief  Finish asynchronous flash programming: this function waits for the
+ *         queued jobs, disables the flash interrupt, restores the caches and
+ *         the vector table and locks the flash.
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: all jobs succeeded
+ * @retval BL_ERASE_ERROR, BL_WRITE_ERROR: a job failed
+ */
+uint8_t Bootloader_AsyncEnd(void) {
+    while (Bootloader_AsyncPoll() == BL_BUSY) {
+        __WFI();
+    }
+
+    HAL_NVIC_DisableIRQ(FLASH_IRQn);
+    CLEAR_BIT(FLASH->CR, FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+    if (SCB->VTOR == (uint32_t)ram_vectors) {
+        SCB->VTOR = flash_vectors;
+        __DSB();
+    }
+    __HAL_FLASH_DATA_CACHE_RESET();
+    __HAL_FLASH_DATA_CACHE_ENABLE();
+    HAL_FLASH_Lock();
+
+    return flash_error;
+}
+
+/**
+ * @brief  Flash interrupt handler of the asynchronous writer: checks the
+ *         operation that just ended and starts the next one.
+ */
+void Bootloader_FlashIRQHandler(void) {
+    uint32_t  error = FLASH->SR & FLASH_FLAG_SR_ERRORS;
+    FlashJob* job   = flash_queue.front();
+
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PG | FLASH_CR_FSTPG | FLASH_CR_PER | FLASH_CR_PNB);
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | error);
+    if (!flash_busy) {
+        return;
+    }
+    flash_stats.cycles += DWT->CYCCNT - job_start;
+
+    if (job->erase) {
+        if (error != 0) {
+            flash_error = BL_ERASE_ERROR;
+        }
+        job_offset += 1;
+    } else if (job_fast) {
+        job_fast = false;
+        if ((error != 0) || (memcmp((const void*)job->address, job->data, job->length) != 0)) {
+            flash_error = BL_WRITE_ERROR;
+        }
+        flash_stats.programmed += job->length;
+        job_offset = job->length;
+    } else {
+        uint32_t address = job->address + job_offset;
+
+        if ((error != 0) || (*(__IO uint32_t*)address != job->data[job_offset / 4]) ||
+            (*(__IO uint32_t*)(address + 4) != job->data[job_offset / 4 + 1])) {
+            flash_error = BL_WRITE_ERROR;
+        }
+        flash_stats.programmed += 8;
+        job_offset += 8;
+    }
+
+    if (flash_error != BL_OK) {
+        /* Stop here: the producer drops the pending jobs, see async_drop */
+        flash_busy = false;
+        return;
+    }
+    async_start();
+}
+
+/**
+ * @brief  This function reads the bootloader record.
+ * @param  record: filled with the content of the record
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: if the record is valid
+ * @retval BL_NO_APP: if no application has been recorded
+ */
+uint8_t Bootloader_GetRecord(BootloaderRecord* record) {
+    memcpy(record, (const void*)RECORD_ADDRESS, sizeof(BootloaderRecord));
+
+    return (record->magic == RECORD_MAGIC) ? BL_OK : BL_NO_APP;
+}
+
+/**
+ * @brief  This function records the identity of the installed application.
+ *         The version is read from the programmed image, at
+ *         ::APP_VERSION_OFFSET.
+ * @param  size: size of the image in bytes
+ * @param  crc: CRC-32 of the image
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_ERASE_ERROR: if the record page cannot be erased
+ * @retval BL_WRITE_ERROR: if the record cannot be written
+ */
+uint8_t Bootloader_SetRecord(uint32_t size, uint32_t crc) {
+    uint32_t          version = *(__IO uint32_t*)(APP_ADDRESS + APP_VERSION_OFFSET);
+    BootloaderRecord  record  = {RECORD_MAGIC, size, crc, (version == 0xFFFFFFFF) ? 0 : version};
+    const uint64_t*   data    = (const uint64_t*)&record;
+    HAL_StatusTypeDef status;
+
+    if (Bootloader_ClearRecord() != BL_OK) {
+        return BL_ERASE_ERROR;
+    }
+
+    HAL_FLASH_Unlock();
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, RECORD_ADDRESS + 8, data[1]);
+    /* The doubleword holding the magic is written last */
+    if (status == HAL_OK) {
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, RECORD_ADDRESS, data[0]);
+    }
+    HAL_FLASH_Lock();
+
+    return (status == HAL_OK) ? BL_OK : BL_WRITE_ERROR;
+}
+
+/**
+ * @brief  This function invalidates the bootloader record and closes the
+ *         update journal. It must be called before the application area is
+ *         modified, unless ::Bootloader_JournalOpen is used.
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_ERASE_ERROR: upon failure
+ */
+uint8_t Bootloader_ClearRecord(void) {
+    uint32_t               PageError = 0;
+    FLASH_EraseInitTypeDef pEraseInit;
+    HAL_StatusTypeDef      status = HAL_OK;
+
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i += 4) {
+        if (*(__IO uint32_t*)(RECORD_ADDRESS + i) != 0xFFFFFFFF) {
+            break;
+        }
+        if (i + 4 == FLASH_PAGE_SIZE) {
+            /* Already blank */
+            return BL_OK;
+        }
+    }
+
+    HAL_FLASH_Unlock();
+
+    pEraseInit.Banks     = FLASH_BANK_1;
+    pEraseInit.NbPages   = 1;
+    pEraseInit.Page      = (RECORD_ADDRESS - FLASH_BASE) / FLASH_PAGE_SIZE;
+    pEraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+    status               = HAL_FLASHEx_Erase(&pEraseInit, &PageError);
+
+    HAL_FLASH_Lock();
+
+    return (status == HAL_OK) ? BL_OK : BL_ERASE_ERROR;
+}
+
+/**
+ * @brief  This function opens the update journal: the bootloader record is
+ *         invalidated and the identity of the image being installed is
+ *         written. Until the journal is closed by ::Bootloader_SetRecord, the
+ *         application is not considered valid. With ::USE_WRITE_PROTECTION,
+ *         the write protection is then removed, which resets the MCU if it
+ *         was active. With ::JOURNAL_CRC_UNKNOWN, only the size is written,
+ *         and ::Bootloader_JournalResume completes the header with the CRC.
+ * @param  size: size of the image being installed
+ * @param  crc: CRC-32 of the image being installed, or ::JOURNAL_CRC_UNKNOWN
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_ERASE_ERROR: if the record page cannot be erased
+ * @retval BL_WRITE_ERROR: if the journal header cannot be written
+ * @retval BL_OBP_ERROR: if the write protection cannot be removed
+ */
+uint8_t Bootloader_JournalOpen(uint32_t size, uint32_t crc) {
+    BootloaderRecord  header = {JOURNAL_MAGIC, size, crc, 0};
+    const uint64_t*   data   = (const uint64_t*)&header;
+    HAL_StatusTypeDef status;
+
+    if (Bootloader_ClearRecord() != BL_OK) {
+        return BL_ERASE_ERROR;
+    }
+
+    HAL_FLASH_Unlock();
+    status = HAL_OK;
+    if (crc != JOURNAL_CRC_UNKNOWN) {
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, JOURNAL_ADDRESS + 8, data[1]);
+    }
+    if (status == HAL_OK) {
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, JOURNAL_ADDRESS, data[0]);
+    }
+    HAL_FLASH_Lock();
+#if (USE_WRITE_PROTECTION)
+    /* Release the application pages: with WRP active, this resets the MCU
+     * with the journal open, and the update starts again unprotected */
+    if ((status == HAL_OK) && (Bootloader_ConfigProtection(BL_PROTECTION_NONE, 0) != BL_OK)) {
+        return BL_OBP_ERROR;
+    }
+#endif
+
+    return (status == HAL_OK) ? BL_OK : BL_WRITE_ERROR;
+}
+
+/**
+ * @brief  This function records that an application page has been fully
+ *         programmed and verified. Pages must be committed in order.
+ * @param  page: index of the page, relative to ::APP_ADDRESS
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: upon success
+ * @retval BL_WRITE_ERROR: upon failure
+ */
+uint8_t Bootloader_JournalCommit(uint32_t page) {
+    uint32_t          address = JOURNAL_ENTRIES_ADDRESS + page * 8;
+    uint32_t          locked;
+    HAL_StatusTypeDef status;
+
+    if ((page >= JOURNAL_ENTRIES_MAX) || (*(__IO uint32_t*)JOURNAL_ADDRESS != JOURNAL_MAGIC)) {
+        return BL_WRITE_ERROR;
+    }
+
+    /* Called in the middle of programming: keep the flash lock state */
+    locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
+    HAL_FLASH_Unlock();
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, ((uint64_t)~page << 32) | page);
+    if (locked) {
+        HAL_FLASH_Lock();
+    }
+
+    return (status == HAL_OK) ? BL_OK : BL_WRITE_ERROR;
+}
+
+/**
+ * @brief  This function checks whether an interrupted update of the given
+ *         image can be resumed. A journal opened for an image of this size
+ *         whose CRC was not known (::JOURNAL_CRC_UNKNOWN) is completed with
+ *         @p crc; no page can have been committed to it.
+ * @param  size: size of the image being installed
+ * @param  crc: CRC-32 of the image being installed
+ * @param  pages: number of application pages already committed
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: if the journal is open for this image
+ * @retval BL_NO_APP: otherwise
+ */
+uint8_t Bootloader_JournalResume(uint32_t size, uint32_t crc, uint32_t* pages) {
+    const BootloaderRecord* header = (const BootloaderRecord*)JOURNAL_ADDRESS;
+    BootloaderRecord        identity = {JOURNAL_MAGIC, size, crc, 0};
+    HAL_StatusTypeDef       status;
+
+    *pages = 0;
+    if ((header->magic != JOURNAL_MAGIC) || (header->size != size)) {
+        return BL_NO_APP;
+    }
+    /* The CRC and version doubleword is left erased by an early open */
+    if ((header->crc == JOURNAL_CRC_UNKNOWN) && (header->version == 0xFFFFFFFF)) {
+        HAL_FLASH_Unlock();
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, JOURNAL_ADDRESS + 8,
+                                   ((const uint64_t*)&identity)[1]);
+        HAL_FLASH_Lock();
+        if (status != HAL_OK) {
+            return BL_NO_APP;
+        }
+    }
+    if (header->crc != crc) {
+        return BL_NO_APP;
+    }
+    return Bootloader_JournalPages(pages);
+}
+
+/**
+ * @brief  This function counts the pages committed to the open journal,
+ *         whatever the image being installed.
+ * @param  pages: number of application pages already committed
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: if the journal is open
+ * @retval BL_NO_APP: otherwise
+ */
+uint8_t Bootloader_JournalPages(uint32_t* pages) {
+    const uint32_t* entry = (const uint32_t*)JOURNAL_ENTRIES_ADDRESS;
+
+    *pages = 0;
+    if (*(__IO uint32_t*)JOURNAL_ADDRESS != JOURNAL_MAGIC) {
+        return BL_NO_APP;
+    }
+
+    while ((*pages < JOURNAL_ENTRIES_MAX) && (entry[0] == *pages) && (entry[1] == ~*pages)) {
+        (*pages)++;
+        entry += 2;
+    }
+    return BL_OK;
+}
+
+/**
+ * @brief  This function checks whether an update is in progress.
+ * @return Bootloader error code ::eBootloaderErrorCodes
+ * @retval BL_OK: if no update is in progress
+ * @retval BL_NO_APP: if the journal is open
+ */
+uint8_t Bootloader_CheckJournal(void) {
+    return (*(__IO uint32_t*)JOURNAL_ADDRESS == JOURNAL_MAGIC) ? BL_NO_APP : BL_OK;
+}
+
 /**
  * @brief  This function returns the protection status of flash.
  * @return Flash protection status ::eFlashProtectionTypes
@@ -160,8 +906,8 @@ uint8_t Bootloader_GetProtectionStatus(void) {
             protection |= BL_PROTECTION_PCROP;
         }
     }
-    /* WRP Area_A */
-    if (OBStruct.WRPEndOffset > OBStruct.WRPStartOffset) {
+    /* WRP Area_A, a single page area has equal offsets */
+    if (OBStruct.WRPEndOffset >= OBStruct.WRPStartOffset) {
         if ((OBStruct.WRPStartOffset * FLASH_PAGE_SIZE + FLASH_BASE) >= APP_ADDRESS) {
             protection |= BL_PROTECTION_WRP;
         }
@@ -170,7 +916,7 @@ uint8_t Bootloader_GetProtectionStatus(void) {
     OBStruct.WRPArea = OB_WRPAREA_BANK1_AREAB;
     HAL_FLASHEx_OBGetConfig(&OBStruct);
     /* WRP Area_B */
-    if (OBStruct.WRPEndOffset > OBStruct.WRPStartOffset) {
+    if (OBStruct.WRPEndOffset >= OBStruct.WRPStartOffset) {
         if ((OBStruct.WRPStartOffset * FLASH_PAGE_SIZE + FLASH_BASE) >= APP_ADDRESS) {
             protection |= BL_PROTECTION_WRP;
         }
@@ -186,39 +932,84 @@ uint8_t Bootloader_GetProtectionStatus(void) {
 }
 
 /**
- * @brief  This function configures the write protection of flash.
+ * @brief  Read a WRP area and tell whether it differs from the requested
+ *         pages. All disabled areas (start above end) are equivalent.
+ * @return true if the area must be programmed
+ */
+static bool wrp_differs(FLASH_OBProgramInitTypeDef* OBStruct) {
+    FLASH_OBProgramInitTypeDef current = {0};
+
+    current.WRPArea = OBStruct->WRPArea;
+    HAL_FLASHEx_OBGetConfig(&current);
+
+    if ((current.WRPStartOffset > current.WRPEndOffset) && (OBStruct->WRPStartOffset > OBStruct->WRPEndOffset)) {
+        return false;
+    }
+    return (current.WRPStartOffset != OBStruct->WRPStartOffset) || (current.WRPEndOffset != OBStruct->WRPEndOffset);
+}
+
+/**
+ * @brief  This function configures the write protection of flash. Area A
+ *         covers the pages of the application image, area B the page of the
+ *         checksum with ::USE_CHECKSUM. The option bytes are only programmed,
+ *         and reloaded, if an area differs from the requested pages: the
+ *         reload resets the MCU, so on success the function only returns when
+ *         the protection is already configured.
  * @param  protection: protection type ::eFlashProtectionTypes
+ * @param  size: size of the application image in bytes, 0 to protect the
+ *         whole application space
  * @return Bootloader error code ::eBootloaderErrorCodes
- * @retval BL_OK: upon success
+ * @retval BL_OK: if the protection is already configured
  * @retval BL_OBP_ERROR: upon failure
  */
-uint8_t Bootloader_ConfigProtection(uint32_t protection) {
-    FLASH_OBProgramInitTypeDef OBStruct = {0};
-    int                        status   = HAL_ERROR;
-
-    status = HAL_FLASH_Unlock();
-    status |= HAL_FLASH_OB_Unlock();
+uint8_t Bootloader_ConfigProtection(uint32_t protection, uint32_t size) {
+    FLASH_OBProgramInitTypeDef AreaA  = {0};
+    FLASH_OBProgramInitTypeDef AreaB  = {0};
+    const uint32_t             first  = (APP_ADDRESS - FLASH_BASE) / FLASH_PAGE_SIZE;
+    const uint32_t             last   = FLASH_PAGE_NBPERBANK - 1;
+    bool                       changeA;
+    bool                       changeB;
+    int                        status = HAL_OK;
 
-    /* Bank 1 */
-    OBStruct.WRPArea    = OB_WRPAREA_BANK1_AREAA;
-    OBStruct.OptionType = OPTIONBYTE_WRP;
+    AreaA.WRPArea        = OB_WRPAREA_BANK1_AREAA;
+    AreaA.OptionType     = OPTIONBYTE_WRP;
+    AreaA.WRPStartOffset = 0xFF;
+    AreaA.WRPEndOffset   = 0x00;
+    AreaB.WRPArea        = OB_WRPAREA_BANK1_AREAB;
+    AreaB.OptionType     = OPTIONBYTE_WRP;
+    AreaB.WRPStartOffset = 0xFF;
+    AreaB.WRPEndOffset   = 0x00;
     if (protection & BL_PROTECTION_WRP) {
-        /* Enable WRP protection for application space */
-        OBStruct.WRPStartOffset = (APP_ADDRESS - FLASH_BASE) / FLASH_PAGE_SIZE;
-        OBStruct.WRPEndOffset   = FLASH_PAGE_NBPERBANK - 1;
-    } else {
-        /* Remove WRP protection */
-        OBStruct.WRPStartOffset = 0xFF;
-        OBStruct.WRPEndOffset   = 0x00;
+        /* Pages of the image, or the whole application space */
+        AreaA.WRPStartOffset = first;
+        AreaA.WRPEndOffset   = last;
+        if ((size > 0) && (first + (size - 1) / FLASH_PAGE_SIZE < last)) {
+            AreaA.WRPEndOffset = first + (size - 1) / FLASH_PAGE_SIZE;
+        }
+#if (USE_CHECKSUM)
+        if (AreaA.WRPEndOffset < last) {
+            AreaB.WRPStartOffset = (CRC_ADDRESS - FLASH_BASE) / FLASH_PAGE_SIZE;
+            AreaB.WRPEndOffset   = AreaB.WRPStartOffset;
+        }
+#endif
+    }
+
+    HAL_FLASH_Unlock();
+    changeA = wrp_differs(&AreaA);
+    changeB = wrp_differs(&AreaB);
+    if (!changeA && !changeB) {
+        /* Nothing to program, no reset */
+        HAL_FLASH_Lock();
+        return BL_OK;
     }
-    status |= HAL_FLASHEx_OBProgram(&OBStruct);
 
-    /* Area B is not used */
-    OBStruct.WRPArea        = OB_WRPAREA_BANK1_AREAB;
-    OBStruct.OptionType     = OPTIONBYTE_WRP;
-    OBStruct.WRPStartOffset = 0xFF;
-    OBStruct.WRPEndOffset   = 0x00;
-    status |= HAL_FLASHEx_OBProgram(&OBStruct);
+    status |= HAL_FLASH_OB_Unlock();
+    if (changeA && (status == HAL_OK)) {
+        status |= HAL_FLASHEx_OBProgram(&AreaA);
+    }
+    if (changeB && (status == HAL_OK)) {
+        status |= HAL_FLASHEx_OBProgram(&AreaB);
+    }
 
     if (status == HAL_OK) {
         /* Loading Flash Option Bytes - this generates a system reset. */
@@ -228,7 +1019,8 @@ uint8_t Bootloader_ConfigProtection(uint32_t protection) {
     status |= HAL_FLASH_OB_Lock();
     status |= HAL_FLASH_Lock();
 
-    return (status == HAL_OK) ? BL_OK : BL_OBP_ERROR;
+    /* Only reached if the option bytes could not be loaded */
+    return BL_OBP_ERROR;
 }
 
 /**
@@ -279,24 +1071,68 @@ uint8_t Bootloader_VerifyChecksum(void) {
     return BL_CHKS_ERROR;
 }
 
+/**
+ * @brief  This function updates a CRC-32 (IEEE 802.3, same as zlib) over a
+ *         memory block. A nibble table keeps the footprint small and allows
+ *         hashing data that lives in flash as well as in RAM.
+ * @param  crc: running CRC, 0 for the first block
+ * @param  data: pointer to the data
+ * @param  length: number of bytes
+ * @return Updated CRC-32
+ */
+uint32_t Bootloader_CRC32(uint32_t crc, const void* data, uint32_t length) {
+    static const uint32_t table[16] = {0x00000000,
+                                       0x1DB71064,
+                                       0x3B6E20C8,
+                                       0x26D930AC,
+                                       0x76DC4190,
+                                       0x6B6B51F4,
+                                       0x4DB26158,
+                                       0x5005713C,
+                                       0xEDB88320,
+                                       0xF00F9344,
+                                       0xD6D6A3E8,
+                                       0xCB61B38C,
+                                       0x9B64C2B0,
+                                       0x86D3D2D4,
+                                       0xA00AE278,
+                                       0xBDBDF21C};
+    const uint8_t*        p         = (const uint8_t*)data;
+
+    crc = ~crc;
+    while (length--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
 /**
  * @brief  This function checks whether a valid application exists in flash.
  *         The check is performed by checking the very first DWORD (4 bytes) of
  *         the application firmware. In case of a valid application, this DWORD
  *         must represent the initialization location of stack pointer - which
- *         must be within the boundaries of RAM.
+ *         must be within the boundaries of RAM. An application whose update
+ *         journal is still open is not valid.
  * @return Bootloader error code ::eBootloaderErrorCodes
  * @retval BL_OK: if first DWORD represents a valid stack pointer location
- * @retval BL_NO_APP: first DWORD value is out of RAM boundaries
+ * @retval BL_NO_APP: first DWORD value is out of RAM boundaries or an update
+ *         is in progress
  */
 uint8_t Bootloader_CheckForApplication(void) {
+    if (Bootloader_CheckJournal() != BL_OK) {
+        /* Application is being updated */
+        return BL_NO_APP;
+    }
     return (((*(uint32_t*)APP_ADDRESS) - RAM_BASE) <= RAM_SIZE) ? BL_OK : BL_NO_APP;
 }
 
 /**
  * @brief  This function performs the jump to the user application in flash.
  * @details The function carries out the following operations:
- *  - De-initialize the clock and peripheral configuration
+ *  - De-initialize the clock and peripheral configuration, or with
+ *    ::USE_HANDOFF only disable and clear the interrupts
  *  - Stop the systick
  *  - Set the vector table location (if ::SET_VECTOR_TABLE is enabled)
  *  - Sets the stack pointer location
@@ -306,12 +1142,29 @@ void Bootloader_JumpToApplication(void) {
     uint32_t  JumpAddress = *(__IO uint32_t*)(APP_ADDRESS + 4);
     pFunction Jump        = (pFunction)JumpAddress;
 
+#if (USE_HANDOFF)
+    /* Clocks and peripherals stay as described by the handoff block: no
+     * interrupt of theirs may reach the application vector table before it
+     * is ready */
+    __disable_irq();
+    for (uint32_t i = 0; i < sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0]); i++) {
+        NVIC->ICER[i] = 0xFFFFFFFF;
+        NVIC->ICPR[i] = 0xFFFFFFFF;
+    }
+#else
     HAL_RCC_DeInit();
     HAL_DeInit();
+#endif
 
     SysTick->CTRL = 0;
     SysTick->LOAD = 0;
     SysTick->VAL  = 0;
+#if (USE_HANDOFF)
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    __DSB();
+    __ISB();
+    __enable_irq();
+#endif
 
     //    SCB->VTOR = APP_ADDRESS;
 
@@ -0,0 +1,363 @@
+/**
+ *******************************************************************************
+ * @file   delta.cpp
+ * @brief  Streaming, in-place application of delta patches. The new image is
+ *         rebuilt one flash page at a time in RAM, using the installed
+ *         application as the source, so memory usage does not depend on the
+ *         image size. A page equal to flash is left alone. A page rebuilt from
+ *         its own source bytes is copied to a scratch page above both images
+ *         before it is erased, the scratch pages rotating over the free end
+ *         of the application area. Each page is committed to the update journal
+ *         once programmed, so that an interrupted update can be resumed.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "delta.h"
+#include "bootloader.h"
+#include <string.h>
+
+/* Private typedef -----------------------------------------------------------*/
+/** Buffered reader over the patch file */
+typedef struct
+{
+    FIL*    fp;
+    uint8_t buf[256];
+    UINT    pos;
+    UINT    len;
+    uint8_t error;
+} PatchReader;
+
+/* Private variables ---------------------------------------------------------*/
+/** Page being rebuilt */
+static uint8_t page[FLASH_PAGE_SIZE] __attribute__((aligned(8)));
+
+/* Private functions ---------------------------------------------------------*/
+static bool reader_byte(PatchReader* r, uint8_t* b) {
+    if (r->pos == r->len) {
+        if (f_read(r->fp, r->buf, sizeof(r->buf), &r->len) != FR_OK) {
+            r->error = DELTA_READ_ERROR;
+            return false;
+        }
+        r->pos = 0;
+        if (r->len == 0) {
+            /* Unexpected end of patch */
+            r->error = DELTA_FORMAT_ERROR;
+            return false;
+        }
+    }
+    *b = r->buf[r->pos++];
+    return true;
+}
+
+static bool reader_varint(PatchReader* r, uint32_t* value) {
+    uint8_t b;
+
+    *value = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        if (!reader_byte(r, &b)) {
+            return false;
+        }
+        *value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    r->error = DELTA_FORMAT_ERROR;
+    return false;
+}
+
+static uint32_t page_count(uint32_t size) {
+    return (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+}
+
+/** Index of the first scratch page, the first page above both images */
+static uint32_t scratch_first(const DeltaHeader* header) {
+    uint32_t source = page_count(header->sourceSize);
+    uint32_t target = page_count(header->targetSize);
+
+    return (source > target) ? source : target;
+}
+
+/** Number of scratch pages: all the pages above both images */
+static uint32_t scratch_count(const DeltaHeader* header) {
+    return (FLASH_BASE + FLASH_SIZE - APP_ADDRESS) / FLASH_PAGE_SIZE - scratch_first(header);
+}
+
+/** Index of the scratch page of page @p index: the copies rotate over the
+ * scratch pages, which spreads their erase cycles */
+static uint32_t scratch_page(const DeltaHeader* header, uint32_t index) {
+    return scratch_first(header) + index % scratch_count(header);
+}
+
+static bool page_blank(uint32_t index) {
+    const __IO uint32_t* word = (const __IO uint32_t*)(APP_ADDRESS + index * FLASH_PAGE_SIZE);
+
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        if (word[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint8_t page_program(uint32_t index) {
+    uint32_t address = APP_ADDRESS + index * FLASH_PAGE_SIZE;
+
+    if (Bootloader_ErasePages(address, 1) != BL_OK) {
+        return DELTA_FLASH_ERROR;
+    }
+    Bootloader_FlashBegin();
+    Bootloader_FlashSeek(address);
+    if (Bootloader_FlashBuffer(page, FLASH_PAGE_SIZE) != BL_OK) {
+        return DELTA_FLASH_ERROR;
+    }
+    Bootloader_FlashEnd();
+    return DELTA_OK;
+}
+
+/**
+ * @brief  Program a rebuilt page and commit it to the journal.
+ * @param  index: page index in the application area
+ * @param  fill: number of bytes of the page in the target image
+ * @param  self: the page was rebuilt from source bytes of its own range, which
+ *         its erase destroys: it needs a copy in the scratch page
+ */
+static uint8_t page_flush(const DeltaHeader* header, const DeltaResume* resume, uint32_t index, uint32_t fill,
+                          bool self, bool apply, uint32_t* crc) {
+    if (index < resume->page) {
+        /* Committed before the interruption */
+        return DELTA_OK;
+    }
+    bool restore = (index == resume->page) && resume->scratch;
+
+    if (restore) {
+        /* The source of this page was lost while it was programmed */
+        memcpy(page, (const void*)(APP_ADDRESS + scratch_page(header, index) * FLASH_PAGE_SIZE), fill);
+    }
+
+    *crc = Bootloader_CRC32(*crc, page, fill);
+    if (!apply) {
+        return DELTA_OK;
+    }
+
+    while (fill < FLASH_PAGE_SIZE) {
+        page[fill++] = 0xFF;
+    }
+    if (memcmp(page, (const void*)(APP_ADDRESS + index * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE) != 0) {
+        /* The scratch copy outlives the source of the page, and is kept until
+         * the page is committed. Other pages are rebuilt from pages above
+         * them, still intact after an interruption */
+        if ((self && !restore && (page_program(scratch_page(header, index)) != DELTA_OK)) ||
+            (page_program(index) != DELTA_OK)) {
+            return DELTA_FLASH_ERROR;
+        }
+    }
+    return (Bootloader_JournalCommit(index) == BL_OK) ? DELTA_OK : DELTA_FLASH_ERROR;
+}
+
+/**
+ * @brief  Decode the patch command stream. Both the dry run and the real
+ *         update go through this function so that the checks performed before
+ *         touching flash are exactly the ones the update relies on.
+ * @param  fp: patch file, positioned right after the header
+ * @param  header: patch header
+ * @param  resume: first page to rebuild, the pages below are read from flash
+ * @param  apply: false for a dry run, true to program flash
+ * @param  crc: CRC-32 of the produced image
+ * @return Delta error code ::eDeltaErrorCodes
+ */
+static uint8_t delta_run(FIL* fp, const DeltaHeader* header, const DeltaResume* resume, bool apply, uint32_t* crc) {
+    static PatchReader reader;
+    uint32_t           out = 0;
+    uint32_t           old = 0;
+    uint8_t            op;
+    uint32_t           n;
+    uint8_t            status;
+    bool               self = false;
+
+    reader.fp    = fp;
+    reader.pos   = 0;
+    reader.len   = 0;
+    reader.error = DELTA_OK;
+    *crc         = Bootloader_CRC32(0, (const void*)APP_ADDRESS,
+                                    (resume->page < page_count(header->targetSize)) ? resume->page * FLASH_PAGE_SIZE
+                                                                                     : header->targetSize);
+
+    while (reader_byte(&reader, &op) && (op != DELTA_OP_END)) {
+        if (!reader_varint(&reader, &n)) {
+            break;
+        }
+
+        if (op == DELTA_OP_SEEK) {
+            int32_t offset = (int32_t)((n >> 1) ^ (0 - (n & 1)));
+            if (((offset < 0) && ((uint32_t)-offset > old)) ||
+                ((offset > 0) && ((uint32_t)offset > header->sourceSize - old))) {
+                return DELTA_FORMAT_ERROR;
+            }
+            old += offset;
+            continue;
+        }
+        if ((op != DELTA_OP_COPY) && (op != DELTA_OP_ADD) && (op != DELTA_OP_INSERT)) {
+            return DELTA_FORMAT_ERROR;
+        }
+        if (n > header->targetSize - out) {
+            return DELTA_FORMAT_ERROR;
+        }
+
+        while (n--) {
+            uint8_t b;
+            uint8_t d;
+
+            if (op == DELTA_OP_INSERT) {
+                if (!reader_byte(&reader, &b)) {
+                    return reader.error;
+                }
+            } else {
+                /* Pages below the one being rebuilt are already overwritten */
+                if ((old >= header->sourceSize) || (old < (out & ~(FLASH_PAGE_SIZE - 1)))) {
+                    return DELTA_FORMAT_ERROR;
+                }
+                self = self || (old < (out & ~(FLASH_PAGE_SIZE - 1)) + FLASH_PAGE_SIZE);
+                b    = *(__IO uint8_t*)(APP_ADDRESS + old++);
+                if (op == DELTA_OP_ADD) {
+                    if (!reader_byte(&reader, &d)) {
+                        return reader.error;
+                    }
+                    b += d;
+                }
+            }
+
+            page[out % FLASH_PAGE_SIZE] = b;
+            if ((++out % FLASH_PAGE_SIZE) == 0) {
+                status = page_flush(header, resume, out / FLASH_PAGE_SIZE - 1, FLASH_PAGE_SIZE, self, apply, crc);
+                if (status != DELTA_OK) {
+                    return status;
+                }
+                self = false;
+            }
+        }
+    }
+    if (reader.error != DELTA_OK) {
+        return reader.error;
+    }
+    if (out != header->targetSize) {
+        return DELTA_FORMAT_ERROR;
+    }
+    if (out % FLASH_PAGE_SIZE) {
+        return page_flush(header, resume, out / FLASH_PAGE_SIZE, out % FLASH_PAGE_SIZE, self, apply, crc);
+    }
+    return DELTA_OK;
+}
+
+/**
+ * @brief  This function reads the patch header and validates the patch
+ *         against the installed application without modifying flash: the
+ *         whole command stream is decoded and the resulting image CRC is
+ *         compared to the one announced by the header. If the update journal
+ *         is open for the target image, the update was interrupted: the page
+ *         being rebuilt is decoded from its source if it is still there, or
+ *         taken from the scratch page otherwise, whichever gives the target
+ *         CRC.
+ * @param  fp: opened patch file
+ * @param  header: filled with the patch header
+ * @param  resume: filled with the page to resume from
+ * @return Delta error code ::eDeltaErrorCodes
+ * @retval DELTA_OK: patch can be applied
+ * @retval DELTA_APPLIED: the installed application is already the target
+ */
+uint8_t Delta_Check(FIL* fp, DeltaHeader* header, DeltaResume* resume) {
+    UINT     num;
+    uint32_t crc;
+    uint8_t  status;
+
+    resume->page    = 0;
+    resume->scratch = 0;
+
+    if ((f_lseek(fp, 0) != FR_OK) || (f_read(fp, header, sizeof(DeltaHeader), &num) != FR_OK)) {
+        return DELTA_READ_ERROR;
+    }
+    if ((num != sizeof(DeltaHeader)) || (header->magic != DELTA_MAGIC) || (header->version != DELTA_VERSION) ||
+        (header->reserved[0] != 0) || (header->reserved[1] != 0)) {
+        return DELTA_FORMAT_ERROR;
+    }
+    if ((Bootloader_CheckSize(header->sourceSize) != BL_OK) || (Bootloader_CheckSize(header->targetSize) != BL_OK) ||
+        (Bootloader_CheckSize((scratch_first(header) + 1) * FLASH_PAGE_SIZE) != BL_OK)) {
+        return DELTA_FORMAT_ERROR;
+    }
+
+    if (Bootloader_JournalResume(header->targetSize, header->targetCrc, &resume->page) == BL_OK) {
+        if (resume->page > page_count(header->targetSize)) {
+            return DELTA_BASE_MISMATCH;
+        }
+        status = delta_run(fp, header, resume, false, &crc);
+        if ((status == DELTA_OK) && (crc != header->targetCrc)) {
+            resume->scratch = 1;
+            if (f_lseek(fp, sizeof(DeltaHeader)) != FR_OK) {
+                return DELTA_READ_ERROR;
+            }
+            status = delta_run(fp, header, resume, false, &crc);
+        }
+        if (status != DELTA_OK) {
+            return status;
+        }
+        return (crc == header->targetCrc) ? DELTA_OK : DELTA_BASE_MISMATCH;
+    }
+
+    if (Bootloader_CRC32(0, (const void*)APP_ADDRESS, header->sourceSize) != header->sourceCrc) {
+        /* A patch left on the card after a successful update */
+        if (Bootloader_CRC32(0, (const void*)APP_ADDRESS, header->targetSize) == header->targetCrc) {
+            return DELTA_APPLIED;
+        }
+        return DELTA_BASE_MISMATCH;
+    }
+
+    status = delta_run(fp, header, resume, false, &crc);
+    if (status != DELTA_OK) {
+        return status;
+    }
+    return (crc == header->targetCrc) ? DELTA_OK : DELTA_FORMAT_ERROR;
+}
+
+/**
+ * @brief  This function applies a patch previously validated by
+ *         ::Delta_Check, committing each page to the update journal, which
+ *         must be open. It then erases the leftover pages of the source image
+ *         and the scratch page, and verifies the CRC of the new image.
+ * @param  fp: opened patch file
+ * @param  header: patch header returned by ::Delta_Check
+ * @param  resume: page to resume from, returned by ::Delta_Check
+ * @return Delta error code ::eDeltaErrorCodes
+ */
+uint8_t Delta_Apply(FIL* fp, const DeltaHeader* header, const DeltaResume* resume) {
+    uint32_t crc;
+    uint32_t first;
+    uint32_t last;
+    uint8_t  status;
+
+    Bootloader_Init();
+
+    if (f_lseek(fp, sizeof(DeltaHeader)) != FR_OK) {
+        return DELTA_READ_ERROR;
+    }
+    status = delta_run(fp, header, resume, true, &crc);
+    if (status != DELTA_OK) {
+        return status;
+    }
+
+    /* Remove the tail of a larger source image and the scratch copies */
+    first = page_count(header->targetSize);
+    last  = scratch_first(header) + ((page_count(header->targetSize) < scratch_count(header))
+                                         ? page_count(header->targetSize)
+                                         : scratch_count(header));
+    for (uint32_t index = first; index < last; index++) {
+        if (!page_blank(index) && (Bootloader_ErasePages(APP_ADDRESS + index * FLASH_PAGE_SIZE, 1) != BL_OK)) {
+            return DELTA_FLASH_ERROR;
+        }
+    }
+
+    if (Bootloader_CRC32(0, (const void*)APP_ADDRESS, header->targetSize) != header->targetCrc) {
+        return DELTA_VERIFY_ERROR;
+    }
+    return DELTA_OK;
+}
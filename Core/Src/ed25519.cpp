@@ -0,0 +1,499 @@
+/**
+ *******************************************************************************
+ * @file   ed25519.cpp
+ * @brief  Ed25519 signature verification (RFC 8032), derived from the public
+ *         domain TweetNaCl field and group arithmetic. The two scalar
+ *         multiplications of the verification equation are merged into one
+ *         double-and-add pass (Straus-Shamir) over a 4 entries table, which
+ *         about halves the number of point operations.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "ed25519.h"
+#include <string.h>
+
+/* Private typedef -----------------------------------------------------------*/
+/** Field element modulo 2^255-19: 16 signed limbs of 16 bits */
+typedef int64_t Fe[16];
+
+/** Curve point in extended coordinates (X:Y:Z:T) */
+typedef Fe Point[4];
+
+/** SHA-512 context */
+typedef struct
+{
+    uint64_t state[8];
+    uint8_t  block[128];
+    uint32_t used;
+    uint32_t length;
+} Sha512Context;
+
+/* Private constants ---------------------------------------------------------*/
+static const uint64_t K512[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL,
+    0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+    0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL, 0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL, 0x983e5152ee66dfabULL,
+    0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL,
+    0x53380d139d95b3dfULL, 0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL, 0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+    0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL,
+    0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL, 0xca273eceea26619cULL,
+    0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+    0x113f9804bef90daeULL, 0x1b710b35131c471bULL, 0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const Fe FE_ZERO = {0};
+static const Fe FE_ONE  = {1};
+/** Curve constant d */
+static const Fe FE_D = {0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+                        0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203};
+/** 2 * d */
+static const Fe FE_D2 = {0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+                         0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406};
+/** Square root of -1 */
+static const Fe FE_I = {0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+                        0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83};
+/** Base point coordinates */
+static const Fe FE_BX = {0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+                         0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169};
+static const Fe FE_BY = {0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+                         0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666};
+
+/** Group order L, little endian */
+static const int64_t ORDER[32] = {0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7,
+                                  0xa2, 0xde, 0xf9, 0xde, 0x14, 0,    0,    0,    0,    0,    0,
+                                  0,    0,    0,    0,    0,    0,    0,    0,    0,    0x10};
+
+/* Private functions: SHA-512 ------------------------------------------------*/
+static inline uint64_t ror64(uint64_t x, uint32_t n) {
+    return (x >> n) | (x << (64 - n));
+}
+
+static void sha512_block(uint64_t* state, const uint8_t* block) {
+    uint64_t w[16];
+    uint64_t v[8];
+    uint64_t t1;
+    uint64_t t2;
+
+    for (uint32_t i = 0; i < 16; i++) {
+        w[i] = 0;
+        for (uint32_t j = 0; j < 8; j++) {
+            w[i] = (w[i] << 8) | block[8 * i + j];
+        }
+    }
+    memcpy(v, state, sizeof(v));
+
+    for (uint32_t i = 0; i < 80; i++) {
+        if (i >= 16) {
+            uint64_t s0 = w[(i + 1) & 15];
+            uint64_t s1 = w[(i + 14) & 15];
+
+            w[i & 15] += (ror64(s0, 1) ^ ror64(s0, 8) ^ (s0 >> 7)) + (ror64(s1, 19) ^ ror64(s1, 61) ^ (s1 >> 6)) +
+                         w[(i + 9) & 15];
+        }
+        t1 = v[7] + (ror64(v[4], 14) ^ ror64(v[4], 18) ^ ror64(v[4], 41)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) +
+             K512[i] + w[i & 15];
+        t2 = (ror64(v[0], 28) ^ ror64(v[0], 34) ^ ror64(v[0], 39)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        for (uint32_t j = 7; j > 0; j--) {
+            v[j] = v[j - 1];
+        }
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+
+    for (uint32_t i = 0; i < 8; i++) {
+        state[i] += v[i];
+    }
+}
+
+static void sha512_init(Sha512Context* ctx) {
+    static const uint64_t iv[8] = {0x6a09e667f3bcc908ULL,
+                                   0xbb67ae8584caa73bULL,
+                                   0x3c6ef372fe94f82bULL,
+                                   0xa54ff53a5f1d36f1ULL,
+                                   0x510e527fade682d1ULL,
+                                   0x9b05688c2b3e6c1fULL,
+                                   0x1f83d9abfb41bd6bULL,
+                                   0x5be0cd19137e2179ULL};
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->used   = 0;
+    ctx->length = 0;
+}
+
+static void sha512_update(Sha512Context* ctx, const uint8_t* data, uint32_t length) {
+    ctx->length += length;
+    while (length--) {
+        ctx->block[ctx->used++] = *data++;
+        if (ctx->used == sizeof(ctx->block)) {
+            sha512_block(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha512_final(Sha512Context* ctx, uint8_t* digest) {
+    uint64_t bits = (uint64_t)ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > sizeof(ctx->block) - 16) {
+        memset(&ctx->block[ctx->used], 0, sizeof(ctx->block) - ctx->used);
+        sha512_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(&ctx->block[ctx->used], 0, sizeof(ctx->block) - ctx->used);
+    for (uint32_t i = 0; i < 8; i++) {
+        ctx->block[127 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha512_block(ctx->state, ctx->block);
+
+    for (uint32_t i = 0; i < 64; i++) {
+        digest[i] = (uint8_t)(ctx->state[i / 8] >> (56 - 8 * (i % 8)));
+    }
+}
+
+/* Private functions: field arithmetic ---------------------------------------*/
+static void fe_copy(Fe r, const Fe a) {
+    memcpy(r, a, sizeof(Fe));
+}
+
+static void fe_carry(Fe r) {
+    int64_t c;
+
+    for (uint32_t i = 0; i < 16; i++) {
+        r[i] += (1LL << 16);
+        c = r[i] >> 16;
+        if (i < 15) {
+            r[i + 1] += c - 1;
+        } else {
+            r[0] += 38 * (c - 1);
+        }
+        r[i] -= c << 16;
+    }
+}
+
+static void fe_add(Fe r, const Fe a, const Fe b) {
+    for (uint32_t i = 0; i < 16; i++) {
+        r[i] = a[i] + b[i];
+    }
+}
+
+static void fe_sub(Fe r, const Fe a, const Fe b) {
+    for (uint32_t i = 0; i < 16; i++) {
+        r[i] = a[i] - b[i];
+    }
+}
+
+static void fe_mul(Fe r, const Fe a, const Fe b) {
+    int64_t t[31] = {0};
+
+    for (uint32_t i = 0; i < 16; i++) {
+        for (uint32_t j = 0; j < 16; j++) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    for (uint32_t i = 0; i < 15; i++) {
+        t[i] += 38 * t[i + 16];
+    }
+    for (uint32_t i = 0; i < 16; i++) {
+        r[i] = t[i];
+    }
+    fe_carry(r);
+    fe_carry(r);
+}
+
+static void fe_sq(Fe r, const Fe a) {
+    fe_mul(r, a, a);
+}
+
+/**
+ * @brief  Canonical 32 bytes little endian encoding of a field element.
+ */
+static void fe_pack(uint8_t* out, const Fe a) {
+    Fe      t;
+    Fe      m;
+    int64_t borrow;
+
+    fe_copy(t, a);
+    fe_carry(t);
+    fe_carry(t);
+    fe_carry(t);
+    /* Subtract p at most twice */
+    for (uint32_t k = 0; k < 2; k++) {
+        m[0] = t[0] - 0xffed;
+        for (uint32_t i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15]  = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        borrow = (m[15] >> 16) & 1;
+        m[14] &= 0xffff;
+        if (!borrow) {
+            fe_copy(t, m);
+        }
+    }
+    for (uint32_t i = 0; i < 16; i++) {
+        out[2 * i]     = (uint8_t)t[i];
+        out[2 * i + 1] = (uint8_t)(t[i] >> 8);
+    }
+}
+
+static void fe_unpack(Fe r, const uint8_t* in) {
+    for (uint32_t i = 0; i < 16; i++) {
+        r[i] = in[2 * i] + ((int64_t)in[2 * i + 1] << 8);
+    }
+    r[15] &= 0x7fff;
+}
+
+static bool fe_equal(const Fe a, const Fe b) {
+    uint8_t pa[32];
+    uint8_t pb[32];
+
+    fe_pack(pa, a);
+    fe_pack(pb, b);
+    return memcmp(pa, pb, sizeof(pa)) == 0;
+}
+
+static uint8_t fe_parity(const Fe a) {
+    uint8_t p[32];
+
+    fe_pack(p, a);
+    return p[0] & 1;
+}
+
+/** a^(p-2) */
+static void fe_invert(Fe r, const Fe a) {
+    Fe c;
+
+    fe_copy(c, a);
+    for (int32_t i = 253; i >= 0; i--) {
+        fe_sq(c, c);
+        if ((i != 2) && (i != 4)) {
+            fe_mul(c, c, a);
+        }
+    }
+    fe_copy(r, c);
+}
+
+/** a^((p-5)/8) */
+static void fe_pow2523(Fe r, const Fe a) {
+    Fe c;
+
+    fe_copy(c, a);
+    for (int32_t i = 250; i >= 0; i--) {
+        fe_sq(c, c);
+        if (i != 1) {
+            fe_mul(c, c, a);
+        }
+    }
+    fe_copy(r, c);
+}
+
+/* Private functions: group arithmetic ---------------------------------------*/
+/**
+ * @brief  p = p + q with the unified addition law, also valid when p and q
+ *         are the same point (doubling).
+ */
+static void point_add(Point p, const Point q) {
+    Fe a, b, c, d, e, f, g, h, t;
+
+    fe_sub(a, p[1], p[0]);
+    fe_sub(t, q[1], q[0]);
+    fe_mul(a, a, t);
+    fe_add(b, p[0], p[1]);
+    fe_add(t, q[0], q[1]);
+    fe_mul(b, b, t);
+    fe_mul(c, p[3], q[3]);
+    fe_mul(c, c, FE_D2);
+    fe_mul(d, p[2], q[2]);
+    fe_add(d, d, d);
+    fe_sub(e, b, a);
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+    fe_add(h, b, a);
+
+    fe_mul(p[0], e, f);
+    fe_mul(p[1], h, g);
+    fe_mul(p[2], g, f);
+    fe_mul(p[3], e, h);
+}
+
+static void point_pack(uint8_t* out, const Point p) {
+    Fe x;
+    Fe y;
+    Fe zi;
+
+    fe_invert(zi, p[2]);
+    fe_mul(x, p[0], zi);
+    fe_mul(y, p[1], zi);
+    fe_pack(out, y);
+    out[31] ^= fe_parity(x) << 7;
+}
+
+/**
+ * @brief  Decode a point and negate it.
+ * @return false if the encoding is not canonical or not on the curve
+ */
+static bool point_unpack_neg(Point r, const uint8_t* in) {
+    Fe      t, chk, num, den, den2, den4, den6;
+    uint8_t y[32];
+
+    fe_copy(r[2], FE_ONE);
+    fe_unpack(r[1], in);
+
+    /* y must be below p */
+    fe_pack(y, r[1]);
+    y[31] |= in[31] & 0x80;
+    if (memcmp(y, in, sizeof(y)) != 0) {
+        return false;
+    }
+
+    /* x^2 = (y^2 - 1) / (d y^2 + 1) */
+    fe_sq(num, r[1]);
+    fe_mul(den, num, FE_D);
+    fe_sub(num, num, r[2]);
+    fe_add(den, r[2], den);
+
+    fe_sq(den2, den);
+    fe_sq(den4, den2);
+    fe_mul(den6, den4, den2);
+    fe_mul(t, den6, num);
+    fe_mul(t, t, den);
+
+    fe_pow2523(t, t);
+    fe_mul(t, t, num);
+    fe_mul(t, t, den);
+    fe_mul(t, t, den);
+    fe_mul(r[0], t, den);
+
+    fe_sq(chk, r[0]);
+    fe_mul(chk, chk, den);
+    if (!fe_equal(chk, num)) {
+        fe_mul(r[0], r[0], FE_I);
+    }
+    fe_sq(chk, r[0]);
+    fe_mul(chk, chk, den);
+    if (!fe_equal(chk, num)) {
+        return false;
+    }
+    /* x = 0 has no negative encoding */
+    if (fe_equal(r[0], FE_ZERO) && (in[31] & 0x80)) {
+        return false;
+    }
+
+    if (fe_parity(r[0]) == (in[31] >> 7)) {
+        fe_sub(r[0], FE_ZERO, r[0]);
+    }
+    fe_mul(r[3], r[0], r[1]);
+    return true;
+}
+
+/* Private functions: scalars ------------------------------------------------*/
+/**
+ * @brief  Reduce a 64 bytes little endian number modulo L.
+ */
+static void scalar_reduce(uint8_t* r, const uint8_t* in) {
+    int64_t  x[64];
+    int64_t  carry;
+    uint32_t j;
+
+    for (uint32_t i = 0; i < 64; i++) {
+        x[i] = in[i];
+    }
+    for (uint32_t i = 63; i >= 32; i--) {
+        carry = 0;
+        for (j = i - 32; j < i - 12; j++) {
+            x[j] += carry - 16 * x[i] * ORDER[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+    carry = 0;
+    for (j = 0; j < 32; j++) {
+        x[j] += carry - (x[31] >> 4) * ORDER[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for (j = 0; j < 32; j++) {
+        x[j] -= carry * ORDER[j];
+    }
+    for (uint32_t i = 0; i < 32; i++) {
+        x[i + 1] += x[i] >> 8;
+        r[i] = (uint8_t)(x[i] & 255);
+    }
+}
+
+/** Check that a 32 bytes little endian scalar is below L */
+static bool scalar_canonical(const uint8_t* s) {
+    for (int32_t i = 31; i >= 0; i--) {
+        if (s[i] != ORDER[i]) {
+            return s[i] < ORDER[i];
+        }
+    }
+    return false;
+}
+
+/* Public functions ----------------------------------------------------------*/
+/**
+ * @brief  This function verifies an Ed25519 signature: it checks that
+ *         [S]B = R + [H(R,A,M)]A, computed as [S]B + [h](-A) in a single
+ *         pass of 256 doublings and at most 256 additions.
+ * @param  signature: ::ED25519_SIGNATURE_SIZE bytes signature (R, S)
+ * @param  message: signed message
+ * @param  length: length of the message in bytes
+ * @param  key: ::ED25519_KEY_SIZE bytes public key A
+ * @return true if the signature is valid
+ */
+bool Ed25519_Verify(const uint8_t* signature, const uint8_t* message, uint32_t length, const uint8_t* key) {
+    Sha512Context sha;
+    Point         table[3]; /* B, -A, B - A */
+    Point         p;
+    uint8_t       h[64];
+    uint8_t       r[32];
+    uint8_t       bits;
+
+    if (!scalar_canonical(&signature[32]) || !point_unpack_neg(table[1], key)) {
+        return false;
+    }
+
+    /* h = SHA-512(R || A || M) mod L */
+    sha512_init(&sha);
+    sha512_update(&sha, signature, 32);
+    sha512_update(&sha, key, ED25519_KEY_SIZE);
+    sha512_update(&sha, message, length);
+    sha512_final(&sha, h);
+    scalar_reduce(h, h);
+
+    fe_copy(table[0][0], FE_BX);
+    fe_copy(table[0][1], FE_BY);
+    fe_copy(table[0][2], FE_ONE);
+    fe_mul(table[0][3], FE_BX, FE_BY);
+    memcpy(table[2], table[0], sizeof(Point));
+    point_add(table[2], table[1]);
+
+    /* Neutral element */
+    fe_copy(p[0], FE_ZERO);
+    fe_copy(p[1], FE_ONE);
+    fe_copy(p[2], FE_ONE);
+    fe_copy(p[3], FE_ZERO);
+
+    for (int32_t i = 255; i >= 0; i--) {
+        point_add(p, p);
+        bits = ((signature[32 + i / 8] >> (i & 7)) & 1) | (((h[i / 8] >> (i & 7)) & 1) << 1);
+        if (bits) {
+            point_add(p, table[bits - 1]);
+        }
+    }
+
+    point_pack(r, p);
+    return memcmp(r, signature, sizeof(r)) == 0;
+}
@@ -0,0 +1,400 @@
+/**
+ *******************************************************************************
+ * @file   hexfile.cpp
+ * @brief  Streaming Intel HEX / Motorola S-record loader. The same record
+ *         decoder runs three passes over the file: a check pass validating
+ *         every record before flash is touched, a programming pass and a
+ *         verification pass.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "hexfile.h"
+#include "bootloader.h"
+#include <string.h>
+
+/* Private defines -----------------------------------------------------------*/
+/** Longest record: count, address, type, 255 data bytes and checksum */
+#define HEX_RECORD_MAX (1 + 2 + 1 + 255 + 1)
+
+/** Number of pages in the application area (FLASH_SIZE is read at run
+ * time, FLASH_END is the end of the 512 KB device) */
+#define HEX_PAGES_MAX ((FLASH_END + 1 - APP_ADDRESS) / FLASH_PAGE_SIZE)
+
+/** Number of rows in the application area */
+#define HEX_ROWS_MAX (HEX_PAGES_MAX * (FLASH_PAGE_SIZE / FLASH_ROW_SIZE))
+
+/* Private typedef -----------------------------------------------------------*/
+/** Pass over the file */
+enum eHexModes
+{
+    HEX_MODE_CHECK = 0,
+    HEX_MODE_PROGRAM,
+    HEX_MODE_VERIFY,
+};
+
+/** Record decoder state */
+typedef struct
+{
+    uint8_t  record[HEX_RECORD_MAX]; /*!< Decoded bytes of the current record */
+    uint32_t length;                 /*!< Number of decoded bytes */
+    uint32_t expected;               /*!< Length of the record, once known */
+    uint32_t base;                   /*!< Intel HEX extended address */
+    char     format;                 /*!< ':' or 'S', 0 between records */
+    uint8_t  type;                   /*!< S-record type, 0xFF until known */
+    uint8_t  high;                   /*!< Pending high nibble */
+    bool     odd;                    /*!< A high nibble is pending */
+    bool     eof;                    /*!< End of file record seen */
+} HexParser;
+
+/* Private variables ---------------------------------------------------------*/
+static HexParser parser;
+static uint8_t   buffer[256];
+/** Row being assembled, 32bit aligned for flash programming */
+static uint32_t  row[FLASH_ROW_SIZE / 4];
+static uint32_t  row_address;
+/** Pages erased (programming pass) or touched (check pass) */
+static uint8_t   pages[HEX_PAGES_MAX / 8];
+static HexInfo*  info;
+/** Rows written (check pass), and bytes written in the current one */
+static uint8_t   rows[HEX_ROWS_MAX / 8];
+static uint32_t  row_mask[FLASH_ROW_SIZE / 32];
+
+/* Private functions ---------------------------------------------------------*/
+static bool page_mark(uint32_t address) {
+    uint32_t page = (address - APP_ADDRESS) / FLASH_PAGE_SIZE;
+    bool     seen = pages[page / 8] & (1 << (page % 8));
+
+    pages[page / 8] |= (1 << (page % 8));
+    return seen;
+}
+
+static uint8_t row_flush(void) {
+    uint8_t status;
+
+    if (row_address == 0) {
+        return HEX_OK;
+    }
+
+    /* Erase a page the first time one of its rows is written */
+    if (!page_mark(row_address)) {
+        if (Bootloader_ErasePages(row_address & ~(FLASH_PAGE_SIZE - 1), 1) != BL_OK) {
+            return HEX_FLASH_ERROR;
+        }
+    }
+
+    Bootloader_FlashBegin();
+    Bootloader_FlashSeek(row_address);
+    status = Bootloader_FlashBuffer(row, FLASH_ROW_SIZE);
+    Bootloader_FlashEnd();
+
+    row_address = 0;
+    return (status == BL_OK) ? HEX_OK : HEX_FLASH_ERROR;
+}
+
+/**
+ * @brief  Record the bytes written in a row during the check pass. A row is
+ *         programmed at once when the records leave it: data written to a
+ *         row already left, or twice to the same byte, cannot be programmed.
+ * @param  address: first byte
+ * @param  length: number of bytes, not crossing the end of the row
+ * @return Hex loader error code ::eHexErrorCodes
+ */
+static uint8_t row_mark(uint32_t address, uint32_t length) {
+    uint32_t index = (address - APP_ADDRESS) / FLASH_ROW_SIZE;
+
+    if ((address & ~(FLASH_ROW_SIZE - 1)) != row_address) {
+        if (rows[index / 8] & (1 << (index % 8))) {
+            return HEX_OVERLAP_ERROR;
+        }
+        rows[index / 8] |= (1 << (index % 8));
+        row_address = address & ~(FLASH_ROW_SIZE - 1);
+        memset(row_mask, 0, sizeof(row_mask));
+    }
+    for (uint32_t i = address - row_address; length--; i++) {
+        if (row_mask[i / 32] & (1UL << (i % 32))) {
+            return HEX_OVERLAP_ERROR;
+        }
+        row_mask[i / 32] |= (1UL << (i % 32));
+    }
+    return HEX_OK;
+}
+
+static uint8_t hex_data(uint8_t mode, uint32_t address, const uint8_t* data, uint32_t length) {
+    uint32_t chunk;
+    uint8_t  status;
+
+    if ((address < APP_ADDRESS) || (address > FLASH_BASE + FLASH_SIZE) ||
+        (length > FLASH_BASE + FLASH_SIZE - address)) {
+        return HEX_RANGE_ERROR;
+    }
+    if (length == 0) {
+        return HEX_OK;
+    }
+
+    switch (mode) {
+        case HEX_MODE_CHECK:
+            if ((info->bytes == 0) || (address < info->start)) {
+                info->start = address;
+            }
+            if (address + length > info->end) {
+                info->end = address + length;
+            }
+            info->bytes += length;
+            for (uint32_t a = address & ~(FLASH_PAGE_SIZE - 1); a < address + length; a += FLASH_PAGE_SIZE) {
+                if (!page_mark(a)) {
+                    info->pages++;
+                }
+            }
+            while (length) {
+                chunk = FLASH_ROW_SIZE - (address % FLASH_ROW_SIZE);
+                if (chunk > length) {
+                    chunk = length;
+                }
+                status = row_mark(address, chunk);
+                if (status != HEX_OK) {
+                    return status;
+                }
+                address += chunk;
+                length -= chunk;
+            }
+            break;
+
+        case HEX_MODE_PROGRAM:
+            while (length) {
+                if ((address & ~(FLASH_ROW_SIZE - 1)) != row_address) {
+                    status = row_flush();
+                    if (status != HEX_OK) {
+                        return status;
+                    }
+                    row_address = address & ~(FLASH_ROW_SIZE - 1);
+                    memset(row, 0xFF, sizeof(row));
+                }
+                chunk = FLASH_ROW_SIZE - (address - row_address);
+                if (chunk > length) {
+                    chunk = length;
+                }
+                memcpy((uint8_t*)row + (address - row_address), data, chunk);
+                address += chunk;
+                data += chunk;
+                length -= chunk;
+            }
+            break;
+
+        case HEX_MODE_VERIFY:
+            if (memcmp((const void*)address, data, length) != 0) {
+                return HEX_VERIFY_ERROR;
+            }
+            break;
+    }
+    return HEX_OK;
+}
+
+static uint8_t record_intel(uint8_t mode) {
+    const uint8_t* rec = parser.record;
+    uint8_t        sum = 0;
+
+    for (uint32_t i = 0; i < parser.length; i++) {
+        sum += rec[i];
+    }
+    if (sum != 0) {
+        return HEX_CHECKSUM_ERROR;
+    }
+
+    switch (rec[3]) {
+        case 0x00:
+            return hex_data(mode, parser.base + (((uint32_t)rec[1] << 8) | rec[2]), &rec[4], rec[0]);
+        case 0x01:
+            parser.eof = true;
+            return HEX_OK;
+        case 0x02:
+        case 0x04:
+            if (rec[0] != 2) {
+                return HEX_FORMAT_ERROR;
+            }
+            parser.base = ((uint32_t)rec[4] << 8) | rec[5];
+            parser.base <<= (rec[3] == 0x02) ? 4 : 16;
+            return HEX_OK;
+        case 0x03:
+        case 0x05:
+            return HEX_OK;
+        default:
+            return HEX_FORMAT_ERROR;
+    }
+}
+
+static uint8_t record_srec(uint8_t mode) {
+    static const uint8_t addrlen[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    const uint8_t*       rec         = parser.record;
+    uint8_t              sum         = 0;
+    uint32_t             address     = 0;
+    uint32_t             n           = addrlen[parser.type];
+
+    for (uint32_t i = 0; i < parser.length; i++) {
+        sum += rec[i];
+    }
+    if (sum != 0xFF) {
+        return HEX_CHECKSUM_ERROR;
+    }
+    if ((n == 0) || (rec[0] < n + 1)) {
+        return HEX_FORMAT_ERROR;
+    }
+
+    for (uint32_t i = 1; i <= n; i++) {
+        address = (address << 8) | rec[i];
+    }
+
+    switch (parser.type) {
+        case 1:
+        case 2:
+        case 3:
+            return hex_data(mode, address, &rec[1 + n], rec[0] - n - 1);
+        case 7:
+        case 8:
+        case 9:
+            parser.eof = true;
+            return HEX_OK;
+        default:
+            return HEX_OK;
+    }
+}
+
+static int8_t hex_nibble(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/**
+ * @brief  Decode the whole file, handing data records to ::hex_data.
+ * @param  fp: opened hex file
+ * @param  mode: pass over the file ::eHexModes
+ * @return Hex loader error code ::eHexErrorCodes
+ */
+static uint8_t hex_run(FIL* fp, uint8_t mode) {
+    UINT    num;
+    uint8_t status = HEX_OK;
+    int8_t  nibble;
+
+    memset(&parser, 0, sizeof(parser));
+    if (f_lseek(fp, 0) != FR_OK) {
+        return HEX_READ_ERROR;
+    }
+
+    do {
+        if (f_read(fp, buffer, sizeof(buffer), &num) != FR_OK) {
+            return HEX_READ_ERROR;
+        }
+
+        for (UINT i = 0; i < num; i++) {
+            char c = (char)buffer[i];
+
+            if (parser.format == 0) {
+                /* Between records */
+                if ((c == '\r') || (c == '\n') || (c == ' ') || (c == '\t')) {
+                    continue;
+                }
+                if (parser.eof || ((c != ':') && (c != 'S'))) {
+                    return HEX_FORMAT_ERROR;
+                }
+                parser.format   = c;
+                parser.type     = 0xFF;
+                parser.length   = 0;
+                parser.expected = 0;
+                parser.odd      = false;
+                continue;
+            }
+
+            if ((parser.format == 'S') && (parser.type == 0xFF)) {
+                if ((c < '0') || (c > '9')) {
+                    return HEX_FORMAT_ERROR;
+                }
+                parser.type = c - '0';
+                continue;
+            }
+
+            nibble = hex_nibble(c);
+            if (nibble < 0) {
+                return HEX_FORMAT_ERROR;
+            }
+            if (!parser.odd) {
+                parser.high = nibble;
+                parser.odd  = true;
+                continue;
+            }
+            parser.odd                     = false;
+            parser.record[parser.length++] = (parser.high << 4) | nibble;
+
+            if (parser.length == 1) {
+                /* Byte count gives the record length */
+                parser.expected = parser.record[0] + ((parser.format == ':') ? 5 : 1);
+            }
+            if (parser.length == parser.expected) {
+                status        = (parser.format == ':') ? record_intel(mode) : record_srec(mode);
+                parser.format = 0;
+                if (status != HEX_OK) {
+                    return status;
+                }
+            }
+        }
+    } while (num > 0);
+
+    if (!parser.eof || (parser.format != 0)) {
+        return HEX_FORMAT_ERROR;
+    }
+    return HEX_OK;
+}
+
+/**
+ * @brief  This function validates a hex file without modifying flash: record
+ *         syntax, checksums and addresses are checked, and records must not
+ *         overlap nor come back to a flash row they left.
+ * @param  fp: opened hex file
+ * @param  summary: filled with the extent of the file
+ * @return Hex loader error code ::eHexErrorCodes
+ */
+uint8_t Hex_Check(FIL* fp, HexInfo* summary) {
+    memset(summary, 0, sizeof(HexInfo));
+    memset(pages, 0, sizeof(pages));
+    memset(rows, 0, sizeof(rows));
+    row_address = 0;
+    info        = summary;
+
+    return hex_run(fp, HEX_MODE_CHECK);
+}
+
+/**
+ * @brief  This function programs a hex file previously validated by
+ *         ::Hex_Check. Only the pages touched by the file are erased.
+ * @param  fp: opened hex file
+ * @return Hex loader error code ::eHexErrorCodes
+ */
+uint8_t Hex_Program(FIL* fp) {
+    uint8_t status;
+
+    memset(pages, 0, sizeof(pages));
+    row_address = 0;
+
+    Bootloader_Init();
+    status = hex_run(fp, HEX_MODE_PROGRAM);
+    if (status == HEX_OK) {
+        status = row_flush();
+    }
+    return status;
+}
+
+/**
+ * @brief  This function compares the flash content with a hex file.
+ * @param  fp: opened hex file
+ * @return Hex loader error code ::eHexErrorCodes
+ */
+uint8_t Hex_Verify(FIL* fp) {
+    return hex_run(fp, HEX_MODE_VERIFY);
+}
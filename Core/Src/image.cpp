@@ -0,0 +1,53 @@
+/**
+ *******************************************************************************
+ * @file   image.cpp
+ * @brief  Update container header check, shared by the bootloader and the
+ *         host packer.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "image.h"
+
+static_assert(sizeof(ImageHeader) == IMAGE_HEADER_SIZE, "ImageHeader must fill one sector");
+
+/* Public functions ----------------------------------------------------------*/
+/**
+ * @brief  This function checks a container header against the file holding
+ *         it and the configuration of the bootloader.
+ * @param  header: container header
+ * @param  fileSize: size of the container file
+ * @param  address: load address of the application
+ * @param  flags: ::eImageFlags required by the bootloader. The encryption
+ *         flag must match, a signature is optional unless required.
+ * @return Container error code ::eImageErrorCodes
+ */
+uint8_t Image_CheckHeader(const ImageHeader* header, uint32_t fileSize, uint32_t address, uint16_t flags) {
+    if (header->magic != IMAGE_MAGIC) {
+        return IMAGE_BAD_MAGIC;
+    }
+    if (header->version != IMAGE_VERSION) {
+        return IMAGE_BAD_VERSION;
+    }
+    if (header->address != address) {
+        return IMAGE_BAD_ADDRESS;
+    }
+    if ((fileSize < IMAGE_HEADER_SIZE) || (header->size != fileSize - IMAGE_HEADER_SIZE)) {
+        return IMAGE_BAD_SIZE;
+    }
+    if (header->chunkSize != 0) {
+        if ((header->chunks > IMAGE_CHUNKS_MAX) ||
+            (header->chunks != (header->size + header->chunkSize - 1) / header->chunkSize)) {
+            return IMAGE_BAD_CHUNKS;
+        }
+    } else if (header->chunks != 0) {
+        return IMAGE_BAD_CHUNKS;
+    }
+    if ((header->compression != IMAGE_COMPRESSION_NONE) ||
+        ((header->flags & ~(IMAGE_FLAG_ENCRYPTED | IMAGE_FLAG_SIGNED)) != 0) ||
+        ((header->flags & IMAGE_FLAG_ENCRYPTED) != (flags & IMAGE_FLAG_ENCRYPTED)) ||
+        ((flags & IMAGE_FLAG_SIGNED) && !(header->flags & IMAGE_FLAG_SIGNED))) {
+        return IMAGE_UNSUPPORTED;
+    }
+    return IMAGE_OK;
+}
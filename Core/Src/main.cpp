@@ -8,6 +8,9 @@
 /* Private includes ----------------------------------------------------------*/
 #include "app.h"
 #include "bootloader.h"
+#include "sha256.h"
+#include "mailbox.h"
+#include "trace.h"
 #include <string.h>
 #include <stdio.h>
 //#include "shared/services/filesystem.h"
@@ -25,8 +28,12 @@ constexpr char COMM[]  = "SD";
 
 /* Private function prototypes -----------------------------------------------*/
 void print_info();
+void print_benchmark();
 void SystemClock_Config(void);
 void DeInit(void);
+#if (USE_MAILBOX)
+bool Probe_Requested(void);
+#endif
 
 /* Private user code ---------------------------------------------------------*/
 
@@ -41,6 +48,8 @@ int main(void) {
 
     /* Configure the system clock */
     SystemClock_Config();
+    Trace_Init();
+    Trace_Event(TRACE_BOOT, RCC->CSR >> 24);
 
     /* Initialize all configured peripherals */
     MX_GPIO_Init();
@@ -48,20 +57,58 @@ int main(void) {
     MX_USART1_UART_Init();
     MX_SPI3_Init();
 
-    /* Infinite loop */
-    print_info();
-    if (Enter_Bootloader()) {
-        print("Failed to prepare bootloader\r\n");
-        Error_Handler();
+#if (USE_MAILBOX)
+    bool probe = Probe_Requested();
+#else
+    bool probe = true;
+#endif
+    uint32_t updateMs = 0;
+
+    if (probe) {
+        print_info();
+#if (SHA256_BENCHMARK)
+        print_benchmark();
+#endif
+        uint32_t updateStart = HAL_GetTick();
+        uint8_t  status      = ERR_UART_NONE;
+#if (USE_UART_UPDATE)
+        /* Bench and production line: an image sent over USART1 replaces the SD card */
+        status = Enter_UartUpdate();
+#endif
+        if (status == ERR_UART_NONE) {
+            status = Enter_Bootloader();
+        }
+        if (status != ERR_OK) {
+            Trace_Event(TRACE_ERROR, status);
+            print("Failed to prepare bootloader\r\n");
+            Error_Handler();
+        }
+        updateMs = HAL_GetTick() - updateStart;
     }
 
-
     if (Bootloader_CheckForApplication() == BL_OK) {
+#if (USE_WRITE_PROTECTION)
+        /* Protect the pages of the recorded image: resets once after an
+         * update, returns at once when the option bytes already match */
+        BootloaderRecord record;
+        if (Bootloader_GetRecord(&record) != BL_OK) {
+            record.size = 0;
+        }
+        if (Bootloader_ConfigProtection(BL_PROTECTION_WRP, record.size) != BL_OK) {
+            print("Failed to set write protection\r\n");
+        }
+#endif
         print("Jumping to application\r\n");
         print(
           "\r\n"
           "--------------"
           "\r\n\r\n");
+#if (USE_HANDOFF)
+        Handoff_Prepare(updateMs);
+#else
+        (void)updateMs;
+#endif
+        Trace_Event(TRACE_JUMP, updateMs);
         DeInit();
         Bootloader_JumpToApplication();
     }
@@ -117,11 +164,44 @@ void SystemClock_Config(void) {
 }
 
 void DeInit(void) {
+#if (USE_HANDOFF)
+    /* SPI3, USART1 and their pins are described by the handoff block */
+    MX_FATFS_DeInit();
+#else
     MX_SPI3_DeInit();
     MX_USART1_UART_DeInit();
     MX_FATFS_DeInit();
     MX_GPIO_DeInit();
+#endif
+}
+
+#if (USE_MAILBOX)
+/**
+ * @brief  Tells whether the SD card must be probed on this boot (see
+ *         ::USE_MAILBOX). Consumes the mailbox request, and moves the reset
+ *         flags to the mailbox.
+ * @return true after a cold boot, on request of the application, or without
+ *         a valid application
+ */
+bool Probe_Requested(void) {
+    Mailbox* mailbox = (Mailbox*)MAILBOX_ADDRESS;
+    uint32_t flags   = RCC->CSR & (RCC_CSR_FWRSTF | RCC_CSR_OBLRSTF | RCC_CSR_PINRSTF | RCC_CSR_BORRSTF |
+                                 RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF);
+    uint32_t warm    = RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF;
+    uint32_t request = Mailbox_Take();
+
+    mailbox->resetFlags = flags;
+#if (CLEAR_RESET_FLAGS)
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+#endif
+
+    /* Internal resets also drive NRST low: PINRSTF alone is the reset pin */
+    if ((flags & (RCC_CSR_BORRSTF | RCC_CSR_OBLRSTF)) || !(flags & warm)) {
+        return true;
+    }
+    return (request != 0) || (Bootloader_CheckForApplication() != BL_OK);
 }
+#endif
 
 /**
  * @brief  This function is executed in case of error occurrence.
@@ -149,3 +229,21 @@ void print_info() {
     print(msg);
     print("\r\n");
 }
+
+#if (SHA256_BENCHMARK)
+void print_benchmark() {
+    uint32_t fast;
+    uint32_t reference;
+    char     msg[100];
+
+    Sha256_Benchmark(&fast, &reference);
+    snprintf(msg,
+             100,
+             "%lu.%02lu cyc/B (reference %lu.%02lu cyc/B)",
+             fast / 100,
+             fast % 100,
+             reference / 100,
+             reference % 100);
+    println("SHA", msg);
+}
+#endif
@@ -0,0 +1,287 @@
+/**
+ *******************************************************************************
+ * @file   sha256.cpp
+ * @brief  Streaming SHA-256 (FIPS 180-4) tuned for the Cortex-M4.
+ *
+ * Fully unrolling the 64 rounds costs several KB of code, too much for the
+ * bootloader area: the rounds are unrolled by 8 instead, which is the period
+ * of the working variables rotation, so that no register moves are needed
+ * between rounds. Big endian loads compile to LDR + REV.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "sha256.h"
+#include "bootloader.h"
+#include <string.h>
+
+/* Private macros ------------------------------------------------------------*/
+#define ROTR(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+#define SIGMA0(x)     (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x)     (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define GAMMA0(x)     (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define GAMMA1(x)     (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z)   ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define SCHEDULE(i)   (W[(i)&15] += GAMMA1(W[((i)-2) & 15]) + W[((i)-7) & 15] + GAMMA0(W[((i)-15) & 15]))
+
+/** One round: the caller rotates the working variables names */
+#define ROUND(a, b, c, d, e, f, g, h, i, w)                                                                            \
+    do {                                                                                                               \
+        uint32_t t = h + SIGMA1(e) + CH(e, f, g) + K[i] + (w);                                                         \
+        d += t;                                                                                                        \
+        h = t + SIGMA0(a) + MAJ(a, b, c);                                                                              \
+    } while (0)
+
+/** Eight rounds, the working variables are back in place afterwards */
+#define ROUNDS8(i, W_)                                                                                                 \
+    do {                                                                                                               \
+        ROUND(a, b, c, d, e, f, g, h, (i) + 0, W_((i) + 0));                                                           \
+        ROUND(h, a, b, c, d, e, f, g, (i) + 1, W_((i) + 1));                                                           \
+        ROUND(g, h, a, b, c, d, e, f, (i) + 2, W_((i) + 2));                                                           \
+        ROUND(f, g, h, a, b, c, d, e, (i) + 3, W_((i) + 3));                                                           \
+        ROUND(e, f, g, h, a, b, c, d, (i) + 4, W_((i) + 4));                                                           \
+        ROUND(d, e, f, g, h, a, b, c, (i) + 5, W_((i) + 5));                                                           \
+        ROUND(c, d, e, f, g, h, a, b, (i) + 6, W_((i) + 6));                                                           \
+        ROUND(b, c, d, e, f, g, h, a, (i) + 7, W_((i) + 7));                                                           \
+    } while (0)
+
+#define W_LOAD(i)     W[(i)&15]
+#define W_SCHEDULE(i) SCHEDULE(i)
+
+/* Private variables ---------------------------------------------------------*/
+static const uint32_t K_init[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Round constants, copied to SRAM2 (no flash wait states) on first use */
+static uint32_t K[64] __attribute__((section(".sram2")));
+static bool     K_ready = false;
+
+/* Private functions ---------------------------------------------------------*/
+static inline uint32_t load_be32(const uint8_t* p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return __builtin_bswap32(v);
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, 4);
+}
+
+static void sha256_compress(uint32_t* state, const uint8_t* data, uint32_t blocks) {
+    uint32_t W[16];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    while (blocks--) {
+        for (uint32_t i = 0; i < 16; i++) {
+            W[i] = load_be32(data + 4 * i);
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (uint32_t i = 0; i < 16; i += 8) {
+            ROUNDS8(i, W_LOAD);
+        }
+        for (uint32_t i = 16; i < 64; i += 8) {
+            ROUNDS8(i, W_SCHEDULE);
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += SHA256_BLOCK_SIZE;
+    }
+}
+
+/**
+ * @brief  This function initializes a SHA-256 context.
+ * @param  ctx: context to be initialized
+ */
+void Sha256_Init(Sha256Context* ctx) {
+    static const uint32_t H_init[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    if (!K_ready) {
+        memcpy(K, K_init, sizeof(K));
+        K_ready = true;
+    }
+
+    memcpy(ctx->state, H_init, sizeof(ctx->state));
+    ctx->used   = 0;
+    ctx->length = 0;
+}
+
+/**
+ * @brief  This function hashes a block of data. Whole 64-byte blocks are
+ *         compressed straight from the given buffer, without copy.
+ * @param  ctx: SHA-256 context
+ * @param  data: pointer to the data, no alignment required
+ * @param  length: number of bytes
+ */
+void Sha256_Update(Sha256Context* ctx, const void* data, uint32_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t       n;
+
+    ctx->length += length;
+
+    /* Complete the pending block */
+    if (ctx->used) {
+        n = SHA256_BLOCK_SIZE - ctx->used;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        length -= n;
+        if (ctx->used < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_compress(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    /* Whole blocks from the caller's buffer */
+    n = length / SHA256_BLOCK_SIZE;
+    if (n) {
+        sha256_compress(ctx->state, p, n);
+        p += n * SHA256_BLOCK_SIZE;
+        length -= n * SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->block, p, length);
+    ctx->used = length;
+}
+
+/**
+ * @brief  This function finalizes the hash.
+ * @param  ctx: SHA-256 context, must be initialized again before reuse
+ * @param  digest: receives the ::SHA256_DIGEST_SIZE bytes digest
+ */
+void Sha256_Final(Sha256Context* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - ctx->used);
+        sha256_compress(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+    store_be32(ctx->block + 56, (uint32_t)(bits >> 32));
+    store_be32(ctx->block + 60, (uint32_t)bits);
+    sha256_compress(ctx->state, ctx->block, 1);
+
+    for (uint32_t i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+/**
+ * @brief  Known answer test with the FIPS 180-4 example messages.
+ * @return true if the implementation produces the expected digests
+ */
+bool Sha256_SelfTest(void) {
+    static const char    msg1[] = "abc";
+    static const char    msg2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    static const uint8_t dig1[] = {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+                                   0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+                                   0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    static const uint8_t dig2[] = {0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26,
+                                   0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff,
+                                   0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1};
+    Sha256Context        ctx;
+    uint8_t              digest[SHA256_DIGEST_SIZE];
+
+    Sha256_Init(&ctx);
+    Sha256_Update(&ctx, msg1, sizeof(msg1) - 1);
+    Sha256_Final(&ctx, digest);
+    if (memcmp(digest, dig1, sizeof(digest)) != 0) {
+        return false;
+    }
+
+    /* Fed byte by byte to exercise the partial block path */
+    Sha256_Init(&ctx);
+    for (uint32_t i = 0; i < sizeof(msg2) - 1; i++) {
+        Sha256_Update(&ctx, &msg2[i], 1);
+    }
+    Sha256_Final(&ctx, digest);
+    return memcmp(digest, dig2, sizeof(digest)) == 0;
+}
+
+#if (SHA256_BENCHMARK)
+/**
+ * @brief  Straightforward rolled implementation, kept as the benchmark
+ *         reference.
+ */
+static void sha256_compress_reference(uint32_t* state, const uint8_t* data) {
+    uint32_t w[64];
+    uint32_t v[8];
+
+    for (uint32_t i = 0; i < 16; i++) {
+        w[i] = load_be32(data + 4 * i);
+    }
+    for (uint32_t i = 16; i < 64; i++) {
+        w[i] = GAMMA1(w[i - 2]) + w[i - 7] + GAMMA0(w[i - 15]) + w[i - 16];
+    }
+    memcpy(v, state, sizeof(v));
+    for (uint32_t i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + SIGMA1(v[4]) + CH(v[4], v[5], v[6]) + K_init[i] + w[i];
+        uint32_t t2 = SIGMA0(v[0]) + MAJ(v[0], v[1], v[2]);
+        memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (uint32_t i = 0; i < 8; i++) {
+        state[i] += v[i];
+    }
+}
+
+/**
+ * @brief  This function measures the compression function throughput over
+ *         1 KB of data, for this implementation and for the reference one.
+ * @param  fast: cycles per byte of this implementation, times 100
+ * @param  reference: cycles per byte of the reference implementation, times 100
+ */
+void Sha256_Benchmark(uint32_t* fast, uint32_t* reference) {
+    static uint8_t data[1024];
+    Sha256Context  ctx;
+    uint32_t       start;
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    Sha256_Init(&ctx);
+    start = DWT->CYCCNT;
+    sha256_compress(ctx.state, data, sizeof(data) / SHA256_BLOCK_SIZE);
+    *fast = (DWT->CYCCNT - start) * 100 / sizeof(data);
+
+    start = DWT->CYCCNT;
+    for (uint32_t i = 0; i < sizeof(data); i += SHA256_BLOCK_SIZE) {
+        sha256_compress_reference(ctx.state, data + i);
+    }
+    *reference = (DWT->CYCCNT - start) * 100 / sizeof(data);
+}
+#endif
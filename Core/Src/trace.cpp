@@ -0,0 +1,69 @@
+/**
+ *******************************************************************************
+ * @file   trace.cpp
+ * @brief  SWO trace output, see trace.h.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "trace.h"
+
+/* Public functions ----------------------------------------------------------*/
+/**
+ * @brief  This function enables the cycle counter, the SWO output (PB3,
+ *         NRZ at ::ITM_SWO_SPEED) and the stimulus ports of the trace. A
+ *         debugger capturing the trace must use the same speed.
+ * @param  None
+ * @retval None
+ */
+void Trace_Init(void) {
+#if (USE_ITM)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    /* Asynchronous trace pin, NRZ (UART) encoding, no formatter */
+    DBGMCU->CR |= DBGMCU_CR_TRACE_IOEN;
+    TPI->SPPR = 2;
+    TPI->ACPR = SystemCoreClock / ITM_SWO_SPEED - 1;
+    TPI->FFCR = 0x100;
+
+    ITM->LAR = 0xC5ACCE55;
+    ITM->TCR = ITM_TCR_ITMENA_Msk | ITM_TCR_SYNCENA_Msk | (1UL << ITM_TCR_TraceBusID_Pos);
+    ITM->TPR = 0;
+    ITM->TER = (1UL << ITM_PORT_TEXT) | (1UL << ITM_PORT_EVENT);
+#endif
+}
+
+/**
+ * @brief  This function writes console text on ::ITM_PORT_TEXT, four
+ *         characters per stimulus port write.
+ * @param  str: text
+ * @param  length: length in bytes
+ * @retval None
+ */
+void Trace_Write(const char* str, uint32_t length) {
+#if (USE_ITM)
+    volatile ITM_Type* itm = ITM;
+
+    if (!(itm->TCR & ITM_TCR_ITMENA_Msk) || !(itm->TER & (1UL << ITM_PORT_TEXT))) {
+        return;
+    }
+    for (; length >= 4; str += 4, length -= 4) {
+        uint32_t word = (uint32_t)(uint8_t)str[0] | ((uint32_t)(uint8_t)str[1] << 8) |
+                        ((uint32_t)(uint8_t)str[2] << 16) | ((uint32_t)(uint8_t)str[3] << 24);
+
+        while (itm->PORT[ITM_PORT_TEXT].u32 == 0) {
+        }
+        itm->PORT[ITM_PORT_TEXT].u32 = word;
+    }
+    for (; length > 0; str++, length--) {
+        while (itm->PORT[ITM_PORT_TEXT].u32 == 0) {
+        }
+        itm->PORT[ITM_PORT_TEXT].u8 = (uint8_t)*str;
+    }
+#else
+    (void)str;
+    (void)length;
+#endif
+}
@@ -34,6 +34,11 @@ void MX_FATFS_Init(void)
 
   /* USER CODE BEGIN Init */
     /* additional user code for init */
+#if SD_USE_SDMMC
+    /* Same drive, on the SDMMC1 driver */
+    FATFS_UnLinkDriver(USERPath);
+    retUSER = FATFS_LinkDriver(&SDMMC_Driver, USERPath);
+#endif
 
   /* USER CODE END Init */
 }
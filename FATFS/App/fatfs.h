@@ -28,6 +28,7 @@
 #include "user_diskio.h" /* defines USER_Driver as external */
 
 /* USER CODE BEGIN Includes */
+#include "sdmmc_diskio.h" /* defines SDMMC_Driver as external */
 
 /* USER CODE END Includes */
 
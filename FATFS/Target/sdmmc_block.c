@@ -0,0 +1,418 @@
+/**
+ ******************************************************************************
+ * @file    sdmmc_block.c
+ * @brief   Block interface of sdmmc_diskio.c on the SDMMC1 peripheral: card
+ *          identification, 4-bit bus, single and multiple block transfers
+ *          moved by DMA2 channel 4.
+ *
+ * The HAL SD driver is not part of this project: the peripheral is driven
+ * through its registers, transfers are polled. Pins: D0-D3 PC8-PC11, CK PC12,
+ * CMD PD2 (AF12). The SDMMC kernel clock is HSI48 (CLK48SEL), 400 kHz during
+ * identification, 24 MHz afterwards.
+ ******************************************************************************
+ */
+
+#include "main.h"
+#include "sdmmc_diskio.h"
+#include <string.h>
+
+#if SD_USE_SDMMC
+
+/* Private define ------------------------------------------------------------*/
+/* SDMMC_CK = 48 MHz / (CLKDIV + 2) */
+#define SDMMC_CLKDIV_INIT  118           /* 400 kHz */
+#define SDMMC_CLKDIV_FAST  0             /* 24 MHz */
+/* Data timeout in SDMMC_CK periods: 500 ms at 24 MHz */
+#define SDMMC_DATA_TIMEOUT 12000000
+/* Command, card ready and transfer timeouts, in ms */
+#define SDMMC_CMD_TIMEOUT  100
+#define SDMMC_INIT_TIMEOUT 1000
+#define SDMMC_XFER_TIMEOUT 500
+/* DMA2 request of SDMMC1 on channel 4 */
+#define SDMMC_DMA_REQUEST  7
+
+/* Error bits of the R1 card status */
+#define R1_ERRORS          0xFDFFE008U
+/* Card state in R1: transfer */
+#define R1_STATE(r1)       (((r1) >> 9) & 0xF)
+#define R1_STATE_TRAN      4
+
+#define STA_CMD_DONE       (SDMMC_STA_CMDREND | SDMMC_STA_CCRCFAIL | SDMMC_STA_CTIMEOUT)
+#define STA_DATA_ERRORS    (SDMMC_STA_DCRCFAIL | SDMMC_STA_DTIMEOUT | SDMMC_STA_TXUNDERR | SDMMC_STA_RXOVERR)
+#define ICR_ALL            0x000005FFU
+
+/* Private typedef -----------------------------------------------------------*/
+/* Response expected from a command */
+typedef enum
+{
+    RESP_NONE,
+    RESP_R1,    /* Card status */
+    RESP_R2,    /* CID or CSD, long */
+    RESP_R3,    /* OCR, no CRC */
+    RESP_R6,    /* Published RCA */
+    RESP_R7,    /* Interface condition */
+} SD_Response;
+
+/* Private variables ---------------------------------------------------------*/
+/* Relative card address, shifted into the command argument */
+static DWORD Rca;
+/* Block addressing (SDHC/SDXC) */
+static BYTE HighCapacity;
+/* Word aligned copy of a sector for the buffers DMA cannot reach */
+static DWORD Bounce[512 / sizeof(DWORD)];
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Sends a command and waits for its response
+  * @param  index: Command index
+  * @param  arg: Command argument
+  * @param  resp: Expected response
+  * @retval 0 on success
+  */
+static int SD_Command(BYTE index, DWORD arg, SD_Response resp)
+{
+    DWORD start = HAL_GetTick();
+    DWORD wait  = (resp == RESP_NONE) ? 0 : (resp == RESP_R2) ? SDMMC_CMD_WAITRESP : SDMMC_CMD_WAITRESP_0;
+    DWORD done  = (resp == RESP_NONE) ? SDMMC_STA_CMDSENT : STA_CMD_DONE;
+    DWORD sta;
+
+    SDMMC1->ICR = ICR_ALL;
+    SDMMC1->ARG = arg;
+    SDMMC1->CMD = index | wait | SDMMC_CMD_CPSMEN;
+    while (((sta = SDMMC1->STA) & done) == 0) {
+        if (HAL_GetTick() - start > SDMMC_CMD_TIMEOUT) {
+            return -1;
+        }
+    }
+    SDMMC1->ICR = ICR_ALL;
+
+    if (resp == RESP_NONE) {
+        return 0;
+    }
+    if ((sta & SDMMC_STA_CTIMEOUT) || ((sta & SDMMC_STA_CCRCFAIL) && (resp != RESP_R3))) {
+        return -1;
+    }
+    if ((resp != RESP_R2) && (resp != RESP_R3) && (SDMMC1->RESPCMD != index)) {
+        return -1;
+    }
+    if ((resp == RESP_R1) && (SDMMC1->RESP1 & R1_ERRORS)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+  * @brief  Sends an application specific command (CMD55 prefix)
+  * @param  index: Command index
+  * @param  arg: Command argument
+  * @param  resp: Expected response
+  * @retval 0 on success
+  */
+static int SD_AppCommand(BYTE index, DWORD arg, SD_Response resp)
+{
+    if (SD_Command(55, Rca, RESP_R1) != 0) {
+        return -1;
+    }
+    return SD_Command(index, arg, resp);
+}
+
+/**
+  * @brief  Waits until the card is back in the transfer state, i.e. done
+  *         programming (SDMMC1 has no busy detection on D0)
+  * @param  timeout: Timeout in ms
+  * @retval 0 on success
+  */
+static int SD_WaitReady(DWORD timeout)
+{
+    DWORD start = HAL_GetTick();
+
+    do {
+        if ((SD_Command(13, Rca, RESP_R1) == 0) && (R1_STATE(SDMMC1->RESP1) == R1_STATE_TRAN)) {
+            return 0;
+        }
+    } while (HAL_GetTick() - start < timeout);
+    return -1;
+}
+
+/**
+  * @brief  Configures the pins, the clocks and the peripheral at the
+  *         identification clock
+  * @retval 0 on success
+  */
+static int SD_HardwareInit(void)
+{
+    GPIO_InitTypeDef gpio = {0};
+    DWORD            start;
+
+    __HAL_RCC_GPIOC_CLK_ENABLE();
+    __HAL_RCC_GPIOD_CLK_ENABLE();
+    gpio.Mode      = GPIO_MODE_AF_PP;
+    gpio.Speed     = GPIO_SPEED_FREQ_VERY_HIGH;
+    gpio.Alternate = GPIO_AF12_SDMMC1;
+    gpio.Pull      = GPIO_NOPULL;
+    gpio.Pin       = GPIO_PIN_12;
+    HAL_GPIO_Init(GPIOC, &gpio);
+    gpio.Pull = GPIO_PULLUP;
+    gpio.Pin  = GPIO_PIN_8 | GPIO_PIN_9 | GPIO_PIN_10 | GPIO_PIN_11;
+    HAL_GPIO_Init(GPIOC, &gpio);
+    gpio.Pin = GPIO_PIN_2;
+    HAL_GPIO_Init(GPIOD, &gpio);
+
+    /* 48 MHz kernel clock */
+    SET_BIT(RCC->CRRCR, RCC_CRRCR_HSI48ON);
+    start = HAL_GetTick();
+    while (!READ_BIT(RCC->CRRCR, RCC_CRRCR_HSI48RDY)) {
+        if (HAL_GetTick() - start > SDMMC_CMD_TIMEOUT) {
+            return -1;
+        }
+    }
+    MODIFY_REG(RCC->CCIPR, RCC_CCIPR_CLK48SEL, 0);
+
+    __HAL_RCC_SDMMC1_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    __HAL_RCC_SDMMC1_FORCE_RESET();
+    __HAL_RCC_SDMMC1_RELEASE_RESET();
+    MODIFY_REG(DMA2_CSELR->CSELR, DMA_CSELR_C4S, SDMMC_DMA_REQUEST << DMA_CSELR_C4S_Pos);
+
+    SDMMC1->CLKCR = SDMMC_CLKDIV_INIT;
+    SDMMC1->POWER = SDMMC_POWER_PWRCTRL;
+    SDMMC1->CLKCR |= SDMMC_CLKCR_CLKEN;
+    /* 74 clocks before the first command */
+    HAL_Delay(2);
+    return 0;
+}
+
+/**
+  * @brief  Arms DMA2 channel 4 for a transfer from or to the FIFO
+  * @param  buff: Word aligned buffer
+  * @param  count: Number of sectors
+  * @param  toCard: Direction
+  * @retval None
+  */
+static void SD_DmaStart(const BYTE* buff, UINT count, BYTE toCard)
+{
+    DMA2_Channel4->CCR   = 0;
+    DMA2->IFCR           = DMA_IFCR_CGIF4;
+    DMA2_Channel4->CPAR  = (DWORD)&SDMMC1->FIFO;
+    DMA2_Channel4->CMAR  = (DWORD)buff;
+    DMA2_Channel4->CNDTR = count * (512 / sizeof(DWORD));
+    DMA2_Channel4->CCR   = DMA_CCR_PL | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_MINC | (toCard ? DMA_CCR_DIR : 0);
+    DMA2_Channel4->CCR |= DMA_CCR_EN;
+}
+
+/**
+  * @brief  Configures the data path for blocks of 512 bytes
+  * @param  count: Number of sectors
+  * @param  fromCard: Direction
+  * @retval None
+  */
+static void SD_DataStart(UINT count, BYTE fromCard)
+{
+    SDMMC1->DTIMER = SDMMC_DATA_TIMEOUT;
+    SDMMC1->DLEN   = count * 512;
+    SDMMC1->DCTRL  = (9 << SDMMC_DCTRL_DBLOCKSIZE_Pos) | SDMMC_DCTRL_DMAEN | (fromCard ? SDMMC_DCTRL_DTDIR : 0) |
+                    SDMMC_DCTRL_DTEN;
+}
+
+/**
+  * @brief  Waits for the end of the data transfer, and of the DMA when
+  *         reading, then stops a multiple block transfer
+  * @param  count: Number of sectors
+  * @param  fromCard: Direction
+  * @retval 0 on success
+  */
+static int SD_DataWait(UINT count, BYTE fromCard)
+{
+    DWORD start = HAL_GetTick();
+    DWORD sta;
+    int   res = 0;
+
+    while (!((sta = SDMMC1->STA) & (SDMMC_STA_DATAEND | STA_DATA_ERRORS)) ||
+           (fromCard && !(sta & STA_DATA_ERRORS) && !(DMA2->ISR & (DMA_ISR_TCIF4 | DMA_ISR_TEIF4)))) {
+        if (HAL_GetTick() - start > SDMMC_XFER_TIMEOUT) {
+            res = -1;
+            break;
+        }
+    }
+    if ((sta & STA_DATA_ERRORS) || (DMA2->ISR & DMA_ISR_TEIF4)) {
+        res = -1;
+    }
+    DMA2_Channel4->CCR = 0;
+    SDMMC1->DCTRL      = 0;
+    SDMMC1->ICR        = ICR_ALL;
+
+    if ((count > 1) && (SD_Command(12, 0, RESP_R1) != 0)) {
+        res = -1;
+    }
+    return res;
+}
+
+/**
+  * @brief  Reads sectors into a word aligned buffer
+  * @param  buff: Word aligned buffer
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors
+  * @retval 0 on success
+  */
+static int SD_ReadAligned(BYTE* buff, DWORD sector, UINT count)
+{
+    DWORD address = HighCapacity ? sector : sector * 512;
+
+    SDMMC1->DCTRL = 0;
+    SD_DmaStart(buff, count, 0);
+    SD_DataStart(count, 1);
+    if (SD_Command((count > 1) ? 18 : 17, address, RESP_R1) != 0) {
+        DMA2_Channel4->CCR = 0;
+        SDMMC1->DCTRL      = 0;
+        return -1;
+    }
+    return SD_DataWait(count, 1);
+}
+
+/**
+  * @brief  Writes sectors from a word aligned buffer
+  * @param  buff: Word aligned buffer
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors
+  * @retval 0 on success
+  */
+static int SD_WriteAligned(const BYTE* buff, DWORD sector, UINT count)
+{
+    DWORD address = HighCapacity ? sector : sector * 512;
+
+    if (SD_Command((count > 1) ? 25 : 24, address, RESP_R1) != 0) {
+        return -1;
+    }
+    SD_DmaStart(buff, count, 1);
+    SD_DataStart(count, 0);
+    if (SD_DataWait(count, 0) != 0) {
+        return -1;
+    }
+    /* Card programming, the next command would be rejected */
+    return SD_WaitReady(SDMMC_XFER_TIMEOUT);
+}
+
+/* Exported functions ------------------------------------------------------- */
+/**
+  * @brief  Identifies the card, selects it and switches to the 4-bit bus
+  * @param  info: Capacity and addressing of the card
+  * @retval 0 on success
+  */
+int SD_BlockInit(SD_CardInfo* info)
+{
+    DWORD start, ocr, csd[3];
+    BYTE  v2;
+
+    Rca = 0;
+    if ((SD_HardwareInit() != 0) || (SD_Command(0, 0, RESP_NONE) != 0)) {
+        return -1;
+    }
+    /* SD v2 answers the interface condition: 2.7-3.6 V, check pattern */
+    v2 = (SD_Command(8, 0x1AA, RESP_R7) == 0) && ((SDMMC1->RESP1 & 0xFFF) == 0x1AA);
+
+    /* Power up, asking for high capacity on v2 cards */
+    start = HAL_GetTick();
+    do {
+        if (HAL_GetTick() - start > SDMMC_INIT_TIMEOUT) {
+            return -1;
+        }
+        if (SD_AppCommand(41, 0x80100000 | (v2 ? 0x40000000 : 0), RESP_R3) != 0) {
+            return -1;
+        }
+        ocr = SDMMC1->RESP1;
+    } while (!(ocr & 0x80000000));
+    HighCapacity = (ocr & 0x40000000) ? 1 : 0;
+
+    /* CID, then relative address */
+    if ((SD_Command(2, 0, RESP_R2) != 0) || (SD_Command(3, 0, RESP_R6) != 0)) {
+        return -1;
+    }
+    Rca = SDMMC1->RESP1 & 0xFFFF0000;
+
+    /* Capacity from the CSD */
+    if (SD_Command(9, Rca, RESP_R2) != 0) {
+        return -1;
+    }
+    csd[0] = SDMMC1->RESP1;
+    csd[1] = SDMMC1->RESP2;
+    csd[2] = SDMMC1->RESP3;
+    if ((csd[0] >> 30) == 1) {
+        /* CSD 2.0: C_SIZE[69:48] in 512 KB units */
+        info->sectors = ((((csd[1] & 0x3F) << 16) | (csd[2] >> 16)) + 1) << 10;
+    } else {
+        /* CSD 1.0: (C_SIZE + 1) << (C_SIZE_MULT + 2 + READ_BL_LEN) bytes */
+        DWORD size = ((csd[1] & 0x3FF) << 2) | (csd[2] >> 30);
+        DWORD mult = (csd[2] >> 15) & 0x7;
+        DWORD len  = (csd[1] >> 16) & 0xF;
+
+        info->sectors = (size + 1) << (mult + 2 + len - 9);
+    }
+    info->highCapacity = HighCapacity;
+
+    /* Select, 512 bytes blocks, 4-bit bus, full speed */
+    if ((SD_Command(7, Rca, RESP_R1) != 0) || (SD_WaitReady(SDMMC_CMD_TIMEOUT) != 0)) {
+        return -1;
+    }
+    if (!HighCapacity && (SD_Command(16, 512, RESP_R1) != 0)) {
+        return -1;
+    }
+    if (SD_AppCommand(6, 2, RESP_R1) != 0) {
+        return -1;
+    }
+    SDMMC1->CLKCR = SDMMC_CLKDIV_FAST | SDMMC_CLKCR_WIDBUS_0 | SDMMC_CLKCR_HWFC_EN | SDMMC_CLKCR_CLKEN;
+    return 0;
+}
+
+/**
+  * @brief  Reads sectors
+  * @param  buff: Data buffer
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors
+  * @retval 0 on success
+  */
+int SD_BlockRead(BYTE* buff, DWORD sector, UINT count)
+{
+    if (((DWORD)buff & 3) == 0) {
+        return SD_ReadAligned(buff, sector, count);
+    }
+    for (; count > 0; count--, sector++, buff += 512) {
+        if (SD_ReadAligned((BYTE*)Bounce, sector, 1) != 0) {
+            return -1;
+        }
+        memcpy(buff, Bounce, 512);
+    }
+    return 0;
+}
+
+/**
+  * @brief  Writes sectors
+  * @param  buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors
+  * @retval 0 on success
+  */
+int SD_BlockWrite(const BYTE* buff, DWORD sector, UINT count)
+{
+    if (((DWORD)buff & 3) == 0) {
+        return SD_WriteAligned(buff, sector, count);
+    }
+    for (; count > 0; count--, sector++, buff += 512) {
+        memcpy(Bounce, buff, 512);
+        if (SD_WriteAligned((const BYTE*)Bounce, sector, 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+  * @brief  Checks that the card is ready, writes already wait for the end of
+  *         programming
+  * @retval 0 on success
+  */
+int SD_BlockSync(void)
+{
+    return SD_WaitReady(SDMMC_XFER_TIMEOUT);
+}
+
+#endif /* SD_USE_SDMMC */
@@ -0,0 +1,137 @@
+/**
+ ******************************************************************************
+ * @file    sdmmc_diskio.c
+ * @brief   FatFs driver of an SD card on the SDMMC1 4-bit bus, linked in
+ *          place of USER_Driver when SD_USE_SDMMC is set in main.h.
+ ******************************************************************************
+ */
+
+#include "sdmmc_diskio.h"
+
+#ifndef SD_USE_SDMMC
+#define SD_USE_SDMMC 0
+#endif
+
+#if SD_USE_SDMMC
+
+/* Private variables ---------------------------------------------------------*/
+/* Disk status */
+static volatile DSTATUS Stat = STA_NOINIT;
+/* Card identified at initialization */
+static SD_CardInfo Card;
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Initializes a Drive
+  * @param  pdrv: Physical drive number (0..)
+  * @retval DSTATUS: Operation status
+  */
+static DSTATUS SDMMC_initialize(BYTE pdrv)
+{
+    if (pdrv != 0) {
+        return STA_NOINIT;
+    }
+    Stat = (SD_BlockInit(&Card) == 0) ? 0 : STA_NOINIT;
+    return Stat;
+}
+
+/**
+  * @brief  Gets Disk Status
+  * @param  pdrv: Physical drive number (0..)
+  * @retval DSTATUS: Operation status
+  */
+static DSTATUS SDMMC_status(BYTE pdrv)
+{
+    return (pdrv != 0) ? STA_NOINIT : Stat;
+}
+
+/**
+  * @brief  Reads Sector(s)
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SDMMC_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+    if ((pdrv != 0) || (count == 0)) {
+        return RES_PARERR;
+    }
+    if (Stat & STA_NOINIT) {
+        return RES_NOTRDY;
+    }
+    return (SD_BlockRead(buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
+
+#if _USE_WRITE == 1
+/**
+  * @brief  Writes Sector(s)
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SDMMC_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+    if ((pdrv != 0) || (count == 0)) {
+        return RES_PARERR;
+    }
+    if (Stat & STA_NOINIT) {
+        return RES_NOTRDY;
+    }
+    return (SD_BlockWrite(buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
+#endif /* _USE_WRITE == 1 */
+
+#if _USE_IOCTL == 1
+/**
+  * @brief  I/O control operation
+  * @param  pdrv: Physical drive number (0..)
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SDMMC_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    if (pdrv != 0) {
+        return RES_PARERR;
+    }
+    if (Stat & STA_NOINIT) {
+        return RES_NOTRDY;
+    }
+    switch (cmd) {
+        case CTRL_SYNC:
+            return (SD_BlockSync() == 0) ? RES_OK : RES_ERROR;
+        case GET_SECTOR_COUNT:
+            *(DWORD*)buff = Card.sectors;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = 512;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            /* Erase block size unknown without reading the SD status */
+            *(DWORD*)buff = 1;
+            return RES_OK;
+        default:
+            return RES_PARERR;
+    }
+}
+#endif /* _USE_IOCTL == 1 */
+
+/* Exported variables --------------------------------------------------------*/
+Diskio_drvTypeDef SDMMC_Driver =
+{
+  SDMMC_initialize,
+  SDMMC_status,
+  SDMMC_read,
+#if  _USE_WRITE == 1
+  SDMMC_write,
+#endif /* _USE_WRITE == 1 */
+#if  _USE_IOCTL == 1
+  SDMMC_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+#endif /* SD_USE_SDMMC */
@@ -0,0 +1,43 @@
+/**
+ ******************************************************************************
+ * @file    sdmmc_diskio.h
+ * @brief   FatFs driver of an SD card on the SDMMC1 4-bit bus (SD_USE_SDMMC),
+ *          and the block interface it is built on.
+ *
+ * The driver (sdmmc_diskio.c) does not depend on the HAL. The block interface
+ * is implemented by sdmmc_block.c on the target, and by a card image on the
+ * host (Tools/fatbench/cachebench.c).
+ ******************************************************************************
+ */
+
+#ifndef _SDMMC_DISKIO_H
+#define _SDMMC_DISKIO_H
+
+#include "integer.h" //from FatFs middleware library
+#include "diskio.h" //from FatFs middleware library
+#include "ff_gen_drv.h" //from FatFs middleware library
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Card identified by SD_BlockInit */
+typedef struct
+{
+    DWORD sectors;       /* Capacity in 512 bytes sectors */
+    BYTE  highCapacity;  /* SDHC/SDXC: block addressing */
+} SD_CardInfo;
+
+/* Block interface, each function returns 0 on success */
+int SD_BlockInit(SD_CardInfo* info);
+int SD_BlockRead(BYTE* buff, DWORD sector, UINT count);
+int SD_BlockWrite(const BYTE* buff, DWORD sector, UINT count);
+int SD_BlockSync(void);
+
+extern Diskio_drvTypeDef SDMMC_Driver;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
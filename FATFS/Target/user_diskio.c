@@ -36,16 +36,116 @@
 /* Includes ------------------------------------------------------------------*/
 #include <string.h>
 #include "ff_gen_drv.h"
+#include "fatfs.h"
 
 #include "user_diskio_spi.h"
 
-/* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+/* Sectors kept by the read cache (SD_CACHE_SECTORS in main.h), 0: disabled */
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS 0
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+#if SD_CACHE_SECTORS > 0
+/* Cached copy of a sector read into the file system window */
+typedef struct
+{
+    DWORD sector;        /* Sector address in LBA */
+    DWORD stamp;         /* Last access, 0 if the entry is free */
+    DWORD data[_MIN_SS / sizeof(DWORD)];
+} CacheEntry;
+#endif
 
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
 
+#if SD_CACHE_SECTORS > 0
+/* Read cache: FAT, directory and boot sectors */
+static CacheEntry Cache[SD_CACHE_SECTORS];
+/* Access counter, orders the entries for LRU replacement */
+static DWORD CacheClock;
+/* Window reads served from the cache / from the card */
+static DWORD CacheHits, CacheMisses;
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Finds a sector in the cache
+  * @param  sector: Sector address (LBA)
+  * @retval Cache entry holding the sector, NULL if not cached
+  */
+static CacheEntry* Cache_Find(DWORD sector)
+{
+    for (UINT i = 0; i < SD_CACHE_SECTORS; i++) {
+        if ((Cache[i].stamp != 0) && (Cache[i].sector == sector)) {
+            return &Cache[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+  * @brief  Stores a sector in the cache, replacing a free or the least
+  *         recently used entry
+  * @param  sector: Sector address (LBA)
+  * @param  buff: Sector content
+  * @retval None
+  */
+static void Cache_Store(DWORD sector, const BYTE* buff)
+{
+    CacheEntry* entry = &Cache[0];
+
+    for (UINT i = 1; i < SD_CACHE_SECTORS; i++) {
+        if (Cache[i].stamp < entry->stamp) {
+            entry = &Cache[i];
+        }
+    }
+    entry->sector = sector;
+    entry->stamp  = ++CacheClock;
+    memcpy(entry->data, buff, _MIN_SS);
+}
+
+/**
+  * @brief  Keeps the cache coherent with sectors written to the card
+  * @param  buff: Data written
+  * @param  sector: First sector address (LBA)
+  * @param  count: Number of sectors
+  * @param  res: Result of the write, the cached copies are dropped on error
+  * @retval None
+  */
+static void Cache_Write(const BYTE* buff, DWORD sector, UINT count, DRESULT res)
+{
+    for (UINT i = 0; i < SD_CACHE_SECTORS; i++) {
+        if ((Cache[i].stamp != 0) && (Cache[i].sector - sector < count)) {
+            if (res == RES_OK) {
+                memcpy(Cache[i].data, buff + (Cache[i].sector - sector) * _MIN_SS, _MIN_SS);
+            } else {
+                Cache[i].stamp = 0;
+            }
+        }
+    }
+}
+#endif /* SD_CACHE_SECTORS > 0 */
+
+/* Exported functions ------------------------------------------------------- */
+/**
+  * @brief  Gets the counters of the read cache
+  * @param  hits: Window reads served from the cache
+  * @param  misses: Window reads served from the card
+  * @retval None
+  */
+void USER_CacheStats(DWORD* hits, DWORD* misses)
+{
+#if SD_CACHE_SECTORS > 0
+    *hits   = CacheHits;
+    *misses = CacheMisses;
+#else
+    *hits   = 0;
+    *misses = 0;
+#endif
+}
+
 /* USER CODE END DECL */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -84,6 +184,11 @@ DSTATUS USER_initialize (
 )
 {
   /* USER CODE BEGIN INIT */
+#if SD_CACHE_SECTORS > 0
+    /* New or re-inserted card */
+    memset(Cache, 0, sizeof(Cache));
+    CacheClock = 0;
+#endif
     return USER_SPI_initialize(pdrv);
   /* USER CODE END INIT */
 }
@@ -118,6 +223,27 @@ DRESULT USER_read (
 )
 {
   /* USER CODE BEGIN READ */
+#if SD_CACHE_SECTORS > 0
+    /* Only the single sector reads into the window are cached: file data is
+       streamed once and would evict the FAT and directory sectors */
+    if ((count == 1) && (buff == USERFatFS.win)) {
+        CacheEntry* entry = Cache_Find(sector);
+        DRESULT     res;
+
+        if (entry != NULL) {
+            CacheHits++;
+            entry->stamp = ++CacheClock;
+            memcpy(buff, entry->data, _MIN_SS);
+            return RES_OK;
+        }
+        CacheMisses++;
+        res = USER_SPI_read(pdrv, buff, sector, count);
+        if (res == RES_OK) {
+            Cache_Store(sector, buff);
+        }
+        return res;
+    }
+#endif
     return USER_SPI_read(pdrv, buff, sector, count);
   /* USER CODE END READ */
 }
@@ -139,8 +265,13 @@ DRESULT USER_write (
 )
 {
   /* USER CODE BEGIN WRITE */
-    /* USER CODE HERE */
-    return USER_SPI_write(pdrv, buff, sector, count);
+    DRESULT res = USER_SPI_write(pdrv, buff, sector, count);
+
+#if SD_CACHE_SECTORS > 0
+    /* Write-through */
+    Cache_Write(buff, sector, count, res);
+#endif
+    return res;
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
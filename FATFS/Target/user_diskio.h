@@ -34,6 +34,7 @@
 /* Exported constants --------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 extern Diskio_drvTypeDef  USER_Driver;
+void USER_CacheStats(DWORD* hits, DWORD* misses);
 
 /* USER CODE END 0 */
 
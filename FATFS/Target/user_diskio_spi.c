@@ -591,6 +591,16 @@ inline DRESULT USER_SPI_ioctl(BYTE  drv, /* Physical drive number (0) */
             }
             break;
 
+        case MMC_GET_TYPE: /* Get card type flags (1 byte) */
+            *(BYTE*)buff = CardType;
+            res          = RES_OK;
+            break;
+
+        case MMC_GET_CSD: /* Receive CSD as a data block (16 bytes) */
+            if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(buff, 16))
+                res = RES_OK;
+            break;
+
         case CTRL_TRIM: /* Erase a block of sectors (used when _USE_ERASE == 1) */
             if (!(CardType & CT_SDC))
                 break; /* Check if the card is SDC */
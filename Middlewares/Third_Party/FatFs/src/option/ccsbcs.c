@@ -0,0 +1,88 @@
+/*------------------------------------------------------------------------*/
+/* Unicode - OEM code bidirectional converter and upper-case conversion   */
+/* for FatFs R0.12c, single byte code page 850 (Latin 1)                  */
+/*------------------------------------------------------------------------*/
+/* Needed when LFN is enabled (_USE_LFN >= 1), which exFAT requires.
+/  ff_convert() maps the code page 850 (_CODE_PAGE) to Unicode and back.
+/  ff_wtoupper() covers ASCII, Latin-1, Latin Extended-A, basic Greek and
+/  Cyrillic and full width Latin letters; other characters are returned
+/  unchanged, i.e. compared case sensitively.
+*/
+
+#include "../ff.h"
+
+
+#if _USE_LFN != 0
+
+#if _CODE_PAGE != 850
+#error "ccsbcs.c only provides the code page 850"
+#endif
+
+/* Unicode of the OEM codes 0x80-0xFF */
+static const WCHAR Tbl[] = {
+	0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+	0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+	0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+	0x00FF, 0x00D6, 0x00DC, 0x00F8, 0x00A3, 0x00D8, 0x00D7, 0x0192,
+	0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+	0x00BF, 0x00AE, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x00C1, 0x00C2, 0x00C0,
+	0x00A9, 0x2563, 0x2551, 0x2557, 0x255D, 0x00A2, 0x00A5, 0x2510,
+	0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x00E3, 0x00C3,
+	0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x00A4,
+	0x00F0, 0x00D0, 0x00CA, 0x00CB, 0x00C8, 0x0131, 0x00CD, 0x00CE,
+	0x00CF, 0x2518, 0x250C, 0x2588, 0x2584, 0x00A6, 0x00CC, 0x2580,
+	0x00D3, 0x00DF, 0x00D4, 0x00D2, 0x00F5, 0x00D5, 0x00B5, 0x00FE,
+	0x00DE, 0x00DA, 0x00DB, 0x00D9, 0x00FD, 0x00DD, 0x00AF, 0x00B4,
+	0x00AD, 0x00B1, 0x2017, 0x00BE, 0x00B6, 0x00A7, 0x00F7, 0x00B8,
+	0x00B0, 0x00A8, 0x00B7, 0x00B9, 0x00B3, 0x00B2, 0x25A0, 0x00A0
+};
+
+
+WCHAR ff_convert (	/* Converted character, Returns zero on error */
+	WCHAR	chr,	/* Character code to be converted */
+	UINT	dir		/* 0: Unicode to OEM code, 1: OEM code to Unicode */
+)
+{
+	WCHAR c;
+
+
+	if (chr < 0x80) {	/* ASCII */
+		c = chr;
+
+	} else {
+		if (dir) {		/* OEM code to Unicode */
+			c = (chr >= 0x100) ? 0 : Tbl[chr - 0x80];
+
+		} else {		/* Unicode to OEM code */
+			for (c = 0; c < 0x80; c++) {
+				if (chr == Tbl[c]) break;
+			}
+			c = (c + 0x80) & 0xFF;
+		}
+	}
+
+	return c;
+}
+
+
+WCHAR ff_wtoupper (	/* Returns upper converted character */
+	WCHAR chr		/* Unicode character to be upper converted */
+)
+{
+	if (chr >= 'a' && chr <= 'z') return chr - 0x20;								/* ASCII */
+	if (chr < 0x80) return chr;
+	if (chr >= 0xE0 && chr <= 0xFE && chr != 0xF7) return chr - 0x20;				/* Latin-1 */
+	if (chr == 0xFF) return 0x178;
+	if (chr == 0x131) return 'I';													/* Latin Extended-A */
+	if ((chr >= 0x100 && chr <= 0x137) || (chr >= 0x14A && chr <= 0x177)) return chr & ~1;
+	if ((chr >= 0x139 && chr <= 0x148) || (chr >= 0x179 && chr <= 0x17E)) return (chr & 1) ? chr : chr - 1;
+	if (chr == 0x3C2) return 0x3A3;													/* Greek */
+	if (chr >= 0x3B1 && chr <= 0x3C9) return chr - 0x20;
+	if (chr >= 0x430 && chr <= 0x44F) return chr - 0x20;							/* Cyrillic */
+	if (chr >= 0x450 && chr <= 0x45F) return chr - 0x50;
+	if (chr >= 0xFF41 && chr <= 0xFF5A) return chr - 0x20;							/* Full width Latin */
+	return chr;
+}
+
+#endif /* _USE_LFN != 0 */
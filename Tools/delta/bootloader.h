@@ -0,0 +1,50 @@
+/**
+ *******************************************************************************
+ * @file   bootloader.h
+ * @brief  Host stand-in for the bootloader API used by Core/Src/delta.cpp
+ *         (Tools/delta): flash geometry, CRC, page erase and programming, and
+ *         the update journal. The functions are implemented by deltagen.cpp
+ *         on top of a flash image mapped at ::APP_ADDRESS.
+ *******************************************************************************
+ */
+
+#ifndef __BOOTLOADER_H
+#define __BOOTLOADER_H
+
+#include <stdint.h>
+
+#define __IO volatile
+
+/** Flash of the STM32L452RE */
+#define FLASH_BASE      (uint32_t)0x08000000
+#define FLASH_SIZE      (uint32_t)(512 * 1024)
+/** Start address of application space in flash */
+#define APP_ADDRESS     (uint32_t)0x08008000
+/** Size of the application space of the STM32L452RE */
+#define APP_SIZE        (FLASH_BASE + FLASH_SIZE - APP_ADDRESS)
+/** Flash page size of the STM32L4 */
+#define FLASH_PAGE_SIZE (uint32_t)0x800
+
+/** Bootloader error codes */
+enum eBootloaderErrorCodes
+{
+    BL_OK = 0,      /*!< No error */
+    BL_NO_APP,      /*!< No application found in flash */
+    BL_SIZE_ERROR,  /*!< New application is too large for flash */
+    BL_CHKS_ERROR,  /*!< Application checksum error */
+    BL_ERASE_ERROR, /*!< Flash erase error */
+    BL_WRITE_ERROR, /*!< Flash write error */
+};
+
+uint8_t  Bootloader_Init(void);
+uint8_t  Bootloader_ErasePages(uint32_t address, uint32_t count);
+uint8_t  Bootloader_FlashBegin(void);
+uint8_t  Bootloader_FlashSeek(uint32_t address);
+uint8_t  Bootloader_FlashBuffer(const void* data, uint32_t length);
+uint8_t  Bootloader_FlashEnd(void);
+uint8_t  Bootloader_JournalCommit(uint32_t page);
+uint8_t  Bootloader_JournalResume(uint32_t size, uint32_t crc, uint32_t* pages);
+uint8_t  Bootloader_CheckSize(uint32_t appsize);
+uint32_t Bootloader_CRC32(uint32_t crc, const void* data, uint32_t length);
+
+#endif /* __BOOTLOADER_H */
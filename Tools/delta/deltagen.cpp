@@ -0,0 +1,663 @@
+/**
+ *******************************************************************************
+ * @file   deltagen.cpp
+ * @brief  Host tool generating the delta patches of the bootloader
+ *         (Core/Inc/delta.h) from two application binaries, and testing them
+ *         with the patch code of the bootloader.
+ *
+ * Patches are applied in place, page by page: a command may only read source
+ * bytes in the page being rebuilt or above it. Matches are searched with a
+ * hash of 4 byte sequences among the source positions allowed at each target
+ * position, and extended with ADD commands while the bytes mostly match, which
+ * covers code moved by a few bytes and its shifted addresses.
+ *
+ * Every patch made is applied by Core/Src/delta.cpp, linked with the host
+ * stand-ins of this directory (bootloader.h, ff.h) over a flash image mapped
+ * at the application address, before it is written. `test` also cuts the
+ * power at each flash operation (page erase, page programming, journal
+ * commit), leaving the page being erased or programmed with random content,
+ * then boots again until the update completes, and checks the image, the
+ * erased tail and the record.
+ *
+ * Build from the repository root (the include order selects the stand-ins of
+ * this directory):
+ * @code
+ * g++ -std=c++17 -O2 -ITools/delta -ICore/Inc Tools/delta/deltagen.cpp Core/Src/delta.cpp -o deltagen
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * deltagen make old.bin new.bin Scale.dif
+ * deltagen test old.bin new.bin [--step n] [--seed s]   # power cut at every n-th flash operation
+ * deltagen selftest [--seed s]                          # same on generated image pairs
+ * @endcode
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "bootloader.h"
+#include "delta.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+/* Private defines -----------------------------------------------------------*/
+/** Shortest match worth a SEEK and a COPY */
+#define MIN_MATCH      12
+/** Candidate source positions examined per target position */
+#define MAX_CANDIDATES 64
+/** Longest ADD extension examined after a match */
+#define MAX_EXTENSION  4096
+/** Size of the journal, as in the bootloader record page */
+#define JOURNAL_ENTRIES_MAX ((FLASH_PAGE_SIZE - 32) / 8)
+
+/* Private typedef -----------------------------------------------------------*/
+/** Thrown by a flash operation when the power is cut */
+struct PowerCut
+{
+};
+
+/* Private variables ---------------------------------------------------------*/
+/** Flash of the application, mapped at ::APP_ADDRESS */
+static uint8_t* flash;
+/** Programming address of ::Bootloader_FlashBuffer */
+static uint32_t seek;
+
+/** Update journal and bootloader record */
+static struct
+{
+    bool     open;
+    bool     valid; /*!< Record of the installed image */
+    uint32_t size;
+    uint32_t crc;
+    bool     committed[JOURNAL_ENTRIES_MAX];
+} journal;
+
+/** Flash operations counted, and the one during which the power is cut */
+static long         operations;
+static long         cutAt = -1;
+static std::mt19937 rng;
+/** Erase cycles of each page during an update */
+static uint32_t erases[APP_SIZE / FLASH_PAGE_SIZE];
+
+/* Private functions ---------------------------------------------------------*/
+static void fail(const char* what, const char* name) {
+    fprintf(stderr, "deltagen: %s: %s\n", what, name);
+    exit(1);
+}
+
+static std::vector<uint8_t> read_file(const char* name) {
+    std::vector<uint8_t> data;
+    FILE*                fp = fopen(name, "rb");
+    uint8_t              buffer[4096];
+    size_t               num;
+
+    if (fp == NULL) {
+        fail("cannot open", name);
+    }
+    while ((num = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + num);
+    }
+    fclose(fp);
+    return data;
+}
+
+static void write_file(const char* name, const std::vector<uint8_t>& data) {
+    FILE* fp = fopen(name, "wb");
+
+    if ((fp == NULL) || (fwrite(data.data(), 1, data.size(), fp) != data.size()) || (fclose(fp) != 0)) {
+        fail("cannot write", name);
+    }
+}
+
+/** CRC-32 (IEEE 802.3, same as zlib and Bootloader_CRC32) */
+static uint32_t crc32(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (length--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+    return ~crc;
+}
+
+/* Patch generator -----------------------------------------------------------*/
+class Patch {
+public:
+    std::vector<uint8_t> data;
+
+    void op(uint8_t opcode, uint32_t n) {
+        data.push_back(opcode);
+        do {
+            data.push_back((n & 0x7F) | ((n > 0x7F) ? 0x80 : 0));
+            n >>= 7;
+        } while (n);
+    }
+};
+
+/** Source bytes at @p old may be read for the target byte at @p out */
+static bool in_place(size_t old, size_t out) {
+    return old >= (out & ~(size_t)(FLASH_PAGE_SIZE - 1));
+}
+
+/** Length of the match at @p old for the target at @p out */
+static size_t match_length(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, size_t old,
+                           size_t out) {
+    size_t n = 0;
+
+    while ((old + n < source.size()) && (out + n < target.size()) && in_place(old + n, out + n) &&
+           (source[old + n] == target[out + n])) {
+        n++;
+    }
+    return n;
+}
+
+/** Length of the ADD command following a match, 0 if not worth it */
+static size_t add_length(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, size_t old,
+                         size_t out) {
+    long   score = 0;
+    long   best  = 0;
+    size_t n     = 0;
+
+    for (size_t i = 0; (i < MAX_EXTENSION) && (old + i < source.size()) && (out + i < target.size()) &&
+                       in_place(old + i, out + i);
+         i++) {
+        score += (source[old + i] == target[out + i]) ? 1 : -1;
+        if (score > best) {
+            best = score;
+            n    = i + 1;
+        }
+    }
+    return n;
+}
+
+static uint32_t key(const std::vector<uint8_t>& data, size_t pos) {
+    return (uint32_t)data[pos] | ((uint32_t)data[pos + 1] << 8) | ((uint32_t)data[pos + 2] << 16) |
+           ((uint32_t)data[pos + 3] << 24);
+}
+
+static std::vector<uint8_t> make_patch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target) {
+    std::unordered_map<uint32_t, std::vector<uint32_t>> index;
+    Patch                                               patch;
+    DeltaHeader                                         header = {};
+    std::vector<uint8_t>                                literals;
+    size_t                                              out = 0;
+    size_t                                              old = 0;
+
+    for (size_t pos = 0; pos + 4 <= source.size(); pos++) {
+        std::vector<uint32_t>& positions = index[key(source, pos)];
+
+        if (positions.size() < MAX_CANDIDATES) {
+            positions.push_back((uint32_t)pos);
+        }
+    }
+
+    auto flush = [&]() {
+        if (!literals.empty()) {
+            patch.op(DELTA_OP_INSERT, (uint32_t)literals.size());
+            patch.data.insert(patch.data.end(), literals.begin(), literals.end());
+            literals.clear();
+        }
+    };
+
+    while (out < target.size()) {
+        /* Continuing from the current source position costs no SEEK */
+        size_t best = old;
+        size_t n    = match_length(source, target, old, out);
+
+        if ((n < MIN_MATCH) && (out + 4 <= target.size())) {
+            auto found = index.find(key(target, out));
+
+            if (found != index.end()) {
+                for (uint32_t pos : found->second) {
+                    size_t length = match_length(source, target, pos, out);
+
+                    if (length > n) {
+                        n    = length;
+                        best = pos;
+                    }
+                }
+            }
+        }
+        if ((n < MIN_MATCH) && !((best == old) && (n >= 4))) {
+            literals.push_back(target[out++]);
+            continue;
+        }
+
+        flush();
+        if (best != old) {
+            int32_t offset = (int32_t)(best - old);
+            patch.op(DELTA_OP_SEEK, ((uint32_t)offset << 1) ^ (uint32_t)(offset >> 31));
+        }
+        patch.op(DELTA_OP_COPY, (uint32_t)n);
+        old = best + n;
+        out += n;
+
+        n = add_length(source, target, old, out);
+        if (n) {
+            patch.op(DELTA_OP_ADD, (uint32_t)n);
+            for (size_t i = 0; i < n; i++) {
+                patch.data.push_back((uint8_t)(target[out + i] - source[old + i]));
+            }
+            old += n;
+            out += n;
+        }
+    }
+    flush();
+    patch.op(DELTA_OP_END, 0);
+
+    header.magic      = DELTA_MAGIC;
+    header.version    = DELTA_VERSION;
+    header.sourceSize = (uint32_t)source.size();
+    header.sourceCrc  = crc32(source.data(), source.size());
+    header.targetSize = (uint32_t)target.size();
+    header.targetCrc  = crc32(target.data(), target.size());
+    patch.data.insert(patch.data.begin(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+    return patch.data;
+}
+
+/* Simulated bootloader ------------------------------------------------------*/
+/** Count a flash operation, and cut the power during the chosen one */
+static bool power_cut(void) {
+    return ++operations == cutAt;
+}
+
+static void damage(uint8_t* data, uint32_t length) {
+    uint32_t n = rng() % (length + 1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        data[i] = (uint8_t)rng();
+    }
+}
+
+uint8_t Bootloader_Init(void) {
+    return BL_OK;
+}
+
+uint8_t Bootloader_ErasePages(uint32_t address, uint32_t count) {
+    uint8_t* page = flash + (address - APP_ADDRESS);
+
+    if ((address < APP_ADDRESS) || ((address - APP_ADDRESS) % FLASH_PAGE_SIZE) ||
+        (address - APP_ADDRESS + count * FLASH_PAGE_SIZE > APP_SIZE)) {
+        return BL_ERASE_ERROR;
+    }
+    for (; count--; page += FLASH_PAGE_SIZE) {
+        erases[(page - flash) / FLASH_PAGE_SIZE]++;
+        if (power_cut()) {
+            damage(page, FLASH_PAGE_SIZE);
+            throw PowerCut();
+        }
+        memset(page, 0xFF, FLASH_PAGE_SIZE);
+    }
+    return BL_OK;
+}
+
+uint8_t Bootloader_FlashBegin(void) {
+    return BL_OK;
+}
+
+uint8_t Bootloader_FlashSeek(uint32_t address) {
+    seek = address;
+    return BL_OK;
+}
+
+uint8_t Bootloader_FlashBuffer(const void* data, uint32_t length) {
+    uint8_t* dest = flash + (seek - APP_ADDRESS);
+
+    if ((seek < APP_ADDRESS) || (seek - APP_ADDRESS + length > APP_SIZE) || (length % 8)) {
+        return BL_WRITE_ERROR;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        if (dest[i] != 0xFF) {
+            /* Doublewords are only programmed once erased */
+            return BL_WRITE_ERROR;
+        }
+    }
+    if (power_cut()) {
+        uint32_t n = (rng() % (length / 8 + 1)) * 8;
+        memcpy(dest, data, n);
+        damage(dest + n, (n < length) ? 8 : 0);
+        throw PowerCut();
+    }
+    memcpy(dest, data, length);
+    seek += length;
+    return BL_OK;
+}
+
+uint8_t Bootloader_FlashEnd(void) {
+    return BL_OK;
+}
+
+uint8_t Bootloader_JournalCommit(uint32_t page) {
+    if (!journal.open || (page >= JOURNAL_ENTRIES_MAX)) {
+        return BL_WRITE_ERROR;
+    }
+    if (power_cut()) {
+        journal.committed[page] = rng() & 1;
+        throw PowerCut();
+    }
+    journal.committed[page] = true;
+    return BL_OK;
+}
+
+uint8_t Bootloader_JournalResume(uint32_t size, uint32_t crc, uint32_t* pages) {
+    *pages = 0;
+    if (!journal.open || (journal.size != size) || (journal.crc != crc)) {
+        return BL_NO_APP;
+    }
+    while ((*pages < JOURNAL_ENTRIES_MAX) && journal.committed[*pages]) {
+        (*pages)++;
+    }
+    return BL_OK;
+}
+
+uint8_t Bootloader_CheckSize(uint32_t appsize) {
+    return (appsize <= APP_SIZE) ? BL_OK : BL_SIZE_ERROR;
+}
+
+uint32_t Bootloader_CRC32(uint32_t crc, const void* data, uint32_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    crc = ~crc;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+    return ~crc;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br) {
+    *br = (fp->size - fp->fptr < btr) ? fp->size - fp->fptr : btr;
+    memcpy(buff, fp->data + fp->fptr, *br);
+    fp->fptr += *br;
+    return FR_OK;
+}
+
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs) {
+    if (ofs > fp->size) {
+        return FR_INVALID_PARAMETER;
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+/**
+ * @brief  Delta update of Enter_DeltaUpdate: check, open or resume the
+ *         journal, apply, then close the journal with the record.
+ * @return Delta error code ::eDeltaErrorCodes
+ */
+static uint8_t boot(const std::vector<uint8_t>& patch) {
+    FIL         file = {patch.data(), (FSIZE_t)patch.size(), 0};
+    DeltaHeader header;
+    DeltaResume resume;
+    uint32_t    page;
+    uint8_t     status;
+
+    status = Delta_Check(&file, &header, &resume);
+    if (status != DELTA_OK) {
+        return status;
+    }
+    if (Bootloader_JournalResume(header.targetSize, header.targetCrc, &page) != BL_OK) {
+        /* The record page is erased, then the journal header written */
+        journal.valid = false;
+        if (power_cut()) {
+            throw PowerCut();
+        }
+        memset(&journal, 0, sizeof(journal));
+        journal.open = true;
+        journal.size = header.targetSize;
+        journal.crc  = header.targetCrc;
+    }
+    status = Delta_Apply(&file, &header, &resume);
+    if (status != DELTA_OK) {
+        return status;
+    }
+    journal.open  = false;
+    journal.valid = true;
+    return DELTA_OK;
+}
+
+/** Map the flash of the application, filled with random data */
+static void flash_init(void) {
+#ifdef MAP_FIXED_NOREPLACE
+    int fixed = MAP_FIXED_NOREPLACE;
+#else
+    int fixed = 0;
+#endif
+    void* map = mmap((void*)(uintptr_t)APP_ADDRESS, APP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | fixed,
+                     -1, 0);
+
+    if (map != (void*)(uintptr_t)APP_ADDRESS) {
+        fail("cannot map flash", "application address in use");
+    }
+    flash = (uint8_t*)map;
+}
+
+/** Install @p source, as left by a previous update */
+static void flash_load(const std::vector<uint8_t>& source) {
+    for (uint32_t i = 0; i < APP_SIZE; i++) {
+        flash[i] = (uint8_t)rng();
+    }
+    memcpy(flash, source.data(), source.size());
+    if (source.size() % FLASH_PAGE_SIZE) {
+        memset(flash + source.size(), 0xFF, FLASH_PAGE_SIZE - source.size() % FLASH_PAGE_SIZE);
+    }
+    memset(&journal, 0, sizeof(journal));
+    memset(erases, 0, sizeof(erases));
+    journal.valid = true;
+}
+
+/** Check the flash after an update from @p source to @p target */
+static bool flash_check(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target) {
+    uint32_t pages   = (uint32_t)((target.size() + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE);
+    uint32_t scratch = (uint32_t)((source.size() + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE);
+
+    uint32_t copies;
+
+    if (scratch < pages) {
+        scratch = pages;
+    }
+    /* The scratch copies rotate over the pages above both images */
+    copies = APP_SIZE / FLASH_PAGE_SIZE - scratch;
+    if (copies > pages) {
+        copies = pages;
+    }
+    if (!journal.valid || journal.open || (memcmp(flash, target.data(), target.size()) != 0)) {
+        return false;
+    }
+    for (uint32_t i = (uint32_t)target.size(); i < (scratch + copies) * FLASH_PAGE_SIZE; i++) {
+        if (flash[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief  Update @p source to @p target with the power cut during flash
+ *         operation @p cut (0: none), then a second time during @p again
+ *         operations of the next boot (0: none), and boot until done.
+ * @return true if the update completes with the target image installed
+ */
+static bool run(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target,
+                const std::vector<uint8_t>& patch, long cut, long again) {
+    flash_load(source);
+    for (int attempt = 0; attempt < 4; attempt++) {
+        operations = 0;
+        cutAt      = (attempt == 0) ? cut : (attempt == 1) ? again : -1;
+        if (cutAt == 0) {
+            cutAt = -1;
+        }
+        try {
+            uint8_t status = boot(patch);
+
+            if (status == DELTA_APPLIED) {
+                /* Done before the last cut, and the record was set */
+                return journal.valid && flash_check(source, target);
+            }
+            if (status != DELTA_OK) {
+                fprintf(stderr, "deltagen: cut %ld/%ld, boot %d: error %u\n", cut, again, attempt, status);
+                return false;
+            }
+            return flash_check(source, target);
+        } catch (const PowerCut&) {
+        }
+    }
+    fprintf(stderr, "deltagen: cut %ld/%ld: update never completed\n", cut, again);
+    return false;
+}
+
+/**
+ * @brief  Round trip of a patch, then power cuts at every @p step flash
+ *         operations, single and double.
+ * @return true if all updates complete
+ */
+static bool test(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target,
+                 const std::vector<uint8_t>& patch, long step) {
+    long     total;
+    long     runs = 0;
+    uint32_t wear = 0;
+
+    if (!run(source, target, patch, 0, 0)) {
+        return false;
+    }
+    total = operations;
+    for (uint32_t count : erases) {
+        wear = (count > wear) ? count : wear;
+    }
+    for (long cut = 1; cut <= total; cut += step) {
+        long again = 1 + (long)(rng() % (unsigned long)total);
+
+        if (!run(source, target, patch, cut, 0) || !run(source, target, patch, cut, again)) {
+            return false;
+        }
+        runs += 2;
+    }
+    printf("%zu -> %zu bytes, patch %zu bytes, %ld flash operations, at most %u erases of a page, "
+           "%ld interrupted updates OK\n",
+           source.size(), target.size(), patch.size(), total, wear, runs);
+    return true;
+}
+
+/** Firmware-like image pair: code moved by insertions and deletions, with addresses shifted */
+static void make_pair(std::vector<uint8_t>& source, std::vector<uint8_t>& target, size_t size, int edits) {
+    source.resize(size);
+    for (size_t i = 0; i < size; i += 4) {
+        uint32_t word = (rng() % 4) ? (0x08008000 + rng() % size) & ~1u : rng();
+        memcpy(&source[i], &word, (size - i < 4) ? size - i : 4);
+    }
+    target = source;
+    for (int e = 0; e < edits; e++) {
+        size_t   pos    = rng() % target.size();
+        size_t   length = 1 + rng() % 512;
+        uint32_t shift  = 4 * (rng() % 64);
+
+        switch (rng() % 3) {
+        case 0:
+            for (size_t i = 0; i < length; i++) {
+                target.insert(target.begin() + pos, (uint8_t)rng());
+            }
+            break;
+        case 1:
+            target.erase(target.begin() + pos, target.begin() + std::min(pos + length, target.size()));
+            break;
+        default:
+            /* Addresses of moved code */
+            for (size_t i = pos & ~(size_t)3; (i + 4 <= target.size()) && (i < pos + length * 4); i += 4) {
+                uint32_t word;
+                memcpy(&word, &target[i], 4);
+                if ((word >> 24) == 0x08) {
+                    word += shift;
+                    memcpy(&target[i], &word, 4);
+                }
+            }
+            break;
+        }
+    }
+    if (target.size() > APP_SIZE - FLASH_PAGE_SIZE) {
+        target.resize(APP_SIZE - FLASH_PAGE_SIZE);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: deltagen make <old.bin> <new.bin> <patch>\n"
+                    "       deltagen test <old.bin> <new.bin> [--step n] [--seed s]\n"
+                    "       deltagen selftest [--seed s]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    long step = 1;
+
+    if (argc < 2) {
+        usage();
+    }
+    for (int i = 2; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--step") == 0) {
+            step = strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            rng.seed((uint32_t)strtoul(argv[++i], NULL, 0));
+        }
+    }
+    if (step < 1) {
+        usage();
+    }
+    flash_init();
+
+    if ((strcmp(argv[1], "make") == 0) && (argc == 5)) {
+        std::vector<uint8_t> source = read_file(argv[2]);
+        std::vector<uint8_t> target = read_file(argv[3]);
+        std::vector<uint8_t> patch;
+
+        if ((source.size() > APP_SIZE - FLASH_PAGE_SIZE) || (target.size() > APP_SIZE - FLASH_PAGE_SIZE)) {
+            fail("image too large", argv[2]);
+        }
+        patch = make_patch(source, target);
+        if (!run(source, target, patch, 0, 0)) {
+            fail("patch does not apply", argv[4]);
+        }
+        write_file(argv[4], patch);
+        printf("%zu -> %zu bytes, patch %zu bytes\n", source.size(), target.size(), patch.size());
+        return 0;
+    }
+    if ((strcmp(argv[1], "test") == 0) && (argc >= 4)) {
+        std::vector<uint8_t> source = read_file(argv[2]);
+        std::vector<uint8_t> target = read_file(argv[3]);
+
+        if ((source.size() > APP_SIZE - FLASH_PAGE_SIZE) || (target.size() > APP_SIZE - FLASH_PAGE_SIZE)) {
+            fail("image too large", argv[2]);
+        }
+        return test(source, target, make_patch(source, target), step) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "selftest") == 0) {
+        static const struct
+        {
+            size_t size;
+            int    edits;
+        } pairs[] = {{1, 0}, {FLASH_PAGE_SIZE, 2}, {3 * FLASH_PAGE_SIZE + 100, 4}, {20000, 8}, {60000, 30}};
+
+        for (const auto& pair : pairs) {
+            std::vector<uint8_t> source;
+            std::vector<uint8_t> target;
+
+            make_pair(source, target, pair.size, pair.edits);
+            if (target.empty()) {
+                target.push_back(0);
+            }
+            if (!test(source, target, make_patch(source, target), 1) ||
+                !test(target, source, make_patch(target, source), 1)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    usage();
+}
@@ -0,0 +1,36 @@
+/**
+ *******************************************************************************
+ * @file   ff.h
+ * @brief  Host stand-in for the FatFs calls of Core/Src/delta.cpp
+ *         (Tools/delta): the patch file is a buffer in memory, implemented by
+ *         deltagen.cpp.
+ *******************************************************************************
+ */
+
+#ifndef _FATFS
+#define _FATFS
+
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef uint32_t     FSIZE_t;
+
+typedef enum
+{
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INVALID_PARAMETER = 19,
+} FRESULT;
+
+/** Patch file held in memory */
+typedef struct
+{
+    const uint8_t* data;
+    FSIZE_t        size;
+    FSIZE_t        fptr;
+} FIL;
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs);
+
+#endif /* _FATFS */
@@ -0,0 +1,334 @@
+/**
+ *******************************************************************************
+ * @file   cachebench.c
+ * @brief  Host benchmark of the FatFs drivers of FATFS/Target on a cluttered
+ *         FAT32 card image: sector cache of user_diskio.c, SPI3 and SDMMC1
+ *         buses.
+ *
+ * The FatFs sources and the drivers (user_diskio.c, or sdmmc_diskio.c with
+ * SD_USE_SDMMC) are the bootloader's. Below them, the SPI driver
+ * (user_diskio_spi.c) and the SDMMC1 block interface (sdmmc_block.c) are
+ * replaced by a card image file, counting the card commands like the bus
+ * would see them and estimating the bus time.
+ *
+ * Build from the repository root, once per cache size or driver (the include
+ * order selects this ffconf.h instead of the target one):
+ * @code
+ * gcc -O2 -DSD_CACHE_SECTORS=8 -DSD_USE_SDMMC=0 -ITools/fatbench -IFATFS/App -IFATFS/Target \
+ *     -IMiddlewares/Third_Party/FatFs/src Tools/fatbench/cachebench.c FATFS/Target/user_diskio.c \
+ *     FATFS/Target/sdmmc_diskio.c Middlewares/Third_Party/FatFs/src/ff.c \
+ *     Middlewares/Third_Party/FatFs/src/diskio.c Middlewares/Third_Party/FatFs/src/ff_gen_drv.c \
+ *     Middlewares/Third_Party/FatFs/src/option/ccsbcs.c -o cachebench
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * cachebench make card.img [size in GB] [exfat]  # sparse image, FAT32 (or exFAT), 32 KB clusters, clutter, Scale.bin
+ * cachebench run card.img                 # same file system calls as an update, prints the counters
+ * @endcode
+ * `run` deletes Scale.bin like the bootloader does: copy the image first.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "fatfs.h"
+#include "user_diskio_spi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Private defines -----------------------------------------------------------*/
+/** Cluster size of the SD Association formatter for 32 GB cards */
+#define CLUSTER_SIZE    (32 * 1024)
+/** Directories in the root, files in each directory, files in the root */
+#define CLUTTER_DIRS    24
+#define CLUTTER_FILES   40
+#define CLUTTER_ROOT    120
+/** Size of Scale.bin, and data written by other files between its clusters */
+#define IMAGE_SIZE      (448 * 1024)
+#define IMAGE_GAP       (1024 * 1024)
+/** Chunk read by the bootloader */
+#define READ_SIZE       512
+
+/** Bus time model, in us: card access (read latency or programming) per
+    command, the same on both buses, then command and data transfers */
+#define CARD_ACCESS_US  100.0
+/** SPI3 at 10 MHz: command, R1 and data token, then 512 data and 2 CRC bytes */
+#define SPI_COMMAND_US  (8 * 8 / 10.0)
+#define SPI_SECTOR_US   ((512 + 2) * 8 / 10.0)
+/** SDMMC1 at 24 MHz: command and response on CMD, then 4-bit data with
+    start, CRC and end bits */
+#define SDMMC_COMMAND_US (96 / 24.0)
+#define SDMMC_SECTOR_US  ((512 * 2 + 16 + 2) / 24.0)
+
+#if SD_USE_SDMMC
+#define BENCH_DRIVER    SDMMC_Driver
+#define BUS_NAME        "SDMMC1 4-bit 24 MHz"
+#define BUS_COMMAND_US  SDMMC_COMMAND_US
+#define BUS_SECTOR_US   SDMMC_SECTOR_US
+#else
+#define BENCH_DRIVER    USER_Driver
+#define BUS_NAME        "SPI3 10 MHz"
+#define BUS_COMMAND_US  SPI_COMMAND_US
+#define BUS_SECTOR_US   SPI_SECTOR_US
+#endif
+
+/* Private variables ---------------------------------------------------------*/
+FATFS USERFatFS;
+char  USERPath[4];
+
+/** Card image */
+static FILE* card;
+static DWORD card_sectors;
+/** Card commands and sectors, as seen on the SPI bus */
+static struct
+{
+    DWORD readCommands;
+    DWORD readSectors;
+    DWORD writeCommands;
+    DWORD writeSectors;
+    double micros;
+} bus;
+
+/** Buffer of the clutter files */
+static BYTE data[IMAGE_GAP];
+
+/* Card image ----------------------------------------------------------------*/
+/** Counts a transfer: one command, plus the stop command of a multiple
+    block transfer */
+static void bus_transfer(UINT count) {
+    bus.micros += CARD_ACCESS_US + ((count > 1) ? 2 : 1) * BUS_COMMAND_US + count * BUS_SECTOR_US;
+}
+
+static int card_read(BYTE* buff, DWORD sector, UINT count) {
+    bus.readCommands++;
+    bus.readSectors += count;
+    bus_transfer(count);
+    if ((fseek(card, (long)sector * 512, SEEK_SET) != 0) || (fread(buff, 512, count, card) != count)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int card_write(const BYTE* buff, DWORD sector, UINT count) {
+    bus.writeCommands++;
+    bus.writeSectors += count;
+    bus_transfer(count);
+    if ((fseek(card, (long)sector * 512, SEEK_SET) != 0) || (fwrite(buff, 512, count, card) != count)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* SPI driver replacement ----------------------------------------------------*/
+DSTATUS USER_SPI_initialize(BYTE pdrv) {
+    return (card != NULL) ? 0 : STA_NOINIT;
+}
+
+DSTATUS USER_SPI_status(BYTE pdrv) {
+    return (card != NULL) ? 0 : STA_NOINIT;
+}
+
+DRESULT USER_SPI_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count) {
+    return (card_read(buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
+
+DRESULT USER_SPI_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count) {
+    return (card_write(buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
+
+DRESULT USER_SPI_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
+    switch (cmd) {
+        case CTRL_SYNC:
+            return (fflush(card) == 0) ? RES_OK : RES_ERROR;
+        case GET_SECTOR_COUNT:
+            *(DWORD*)buff = card_sectors;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            *(DWORD*)buff = 8192;
+            return RES_OK;
+        default:
+            return RES_PARERR;
+    }
+}
+
+/* SDMMC1 block interface replacement ----------------------------------------*/
+int SD_BlockInit(SD_CardInfo* info) {
+    if (card == NULL) {
+        return -1;
+    }
+    info->sectors      = card_sectors;
+    info->highCapacity = 1;
+    return 0;
+}
+
+int SD_BlockRead(BYTE* buff, DWORD sector, UINT count) {
+    return card_read(buff, sector, count);
+}
+
+int SD_BlockWrite(const BYTE* buff, DWORD sector, UINT count) {
+    return card_write(buff, sector, count);
+}
+
+int SD_BlockSync(void) {
+    return (fflush(card) == 0) ? 0 : -1;
+}
+
+DWORD get_fattime(void) {
+    return 0;
+}
+
+/* Private functions ---------------------------------------------------------*/
+static void check(FRESULT fr, const char* what) {
+    if (fr != FR_OK) {
+        fprintf(stderr, "cachebench: %s: FatFs error %u\n", what, fr);
+        exit(1);
+    }
+}
+
+static void append(FIL* fp, UINT length) {
+    UINT bw;
+
+    check(f_write(fp, data, length, &bw), "f_write");
+    check((bw == length) ? FR_OK : FR_DENIED, "card full");
+}
+
+/** Formats the image and fills it like a card used for a while */
+static int make(const char* name, DWORD gigabytes, BYTE format) {
+    static BYTE work[_MAX_SS];
+    FIL         files[2];
+    char        path[32];
+
+    card_sectors = gigabytes * 1024 * 1024 * 2;
+    card         = fopen(name, "w+b");
+    if ((card == NULL) || (fseek(card, (long)card_sectors * 512 - 1, SEEK_SET) != 0) || (fputc(0, card) == EOF)) {
+        fprintf(stderr, "cachebench: cannot create %s\n", name);
+        return 1;
+    }
+    FATFS_LinkDriver(&BENCH_DRIVER, USERPath);
+    check(f_mkfs(USERPath, format, CLUSTER_SIZE, work, sizeof(work)), "f_mkfs");
+    check(f_mount(&USERFatFS, USERPath, 1), "f_mount");
+
+    srand(1);
+    for (UINT i = 0; i < sizeof(data); i++) {
+        data[i] = (BYTE)rand();
+    }
+
+    /* Directories of small files, written two at a time so that their
+       cluster chains interleave */
+    for (UINT d = 0; d < CLUTTER_DIRS; d++) {
+        snprintf(path, sizeof(path), "DIR%03u", d);
+        check(f_mkdir(path), "f_mkdir");
+        for (UINT f = 0; f < CLUTTER_FILES; f += 2) {
+            for (UINT i = 0; i < 2; i++) {
+                snprintf(path, sizeof(path), "DIR%03u/F%03u.DAT", d, f + i);
+                check(f_open(&files[i], path, FA_CREATE_ALWAYS | FA_WRITE), path);
+            }
+            for (UINT n = rand() % 4 + 1; n > 0; n--) {
+                append(&files[0], rand() % CLUSTER_SIZE + 1);
+                append(&files[1], rand() % CLUSTER_SIZE + 1);
+            }
+            check(f_close(&files[0]), "f_close");
+            check(f_close(&files[1]), "f_close");
+        }
+    }
+
+    /* Root directory entries in front of Scale.bin */
+    for (UINT f = 0; f < CLUTTER_ROOT; f++) {
+        snprintf(path, sizeof(path), "LOG%05u.TXT", f);
+        check(f_open(&files[0], path, FA_CREATE_ALWAYS | FA_WRITE), path);
+        append(&files[0], rand() % 4096 + 1);
+        check(f_close(&files[0]), "f_close");
+    }
+
+    /* Scale.bin, written while another file grows: each cluster lies in
+       another FAT sector */
+    check(f_open(&files[0], "Scale.bin", FA_CREATE_ALWAYS | FA_WRITE), "Scale.bin");
+    check(f_open(&files[1], "RECORD.DAT", FA_CREATE_ALWAYS | FA_WRITE), "RECORD.DAT");
+    for (UINT offset = 0; offset < IMAGE_SIZE; offset += CLUSTER_SIZE) {
+        append(&files[0], CLUSTER_SIZE);
+        append(&files[1], IMAGE_GAP);
+    }
+    check(f_close(&files[0]), "f_close");
+    check(f_close(&files[1]), "f_close");
+    check(f_mount(NULL, USERPath, 0), "f_unmount");
+    fclose(card);
+    printf("%s: %lu GB %s, %u directories of %u files, %u files in the root, Scale.bin %u KB\n",
+           name,
+           (unsigned long)gigabytes,
+           (format == FM_EXFAT) ? "exFAT" : "FAT32",
+           CLUTTER_DIRS,
+           CLUTTER_FILES,
+           CLUTTER_ROOT,
+           IMAGE_SIZE / 1024);
+    return 0;
+}
+
+/** Reads the whole file, chunk by chunk */
+static void read_file(FIL* fp) {
+    static BYTE buffer[READ_SIZE];
+    UINT        br;
+
+    check(f_lseek(fp, 0), "f_lseek");
+    do {
+        check(f_read(fp, buffer, sizeof(buffer), &br), "f_read");
+    } while (br == sizeof(buffer));
+}
+
+/** File system calls of an update: CRC pass, programming, verification on a
+    reopened file, deletion */
+static int run(const char* name) {
+    FIL   file;
+    DWORD hits, misses;
+
+    card = fopen(name, "r+b");
+    if ((card == NULL) || (fseek(card, 0, SEEK_END) != 0)) {
+        fprintf(stderr, "cachebench: cannot open %s\n", name);
+        return 1;
+    }
+    card_sectors = (DWORD)(ftell(card) / 512);
+    FATFS_LinkDriver(&BENCH_DRIVER, USERPath);
+
+    check(f_mount(&USERFatFS, USERPath, 1), "f_mount");
+    check(f_open(&file, "Scale.bin", FA_READ), "Scale.bin");
+    read_file(&file);
+    read_file(&file);
+    check(f_close(&file), "f_close");
+    check(f_open(&file, "Scale.bin", FA_READ), "Scale.bin");
+    read_file(&file);
+    check(f_close(&file), "f_close");
+    check(f_unlink("Scale.bin"), "f_unlink");
+    check(f_mount(NULL, USERPath, 0), "f_unmount");
+    fclose(card);
+
+    USER_CacheStats(&hits, &misses);
+    printf("%s, SD_CACHE_SECTORS %u (%u bytes): %lu hits, %lu misses, "
+           "%lu read commands (%lu sectors), %lu write commands (%lu sectors), %.1f ms on the bus\n",
+           BUS_NAME,
+           SD_USE_SDMMC ? 0 : SD_CACHE_SECTORS,
+           (SD_USE_SDMMC ? 0 : SD_CACHE_SECTORS) * (512 + 8),
+           (unsigned long)hits,
+           (unsigned long)misses,
+           (unsigned long)bus.readCommands,
+           (unsigned long)bus.readSectors,
+           (unsigned long)bus.writeCommands,
+           (unsigned long)bus.writeSectors,
+           bus.micros / 1000);
+    return 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+int main(int argc, char** argv) {
+    if ((argc >= 3) && (strcmp(argv[1], "make") == 0)) {
+        return make(argv[2],
+                    (argc >= 4) ? (DWORD)strtoul(argv[3], NULL, 0) : 32,
+                    ((argc >= 5) && (strcmp(argv[4], "exfat") == 0)) ? FM_EXFAT : FM_FAT32);
+    }
+    if ((argc == 3) && (strcmp(argv[1], "run") == 0)) {
+        return run(argv[2]);
+    }
+    fprintf(stderr,
+            "usage: cachebench make <image> [size in GB] [exfat]\n"
+            "       cachebench run <image>\n");
+    return 2;
+}
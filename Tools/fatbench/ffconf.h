@@ -0,0 +1,56 @@
+/**
+ *******************************************************************************
+ * @file   ffconf.h
+ * @brief  FatFs configuration of the host benchmark (Tools/fatbench): the
+ *         options of FATFS/Target/ffconf.h, without the HAL, plus f_mkfs to
+ *         build the card image.
+ *******************************************************************************
+ */
+
+#ifndef _FFCONF
+#define _FFCONF 68300 /* Revision ID */
+
+/* Stands for main.h of the target */
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS 8
+#endif
+#ifndef SD_USE_SDMMC
+#define SD_USE_SDMMC 0
+#endif
+
+#define _FS_READONLY   0
+#define _FS_MINIMIZE   0
+#define _USE_STRFUNC   0
+#define _USE_FIND      0
+#define _USE_MKFS      1 /* Host only */
+#define _USE_FASTSEEK  0
+#define _USE_EXPAND    0
+#define _USE_CHMOD     0
+#define _USE_LABEL     0
+#define _USE_FORWARD   1
+#define _CODE_PAGE     850
+#define _USE_LFN       1
+#define _MAX_LFN       255
+#define _LFN_UNICODE   0
+#define _STRF_ENCODE   3
+#define _FS_RPATH      0
+#define _VOLUMES       1
+#define _STR_VOLUME_ID 0
+#define _VOLUME_STRS   "RAM", "NAND", "CF", "SD1", "SD2", "USB1", "USB2", "USB3"
+#define _MULTI_PARTITION 0
+#define _MIN_SS        512
+#define _MAX_SS        512
+#define _USE_TRIM      0
+#define _FS_NOFSINFO   0
+#define _FS_TINY       0
+#define _FS_EXFAT      1
+#define _FS_NORTC      0
+#define _NORTC_MON     6
+#define _NORTC_MDAY    4
+#define _NORTC_YEAR    2015
+#define _FS_LOCK       2 /* Host only: two files written at a time */
+#define _FS_REENTRANT  0
+#define _FS_TIMEOUT    1000
+#define _SYNC_t        NULL
+
+#endif /* _FFCONF */
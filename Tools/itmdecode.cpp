@@ -0,0 +1,315 @@
+/**
+ *******************************************************************************
+ * @file   itmdecode.cpp
+ * @brief  Host tool decoding the SWO trace of the bootloader (USE_ITM, see
+ *         Core/Inc/trace.h): the console text of ITM port 0, and the events
+ *         of port 1 as a timeline with the duration and throughput of each
+ *         phase of the update.
+ *
+ * Build from the repository root (HAL headers are only needed for the
+ * configuration included by trace.h):
+ * @code
+ * g++ -std=c++17 -O2 -DSTM32L452xx -ICore/Inc -IDrivers/CMSIS/Include \
+ *     -IDrivers/CMSIS/Device/ST/STM32L4xx/Include -IDrivers/STM32L4xx_HAL_Driver/Inc \
+ *     Tools/itmdecode.cpp -o itmdecode
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * itmdecode swo.bin [--clock 80000000] [--chunks] [--no-text]
+ * @endcode
+ * The input is the raw SWO byte stream ("-" for stdin), without the TPIU
+ * formatter, e.g. captured by OpenOCD:
+ * @code
+ * tpiu config internal swo.bin uart off 80000000 2000000
+ * itm ports on
+ * @endcode
+ * --chunks lists every programmed or verified chunk, --no-text leaves the
+ * console text out of the timeline. Times come from the 32-bit cycle counter
+ * of the core: events must be less than 2^32 cycles (53 s at 80 MHz) apart.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Private defines -----------------------------------------------------------*/
+/** Default core clock, SystemCoreClock of the bootloader */
+#define DEFAULT_CLOCK 80000000
+
+/* Private variables ---------------------------------------------------------*/
+/** Command line options */
+static struct
+{
+    uint32_t clock  = DEFAULT_CLOCK;
+    bool     chunks = false;
+    bool     text   = true;
+} options;
+
+/** Statistics of a phase */
+struct PhaseStats {
+    uint64_t cycles = 0; /*!< Total duration */
+    uint32_t runs   = 0;
+    uint32_t chunks = 0;
+    uint64_t bytes  = 0;
+    uint64_t maxGap = 0; /*!< Longest time between two chunks, or the phase start */
+};
+
+static const char* const phase_names[] = {
+  "?", "mount", "check", "erase", "program", "verify", "cleanup", "uart",
+};
+#define PHASE_COUNT (sizeof(phase_names) / sizeof(phase_names[0]))
+
+static PhaseStats phases[PHASE_COUNT];
+
+/** Time line state */
+static struct
+{
+    bool     started = false;
+    uint32_t last    = 0; /*!< Cycle counter of the last event */
+    uint64_t now     = 0; /*!< Cycles since the first event */
+    uint32_t phase   = 0; /*!< Running phase, 0 if none */
+    uint64_t begin   = 0; /*!< Start of the running phase */
+    uint64_t chunk   = 0; /*!< Last chunk, or start of the running phase */
+} timeline;
+
+/** Words of port 1 waiting for the second word of their event */
+static std::vector<uint32_t> pending;
+/** Console text line being received */
+static std::string line;
+/** Line ended by \r, overwritten by the next character but \n */
+static bool        returned;
+static uint32_t    overflows;
+static uint32_t    dropped;
+
+/* Private functions ---------------------------------------------------------*/
+static void usage(void) {
+    fprintf(stderr, "usage: itmdecode <swo.bin|-> [--clock Hz] [--chunks] [--no-text]\n");
+    exit(2);
+}
+
+static double to_ms(uint64_t cycles) {
+    return (double)cycles * 1000.0 / options.clock;
+}
+
+static const char* phase_name(uint32_t phase) {
+    return (phase < PHASE_COUNT) ? phase_names[phase] : "?";
+}
+
+/** End the running phase at the current time */
+static void end_phase(void) {
+    if (timeline.phase != 0) {
+        PhaseStats& stats = phases[timeline.phase];
+
+        stats.cycles += timeline.now - timeline.begin;
+        stats.runs++;
+        timeline.phase = 0;
+    }
+}
+
+/** Print the console text line, without the padding of println() */
+static void flush_line(void) {
+    line.erase(line.find_last_not_of(' ') + 1);
+    if (!line.empty() && options.text) {
+        printf("%12s  | %s\n", "", line.c_str());
+    }
+    line.clear();
+    returned = false;
+}
+
+/** Console text of port 0, printed line by line in the timeline. Like on a
+ * terminal, a line of printr() ended by \r is overwritten by the next one */
+static void text(uint8_t c) {
+    if (c == '\n') {
+        flush_line();
+    } else if (c == '\r') {
+        returned = true;
+    } else {
+        if (returned) {
+            line.clear();
+            returned = false;
+        }
+        line.push_back((char)c);
+    }
+}
+
+static void event(uint32_t word, uint32_t cycles) {
+    uint8_t  id  = (uint8_t)(word >> 24);
+    uint32_t arg = word & 0xFFFFFF;
+
+    if (timeline.started) {
+        timeline.now += (uint32_t)(cycles - timeline.last);
+    }
+    timeline.started = true;
+    timeline.last    = cycles;
+
+    switch (id) {
+        case TRACE_BOOT:
+            end_phase();
+            timeline.now = 0;
+            printf("%9.3f ms  BOOT    reset flags 0x%02X\n", 0.0, arg);
+            break;
+        case TRACE_PHASE:
+            end_phase();
+            timeline.phase = (arg < PHASE_COUNT) ? arg : 0;
+            timeline.begin = timeline.chunk = timeline.now;
+            printf("%9.3f ms  PHASE   %s\n", to_ms(timeline.now), phase_name(arg));
+            break;
+        case TRACE_CHUNK: {
+            PhaseStats& stats = phases[timeline.phase];
+
+            stats.chunks++;
+            stats.bytes += arg;
+            if (timeline.now - timeline.chunk > stats.maxGap) {
+                stats.maxGap = timeline.now - timeline.chunk;
+            }
+            if (options.chunks) {
+                printf("%9.3f ms  CHUNK   %u bytes (+%.3f ms)\n",
+                       to_ms(timeline.now),
+                       arg,
+                       to_ms(timeline.now - timeline.chunk));
+            }
+            timeline.chunk = timeline.now;
+            break;
+        }
+        case TRACE_ERROR:
+            end_phase();
+            printf("%9.3f ms  ERROR   %u\n", to_ms(timeline.now), arg);
+            break;
+        case TRACE_JUMP:
+            end_phase();
+            printf("%9.3f ms  JUMP    update took %u ms\n", to_ms(timeline.now), arg);
+            break;
+        default:
+            break;
+    }
+}
+
+/** Word of port 1: events are pairs of words, a bad first word is dropped */
+static void event_word(uint32_t word) {
+    pending.push_back(word);
+    if ((pending.size() == 1) && (((word >> 24) < TRACE_BOOT) || ((word >> 24) > TRACE_JUMP))) {
+        pending.clear();
+        dropped++;
+        return;
+    }
+    if (pending.size() == 2) {
+        event(pending[0], pending[1]);
+        pending.clear();
+    }
+}
+
+/** Skip the continuation bytes of a packet */
+static void skip_continuation(FILE* f, int c) {
+    while ((c & 0x80) && ((c = fgetc(f)) != EOF)) {
+    }
+}
+
+static void summary(void) {
+    printf("\n%-8s %6s %10s %8s %10s %10s %12s\n", "phase", "runs", "ms", "chunks", "bytes", "KB/s", "max gap ms");
+    for (uint32_t i = 1; i < PHASE_COUNT; i++) {
+        const PhaseStats& stats = phases[i];
+        double            ms    = to_ms(stats.cycles);
+
+        if (stats.runs == 0) {
+            continue;
+        }
+        printf("%-8s %6u %10.3f %8u %10llu %10.1f %12.3f\n",
+               phase_names[i],
+               stats.runs,
+               ms,
+               stats.chunks,
+               (unsigned long long)stats.bytes,
+               (ms > 0) ? (double)stats.bytes / 1024 / (ms / 1000) : 0.0,
+               to_ms(stats.maxGap));
+    }
+    if (overflows || dropped) {
+        printf("\n%u ITM overflows, %u words dropped\n", overflows, dropped);
+    }
+}
+
+int main(int argc, char** argv) {
+    FILE* f;
+    int   c;
+
+    if (argc < 2) {
+        usage();
+    }
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "--clock") == 0) && (i + 1 < argc)) {
+            options.clock = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--chunks") == 0) {
+            options.chunks = true;
+        } else if (strcmp(argv[i], "--no-text") == 0) {
+            options.text = false;
+        } else {
+            usage();
+        }
+    }
+    if (options.clock == 0) {
+        usage();
+    }
+
+    f = (strcmp(argv[1], "-") == 0) ? stdin : fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    /* ARMv7-M ITM packets, see the ARMv7-M Architecture Reference Manual,
+     * appendix D4 */
+    while ((c = fgetc(f)) != EOF) {
+        if ((c == 0x00) || (c == 0x80)) {
+            /* Synchronization: zeros ended by 0x80 */
+        } else if (c == 0x70) {
+            /* Overflow: packets were lost, an event may have lost a word */
+            overflows++;
+            dropped += (uint32_t)pending.size();
+            pending.clear();
+        } else if ((c & 0x0F) == 0x00) {
+            /* Local timestamp */
+            skip_continuation(f, c);
+        } else if ((c == 0x94) || (c == 0xB4)) {
+            /* Global timestamp */
+            skip_continuation(f, c);
+        } else if ((c & 0x0B) == 0x08) {
+            /* Extension */
+            skip_continuation(f, c);
+        } else if ((c & 0x03) != 0) {
+            uint32_t size  = (c & 0x03) == 3 ? 4 : (c & 0x03);
+            uint32_t port  = (uint32_t)c >> 3;
+            uint32_t value = 0;
+            int      b     = 0;
+
+            for (uint32_t i = 0; (i < size) && ((b = fgetc(f)) != EOF); i++) {
+                value |= (uint32_t)b << (8 * i);
+            }
+            if (b == EOF) {
+                break;
+            }
+            if (c & 0x04) {
+                /* Hardware source (DWT) */
+                continue;
+            }
+            if (port == ITM_PORT_TEXT) {
+                for (uint32_t i = 0; i < size; i++) {
+                    text((uint8_t)(value >> (8 * i)));
+                }
+            } else if ((port == ITM_PORT_EVENT) && (size == 4)) {
+                event_word(value);
+            }
+        }
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    end_phase();
+    flush_line();
+    summary();
+    return 0;
+}
@@ -0,0 +1,168 @@
+/**
+ *******************************************************************************
+ * @file   katcheck.cpp
+ * @brief  Host known answer tests of the bootloader's SHA-256 and Ed25519
+ *         verification, built from the same sources as the target.
+ *
+ * SHA-256 is checked against the FIPS 180-4 examples (and the empty message),
+ * fed in one piece and in odd sized pieces to go through the partial block
+ * path of Sha256_Update(). Ed25519_Verify() is checked against the RFC 8032
+ * section 7.1 vectors, which must be accepted, and against the same vectors
+ * with one bit flipped in the message, the signature or the key, which must
+ * be rejected. The exit code is the number of failed tests.
+ *
+ * Build from the repository root (HAL headers are only needed for the
+ * configuration of sha256.cpp):
+ * @code
+ * g++ -std=c++17 -O2 -DSTM32L452xx -ICore/Inc -IDrivers/CMSIS/Include \
+ *     -IDrivers/CMSIS/Device/ST/STM32L4xx/Include -IDrivers/STM32L4xx_HAL_Driver/Inc \
+ *     Tools/katcheck.cpp Core/Src/sha256.cpp Core/Src/ed25519.cpp -o katcheck
+ * @endcode
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "sha256.h"
+#include "ed25519.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Private typedef -----------------------------------------------------------*/
+/** SHA-256 test vector: @p repeat copies of @p message */
+typedef struct
+{
+    const char* message;
+    uint32_t    repeat;
+    const char* digest;
+} Sha256Vector;
+
+/** Ed25519 test vector, in hexadecimal */
+typedef struct
+{
+    const char* key;
+    const char* message;
+    const char* signature;
+} Ed25519Vector;
+
+/* Private variables ---------------------------------------------------------*/
+/** FIPS 180-4 examples (NIST CSRC), and the empty message */
+static const Sha256Vector sha256Vectors[] = {
+    {"", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+};
+
+/** RFC 8032 section 7.1, tests 1 to 3 */
+static const Ed25519Vector ed25519Vectors[] = {
+    {"d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a", "",
+     "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b"},
+    {"3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c", "72",
+     "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00"},
+    {"fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025", "af82",
+     "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a"},
+};
+
+/** Number of failed tests */
+static int failed = 0;
+
+/* Private functions ---------------------------------------------------------*/
+static std::vector<uint8_t> parse_hex(const char* text) {
+    std::vector<uint8_t> data;
+
+    for (size_t i = 0; text[i] != 0 && text[i + 1] != 0; i += 2) {
+        char byte[3] = {text[i], text[i + 1], 0};
+
+        data.push_back((uint8_t)strtoul(byte, NULL, 16));
+    }
+    return data;
+}
+
+static void report(bool ok, const char* what, int index) {
+    printf("%-4s %s #%d\n", ok ? "OK" : "FAIL", what, index + 1);
+    if (!ok) {
+        failed++;
+    }
+}
+
+/**
+ * @brief  Hash @p message in pieces of @p piece bytes (0: in one piece).
+ */
+static bool sha256_check(const std::string& message, uint32_t piece, const uint8_t* expected) {
+    Sha256Context ctx;
+    uint8_t       digest[SHA256_DIGEST_SIZE];
+
+    Sha256_Init(&ctx);
+    if (piece == 0) {
+        Sha256_Update(&ctx, message.data(), (uint32_t)message.size());
+    } else {
+        for (size_t i = 0; i < message.size(); i += piece) {
+            size_t length = (message.size() - i < piece) ? message.size() - i : piece;
+
+            Sha256_Update(&ctx, message.data() + i, (uint32_t)length);
+        }
+    }
+    Sha256_Final(&ctx, digest);
+    return memcmp(digest, expected, SHA256_DIGEST_SIZE) == 0;
+}
+
+static void sha256_tests(void) {
+    static const uint32_t pieces[] = {0, 1, 7, SHA256_BLOCK_SIZE - 1, SHA256_BLOCK_SIZE + 3};
+
+    for (size_t i = 0; i < sizeof(sha256Vectors) / sizeof(sha256Vectors[0]); i++) {
+        const Sha256Vector&  v = sha256Vectors[i];
+        std::vector<uint8_t> expected = parse_hex(v.digest);
+        std::string          message;
+        bool                 ok = true;
+
+        for (uint32_t r = 0; r < v.repeat; r++) {
+            message += v.message;
+        }
+        for (uint32_t piece : pieces) {
+            ok = ok && sha256_check(message, piece, expected.data());
+        }
+        report(ok, "SHA-256 FIPS 180-4", (int)i);
+    }
+    report(Sha256_SelfTest(), "SHA-256 self-test", 0);
+}
+
+static void ed25519_tests(void) {
+    for (size_t i = 0; i < sizeof(ed25519Vectors) / sizeof(ed25519Vectors[0]); i++) {
+        const Ed25519Vector& v         = ed25519Vectors[i];
+        std::vector<uint8_t> key       = parse_hex(v.key);
+        std::vector<uint8_t> message   = parse_hex(v.message);
+        std::vector<uint8_t> signature = parse_hex(v.signature);
+        bool                 ok;
+
+        /* The empty message needs a valid pointer all the same */
+        message.reserve(1);
+        report(Ed25519_Verify(signature.data(), message.data(), (uint32_t)message.size(), key.data()),
+               "Ed25519 RFC 8032 accepted", (int)i);
+
+        ok = true;
+        if (!message.empty()) {
+            message[0] ^= 0x01;
+            ok = !Ed25519_Verify(signature.data(), message.data(), (uint32_t)message.size(), key.data());
+            message[0] ^= 0x01;
+        }
+        for (size_t bit = 0; bit < 8 * ED25519_SIGNATURE_SIZE; bit += 61) {
+            signature[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+            ok = ok && !Ed25519_Verify(signature.data(), message.data(), (uint32_t)message.size(), key.data());
+            signature[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        }
+        key[0] ^= 0x01;
+        ok = ok && !Ed25519_Verify(signature.data(), message.data(), (uint32_t)message.size(), key.data());
+        report(ok, "Ed25519 RFC 8032 tampered rejected", (int)i);
+    }
+}
+
+int main(void) {
+    sha256_tests();
+    ed25519_tests();
+    printf("%d failed\n", failed);
+    return failed;
+}
@@ -0,0 +1,339 @@
+/**
+ *******************************************************************************
+ * @file   packer.cpp
+ * @brief  Host tool turning the application binary into an update container
+ *         (Core/Inc/image.h), and checking a container with the header check
+ *         of the bootloader.
+ *
+ * Build from the repository root (the crypto sources are the bootloader's,
+ * HAL headers are only needed for the configuration of sha256.cpp):
+ * @code
+ * g++ -std=c++17 -O2 -DSTM32L452xx -ICore/Inc -IDrivers/CMSIS/Include \
+ *     -IDrivers/CMSIS/Device/ST/STM32L4xx/Include -IDrivers/STM32L4xx_HAL_Driver/Inc \
+ *     Tools/packer.cpp Core/Src/image.cpp Core/Src/sha256.cpp Core/Src/aes.cpp Core/Src/ed25519.cpp \
+ *     -o packer
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * packer pack app.bin Scale.bin [--address 0x08008000] [--chunk 65536] [--key <hex>] [--iv <hex>] [--signed]
+ * packer tbs Scale.bin tbs.bin     # header bytes to sign
+ * packer sign Scale.bin sig.bin    # insert the signature of tbs.bin
+ * packer check Scale.bin [--address 0x08008000] [--key <hex>] [--pubkey <hex>]
+ * @endcode
+ * A signature is made with any Ed25519 signer, e.g.
+ * `openssl pkeyutl -sign -inkey key.pem -rawin -in tbs.bin -out sig.bin`.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "image.h"
+#include "sha256.h"
+#include "aes.h"
+#include "ed25519.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Private defines -----------------------------------------------------------*/
+/** Default load address of the application */
+#define DEFAULT_ADDRESS    0x08008000
+/** Default chunk size, ::STAGING_CHUNK_SIZE of the bootloader */
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/* Private variables ---------------------------------------------------------*/
+/** Command line options */
+static struct
+{
+    uint32_t             address   = DEFAULT_ADDRESS;
+    uint32_t             chunkSize = DEFAULT_CHUNK_SIZE;
+    std::vector<uint8_t> key;
+    std::vector<uint8_t> iv;
+    std::vector<uint8_t> pubkey;
+    bool                 sign = false;
+} options;
+
+/* Private functions ---------------------------------------------------------*/
+static void usage(void) {
+    fprintf(stderr,
+            "usage: packer pack <app.bin> <container> [--address a] [--chunk n] [--key hex] [--iv hex] [--signed]\n"
+            "       packer tbs <container> <out>\n"
+            "       packer sign <container> <signature>\n"
+            "       packer check <container> [--address a] [--key hex] [--pubkey hex]\n");
+    exit(2);
+}
+
+static void fail(const char* what, const char* name) {
+    fprintf(stderr, "packer: %s: %s\n", what, name);
+    exit(1);
+}
+
+static std::vector<uint8_t> read_file(const char* name) {
+    std::vector<uint8_t> data;
+    FILE*                fp = fopen(name, "rb");
+    uint8_t              buffer[4096];
+    size_t               num;
+
+    if (fp == NULL) {
+        fail("cannot open", name);
+    }
+    while ((num = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + num);
+    }
+    fclose(fp);
+    return data;
+}
+
+static void write_file(const char* name, const void* data, size_t length) {
+    FILE* fp = fopen(name, "wb");
+
+    if ((fp == NULL) || (fwrite(data, 1, length, fp) != length) || (fclose(fp) != 0)) {
+        fail("cannot write", name);
+    }
+}
+
+static std::vector<uint8_t> parse_hex(const char* text, size_t length, const char* what) {
+    std::vector<uint8_t> data;
+
+    if (strlen(text) != 2 * length) {
+        fail("bad length", what);
+    }
+    for (size_t i = 0; i < length; i++) {
+        char byte[3] = {text[2 * i], text[2 * i + 1], 0};
+        char* end;
+
+        data.push_back((uint8_t)strtoul(byte, &end, 16));
+        if (*end != 0) {
+            fail("not hexadecimal", what);
+        }
+    }
+    return data;
+}
+
+static void parse_options(int argc, char** argv, int first) {
+    for (int i = first; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "--signed") {
+            options.sign = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage();
+        }
+        if (option == "--address") {
+            options.address = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (option == "--chunk") {
+            options.chunkSize = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (option == "--key") {
+            options.key = parse_hex(argv[++i], AES_KEY_SIZE, "--key");
+        } else if (option == "--iv") {
+            options.iv = parse_hex(argv[++i], AES_BLOCK_SIZE, "--iv");
+        } else if (option == "--pubkey") {
+            options.pubkey = parse_hex(argv[++i], ED25519_KEY_SIZE, "--pubkey");
+        } else {
+            usage();
+        }
+    }
+}
+
+/** CRC-32 (IEEE 802.3, same as zlib and Bootloader_CRC32) */
+static uint32_t crc32(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (length--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+    return ~crc;
+}
+
+static void sha256(const uint8_t* data, size_t length, uint8_t* digest) {
+    Sha256Context ctx;
+
+    Sha256_Init(&ctx);
+    Sha256_Update(&ctx, data, (uint32_t)length);
+    Sha256_Final(&ctx, digest);
+}
+
+/** Header and image of a container file */
+static void load_container(const char* name, std::vector<uint8_t>& file, ImageHeader& header) {
+    file = read_file(name);
+    if (file.size() < sizeof(header)) {
+        fail("too short for a container", name);
+    }
+    memcpy(&header, file.data(), sizeof(header));
+}
+
+static int pack(const char* input, const char* output) {
+    std::vector<uint8_t> image = read_file(input);
+    ImageHeader          header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic   = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.address = options.address;
+    header.size    = (uint32_t)image.size();
+    header.crc     = crc32(image.data(), image.size());
+    sha256(image.data(), image.size(), header.digest);
+
+    if (options.chunkSize != 0) {
+        header.chunkSize = options.chunkSize;
+        header.chunks    = (header.size + header.chunkSize - 1) / header.chunkSize;
+        if (header.chunks > IMAGE_CHUNKS_MAX) {
+            fail("too many chunks, use a larger --chunk", input);
+        }
+        for (uint32_t i = 0; i < header.chunks; i++) {
+            uint32_t offset = i * header.chunkSize;
+            uint32_t length = (header.size - offset < header.chunkSize) ? header.size - offset : header.chunkSize;
+
+            sha256(&image[offset], length, header.chunkDigests[i]);
+        }
+    }
+
+    if (!options.key.empty()) {
+        AesCtrContext ctx;
+
+        if (options.iv.empty()) {
+            std::random_device random;
+
+            for (uint32_t i = 0; i < AES_BLOCK_SIZE; i++) {
+                options.iv.push_back((uint8_t)random());
+            }
+        }
+        memcpy(header.iv, options.iv.data(), AES_BLOCK_SIZE);
+        header.flags |= IMAGE_FLAG_ENCRYPTED;
+        Aes_CtrInit(&ctx, options.key.data(), header.iv);
+        Aes_CtrCrypt(&ctx, image.data(), (uint32_t)image.size());
+    }
+    if (options.sign) {
+        header.flags |= IMAGE_FLAG_SIGNED;
+    }
+
+    image.insert(image.begin(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+    write_file(output, image.data(), image.size());
+    printf("%s: %u bytes, CRC %08X, %u chunks%s%s\n",
+           output,
+           header.size,
+           header.crc,
+           header.chunks,
+           (header.flags & IMAGE_FLAG_ENCRYPTED) ? ", encrypted" : "",
+           (header.flags & IMAGE_FLAG_SIGNED) ? ", to be signed" : "");
+    return 0;
+}
+
+static int tbs(const char* container, const char* output) {
+    std::vector<uint8_t> file;
+    ImageHeader          header;
+
+    load_container(container, file, header);
+    write_file(output, &header, IMAGE_SIGNED_SIZE);
+    return 0;
+}
+
+static int sign(const char* container, const char* signature) {
+    std::vector<uint8_t> file;
+    std::vector<uint8_t> sig = read_file(signature);
+    ImageHeader          header;
+
+    load_container(container, file, header);
+    if (!(header.flags & IMAGE_FLAG_SIGNED)) {
+        fail("not packed with --signed", container);
+    }
+    if (sig.size() != ED25519_SIGNATURE_SIZE) {
+        fail("not an Ed25519 signature", signature);
+    }
+    memcpy(&file[offsetof(ImageHeader, signature)], sig.data(), sig.size());
+    write_file(container, file.data(), file.size());
+    return 0;
+}
+
+static int check(const char* container) {
+    std::vector<uint8_t> file;
+    ImageHeader          header;
+    uint16_t             flags = 0;
+    uint8_t              status;
+    uint8_t              digest[SHA256_DIGEST_SIZE];
+    bool                 valid = true;
+
+    load_container(container, file, header);
+    if (!options.key.empty()) {
+        flags |= IMAGE_FLAG_ENCRYPTED;
+    }
+    if (!options.pubkey.empty()) {
+        flags |= IMAGE_FLAG_SIGNED;
+    }
+
+    /* Same check as the bootloader */
+    status = Image_CheckHeader(&header, (uint32_t)file.size(), options.address, flags);
+    printf("header: %s (%u)\n", (status == IMAGE_OK) ? "OK" : "rejected", status);
+    if (status != IMAGE_OK) {
+        return 1;
+    }
+
+    uint8_t* image = &file[IMAGE_HEADER_SIZE];
+    if (header.flags & IMAGE_FLAG_ENCRYPTED) {
+        AesCtrContext ctx;
+
+        Aes_CtrInit(&ctx, options.key.data(), header.iv);
+        Aes_CtrCrypt(&ctx, image, header.size);
+    }
+    /* The bootloader compares the CRC of the programmed image with the header
+     * before recording it, a mismatch fails the update after programming */
+    if (crc32(image, header.size) != header.crc) {
+        printf("CRC: image as programmed does not match the header\n");
+        valid = false;
+    }
+    sha256(image, header.size, digest);
+    if (memcmp(digest, header.digest, sizeof(digest)) != 0) {
+        printf("SHA-256: mismatch\n");
+        valid = false;
+    }
+    for (uint32_t i = 0; i < header.chunks; i++) {
+        uint32_t offset = i * header.chunkSize;
+        uint32_t length = (header.size - offset < header.chunkSize) ? header.size - offset : header.chunkSize;
+
+        sha256(&image[offset], length, digest);
+        if (memcmp(digest, header.chunkDigests[i], sizeof(digest)) != 0) {
+            printf("chunk %u: mismatch\n", i);
+            valid = false;
+        }
+    }
+    if (!options.pubkey.empty() &&
+        !Ed25519_Verify(header.signature, (const uint8_t*)&header, IMAGE_SIGNED_SIZE, options.pubkey.data())) {
+        printf("signature: invalid\n");
+        valid = false;
+    }
+    printf("image: %s\n", valid ? "OK" : "corrupted");
+    return valid ? 0 : 1;
+}
+
+/* Public functions ----------------------------------------------------------*/
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage();
+    }
+    std::string command = argv[1];
+
+    if (command == "pack" && (argc >= 4)) {
+        parse_options(argc, argv, 4);
+        return pack(argv[2], argv[3]);
+    }
+    if (command == "tbs" && (argc == 4)) {
+        return tbs(argv[2], argv[3]);
+    }
+    if (command == "sign" && (argc == 4)) {
+        return sign(argv[2], argv[3]);
+    }
+    if (command == "check") {
+        parse_options(argc, argv, 3);
+        return check(argv[2]);
+    }
+    usage();
+    return 2;
+}
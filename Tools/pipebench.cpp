@@ -0,0 +1,196 @@
+/**
+ *******************************************************************************
+ * @file   pipebench.cpp
+ * @brief  Host benchmark of the update pipeline (Core/Inc/pipeline.h): each
+ *         transform stage of the bootloader is wrapped in ::Timed with a host
+ *         clock and run alone, then all of them together, over an image held
+ *         in memory, for several chunk sizes.
+ *
+ * The stages are the bootloader's (AES-128-CTR decryption, SHA-256) plus the
+ * CRC-32 of the verification, with the same source and sink interfaces as in
+ * app.cpp: a memory source standing for FileSource and a sink dropping the
+ * data standing for FlashSink. The pipeline without any stage gives the cost
+ * of the composition itself, which should be that of the copy alone. Host
+ * figures only compare stages and chunk sizes with each other: the target
+ * figures come from SHA256_BENCHMARK and the [AES] line of an update.
+ *
+ * Build from the repository root (HAL headers are only needed for the
+ * configuration of sha256.cpp):
+ * @code
+ * g++ -std=c++17 -O2 -DSTM32L452xx -ICore/Inc -IDrivers/CMSIS/Include \
+ *     -IDrivers/CMSIS/Device/ST/STM32L4xx/Include -IDrivers/STM32L4xx_HAL_Driver/Inc \
+ *     Tools/pipebench.cpp Core/Src/sha256.cpp Core/Src/aes.cpp -o pipebench
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * pipebench [--size <image bytes>] [--rounds <n>]
+ * @endcode
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "pipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+/* Private defines -----------------------------------------------------------*/
+/** Default image size: the application area */
+#define DEFAULT_SIZE (480 * 1024)
+
+/* Private typedef -----------------------------------------------------------*/
+/** Nanoseconds of a steady clock */
+struct HostClock {
+    static uint32_t now(void) {
+        return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+};
+
+/** Source: image in memory, copied chunk by chunk like FileSource */
+class MemorySource {
+public:
+    MemorySource(const std::vector<uint8_t>& image) : image(image), offset(0) {}
+
+    uint8_t read(uint8_t* data, uint32_t size, uint32_t* length) {
+        *length = (image.size() - offset < size) ? (uint32_t)(image.size() - offset) : size;
+        memcpy(data, &image[offset], *length);
+        offset += *length;
+        return 0;
+    }
+
+private:
+    const std::vector<uint8_t>& image;
+    size_t                      offset;
+};
+
+/** Sink: drops the data, keeping one byte of each chunk */
+class DropSink {
+public:
+    uint8_t last = 0;
+
+    uint8_t write(uint8_t* data, uint32_t length) {
+        last ^= data[length - 1];
+        return 0;
+    }
+};
+
+/** CRC-32 of the stream, as CrcStage in app.cpp */
+class Crc32Stage {
+public:
+    uint32_t crc = 0;
+
+    uint8_t process(uint8_t* data, uint32_t length) {
+        uint32_t c = ~crc;
+
+        for (uint32_t i = 0; i < length; i++) {
+            c ^= data[i];
+            for (int k = 0; k < 8; k++) {
+                c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0);
+            }
+        }
+        crc = ~c;
+        return 0;
+    }
+};
+
+typedef Timed<CtrDecryptStage, HostClock> DecryptStage;
+typedef Timed<Sha256Stage, HostClock>     HashStage;
+typedef Timed<Crc32Stage, HostClock>      CrcStage;
+
+/* Private variables ---------------------------------------------------------*/
+/** Results of the runs, read so that no stage is optimized out */
+static volatile uint32_t results;
+
+/* Private functions ---------------------------------------------------------*/
+static double mbps(uint64_t bytes, uint64_t ns) {
+    return (ns == 0) ? 0.0 : (double)bytes * 1000.0 / (double)ns;
+}
+
+/**
+ * @brief  Run the pipeline made of @p stages over the image.
+ * @return Nanoseconds of the whole run
+ */
+template <typename... Stages>
+static uint64_t run(const std::vector<uint8_t>& image, uint32_t chunk, Stages&... stages) {
+    static uint8_t buffer[64 * 1024] __attribute__((aligned(8)));
+    MemorySource   source(image);
+    DropSink       sink;
+    Pipeline       pipeline(source, sink, stages...);
+    uint32_t       start = HostClock::now();
+
+    pipeline.run(buffer, chunk, [](uint32_t) {});
+    start = HostClock::now() - start;
+    results = results + sink.last;
+    return start;
+}
+
+int main(int argc, char** argv) {
+    static const uint32_t chunks[] = {512, 2048, 16 * 1024, 64 * 1024};
+    static const uint8_t  key[AES_KEY_SIZE] = {0};
+    static const uint8_t  iv[AES_BLOCK_SIZE] = {0};
+    uint32_t              size   = DEFAULT_SIZE;
+    int                   rounds = 20;
+
+    for (int i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) {
+            size = (uint32_t)strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "--rounds") == 0) {
+            rounds = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "usage: pipebench [--size <image bytes>] [--rounds <n>]\n");
+            return 2;
+        }
+    }
+    if ((size == 0) || (rounds < 1)) {
+        return 2;
+    }
+
+    std::vector<uint8_t> image(size);
+    for (uint32_t i = 0; i < size; i++) {
+        image[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+    uint64_t bytes = (uint64_t)size * rounds;
+
+    printf("%u bytes x %d rounds, MB/s per stage (time spent in the stage) and of the whole pipeline\n", size,
+           rounds);
+    printf("%8s %10s %10s %10s %10s %10s\n", "chunk", "none", "decrypt", "sha256", "crc32", "all");
+    for (uint32_t chunk : chunks) {
+        DecryptStage decrypt;
+        HashStage    hash;
+        CrcStage     crc;
+        NullStage    none;
+        uint64_t     empty = 0;
+        uint64_t     all   = 0;
+        uint64_t     alone[3] = {0, 0, 0};
+
+        decrypt.init(key, iv);
+        hash.init();
+        for (int r = 0; r < rounds; r++) {
+            empty += run(image, chunk, none);
+            decrypt.seek(0);
+            run(image, chunk, decrypt);
+            run(image, chunk, hash);
+            run(image, chunk, crc);
+        }
+        alone[0] = decrypt.elapsed;
+        alone[1] = hash.elapsed;
+        alone[2] = crc.elapsed;
+
+        decrypt.elapsed = 0;
+        hash.elapsed    = 0;
+        crc.elapsed     = 0;
+        for (int r = 0; r < rounds; r++) {
+            decrypt.seek(0);
+            all += run(image, chunk, decrypt, hash, crc);
+        }
+        results = results + crc.crc;
+        printf("%8u %10.1f %10.1f %10.1f %10.1f %10.1f\n", chunk, mbps(bytes, empty), mbps(bytes, alone[0]),
+               mbps(bytes, alone[1]), mbps(bytes, alone[2]), mbps(bytes, all));
+    }
+    return 0;
+}
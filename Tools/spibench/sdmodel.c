@@ -0,0 +1,594 @@
+/**
+ *******************************************************************************
+ * @file   sdmodel.c
+ * @brief  Byte accurate model of an SD card in SPI mode, see sdmodel.h.
+ *
+ * Each clocked byte first shifts out the next byte of the card: a queued
+ * response, a busy byte, or the next byte of the read stream (latency, start
+ * token, block, CRC16), 0xFF otherwise. The byte of the host then feeds the
+ * command frame or the block being written.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "sdmodel.h"
+#include <string.h>
+
+/* Private defines -----------------------------------------------------------*/
+/** R1 response bits */
+#define R1_IDLE      0x01
+#define R1_ILLEGAL   0x04
+#define R1_CRC       0x08
+#define R1_ADDRESS   0x20
+#define R1_PARAMETER 0x40
+
+/** Data tokens */
+#define TOKEN_START       0xFE /*!< Read block, single block write */
+#define TOKEN_MULTI_WRITE 0xFC /*!< Block of a multiple block write */
+#define TOKEN_STOP        0xFD /*!< End of a multiple block write */
+#define TOKEN_ERROR       0x01 /*!< Data error token: error */
+#define TOKEN_RANGE       0x08 /*!< Data error token: out of range */
+
+/** Data responses */
+#define RESPONSE_ACCEPTED 0x05
+#define RESPONSE_CRC      0x0B
+#define RESPONSE_WRITE    0x0D
+
+/** Bytes of a response: Ncr, R1 and up to 4 bytes of payload */
+#define QUEUE_SIZE 16
+
+/** Latency of a read block which never starts */
+#define LATENCY_STALL UINT32_MAX
+
+/* Private types -------------------------------------------------------------*/
+/** Byte categories of the counters */
+enum
+{
+    KIND_IDLE,
+    KIND_COMMAND,
+    KIND_DATA,
+    KIND_WAIT,
+};
+
+/** Read streams */
+enum
+{
+    STREAM_NONE,
+    STREAM_SINGLE, /*!< CMD9, CMD10, CMD17, ACMD13 */
+    STREAM_MULTI,  /*!< CMD18, until CMD12 */
+};
+
+/** Write states */
+enum
+{
+    WRITE_NONE,
+    WRITE_TOKEN, /*!< Waiting for a data token */
+    WRITE_DATA,  /*!< Receiving a block and its CRC */
+};
+
+/* Private variables ---------------------------------------------------------*/
+SdModelStats SdModel_Stats;
+
+static struct
+{
+    SdModelConfig config;
+    FILE*         image;
+    uint32_t      sectors;
+    uint8_t       csd[16];
+    uint8_t       cid[16];
+    int           selected;
+
+    /* Card state */
+    uint8_t  spi;      /*!< SPI mode, after CMD0 */
+    uint8_t  ready;    /*!< Initialization done by ACMD41 */
+    uint8_t  app;      /*!< The next command is an ACMD */
+    uint8_t  crc;      /*!< CRC checked on every command and block (CMD59) */
+    uint32_t polls;    /*!< ACMD41 answered idle so far */
+    uint32_t commands; /*!< Commands received, for failCommand */
+    uint32_t reads;    /*!< Read blocks started, for badToken and stall */
+    uint32_t writes;   /*!< Blocks received, for reject */
+
+    /* Command frame */
+    uint8_t  frame[6];
+    uint32_t framed; /*!< Bytes of the frame received */
+
+    /* Response queue, then busy bytes */
+    uint8_t  queue[QUEUE_SIZE];
+    uint8_t  queueKind[QUEUE_SIZE];
+    uint32_t head;
+    uint32_t queued;
+    uint32_t busy;
+
+    /* Read stream: latency, token, payload, CRC16 */
+    uint8_t  stream;
+    uint32_t latency;
+    uint8_t  block[1 + 512 + 2];
+    uint32_t blockLength;
+    uint32_t blockPos;
+    uint32_t sector; /*!< Sector being sent by a multiple block read */
+
+    /* Write */
+    uint8_t  write;
+    uint8_t  multi;
+    uint32_t writeSector;
+    uint32_t received;
+    uint8_t  data[512 + 2];
+} card;
+
+/* Private functions ---------------------------------------------------------*/
+/** CRC7 of a command frame or register, polynomial x^7 + x^3 + 1 */
+static uint8_t crc7(const uint8_t* data, uint32_t length) {
+    uint8_t crc = 0;
+
+    while (length--) {
+        uint8_t byte = *data++;
+
+        for (int i = 0; i < 8; i++, byte <<= 1) {
+            crc <<= 1;
+            if ((byte ^ crc) & 0x80) {
+                crc ^= 0x09;
+            }
+        }
+    }
+    return crc & 0x7F;
+}
+
+/** CRC16 of a data block, polynomial 0x1021 */
+static uint16_t crc16(const uint8_t* data, uint32_t length) {
+    uint16_t crc = 0;
+
+    while (length--) {
+        crc ^= (uint16_t)(*data++ << 8);
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static void push(uint8_t byte, uint8_t kind) {
+    if (card.queued < QUEUE_SIZE) {
+        uint32_t i = (card.head + card.queued++) % QUEUE_SIZE;
+
+        card.queue[i]     = byte;
+        card.queueKind[i] = kind;
+    }
+}
+
+/** Queue Ncr and an R1 response */
+static void respond(uint8_t r1) {
+    for (uint32_t i = 0; i < card.config.ncr; i++) {
+        push(0xFF, KIND_COMMAND);
+    }
+    push(r1, KIND_COMMAND);
+    if (r1 & (R1_ILLEGAL | R1_CRC | R1_ADDRESS | R1_PARAMETER)) {
+        SdModel_Stats.errors++;
+    }
+}
+
+/** Start sending a data block, after the read latency */
+static void start_block(const uint8_t* payload, uint32_t length) {
+    uint16_t crc = crc16(payload, length);
+
+    card.reads++;
+    card.latency  = card.config.latency;
+    card.blockPos = 0;
+    if (card.reads == card.config.stall) {
+        card.latency = LATENCY_STALL;
+    }
+    if (card.reads == card.config.badToken) {
+        card.block[0]    = TOKEN_ERROR;
+        card.blockLength = 1;
+        SdModel_Stats.errors++;
+        return;
+    }
+    card.block[0] = TOKEN_START;
+    memmove(&card.block[1], payload, length);
+    card.block[1 + length] = (uint8_t)(crc >> 8);
+    card.block[2 + length] = (uint8_t)crc;
+    card.blockLength       = length + 3;
+}
+
+/** Start sending a sector of the image */
+static void start_sector(uint32_t sector) {
+    uint8_t buffer[512];
+
+    if ((sector >= card.sectors) || (fseek(card.image, (long)sector * 512, SEEK_SET) != 0) ||
+        (fread(buffer, 512, 1, card.image) != 1)) {
+        card.reads++;
+        card.latency     = card.config.latency;
+        card.blockPos    = 0;
+        card.block[0]    = TOKEN_RANGE;
+        card.blockLength = 1;
+        SdModel_Stats.errors++;
+        return;
+    }
+    start_block(buffer, sizeof(buffer));
+}
+
+/** Next byte of the read stream */
+static uint8_t stream_next(uint8_t* kind) {
+    uint8_t byte;
+
+    if (card.blockPos == card.blockLength) {
+        /* Next block of a multiple block read, once clocked */
+        start_sector(++card.sector);
+    }
+    if (card.latency != 0) {
+        if (card.latency != LATENCY_STALL) {
+            card.latency--;
+        }
+        *kind = KIND_WAIT;
+        return 0xFF;
+    }
+    byte  = card.block[card.blockPos++];
+    *kind = KIND_DATA;
+    if (card.blockPos == card.blockLength) {
+        if (card.block[0] != TOKEN_START) {
+            /* A multiple block read stops on an error, CMD12 is still answered */
+            card.stream = STREAM_NONE;
+        } else {
+            SdModel_Stats.readBlocks++;
+            if (card.stream != STREAM_MULTI) {
+                card.stream = STREAM_NONE;
+            }
+        }
+    }
+    return byte;
+}
+
+/**
+ * @brief  Sector addressed by a read or write command.
+ * @return 0, or the R1 error
+ */
+static uint8_t address(uint32_t arg, uint32_t* sector) {
+    if (!card.config.sdhc) {
+        if (arg % 512 != 0) {
+            return R1_ADDRESS;
+        }
+        arg /= 512;
+    }
+    if (arg >= card.sectors) {
+        return R1_PARAMETER;
+    }
+    *sector = arg;
+    return 0;
+}
+
+static void execute(void) {
+    uint8_t  cmd  = card.frame[0] & 0x3F;
+    uint32_t arg  = ((uint32_t)card.frame[1] << 24) | ((uint32_t)card.frame[2] << 16) |
+                   ((uint32_t)card.frame[3] << 8) | card.frame[4];
+    uint8_t  app  = card.app;
+    uint8_t  good = (card.frame[5] == (uint8_t)((crc7(card.frame, 5) << 1) | 1));
+    uint8_t  idle;
+    uint8_t  r1;
+    uint32_t sector;
+
+    if (!card.spi) {
+        /* SD mode: only CMD0 with CS low, and its CRC, enters SPI mode */
+        if ((cmd != 0) || !good) {
+            return;
+        }
+        card.spi = 1;
+    }
+    card.app    = 0;
+    card.queued = 0;
+    card.commands++;
+    if (app) {
+        SdModel_Stats.appCommands[cmd]++;
+    } else {
+        SdModel_Stats.commands[cmd]++;
+    }
+    if (cmd == 12) {
+        /* Stuff byte, then the response */
+        card.stream = STREAM_NONE;
+        push(0xFF, KIND_COMMAND);
+    } else if (card.stream != STREAM_NONE) {
+        /* Aborted */
+        card.stream = STREAM_NONE;
+    }
+    card.write = WRITE_NONE;
+
+    idle = card.ready ? 0 : R1_IDLE;
+    /* CMD0 and CMD8 are always checked */
+    if (!good && ((cmd == 0) || (cmd == 8) || card.crc)) {
+        respond(idle | R1_CRC);
+        return;
+    }
+    if (card.commands == card.config.failCommand) {
+        respond(idle | R1_CRC);
+        return;
+    }
+    if (!card.ready && (cmd != 0) && (cmd != 8) && (cmd != 55) && (cmd != 58) && (cmd != 59) &&
+        !(app && (cmd == 41))) {
+        respond(idle | R1_ILLEGAL);
+        return;
+    }
+
+    switch (cmd) {
+        case 0: /* GO_IDLE_STATE */
+            card.ready = 0;
+            card.crc   = 0;
+            card.polls = 0;
+            card.busy  = 0;
+            respond(R1_IDLE);
+            break;
+
+        case 8: /* SEND_IF_COND, R7: echo of the voltage and check pattern */
+            if (!card.config.sdhc) {
+                respond(idle | R1_ILLEGAL);
+                break;
+            }
+            respond(idle);
+            push(0x00, KIND_COMMAND);
+            push(0x00, KIND_COMMAND);
+            push((uint8_t)((arg >> 8) & 0x0F), KIND_COMMAND);
+            push((uint8_t)arg, KIND_COMMAND);
+            break;
+
+        case 55: /* APP_CMD */
+            respond(idle);
+            card.app = 1;
+            break;
+
+        case 58: /* READ_OCR, R3: 3.2-3.4 V, CCS once ready */
+            respond(idle);
+            push((uint8_t)((card.ready ? 0x80 : 0) | ((card.ready && card.config.sdhc) ? 0x40 : 0)), KIND_COMMAND);
+            push(0xFF, KIND_COMMAND);
+            push(0x80, KIND_COMMAND);
+            push(0x00, KIND_COMMAND);
+            break;
+
+        case 59: /* CRC_ON_OFF */
+            card.crc = arg & 1;
+            respond(idle);
+            break;
+
+        case 9: /* SEND_CSD */
+            respond(0);
+            card.stream = STREAM_SINGLE;
+            start_block(card.csd, sizeof(card.csd));
+            break;
+
+        case 10: /* SEND_CID */
+            respond(0);
+            card.stream = STREAM_SINGLE;
+            start_block(card.cid, sizeof(card.cid));
+            break;
+
+        case 12: /* STOP_TRANSMISSION */
+            respond(0);
+            break;
+
+        case 13:
+            respond(0);
+            push(0x00, KIND_COMMAND);
+            if (app) {
+                /* SD_STATUS, R2 and a 64 bytes block: AU_SIZE 4 MB */
+                uint8_t status[64] = {0};
+
+                status[10]  = 0x90;
+                card.stream = STREAM_SINGLE;
+                start_block(status, sizeof(status));
+            }
+            break;
+
+        case 16: /* SET_BLOCKLEN */
+            respond((arg == 512) ? 0 : R1_PARAMETER);
+            break;
+
+        case 17: /* READ_SINGLE_BLOCK */
+        case 18: /* READ_MULTIPLE_BLOCK */
+            r1 = address(arg, &sector);
+            respond(r1);
+            if (r1 == 0) {
+                card.stream = (cmd == 18) ? STREAM_MULTI : STREAM_SINGLE;
+                card.sector = sector;
+                start_sector(sector);
+            }
+            break;
+
+        case 23: /* SET_WR_BLK_ERASE_COUNT */
+            respond(app ? 0 : R1_ILLEGAL);
+            break;
+
+        case 24: /* WRITE_BLOCK */
+        case 25: /* WRITE_MULTIPLE_BLOCK */
+            r1 = address(arg, &sector);
+            respond(r1);
+            if (r1 == 0) {
+                card.write       = WRITE_TOKEN;
+                card.multi       = (cmd == 25);
+                card.writeSector = sector;
+            }
+            break;
+
+        case 32: /* ERASE_WR_BLK_START */
+        case 33: /* ERASE_WR_BLK_END */
+            respond(0);
+            break;
+
+        case 38: /* ERASE, R1b: busy, the image is left as it is */
+            respond(0);
+            card.busy += card.config.busy;
+            break;
+
+        case 41: /* SD_SEND_OP_COND: an SDHC card stays idle without HCS */
+            if (card.polls < card.config.initPolls) {
+                card.polls++;
+            } else if (!card.config.sdhc || (arg & (1UL << 30))) {
+                card.ready = 1;
+            }
+            respond(card.ready ? 0 : R1_IDLE);
+            break;
+
+        default:
+            respond(idle | R1_ILLEGAL);
+            break;
+    }
+}
+
+/** Block of a write received with its CRC */
+static void written(void) {
+    uint8_t response = RESPONSE_ACCEPTED;
+
+    card.writes++;
+    if (card.crc && (crc16(card.data, 512) != (uint16_t)((card.data[512] << 8) | card.data[513]))) {
+        response = RESPONSE_CRC;
+    } else if ((card.writes == card.config.reject) || (card.writeSector >= card.sectors) ||
+               (fseek(card.image, (long)card.writeSector * 512, SEEK_SET) != 0) ||
+               (fwrite(card.data, 512, 1, card.image) != 1)) {
+        response = RESPONSE_WRITE;
+    }
+    push(response, KIND_DATA);
+    if (response == RESPONSE_ACCEPTED) {
+        SdModel_Stats.writeBlocks++;
+        card.writeSector++;
+        card.busy += card.config.busy;
+    } else {
+        SdModel_Stats.errors++;
+    }
+    /* After an error, a multiple block write still waits for the stop token */
+    card.write = card.multi ? WRITE_TOKEN : WRITE_NONE;
+}
+
+/* Public functions ----------------------------------------------------------*/
+int SdModel_Insert(FILE* image, const SdModelConfig* config) {
+    long     size;
+    uint32_t csize;
+
+    memset(&card, 0, sizeof(card));
+    memset(&SdModel_Stats, 0, sizeof(SdModel_Stats));
+    card.image  = image;
+    card.config = *config;
+    if ((card.config.ncr == 0) || (card.config.ncr > 8)) {
+        card.config.ncr = 1;
+    }
+    if ((fseek(image, 0, SEEK_END) != 0) || ((size = ftell(image)) < 0)) {
+        return -1;
+    }
+
+    /* CSD: 25 MHz, block length 512, sector erase, capacity rounded down */
+    card.csd[3]  = 0x32;
+    card.csd[4]  = 0x5B;
+    card.csd[5]  = 0x59;
+    card.csd[10] = 0x40 | 0x3F;
+    card.csd[11] = 0x80;
+    card.csd[12] = 0x0A;
+    card.csd[13] = 0x40;
+    if (card.config.sdhc) {
+        /* Version 2: C_SIZE in units of 512 KB */
+        if (size / (512 * 1024) < 1) {
+            return -1;
+        }
+        csize        = (uint32_t)(size / (512 * 1024)) - 1;
+        card.sectors = (csize + 1) * 1024;
+        card.csd[0]  = 0x40;
+        card.csd[7]  = (uint8_t)((csize >> 16) & 0x3F);
+        card.csd[8]  = (uint8_t)(csize >> 8);
+        card.csd[9]  = (uint8_t)csize;
+    } else {
+        /* Version 1: C_SIZE_MULT 7, C_SIZE in units of 256 KB, up to 1 GB */
+        if ((size / (256 * 1024) < 1) || (size / (256 * 1024) > 4096)) {
+            return -1;
+        }
+        csize        = (uint32_t)(size / (256 * 1024)) - 1;
+        card.sectors = (csize + 1) * 512;
+        card.csd[6]  = (uint8_t)((csize >> 10) & 0x03);
+        card.csd[7]  = (uint8_t)(csize >> 2);
+        card.csd[8]  = (uint8_t)((csize & 0x03) << 6);
+        card.csd[9]  = 0x03;
+        card.csd[10] |= 0x80;
+    }
+    card.csd[15] = (uint8_t)((crc7(card.csd, 15) << 1) | 1);
+
+    /* CID: OEM "SB", product "MODEL" */
+    memcpy(&card.cid[1], "SBMODEL", 7);
+    card.cid[15] = (uint8_t)((crc7(card.cid, 15) << 1) | 1);
+    return 0;
+}
+
+uint32_t SdModel_Sectors(void) {
+    return card.sectors;
+}
+
+void SdModel_Select(int selected) {
+    if (!selected) {
+        /* A frame or block cut by CS is lost */
+        card.framed = 0;
+        if (card.write == WRITE_DATA) {
+            card.write = WRITE_NONE;
+        }
+    }
+    card.selected = selected;
+}
+
+uint8_t SdModel_Exchange(uint8_t mosi) {
+    uint8_t miso = 0xFF;
+    uint8_t kind = KIND_IDLE;
+
+    SdModel_Stats.bytes++;
+    if (!card.selected) {
+        SdModel_Stats.deselected++;
+        return 0xFF;
+    }
+
+    /* Card to host */
+    if (card.queued != 0) {
+        miso      = card.queue[card.head];
+        kind      = card.queueKind[card.head];
+        card.head = (card.head + 1) % QUEUE_SIZE;
+        card.queued--;
+    } else if (card.busy != 0) {
+        card.busy--;
+        miso = 0x00;
+        kind = KIND_WAIT;
+    } else if (card.stream != STREAM_NONE) {
+        miso = stream_next(&kind);
+    }
+
+    /* Host to card */
+    if (card.write == WRITE_DATA) {
+        kind                       = KIND_DATA;
+        card.data[card.received++] = mosi;
+        if (card.received == sizeof(card.data)) {
+            written();
+        }
+    } else if ((card.write == WRITE_TOKEN) && ((card.multi && (mosi == TOKEN_STOP)) ||
+                                               (mosi == (card.multi ? TOKEN_MULTI_WRITE : TOKEN_START)))) {
+        kind = KIND_DATA;
+        if (mosi == TOKEN_STOP) {
+            /* Stuff byte, then busy */
+            card.write = WRITE_NONE;
+            push(0xFF, KIND_DATA);
+            card.busy += card.config.busy;
+        } else {
+            card.write    = WRITE_DATA;
+            card.received = 0;
+        }
+    } else if ((card.framed != 0) || ((mosi & 0xC0) == 0x40)) {
+        kind                      = KIND_COMMAND;
+        card.frame[card.framed++] = mosi;
+        if (card.framed == sizeof(card.frame)) {
+            card.framed = 0;
+            execute();
+        }
+    }
+
+    switch (kind) {
+        case KIND_COMMAND:
+            SdModel_Stats.command++;
+            break;
+        case KIND_DATA:
+            SdModel_Stats.data++;
+            break;
+        case KIND_WAIT:
+            SdModel_Stats.wait++;
+            break;
+        default:
+            SdModel_Stats.idle++;
+            break;
+    }
+    return miso;
+}
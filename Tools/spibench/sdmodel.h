@@ -0,0 +1,81 @@
+/**
+ *******************************************************************************
+ * @file   sdmodel.h
+ * @brief  Byte accurate model of an SD card in SPI mode, backed by a card
+ *         image file, for the host benchmark of user_diskio_spi.c
+ *         (Tools/spibench).
+ *
+ * The model sees every byte clocked on the bus and answers like a card:
+ * CMD0/8/9/10/12/13/16/17/18/24/25/32/33/38/55/58/59, ACMD13/23/41, idle
+ * state until ACMD41 completes, response delay (Ncr), start token latency of
+ * the read blocks, busy after a write, R1/R3/R7 responses, data tokens and
+ * data responses, CRC7 and CRC16 (checked after CMD59). An SDHC card is
+ * block addressed, an SDSC card (SDv1) byte addressed. Errors can be injected
+ * on the Nth command, read block or written block.
+ *
+ * Differences with a card: the SD mode, the MMC commands and the erase and
+ * lock functions are not modeled (CMD38 answers busy without erasing), a
+ * command received during a read stream aborts it like CMD12.
+ *******************************************************************************
+ */
+
+#ifndef __SDMODEL_H
+#define __SDMODEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Card behavior and injected errors */
+typedef struct
+{
+    uint8_t  sdhc;        /*!< 1: SDv2 block addressed, 0: SDv1 byte addressed (image up to 1 GB) */
+    uint32_t ncr;         /*!< 0xFF bytes before a response, 1 to 8 */
+    uint32_t latency;     /*!< 0xFF bytes before the start token of each read block */
+    uint32_t busy;        /*!< Busy bytes after each written block */
+    uint32_t initPolls;   /*!< ACMD41 answered idle this many times */
+    uint32_t failCommand; /*!< Nth command answered with a CRC error, 0: none */
+    uint32_t badToken;    /*!< Nth read block starting with an error token, 0: none */
+    uint32_t stall;       /*!< Nth read block never starting, 0: none */
+    uint32_t reject;      /*!< Nth written block rejected with a write error, 0: none */
+} SdModelConfig;
+
+/** Bus counters */
+typedef struct
+{
+    uint64_t bytes;           /*!< Bytes clocked */
+    uint64_t deselected;      /*!< Bytes clocked with CS high */
+    uint64_t command;         /*!< Command frames and their responses */
+    uint64_t data;            /*!< Data tokens, blocks, CRC and data responses */
+    uint64_t wait;            /*!< Busy bytes, and 0xFF before a start token */
+    uint64_t idle;            /*!< Other bytes clocked with CS low */
+    uint32_t commands[64];    /*!< Commands received, by index */
+    uint32_t appCommands[64]; /*!< Application commands (ACMD), by index */
+    uint32_t readBlocks;      /*!< Data blocks sent */
+    uint32_t writeBlocks;     /*!< Data blocks written */
+    uint32_t errors;          /*!< Error responses, error tokens and rejected blocks */
+} SdModelStats;
+
+extern SdModelStats SdModel_Stats;
+
+/**
+ * @brief  Insert a card. The image is read and written in place.
+ * @param  image: card image, opened for reading and writing
+ * @param  config: card behavior
+ * @return 0 on success, -1 if the image does not fit the card type
+ */
+int SdModel_Insert(FILE* image, const SdModelConfig* config);
+
+/** Number of 512 bytes sectors of the card */
+uint32_t SdModel_Sectors(void);
+
+/** Chip select, 1 while CS is low */
+void SdModel_Select(int selected);
+
+/**
+ * @brief  Clock one byte.
+ * @param  mosi: byte sent by the host
+ * @return Byte sent by the card
+ */
+uint8_t SdModel_Exchange(uint8_t mosi);
+
+#endif /* __SDMODEL_H */
@@ -0,0 +1,469 @@
+/**
+ *******************************************************************************
+ * @file   spibench.c
+ * @brief  Host benchmark of the SPI driver of the SD card
+ *         (FATFS/Target/user_diskio_spi.c) on a byte accurate card model
+ *         (sdmodel.c), backed by a card image.
+ *
+ * The driver, user_diskio.c and FatFs are the bootloader's. Below them,
+ * HAL_SPI_TransmitReceive and the chip select pin drive the card model, and
+ * the time is the bus time: 8 clocks per byte at the SPI3 clock set in
+ * SPI_CR1, plus the cost of each HAL call. Every clocked byte and command is
+ * counted, so that driver changes (burst transfers, CMD18 left open, CRC)
+ * can be compared on the same workload, and checked against the image.
+ *
+ * Build from the repository root (the include order selects the HAL stand-in
+ * of this directory and the ffconf.h of Tools/fatbench):
+ * @code
+ * gcc -O2 -ITools/spibench -ITools/fatbench -IFATFS/App -IFATFS/Target \
+ *     -IMiddlewares/Third_Party/FatFs/src Tools/spibench/spibench.c Tools/spibench/sdmodel.c \
+ *     FATFS/Target/user_diskio.c FATFS/Target/user_diskio_spi.c Middlewares/Third_Party/FatFs/src/ff.c \
+ *     Middlewares/Third_Party/FatFs/src/diskio.c Middlewares/Third_Party/FatFs/src/ff_gen_drv.c \
+ *     Middlewares/Third_Party/FatFs/src/option/ccsbcs.c -o spibench
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * spibench update card.img [options]   # file system calls of an update, on a `cachebench make` image
+ * spibench sectors card.img [options]  # driver calls: reads and writes checked against the image
+ * @endcode
+ * Card options: --sdsc (SDv1, byte addressed, image up to 1 GB), --ncr <bytes>,
+ * --latency <bytes> before each read block, --busy <bytes> after each
+ * written block, --polls <ACMD41 idle answers>. Injected errors, counted
+ * from 1: --fail-cmd <n> (CRC error response), --bad-token <n> (read block
+ * error token), --stall <n> (read block never starting), --reject <n>
+ * (written block rejected). Bus: --call-us <us per HAL call>. `sectors`:
+ * --span <sectors read and written>.
+ *
+ * `update` deletes Scale.bin like the bootloader does, `sectors` restores the
+ * sectors it writes: copy the image first anyway.
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "fatfs.h"
+#include "user_diskio_spi.h"
+#include "stm32l4xx_hal.h"
+#include "sdmodel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Private defines -----------------------------------------------------------*/
+/** SPI3 kernel clock (PCLK1) */
+#define SPI_PCLK_MHZ     80.0
+/** Cost of a HAL_SPI_TransmitReceive call besides the clocks, estimate */
+#define DEFAULT_CALL_US  2.0
+/** Chunk read by the bootloader */
+#define READ_SIZE        512
+/** Sectors read and written by `sectors` */
+#define DEFAULT_SPAN     2048
+/** Largest transfer of FatFs */
+#define MAX_COUNT        128
+
+/* Private variables ---------------------------------------------------------*/
+FATFS USERFatFS;
+char  USERPath[4];
+
+/** SPI3 at the prescaler of MX_SPI3_Init */
+GPIO_TypeDef       host_gpiod;
+static SPI_TypeDef spi3  = {SPI_BAUDRATEPRESCALER_8};
+SPI_HandleTypeDef  hspi3 = {&spi3};
+
+/** Command line options */
+static struct
+{
+    SdModelConfig card;
+    double        callUs;
+    uint32_t      span;
+} options = {{1, 1, 250, 250, 50, 0, 0, 0, 0}, DEFAULT_CALL_US, DEFAULT_SPAN};
+
+/** Bus time */
+static struct
+{
+    double   micros;
+    uint64_t calls;
+} bus;
+
+/** Card image */
+static FILE* card;
+
+/** Counters at the start of a step */
+static SdModelStats step_stats;
+static double       step_micros;
+static uint64_t     step_calls;
+/** Steps failed, and successful reads which returned wrong data */
+static uint32_t failures;
+static uint32_t mismatches;
+
+/* HAL stand-in --------------------------------------------------------------*/
+uint32_t HAL_GetTick(void) {
+    return (uint32_t)(bus.micros / 1000);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+    if ((GPIOx == SD_CS_GPIO_Port) && (GPIO_Pin == SD_CS_Pin)) {
+        SdModel_Select(PinState == GPIO_PIN_RESET);
+    }
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi,
+                                          uint8_t*           pTxData,
+                                          uint8_t*           pRxData,
+                                          uint16_t           Size,
+                                          uint32_t           Timeout) {
+    double mhz = SPI_PCLK_MHZ / (2 << ((hspi->Instance->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos));
+
+    (void)Timeout;
+    bus.calls++;
+    bus.micros += options.callUs + Size * 8 / mhz;
+    for (uint16_t i = 0; i < Size; i++) {
+        pRxData[i] = SdModel_Exchange(pTxData[i]);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout) {
+    static uint8_t discard[MAX_COUNT * 512];
+
+    return HAL_SPI_TransmitReceive(hspi, pData, discard, Size, Timeout);
+}
+
+/** Like the HAL in full duplex master mode, the buffer is also sent */
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout) {
+    return HAL_SPI_TransmitReceive(hspi, pData, pData, Size, Timeout);
+}
+
+DWORD get_fattime(void) {
+    return 0;
+}
+
+/* Private functions ---------------------------------------------------------*/
+static void usage(void) {
+    fprintf(stderr,
+            "usage: spibench update|sectors <card.img> [--sdsc] [--ncr N] [--latency N] [--busy N] [--polls N]\n"
+            "                [--fail-cmd N] [--bad-token N] [--stall N] [--reject N] [--call-us us] [--span N]\n");
+    exit(2);
+}
+
+static int injected(void) {
+    return options.card.failCommand || options.card.badToken || options.card.stall || options.card.reject;
+}
+
+static void step_begin(void) {
+    step_stats  = SdModel_Stats;
+    step_micros = bus.micros;
+    step_calls  = bus.calls;
+}
+
+/** Print the counters of a step, payload in bytes */
+static void step_end(const char* name, const char* result, uint64_t payload) {
+    double ms = (bus.micros - step_micros) / 1000;
+
+    printf("%-22s %-10s %10.3f ms %8.1f KB/s %10llu bytes %8llu calls %6llu waits\n",
+           name,
+           result,
+           ms,
+           (ms > 0) ? payload / 1024.0 / (ms / 1000) : 0.0,
+           (unsigned long long)(SdModel_Stats.bytes - step_stats.bytes),
+           (unsigned long long)(bus.calls - step_calls),
+           (unsigned long long)(SdModel_Stats.wait - step_stats.wait));
+}
+
+static const char* result_name(DRESULT res) {
+    static const char* const names[] = {"OK", "ERROR", "WRPRT", "NOTRDY", "PARERR"};
+
+    return (res < sizeof(names) / sizeof(names[0])) ? names[res] : "?";
+}
+
+static void summary(void) {
+    const SdModelStats* s = &SdModel_Stats;
+
+    printf("\nSPI3 %.1f MHz at the end, %.1f us per HAL call\n",
+           SPI_PCLK_MHZ / (2 << ((spi3.CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos)),
+           options.callUs);
+    printf("bus time     %.3f ms, %llu HAL calls\n", bus.micros / 1000, (unsigned long long)bus.calls);
+    printf("bytes        %llu: %llu command, %llu data, %llu wait, %llu idle, %llu deselected\n",
+           (unsigned long long)s->bytes,
+           (unsigned long long)s->command,
+           (unsigned long long)s->data,
+           (unsigned long long)s->wait,
+           (unsigned long long)s->idle,
+           (unsigned long long)s->deselected);
+    printf("blocks       %u read, %u written, %u errors sent\n", s->readBlocks, s->writeBlocks, s->errors);
+    printf("commands    ");
+    for (int i = 0; i < 64; i++) {
+        if (s->commands[i]) {
+            printf(" CMD%d %u", i, s->commands[i]);
+        }
+        if (s->appCommands[i]) {
+            printf(" ACMD%d %u", i, s->appCommands[i]);
+        }
+    }
+    printf("\n");
+}
+
+static void insert(const char* name) {
+    card = fopen(name, "r+b");
+    if (card == NULL) {
+        fprintf(stderr, "spibench: cannot open %s\n", name);
+        exit(1);
+    }
+    if (SdModel_Insert(card, &options.card) != 0) {
+        fprintf(stderr, "spibench: %s does not fit the card type\n", name);
+        exit(1);
+    }
+}
+
+/** Initialization, then the driver is ready for the steps */
+static int initialize(void) {
+    BYTE type = 0;
+
+    step_begin();
+    if (USER_SPI_initialize(0) != 0) {
+        step_end("initialize", "NOTRDY", 0);
+        failures++;
+        return -1;
+    }
+    USER_SPI_ioctl(0, MMC_GET_TYPE, &type);
+    step_end("initialize", (type & 0x08) ? "SDHC" : "SDSC", 0);
+    return 0;
+}
+
+static void check(FRESULT fr, const char* what) {
+    if (fr != FR_OK) {
+        fprintf(stderr, "spibench: %s: FatFs error %u\n", what, fr);
+        summary();
+        exit(1);
+    }
+}
+
+/** Reads the whole file, chunk by chunk */
+static void read_file(FIL* fp) {
+    static BYTE buffer[READ_SIZE];
+    UINT        br;
+
+    check(f_lseek(fp, 0), "f_lseek");
+    do {
+        check(f_read(fp, buffer, sizeof(buffer), &br), "f_read");
+    } while (br == sizeof(buffer));
+}
+
+/** File system calls of an update, as Tools/fatbench: CRC pass, programming,
+    verification on a reopened file, deletion */
+static int update(void) {
+    FIL   file;
+    DWORD hits, misses;
+
+    FATFS_LinkDriver(&USER_Driver, USERPath);
+    step_begin();
+    check(f_mount(&USERFatFS, USERPath, 1), "f_mount");
+    step_end("f_mount", "OK", 0);
+
+    check(f_open(&file, "Scale.bin", FA_READ), "Scale.bin");
+    for (int pass = 0; pass < 3; pass++) {
+        step_begin();
+        if (pass == 2) {
+            check(f_close(&file), "f_close");
+            check(f_open(&file, "Scale.bin", FA_READ), "Scale.bin");
+        }
+        read_file(&file);
+        step_end((pass == 0) ? "crc pass" : (pass == 1) ? "program pass" : "verify pass", "OK", f_size(&file));
+    }
+    check(f_close(&file), "f_close");
+
+    step_begin();
+    check(f_unlink("Scale.bin"), "f_unlink");
+    check(f_mount(NULL, USERPath, 0), "f_unmount");
+    step_end("f_unlink", "OK", 0);
+
+    USER_CacheStats(&hits, &misses);
+    printf("\nsector cache %u: %lu hits, %lu misses\n", SD_CACHE_SECTORS, (unsigned long)hits, (unsigned long)misses);
+    return 0;
+}
+
+/** Image content, read around the model */
+static void image_read(BYTE* buff, DWORD sector, UINT count) {
+    if ((fseek(card, (long)sector * 512, SEEK_SET) != 0) || (fread(buff, 512, count, card) != count)) {
+        memset(buff, 0, count * 512);
+    }
+}
+
+/** Reads the span in transfers of count sectors, checked against the image */
+static void read_span(DWORD first, UINT count, const char* name) {
+    static BYTE data[MAX_COUNT * 512];
+    static BYTE expected[MAX_COUNT * 512];
+    DRESULT     res     = RES_OK;
+    DRESULT     failed  = RES_OK;
+    uint64_t    payload = 0;
+
+    step_begin();
+    for (DWORD sector = first; sector + count <= first + options.span; sector += count) {
+        res = USER_SPI_read(0, data, sector, count);
+        if (res != RES_OK) {
+            failed = res;
+            continue;
+        }
+        payload += count * 512;
+        image_read(expected, sector, count);
+        if (memcmp(data, expected, count * 512) != 0) {
+            fprintf(stderr, "spibench: %s: wrong data at sector %lu\n", name, (unsigned long)sector);
+            mismatches++;
+        }
+    }
+    step_end(name, result_name(failed), payload);
+    if (failed != RES_OK) {
+        failures++;
+    }
+}
+
+/** Writes a pattern over the span in transfers of count sectors, reads it
+    back, then restores the original content */
+static void write_span(DWORD first, UINT count, const char* name) {
+    static BYTE original[DEFAULT_SPAN * 512];
+    static BYTE data[MAX_COUNT * 512];
+    static BYTE readback[MAX_COUNT * 512];
+    DRESULT     failed  = RES_OK;
+    uint64_t    payload = 0;
+    UINT        span    = (options.span < DEFAULT_SPAN) ? options.span : DEFAULT_SPAN;
+
+    image_read(original, first, span);
+    step_begin();
+    for (DWORD sector = first; sector + count <= first + span; sector += count) {
+        DRESULT res;
+
+        for (UINT i = 0; i < count * 512; i++) {
+            data[i] = (BYTE)(sector * 7 + i);
+        }
+        res = USER_SPI_write(0, data, sector, count);
+        if (res == RES_OK) {
+            payload += count * 512;
+            res = USER_SPI_read(0, readback, sector, count);
+            if ((res == RES_OK) && (memcmp(data, readback, count * 512) != 0)) {
+                fprintf(stderr, "spibench: %s: wrong data at sector %lu\n", name, (unsigned long)sector);
+                mismatches++;
+            }
+        }
+        if (res != RES_OK) {
+            failed = res;
+        }
+    }
+    if (USER_SPI_ioctl(0, CTRL_SYNC, NULL) != RES_OK) {
+        failed = RES_ERROR;
+    }
+    step_end(name, result_name(failed), payload);
+    if (failed != RES_OK) {
+        failures++;
+    }
+
+    /* Straight into the image: the counters are kept for the steps */
+    if ((fseek(card, (long)first * 512, SEEK_SET) != 0) || (fwrite(original, 512, span, card) != span)) {
+        fprintf(stderr, "spibench: cannot restore the image\n");
+        exit(1);
+    }
+}
+
+/** Driver calls: information, reads of 1 to 128 sectors, writes */
+static int sectors(void) {
+    DWORD count = 0;
+    DWORD block = 0;
+    DWORD first;
+
+    if (initialize() != 0) {
+        return 1;
+    }
+
+    step_begin();
+    if ((USER_SPI_ioctl(0, GET_SECTOR_COUNT, &count) != RES_OK) || (count != SdModel_Sectors())) {
+        fprintf(stderr, "spibench: capacity %lu, card %lu\n", (unsigned long)count, (unsigned long)SdModel_Sectors());
+        failures++;
+    }
+    if (USER_SPI_ioctl(0, GET_BLOCK_SIZE, &block) != RES_OK) {
+        failures++;
+    }
+    step_end("ioctl", "OK", 0);
+    printf("%lu sectors, erase block %lu sectors\n", (unsigned long)count, (unsigned long)block);
+
+    if (options.span > SdModel_Sectors() / 2) {
+        options.span = SdModel_Sectors() / 2;
+    }
+    read_span(0, 1, "read 1 sector");
+    read_span(0, 8, "read 8 sectors");
+    read_span(0, 32, "read 32 sectors");
+    read_span(0, MAX_COUNT, "read 128 sectors");
+
+    /* Away from the file system structures */
+    first = SdModel_Sectors() / 2;
+    write_span(first, 1, "write 1 sector");
+    write_span(first, 16, "write 16 sectors");
+    return 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+int main(int argc, char** argv) {
+    int status;
+
+    if (argc < 3) {
+        usage();
+    }
+    for (int i = 3; i < argc; i++) {
+        const char* option = argv[i];
+
+        if (strcmp(option, "--sdsc") == 0) {
+            options.card.sdhc = 0;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+        }
+        if (strcmp(option, "--call-us") == 0) {
+            options.callUs = strtod(argv[++i], NULL);
+            continue;
+        }
+
+        uint32_t value = (uint32_t)strtoul(argv[++i], NULL, 0);
+
+        if (strcmp(option, "--ncr") == 0) {
+            options.card.ncr = value;
+        } else if (strcmp(option, "--latency") == 0) {
+            options.card.latency = value;
+        } else if (strcmp(option, "--busy") == 0) {
+            options.card.busy = value;
+        } else if (strcmp(option, "--polls") == 0) {
+            options.card.initPolls = value;
+        } else if (strcmp(option, "--fail-cmd") == 0) {
+            options.card.failCommand = value;
+        } else if (strcmp(option, "--bad-token") == 0) {
+            options.card.badToken = value;
+        } else if (strcmp(option, "--stall") == 0) {
+            options.card.stall = value;
+        } else if (strcmp(option, "--reject") == 0) {
+            options.card.reject = value;
+        } else if ((strcmp(option, "--span") == 0) && (value >= MAX_COUNT)) {
+            options.span = value;
+        } else {
+            usage();
+        }
+    }
+
+    insert(argv[2]);
+    if (strcmp(argv[1], "update") == 0) {
+        status = update();
+    } else if (strcmp(argv[1], "sectors") == 0) {
+        status = sectors();
+    } else {
+        usage();
+    }
+    fclose(card);
+    summary();
+
+    if (mismatches != 0) {
+        printf("%u transfers returned wrong data\n", mismatches);
+        return 1;
+    }
+    if ((failures != 0) && !injected()) {
+        printf("%u steps failed\n", failures);
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,82 @@
+/**
+ *******************************************************************************
+ * @file   stm32l4xx_hal.h
+ * @brief  Host stand-in for the HAL of the SPI driver (Tools/spibench): the
+ *         SPI3 handle and registers, chip select pin and tick used by
+ *         FATFS/Target/user_diskio_spi.c, and the pins of main.h. The
+ *         functions are implemented by spibench.c on top of the card model.
+ *******************************************************************************
+ */
+
+#ifndef __STM32L4xx_HAL_H
+#define __STM32L4xx_HAL_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    HAL_OK      = 0x00,
+    HAL_ERROR   = 0x01,
+    HAL_BUSY    = 0x02,
+    HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef struct
+{
+    volatile uint32_t CR1;
+} SPI_TypeDef;
+
+typedef struct
+{
+    SPI_TypeDef* Instance;
+} SPI_HandleTypeDef;
+
+typedef struct
+{
+    volatile uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef enum
+{
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+#define READ_REG(REG)         ((REG))
+#define WRITE_REG(REG, VAL)   ((REG) = (VAL))
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) WRITE_REG((REG), (((READ_REG(REG)) & (~(CLEARMASK))) | (SETMASK)))
+
+/** Baud rate control of SPI_CR1: f = PCLK / 2^(BR + 1) */
+#define SPI_CR1_BR_Pos            3
+#define SPI_CR1_BR                (0x7UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_2   (0x00000000U)
+#define SPI_BAUDRATEPRESCALER_4   (0x00000008U)
+#define SPI_BAUDRATEPRESCALER_8   (0x00000010U)
+#define SPI_BAUDRATEPRESCALER_16  (0x00000018U)
+#define SPI_BAUDRATEPRESCALER_32  (0x00000020U)
+#define SPI_BAUDRATEPRESCALER_64  (0x00000028U)
+#define SPI_BAUDRATEPRESCALER_128 (0x00000030U)
+#define SPI_BAUDRATEPRESCALER_256 (0x00000038U)
+
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+
+/* main.h */
+extern GPIO_TypeDef      host_gpiod;
+extern SPI_HandleTypeDef hspi3;
+#define uSD_CS_Pin       GPIO_PIN_2
+#define uSD_CS_GPIO_Port (&host_gpiod)
+#define SD_SPI_HANDLE    hspi3
+#define SD_CS_GPIO_Port  uSD_CS_GPIO_Port
+#define SD_CS_Pin        uSD_CS_Pin
+
+uint32_t          HAL_GetTick(void);
+void              HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi,
+                                          uint8_t*           pTxData,
+                                          uint8_t*           pRxData,
+                                          uint16_t           Size,
+                                          uint32_t           Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout);
+
+#endif /* __STM32L4xx_HAL_H */
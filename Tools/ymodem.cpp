@@ -0,0 +1,354 @@
+/**
+ *******************************************************************************
+ * @file   ymodem.cpp
+ * @brief  Host tool sending an application binary to the bootloader over a
+ *         serial port with YMODEM-1K (USE_UART_UPDATE), and receiving one
+ *         with the receiver of the bootloader (Core/Inc/ymodem.h), to test
+ *         the link on a pseudo-terminal pair.
+ *
+ * Build from the repository root (POSIX host):
+ * @code
+ * g++ -std=c++17 -O2 -ICore/Inc Tools/ymodem.cpp -o ymodem
+ * @endcode
+ *
+ * Usage:
+ * @code
+ * ymodem send /dev/ttyUSB0 app.bin [--baud 921600] [--wait 30000] [--corrupt <block>]
+ * ymodem receive /dev/ttyUSB0 out.bin [--baud 921600] [--wait 30000]
+ * @endcode
+ * The bootloader polls for a sender for UART_UPDATE_WAIT ms after a reset:
+ * start the sender first, then reset the board. --corrupt damages the CRC of
+ * one block once, to exercise the retransmission. On a host:
+ * @code
+ * socat -d -d pty,raw,echo=0,link=/tmp/ttyA pty,raw,echo=0,link=/tmp/ttyB &
+ * ymodem receive /tmp/ttyB out.bin & ymodem send /tmp/ttyA app.bin
+ * @endcode
+ *******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "ymodem.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+/* Private defines -----------------------------------------------------------*/
+/** Default baud rate, ::UART_UPDATE_BAUDRATE of the bootloader */
+#define DEFAULT_BAUDRATE 921600
+/** Default time waiting for the other side, in ms */
+#define DEFAULT_WAIT     30000
+/** Time waiting for the acknowledgement of a block, in ms: the receiver
+ * may first wait for a page erase */
+#define ACK_TIMEOUT      5000
+/** Largest image received, the application area of the bootloader */
+#define RECEIVE_LIMIT    (480 * 1024)
+
+/* Private variables ---------------------------------------------------------*/
+/** Command line options */
+static struct
+{
+    uint32_t baudrate = DEFAULT_BAUDRATE;
+    uint32_t wait     = DEFAULT_WAIT;
+    long     corrupt  = -1;
+} options;
+
+/** Serial port */
+static int port = -1;
+
+/* Private functions ---------------------------------------------------------*/
+static void usage(void) {
+    fprintf(stderr,
+            "usage: ymodem send <port> <file> [--baud N] [--wait ms] [--corrupt block]\n"
+            "       ymodem receive <port> <file> [--baud N] [--wait ms]\n");
+    exit(2);
+}
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static speed_t baud_constant(uint32_t baudrate) {
+    switch (baudrate) {
+        case 115200:
+            return B115200;
+        case 230400:
+            return B230400;
+        case 460800:
+            return B460800;
+        case 921600:
+            return B921600;
+        case 1000000:
+            return B1000000;
+        case 1500000:
+            return B1500000;
+        case 2000000:
+            return B2000000;
+        default:
+            fprintf(stderr, "unsupported baud rate %u\n", baudrate);
+            exit(2);
+    }
+}
+
+/**
+ * @brief  Open the serial port raw, 8N1. The baud rate is ignored by a
+ *         pseudo-terminal.
+ */
+static void open_port(const char* path) {
+    struct termios tio;
+
+    port = open(path, O_RDWR | O_NOCTTY);
+    if (port < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (tcgetattr(port, &tio) == 0) {
+        cfmakeraw(&tio);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+        cfsetispeed(&tio, baud_constant(options.baudrate));
+        cfsetospeed(&tio, baud_constant(options.baudrate));
+        tcsetattr(port, TCSANOW, &tio);
+        tcflush(port, TCIOFLUSH);
+    }
+}
+
+/** Next byte, -1 after timeout ms */
+static int get_byte(uint32_t timeout) {
+    struct pollfd pfd = {port, POLLIN, 0};
+    uint8_t       c;
+
+    if ((poll(&pfd, 1, (int)timeout) <= 0) || (read(port, &c, 1) != 1)) {
+        return -1;
+    }
+    return c;
+}
+
+static void put_bytes(const uint8_t* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(port, data, length);
+
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+}
+
+/** Serial port of the receiver, see ymodem.h */
+struct HostPort {
+    static int32_t  get(void) { return get_byte(1); }
+    static void     put(uint8_t c) { put_bytes(&c, 1); }
+    static uint32_t now(void) { return now_ms(); }
+};
+
+/**
+ * @brief  Wait for one of the expected characters, skipping the others.
+ * @return The character, -1 on timeout, ::YMODEM_CAN on a cancel
+ */
+static int wait_for(const char* expected, uint32_t timeout) {
+    uint32_t begin = now_ms();
+    int      c;
+
+    while (now_ms() - begin < timeout) {
+        c = get_byte(timeout - (now_ms() - begin));
+        if (c < 0) {
+            break;
+        }
+        if ((c == YMODEM_CAN) && (get_byte(100) == YMODEM_CAN)) {
+            return YMODEM_CAN;
+        }
+        if ((c != 0) && (strchr(expected, c) != NULL)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief  Send a block until it is acknowledged.
+ * @return true once acknowledged
+ */
+static bool send_block(uint8_t seq, const uint8_t* payload, uint32_t length, bool corrupt) {
+    std::vector<uint8_t> block(3 + length + 2);
+    uint16_t             crc = Ymodem_CRC16(0, payload, length);
+
+    block[0] = (length == YMODEM_BLOCK_SIZE) ? YMODEM_STX : YMODEM_SOH;
+    block[1] = seq;
+    block[2] = (uint8_t)~seq;
+    memcpy(&block[3], payload, length);
+    block[3 + length] = (uint8_t)(crc >> 8);
+    block[4 + length] = (uint8_t)crc;
+
+    for (int tries = 0; tries < YMODEM_RETRIES; tries++) {
+        if (corrupt && (tries == 0)) {
+            block[4 + length] ^= 0xFF;
+            put_bytes(block.data(), block.size());
+            block[4 + length] ^= 0xFF;
+        } else {
+            put_bytes(block.data(), block.size());
+        }
+        /* A 'C' polling for the header may still be on its way: only ACK
+         * and NAK answer a block */
+        switch (wait_for("\x06\x15", ACK_TIMEOUT)) {
+            case YMODEM_ACK:
+                return true;
+            case YMODEM_CAN:
+                fprintf(stderr, "cancelled by the receiver\n");
+                return false;
+            default:
+                fprintf(stderr, "block %u sent again\n", seq);
+                break;
+        }
+    }
+    fprintf(stderr, "block %u not acknowledged\n", seq);
+    return false;
+}
+
+static int send_file(const char* path) {
+    std::vector<uint8_t> image;
+    uint8_t              header[YMODEM_SHORT_SIZE] = {0};
+    uint8_t              payload[YMODEM_BLOCK_SIZE];
+    FILE*                f = fopen(path, "rb");
+    int                  c;
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    while ((c = fgetc(f)) != EOF) {
+        image.push_back((uint8_t)c);
+    }
+    fclose(f);
+
+    std::string name(path);
+    name = name.substr(name.find_last_of('/') + 1);
+    snprintf((char*)header, sizeof(header) - 1, "%s", name.c_str());
+    snprintf((char*)header + strlen((char*)header) + 1,
+             sizeof(header) - strlen((char*)header) - 2,
+             "%zu",
+             image.size());
+
+    fprintf(stderr, "waiting for the receiver\n");
+    if (wait_for("C", options.wait) != YMODEM_CRC) {
+        fprintf(stderr, "no receiver\n");
+        return 1;
+    }
+    uint32_t begin = now_ms();
+
+    if (!send_block(0, header, sizeof(header), false)) {
+        return 1;
+    }
+    /* The receiver asks for the data once its flash is ready */
+    if (wait_for("C", ACK_TIMEOUT) != YMODEM_CRC) {
+        fprintf(stderr, "receiver not ready\n");
+        return 1;
+    }
+
+    uint8_t seq = 1;
+    for (size_t offset = 0; offset < image.size(); offset += YMODEM_BLOCK_SIZE, seq++) {
+        size_t length = image.size() - offset;
+
+        if (length > YMODEM_BLOCK_SIZE) {
+            length = YMODEM_BLOCK_SIZE;
+        }
+        memcpy(payload, &image[offset], length);
+        memset(payload + length, 0x1A, YMODEM_BLOCK_SIZE - length);
+        if (!send_block(seq, payload, YMODEM_BLOCK_SIZE, (long)(offset / YMODEM_BLOCK_SIZE + 1) == options.corrupt)) {
+            return 1;
+        }
+    }
+
+    /* End of file, confirmed twice, then the empty header ending the batch */
+    for (int tries = 0;; tries++) {
+        uint8_t eot = YMODEM_EOT;
+
+        if (tries == YMODEM_RETRIES) {
+            fprintf(stderr, "end of file not acknowledged\n");
+            return 1;
+        }
+        put_bytes(&eot, 1);
+        if (wait_for("\x06\x15", ACK_TIMEOUT) == YMODEM_ACK) {
+            break;
+        }
+    }
+    if (wait_for("C", ACK_TIMEOUT) == YMODEM_CRC) {
+        memset(header, 0, sizeof(header));
+        send_block(0, header, sizeof(header), false);
+    }
+
+    uint32_t ms = now_ms() - begin;
+    fprintf(stderr,
+            "sent %zu bytes in %u ms (%u bytes/s)\n",
+            image.size(),
+            ms,
+            (uint32_t)(ms ? (uint64_t)image.size() * 1000 / ms : 0));
+    return 0;
+}
+
+static int receive_file(const char* path) {
+    static uint8_t         buffer[YMODEM_BLOCK_SIZE];
+    YmodemSource<HostPort> source(RECEIVE_LIMIT);
+    std::vector<uint8_t>   image;
+    uint32_t               length;
+
+    if (source.start(buffer, options.wait) != YMODEM_OK) {
+        fprintf(stderr, "no file received (%u)\n", source.status);
+        return 1;
+    }
+    fprintf(stderr, "receiving %u bytes\n", source.size);
+    do {
+        if (source.read(buffer, sizeof(buffer), &length) != YMODEM_OK) {
+            fprintf(stderr, "transfer failed (%u) after %u bytes\n", source.status, source.received);
+            return 1;
+        }
+        image.insert(image.end(), buffer, buffer + length);
+    } while (length != 0);
+
+    FILE* f = fopen(path, "wb");
+
+    if ((f == NULL) || (fwrite(image.data(), 1, image.size(), f) != image.size())) {
+        perror(path);
+        return 1;
+    }
+    fclose(f);
+    fprintf(stderr, "received %zu bytes\n", image.size());
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        usage();
+    }
+    for (int i = 4; i < argc; i++) {
+        if ((strcmp(argv[i], "--baud") == 0) && (i + 1 < argc)) {
+            options.baudrate = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--wait") == 0) && (i + 1 < argc)) {
+            options.wait = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--corrupt") == 0) && (i + 1 < argc)) {
+            options.corrupt = strtol(argv[++i], NULL, 0);
+        } else {
+            usage();
+        }
+    }
+
+    open_port(argv[2]);
+    if (strcmp(argv[1], "send") == 0) {
+        return send_file(argv[3]);
+    }
+    if (strcmp(argv[1], "receive") == 0) {
+        return receive_file(argv[3]);
+    }
+    usage();
+}